@@ -13,5 +13,13 @@ LLVMFuzzerTestOneInput (const unsigned char *data, size_t size)
 
     g_clear_pointer (&cookie, soup_cookie_free);
 
+    /* With an origin, the domain is checked and the path defaulted */
+    GUri *origin = g_uri_parse ("https://www.example.com/a/b", SOUP_HTTP_URI_FLAGS, NULL);
+
+    cookie = soup_cookie_parse ((char*)data, origin);
+
+    g_clear_pointer (&cookie, soup_cookie_free);
+    g_uri_unref (origin);
+
     return 0;
 }
\ No newline at end of file
@@ -25,8 +25,11 @@ struct _SoupCacheInputStream {
 
 typedef struct {
 	GOutputStream *output_stream;
+	GOutputStream *base_output_stream; /* Below the compressor, if any */
+	gboolean compress;
 	GCancellable *cancellable;
 	gsize bytes_written;
+	gsize stored_size;
 
 	gboolean read_finished;
 	GBytes *current_writing_buffer;
@@ -42,6 +45,7 @@ G_DEFINE_FINAL_TYPE_WITH_CODE (SoupCacheInputStream, soup_cache_input_stream, SO
 
 
 static void soup_cache_input_stream_write_next_buffer (SoupCacheInputStream *istream);
+static void finish_caching (SoupCacheInputStream *istream);
 
 static inline void
 notify_and_clear (SoupCacheInputStream *istream, GError *error)
@@ -52,6 +56,7 @@ notify_and_clear (SoupCacheInputStream *istream, GError *error)
 
 	g_clear_object (&priv->cancellable);
 	g_clear_object (&priv->output_stream);
+	g_clear_object (&priv->base_output_stream);
 	g_clear_error (&error);
 }
 
@@ -63,7 +68,7 @@ try_write_next_buffer (SoupCacheInputStream *istream)
 	if (priv->current_writing_buffer == NULL && priv->buffer_queue->length)
 		soup_cache_input_stream_write_next_buffer (istream);
 	else if (priv->read_finished)
-		notify_and_clear (istream, NULL);
+		finish_caching (istream);
 	else if (g_input_stream_is_closed (G_INPUT_STREAM (istream))) {
 		GError *error = NULL;
 		g_set_error_literal (&error, G_IO_ERROR, G_IO_ERROR_CLOSED,
@@ -72,21 +77,76 @@ try_write_next_buffer (SoupCacheInputStream *istream)
 	}
 }
 
+static void
+compressor_closed_cb (GOutputStream        *stream,
+		      GAsyncResult         *result,
+		      SoupCacheInputStream *istream)
+{
+	SoupCacheInputStreamPrivate *priv = soup_cache_input_stream_get_instance_private (istream);
+	GError *error = NULL;
+
+	if (g_output_stream_close_finish (stream, result, &error))
+		priv->stored_size = g_seekable_tell (G_SEEKABLE (priv->base_output_stream));
+
+	notify_and_clear (istream, error);
+	g_object_unref (istream);
+}
+
+static void
+finish_caching (SoupCacheInputStream *istream)
+{
+	SoupCacheInputStreamPrivate *priv = soup_cache_input_stream_get_instance_private (istream);
+
+	if (!priv->compress) {
+		priv->stored_size = priv->bytes_written;
+		notify_and_clear (istream, NULL);
+		return;
+	}
+
+	/* The compressor holds the end of the resource until it's
+	 * closed, which is done in a thread like the writes.
+	 */
+	g_output_stream_close_async (priv->output_stream, G_PRIORITY_LOW, priv->cancellable,
+				     (GAsyncReadyCallback) compressor_closed_cb,
+				     g_object_ref (istream));
+}
+
+static void
+set_output_stream (SoupCacheInputStream *istream,
+		   GOutputStream        *stream)
+{
+	SoupCacheInputStreamPrivate *priv = soup_cache_input_stream_get_instance_private (istream);
+	GZlibCompressor *compressor;
+
+	priv->base_output_stream = stream;
+	if (!priv->compress) {
+		priv->output_stream = g_object_ref (stream);
+		return;
+	}
+
+	compressor = g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_GZIP, -1);
+	priv->output_stream = g_converter_output_stream_new (stream, G_CONVERTER (compressor));
+	g_filter_output_stream_set_close_base_stream (G_FILTER_OUTPUT_STREAM (priv->output_stream), FALSE);
+	g_object_unref (compressor);
+}
+
 static void
 file_replaced_cb (GObject      *source,
 		  GAsyncResult *res,
 		  gpointer      user_data)
 {
 	SoupCacheInputStream *istream = SOUP_CACHE_INPUT_STREAM (user_data);
-	SoupCacheInputStreamPrivate *priv = soup_cache_input_stream_get_instance_private (istream);
+	GFileOutputStream *stream;
 	GError *error = NULL;
 
-	priv->output_stream = (GOutputStream *) g_file_replace_finish (G_FILE (source), res, &error);
+	stream = g_file_replace_finish (G_FILE (source), res, &error);
 
-	if (error)
+	if (error) {
 		notify_and_clear (istream, error);
-	else
+	} else {
+		set_output_stream (istream, G_OUTPUT_STREAM (stream));
 		try_write_next_buffer (istream);
+	}
 
 	g_object_unref (istream);
 }
@@ -107,6 +167,7 @@ soup_cache_input_stream_finalize (GObject *object)
 
 	g_clear_object (&priv->cancellable);
 	g_clear_object (&priv->output_stream);
+	g_clear_object (&priv->base_output_stream);
 	g_clear_pointer (&priv->current_writing_buffer, g_bytes_unref);
 	g_queue_free_full (priv->buffer_queue, (GDestroyNotify) g_bytes_unref);
 
@@ -193,7 +254,7 @@ read_internal (GInputStream  *stream,
 		priv->read_finished = TRUE;
 
 		if (priv->current_writing_buffer == NULL && priv->output_stream)
-			notify_and_clear (istream, NULL);
+			finish_caching (istream);
 	} else {
 		GBytes *local_buffer = g_bytes_new (buffer, nread);
 		g_queue_push_tail (priv->buffer_queue, g_steal_pointer (&local_buffer));
@@ -282,9 +343,14 @@ soup_cache_input_stream_class_init (SoupCacheInputStreamClass *klass)
 			      G_TYPE_INT, G_TYPE_ERROR);
 }
 
+/* If @file is %NULL the resource is kept in memory, and can be taken
+ * with soup_cache_input_stream_steal_bytes() when caching finishes.
+ * If @compress is %TRUE it's stored gzipped.
+ */
 GInputStream *
 soup_cache_input_stream_new (GInputStream *base_stream,
-			     GFile        *file)
+			     GFile        *file,
+			     gboolean      compress)
 {
 	SoupCacheInputStream *istream = g_object_new (SOUP_TYPE_CACHE_INPUT_STREAM,
 					      "base-stream", base_stream,
@@ -292,7 +358,13 @@ soup_cache_input_stream_new (GInputStream *base_stream,
 					      NULL);
 	SoupCacheInputStreamPrivate *priv = soup_cache_input_stream_get_instance_private (istream);
 
+	priv->compress = compress;
 	priv->cancellable = g_cancellable_new ();
+	if (!file) {
+		set_output_stream (istream, g_memory_output_stream_new_resizable ());
+		return (GInputStream *) istream;
+	}
+
 	g_file_replace_async (file, NULL, FALSE,
 			      G_FILE_CREATE_PRIVATE | G_FILE_CREATE_REPLACE_DESTINATION,
 			      G_PRIORITY_DEFAULT, priv->cancellable,
@@ -300,3 +372,28 @@ soup_cache_input_stream_new (GInputStream *base_stream,
 
 	return (GInputStream *) istream;
 }
+
+/* Only valid from a handler of #SoupCacheInputStream::caching-finished */
+GBytes *
+soup_cache_input_stream_steal_bytes (SoupCacheInputStream *istream)
+{
+	SoupCacheInputStreamPrivate *priv = soup_cache_input_stream_get_instance_private (istream);
+
+	if (!G_IS_MEMORY_OUTPUT_STREAM (priv->base_output_stream))
+		return NULL;
+
+	g_output_stream_close (priv->base_output_stream, NULL, NULL);
+	return g_memory_output_stream_steal_as_bytes (G_MEMORY_OUTPUT_STREAM (priv->base_output_stream));
+}
+
+/* The size of the resource as it was stored, smaller than the bytes
+ * reported by #SoupCacheInputStream::caching-finished if it was
+ * compressed. Only valid from a handler of that signal.
+ */
+gsize
+soup_cache_input_stream_get_stored_size (SoupCacheInputStream *istream)
+{
+	SoupCacheInputStreamPrivate *priv = soup_cache_input_stream_get_instance_private (istream);
+
+	return priv->stored_size;
+}
@@ -12,7 +12,10 @@ G_BEGIN_DECLS
 #define SOUP_TYPE_CACHE_INPUT_STREAM		(soup_cache_input_stream_get_type())
 G_DECLARE_FINAL_TYPE (SoupCacheInputStream, soup_cache_input_stream, SOUP, CACHE_INPUT_STREAM, SoupFilterInputStream)
 
-GInputStream *soup_cache_input_stream_new (GInputStream *base_stream,
-					   GFile        *file);
+GInputStream *soup_cache_input_stream_new             (GInputStream         *base_stream,
+						       GFile                *file,
+						       gboolean              compress);
+GBytes       *soup_cache_input_stream_steal_bytes     (SoupCacheInputStream *istream);
+gsize         soup_cache_input_stream_get_stored_size (SoupCacheInputStream *istream);
 
 G_END_DECLS
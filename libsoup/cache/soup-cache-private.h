@@ -30,13 +30,21 @@ G_BEGIN_DECLS
 typedef enum {
 	SOUP_CACHE_RESPONSE_FRESH,
 	SOUP_CACHE_RESPONSE_NEEDS_VALIDATION,
-	SOUP_CACHE_RESPONSE_STALE
+	SOUP_CACHE_RESPONSE_STALE,
+	SOUP_CACHE_RESPONSE_STALE_WHILE_REVALIDATE
 } SoupCacheResponse;
 
 SoupCacheResponse  soup_cache_has_response                    (SoupCache   *cache,
 							       SoupMessage *msg);
-GInputStream      *soup_cache_send_response                   (SoupCache   *cache,
-							       SoupMessage *msg);
+void               soup_cache_send_response_async             (SoupCache           *cache,
+							       SoupMessage         *msg,
+							       int                  io_priority,
+							       GCancellable        *cancellable,
+							       GAsyncReadyCallback  callback,
+							       gpointer             user_data);
+GInputStream      *soup_cache_send_response_finish            (SoupCache           *cache,
+							       GAsyncResult        *result,
+							       GError             **error);
 SoupCacheability   soup_cache_get_cacheability                (SoupCache   *cache,
 							       SoupMessage *msg);
 SoupMessage       *soup_cache_generate_conditional_request    (SoupCache   *cache,
@@ -45,5 +53,7 @@ void               soup_cache_cancel_conditional_request      (SoupCache   *cach
 							       SoupMessage *msg);
 void               soup_cache_update_from_conditional_request (SoupCache   *cache,
 							       SoupMessage *msg);
+gboolean           soup_cache_allows_stale_if_error           (SoupCache   *cache,
+							       SoupMessage *msg);
 
 G_END_DECLS
@@ -38,6 +38,7 @@
 #include "soup-cache-input-stream.h"
 #include "soup-cache-private.h"
 #include "soup-content-processor.h"
+#include "soup-date-utils-private.h"
 #include "soup-message-private.h"
 #include "soup-message-headers-private.h"
 #include "soup.h"
@@ -72,6 +73,28 @@ static void soup_cache_content_processor_init (SoupContentProcessorInterface *in
 	                                of the cache that can be
 	                                filled by a single entry */
 
+/* Resources are read into the memory tier once they have been hit
+ * MEMORY_TIER_MIN_HITS times, if it's enabled. The least recently
+ * used ones are dropped from it when its size is exceeded.
+ */
+#define MEMORY_TIER_MIN_HITS 3
+
+/* When compression is enabled the bodies of text resources are stored
+ * gzipped, unless they are smaller than COMPRESSION_MIN_SIZE or the
+ * server already compressed them.
+ */
+#define COMPRESSION_MIN_SIZE 1024
+
+static const char * const compressible_types[] = {
+	"text/*",
+	"application/javascript",
+	"application/json",
+	"application/xml",
+	"application/xhtml+xml",
+	"image/svg+xml",
+	NULL
+};
+
 /*
  * Version 2: cache is now saved in soup.cache2. Added the version
  * number to the beginning of the file.
@@ -89,51 +112,181 @@ static void soup_cache_content_processor_init (SoupContentProcessorInterface *in
  *   - entry key is now a uint32 instead of a (char *).
  *   - added uri, used to check for collisions
  *   - removed filename, it's built from the entry key.
+ *
+ * Version 6: cache is now saved in soup.cache3, version 5 indexes
+ * in soup.cache2 are migrated when loaded.
+ *   - entry key is now a 64 bits hash of the uri and the variant,
+ *     and files are named after it in hexadecimal.
+ *   - added variant, the request headers listed in Vary.
+ *
+ * Version 7: added segment and offset, the location of resources
+ * packed in segment files. Segment 0 means the resource has its own
+ * file.
+ *
+ * Version 8: added compressed and stored_length, resources can be
+ * stored gzipped and then take stored_length bytes instead of length.
  */
-#define SOUP_CACHE_CURRENT_VERSION 5
+#define SOUP_CACHE_CURRENT_VERSION 8
 
-#define OLD_SOUP_CACHE_FILE "soup.cache"
-#define SOUP_CACHE_FILE "soup.cache2"
+#define OLD_SOUP_CACHE_FILE "soup.cache2"
+#define OLD_SOUP_CACHE_VERSION 5
+#define SOUP_CACHE_FILE "soup.cache3"
 
 #define SOUP_CACHE_HEADERS_FORMAT "{ss}"
-#define SOUP_CACHE_PHEADERS_FORMAT "(sbuuuuuqa" SOUP_CACHE_HEADERS_FORMAT ")"
+#define SOUP_CACHE_PHEADERS_FORMAT "(ssbuuuuuquubua" SOUP_CACHE_HEADERS_FORMAT ")"
 #define SOUP_CACHE_ENTRIES_FORMAT "(qa" SOUP_CACHE_PHEADERS_FORMAT ")"
+#define OLD_SOUP_CACHE_PHEADERS_FORMAT "(sbuuuuuqa" SOUP_CACHE_HEADERS_FORMAT ")"
+#define OLD_SOUP_CACHE_ENTRIES_FORMAT "(qa" OLD_SOUP_CACHE_PHEADERS_FORMAT ")"
 
 /* Basically the same format than above except that some strings are
    prepended with &. This way the GVariant returns a pointer to the
-   data instead of duplicating the string */
+   data instead of duplicating the string. Headers are kept packed
+   until they are needed */
 #define SOUP_CACHE_DECODE_HEADERS_FORMAT "{&s&s}"
+#define SOUP_CACHE_DECODE_PHEADERS_FORMAT "(&s&sbuuuuuquubu@a" SOUP_CACHE_HEADERS_FORMAT ")"
+#define OLD_SOUP_CACHE_DECODE_PHEADERS_FORMAT "(&sbuuuuuq@a" SOUP_CACHE_HEADERS_FORMAT ")"
+
+/* SOUP_CACHE_FILE is only rewritten by soup_cache_dump() once the
+ * changes made since then don't fit in the journal anymore. Until
+ * then they are appended to SOUP_CACHE_JOURNAL_FILE, and replayed on
+ * top of the index by soup_cache_load(). Each record is its size as a
+ * little endian guint32, its type, and a GVariant.
+ *
+ * Records are buffered in memory as they happen, and written in
+ * batches by a writer thread, or by soup_cache_dump(), so that
+ * storing or evicting an entry doesn't wait for the disk.
+ */
+#define SOUP_CACHE_JOURNAL_FILE "soup.journal"
+#define JOURNAL_RECORD_HEADER_SIZE 5
+#define JOURNAL_MIN_RECORDS 1024
+
+/* Resources up to SEGMENT_MAX_RESOURCE_SIZE are appended to segment
+ * files when packed storage is enabled, instead of getting a file of
+ * their own. A new segment is started when the current one reaches
+ * SEGMENT_MAX_SIZE, and soup_cache_dump() moves the resources out of
+ * the segments that are mostly unused space.
+ */
+#define SEGMENT_FILE_PREFIX "segment-"
+#define SEGMENT_MAX_RESOURCE_SIZE (16 * 1024)
+#define SEGMENT_MAX_SIZE (4 * 1024 * 1024)
+#define SEGMENT_MIN_LIVE_PERCENTAGE 25
+
+typedef struct {
+	guint32 id;
+	gsize size;
+	gsize live;
+} SoupCacheSegment;
+
+typedef enum {
+	JOURNAL_RECORD_INSERT = 'i',  /* SOUP_CACHE_PHEADERS_FORMAT */
+	JOURNAL_RECORD_DELETE = 'd',  /* "(ss)", uri and variant */
+	JOURNAL_RECORD_PENDING = 'p'  /* "t", key of an entry being written */
+} JournalRecordType;
+
+
+/* Entries are kept in buckets by number of hits, in least recently
+ * used order inside each bucket, so that they can be found, moved
+ * and evicted without walking the whole cache.
+ */
+typedef struct {
+	guint32 hits;
+	GQueue entries;
+	GList link;
+} SoupCacheLRUBucket;
 
+/* Number of entries considered for eviction at a time, see
+ * make_room_for_new_entry()
+ */
+#define LRU_EVICTION_WINDOW 8
 
 typedef struct _SoupCacheEntry {
-	guint32 key;
+	guint64 key;
 	char *uri;
+	char *variant;
 	guint32 freshness_lifetime;
 	gboolean must_revalidate;
 	gsize length;
+	gboolean compressed;
+	gsize stored_length; /* Less than length if it's compressed */
 	guint32 corrected_initial_age;
 	guint32 response_time;
 	gboolean dirty;
 	gboolean being_validated;
 	SoupMessageHeaders *headers;
+	GVariant *packed_headers; /* As loaded from the index, until needed */
 	guint32 hits;
 	GCancellable *cancellable;
 	guint16 status_code;
+	guint32 segment;
+	guint32 offset;
+	GBytes *body; /* Only in the memory tier */
+	GList memory_link;
+	SoupCacheLRUBucket *lru_bucket;
+	GList lru_link;
+	/* Other responses for the same uri, with a different variant */
+	struct _SoupCacheEntry *next_variant;
 } SoupCacheEntry;
 
 typedef struct {
 	char *cache_dir;
         GMutex mutex;
-	GHashTable *cache;
+	GHashTable *cache; /* uri -> newest SoupCacheEntry */
 	guint n_pending;
 	SoupSession *session;
 	SoupCacheType cache_type;
 	guint size;
 	guint max_size;
 	guint max_entry_data_size; /* Computed value. Here for performance reasons */
-	GList *lru_start;
+	GQueue lru_buckets;
+	GHashTable *lru_buckets_by_hits;
+	GFileIOStream *journal;
+	guint journal_records;
+	gboolean journal_incomplete;
+	GByteArray *journal_buffer; /* Records not written yet */
+	gboolean journal_write_queued;
+	GThreadPool *journal_writer;
+	/* Held while writing to @journal, taken before @mutex */
+	GMutex journal_mutex;
+	gboolean packed_storage;
+	gboolean compression;
+	GHashTable *segments;
+	SoupCacheSegment *current_segment;
+	guint32 next_segment_id;
+	GQueue segment_writes;
+	GOutputStream *segment_stream;
+	guint32 segment_stream_id;
+	gboolean loading;
+	guint memory_tier_size;
+	gsize memory_tier_used;
+	GQueue memory_tier; /* Most recently used first */
+	GPtrArray *evicted_uris; /* Until ::evicted is emitted */
+
+	/* Statistics, updated atomically so that they don't need the
+	 * lock. Counters are gsize for g_atomic_pointer_add().
+	 */
+	struct {
+		gsize memory_hits;
+		gsize disk_hits;
+		gsize stale_hits;
+		gsize misses;
+		gsize revalidations;
+		gsize not_modified;
+		gsize evictions;
+		gsize bytes_from_cache;
+		gsize bytes_from_network;
+	} stats;
 } SoupCachePrivate;
 
+#define STATS_ADD(priv, counter, value) g_atomic_pointer_add (&(priv)->stats.counter, (value))
+#define STATS_GET(priv, counter) ((gsize) g_atomic_pointer_get (&(priv)->stats.counter))
+
+enum {
+	EVICTED,
+	LAST_SIGNAL
+};
+
+static guint signals[LAST_SIGNAL] = { 0 };
+
 enum {
 	PROP_0,
 	PROP_CACHE_DIR,
@@ -155,18 +308,97 @@ static gboolean soup_cache_entry_remove (SoupCache *cache, SoupCacheEntry *entry
 static void make_room_for_new_entry (SoupCache *cache, guint length_to_add);
 static gboolean cache_accepts_entries_of_size (SoupCache *cache, guint length_to_add);
 
+static char *
+get_filename_from_key (guint64 key)
+{
+	return g_strdup_printf ("%016" G_GINT64_MODIFIER "x", key);
+}
+
+static char *
+get_segment_filename (guint32 id)
+{
+	return g_strdup_printf (SEGMENT_FILE_PREFIX "%u", id);
+}
+
+static char *
+get_filename_from_entry (SoupCacheEntry *entry)
+{
+	if (entry->segment)
+		return get_segment_filename (entry->segment);
+
+	return get_filename_from_key (entry->key);
+}
+
 static GFile *
-get_file_from_entry (SoupCache *cache, SoupCacheEntry *entry)
+get_segment_file (SoupCache *cache, guint32 id)
 {
         SoupCachePrivate *priv = soup_cache_get_instance_private (cache);
-	char *filename = g_strdup_printf ("%s%s%u", priv->cache_dir,
-					  G_DIR_SEPARATOR_S, (guint) entry->key);
+	char *filename = g_strdup_printf ("%s" G_DIR_SEPARATOR_S SEGMENT_FILE_PREFIX "%u",
+					  priv->cache_dir, id);
 	GFile *file = g_file_new_for_path (filename);
 	g_free (filename);
 
 	return file;
 }
 
+/* The file holding the resource, which is shared with other entries
+ * if it's a segment.
+ */
+static GFile *
+get_file_from_entry (SoupCache *cache, SoupCacheEntry *entry)
+{
+        SoupCachePrivate *priv = soup_cache_get_instance_private (cache);
+	char *filename;
+	GFile *file;
+
+	if (entry->segment)
+		return get_segment_file (cache, entry->segment);
+
+	filename = g_strdup_printf ("%s" G_DIR_SEPARATOR_S "%016" G_GINT64_MODIFIER "x",
+				    priv->cache_dir, entry->key);
+	file = g_file_new_for_path (filename);
+	g_free (filename);
+
+	return file;
+}
+
+/* Builds the part of @request_headers that selects a variant of a
+ * response with @response_headers: the values of the headers listed
+ * in its Vary, or %NULL if it doesn't vary.
+ */
+static char *
+get_variant (SoupMessageHeaders *response_headers,
+	     SoupMessageHeaders *request_headers)
+{
+	const char *vary;
+	GSList *names, *l;
+	GString *variant;
+
+	vary = soup_message_headers_get_list_common (response_headers, SOUP_HEADER_VARY);
+	if (!vary)
+		return NULL;
+
+	names = g_slist_sort (soup_header_parse_list (vary), (GCompareFunc)g_ascii_strcasecmp);
+	if (!names)
+		return NULL;
+
+	variant = g_string_new (NULL);
+	for (l = names; l; l = l->next) {
+		const char *value = soup_message_headers_get_list (request_headers, l->data);
+		char *name = g_ascii_strdown (l->data, -1);
+
+		/* Tell apart missing and empty headers */
+		if (value)
+			g_string_append_printf (variant, "%s: %s\n", name, value);
+		else
+			g_string_append_printf (variant, "%s\n", name);
+		g_free (name);
+	}
+	soup_header_free_list (names);
+
+	return g_string_free (variant, FALSE);
+}
+
 static SoupCacheability
 get_cacheability (SoupCache *cache, SoupMessage *msg)
 {
@@ -284,6 +516,13 @@ get_cacheability (SoupCache *cache, SoupMessage *msg)
 		break;
 	}
 
+	/* A response that varies on "*" can't be used for any
+	 * other request
+	 */
+	if (cacheability == SOUP_CACHE_CACHEABLE &&
+	    soup_message_headers_header_contains_common (soup_message_get_response_headers (msg), SOUP_HEADER_VARY, "*"))
+		return SOUP_CACHE_UNCACHEABLE;
+
 	return cacheability;
 }
 
@@ -294,12 +533,424 @@ static void
 soup_cache_entry_free (SoupCacheEntry *entry)
 {
 	g_free (entry->uri);
+	g_free (entry->variant);
 	g_clear_pointer (&entry->headers, soup_message_headers_unref);
+	g_clear_pointer (&entry->packed_headers, g_variant_unref);
+	g_clear_pointer (&entry->body, g_bytes_unref);
 	g_clear_object (&entry->cancellable);
 
 	g_slice_free (SoupCacheEntry, entry);
 }
 
+static SoupMessageHeaders *
+soup_cache_entry_get_headers (SoupCacheEntry *entry)
+{
+	GVariantIter iter;
+	const char *header_key, *header_value;
+
+	if (entry->headers)
+		return entry->headers;
+
+	entry->headers = soup_message_headers_new (SOUP_MESSAGE_HEADERS_RESPONSE);
+	g_variant_iter_init (&iter, entry->packed_headers);
+	while (g_variant_iter_next (&iter, SOUP_CACHE_DECODE_HEADERS_FORMAT, &header_key, &header_value)) {
+		if (*header_key && *header_value)
+			soup_message_headers_append (entry->headers, header_key, header_value);
+	}
+	g_clear_pointer (&entry->packed_headers, g_variant_unref);
+
+	return entry->headers;
+}
+
+static GVariant *
+soup_cache_entry_serialize (SoupCacheEntry *entry)
+{
+	GVariant *headers;
+
+	if (entry->packed_headers) {
+		headers = entry->packed_headers;
+	} else {
+		GVariantBuilder headers_builder;
+		SoupMessageHeadersIter iter;
+		const char *header_key, *header_value;
+
+		g_variant_builder_init (&headers_builder, G_VARIANT_TYPE ("a" SOUP_CACHE_HEADERS_FORMAT));
+		soup_message_headers_iter_init (&iter, entry->headers);
+		while (soup_message_headers_iter_next (&iter, &header_key, &header_value)) {
+			if (g_utf8_validate (header_value, -1, NULL))
+				g_variant_builder_add (&headers_builder, SOUP_CACHE_HEADERS_FORMAT,
+						       header_key, header_value);
+		}
+		headers = g_variant_builder_end (&headers_builder);
+	}
+
+	return g_variant_new ("(ssbuuuuuquubu@a" SOUP_CACHE_HEADERS_FORMAT ")",
+			      entry->uri,
+			      entry->variant ? entry->variant : "",
+			      entry->must_revalidate,
+			      entry->freshness_lifetime,
+			      entry->corrected_initial_age,
+			      entry->response_time,
+			      entry->hits,
+			      (guint32) entry->length,
+			      entry->status_code,
+			      entry->segment,
+			      entry->offset,
+			      entry->compressed,
+			      (guint32) entry->stored_length,
+			      headers);
+}
+
+static gboolean
+journal_write (GFileIOStream *journal,
+	       GByteArray    *records)
+{
+	if (records->len == 0)
+		return TRUE;
+
+	return g_output_stream_write_all (g_io_stream_get_output_stream (G_IO_STREAM (journal)),
+					  records->data, records->len, NULL, NULL, NULL);
+}
+
+/* Runs in the writer thread. Whatever was buffered by the time it
+ * runs is written at once.
+ */
+static void
+journal_write_buffered (gpointer data,
+			gpointer user_data)
+{
+	SoupCache *cache = user_data;
+	SoupCachePrivate *priv = soup_cache_get_instance_private (cache);
+	GFileIOStream *journal;
+	GByteArray *records;
+
+	g_mutex_lock (&priv->journal_mutex);
+        g_mutex_lock (&priv->mutex);
+	priv->journal_write_queued = FALSE;
+	records = priv->journal_buffer;
+	priv->journal_buffer = g_byte_array_new ();
+	journal = priv->journal ? g_object_ref (priv->journal) : NULL;
+        g_mutex_unlock (&priv->mutex);
+
+	if (journal && !journal_write (journal, records)) {
+                g_mutex_lock (&priv->mutex);
+		/* Unless the journal was started again meanwhile */
+		if (priv->journal == journal) {
+			g_clear_object (&priv->journal);
+			priv->journal_incomplete = TRUE;
+		}
+                g_mutex_unlock (&priv->mutex);
+	}
+
+	g_clear_object (&journal);
+	g_byte_array_unref (records);
+	g_mutex_unlock (&priv->journal_mutex);
+}
+
+/* Appends a change of the index to the journal. If that's not
+ * possible the journal no longer describes the index, and the whole
+ * index will be written on the next soup_cache_dump().
+ */
+static void
+journal_append (SoupCache         *cache,
+		JournalRecordType  type,
+		GVariant          *record)
+{
+	SoupCachePrivate *priv = soup_cache_get_instance_private (cache);
+	guint8 header[JOURNAL_RECORD_HEADER_SIZE];
+	guint32 size;
+
+	g_variant_ref_sink (record);
+
+	if (!priv->journal) {
+		priv->journal_incomplete = TRUE;
+		g_variant_unref (record);
+		return;
+	}
+
+	size = GUINT32_TO_LE ((guint32) g_variant_get_size (record));
+	memcpy (header, &size, sizeof (size));
+	header[sizeof (size)] = type;
+
+	g_byte_array_append (priv->journal_buffer, header, sizeof (header));
+	g_byte_array_append (priv->journal_buffer, g_variant_get_data (record), g_variant_get_size (record));
+	priv->journal_records++;
+
+	if (!priv->journal_write_queued) {
+		priv->journal_write_queued = TRUE;
+		g_thread_pool_push (priv->journal_writer, cache, NULL);
+	}
+
+	g_variant_unref (record);
+}
+
+static void
+journal_append_delete (SoupCache      *cache,
+		       SoupCacheEntry *entry)
+{
+	journal_append (cache, JOURNAL_RECORD_DELETE,
+			g_variant_new ("(ss)", entry->uri, entry->variant ? entry->variant : ""));
+}
+
+static void
+journal_append_pending (SoupCache      *cache,
+			SoupCacheEntry *entry)
+{
+	journal_append (cache, JOURNAL_RECORD_PENDING, g_variant_new ("t", entry->key));
+}
+
+typedef struct {
+	SoupCacheEntry *entry;
+	GBytes *body;
+	guint32 segment;
+} SegmentWrite;
+
+static void segment_write_next (SoupCache *cache);
+
+static void
+segment_free (SoupCacheSegment *segment)
+{
+	g_slice_free (SoupCacheSegment, segment);
+}
+
+static SoupCacheSegment *
+segment_lookup (SoupCache *cache,
+		guint32    id,
+		gboolean   create)
+{
+	SoupCachePrivate *priv = soup_cache_get_instance_private (cache);
+	SoupCacheSegment *segment;
+
+	segment = g_hash_table_lookup (priv->segments, GUINT_TO_POINTER (id));
+	if (!segment && create) {
+		segment = g_slice_new0 (SoupCacheSegment);
+		segment->id = id;
+		g_hash_table_insert (priv->segments, GUINT_TO_POINTER (id), segment);
+		priv->next_segment_id = MAX (priv->next_segment_id, id + 1);
+	}
+
+	return segment;
+}
+
+static void
+segment_delete (SoupCache        *cache,
+		SoupCacheSegment *segment)
+{
+	SoupCachePrivate *priv = soup_cache_get_instance_private (cache);
+	GFile *file = get_segment_file (cache, segment->id);
+
+	g_file_delete (file, NULL, NULL);
+	g_object_unref (file);
+
+	if (segment == priv->current_segment)
+		priv->current_segment = NULL;
+	g_hash_table_remove (priv->segments, GUINT_TO_POINTER (segment->id));
+}
+
+/* Accounts for an entry loaded from the index */
+static void
+segment_add_entry (SoupCache      *cache,
+		   SoupCacheEntry *entry)
+{
+	SoupCacheSegment *segment;
+
+	if (!entry->segment)
+		return;
+
+	segment = segment_lookup (cache, entry->segment, TRUE);
+	segment->size = MAX (segment->size, entry->offset + entry->stored_length);
+	segment->live += entry->stored_length;
+}
+
+/* Accounts for an entry that is gone, and deletes its segment if
+ * @purge is %TRUE and no other entry is using it.
+ */
+static void
+segment_remove_entry (SoupCache      *cache,
+		      SoupCacheEntry *entry,
+		      gboolean        purge)
+{
+	SoupCachePrivate *priv = soup_cache_get_instance_private (cache);
+	SoupCacheSegment *segment;
+
+	segment = segment_lookup (cache, entry->segment, FALSE);
+	if (!segment)
+		return;
+
+	segment->live -= MIN (segment->live, entry->stored_length);
+	if (purge && !segment->live && segment != priv->current_segment && !priv->loading)
+		segment_delete (cache, segment);
+}
+
+static void
+segment_write_finish (SoupCache    *cache,
+		      SegmentWrite *write,
+		      gboolean      success)
+{
+	SoupCachePrivate *priv = soup_cache_get_instance_private (cache);
+	SoupCacheEntry *entry = write->entry;
+
+	--priv->n_pending;
+	entry->dirty = FALSE;
+
+	if (!success || g_cancellable_is_cancelled (entry->cancellable)) {
+		g_clear_object (&entry->cancellable);
+		soup_cache_entry_remove (cache, entry, TRUE);
+	} else {
+		g_clear_object (&entry->cancellable);
+		journal_append (cache, JOURNAL_RECORD_INSERT, soup_cache_entry_serialize (entry));
+	}
+
+	g_bytes_unref (write->body);
+	g_slice_free (SegmentWrite, write);
+}
+
+/* The offsets of the writes after a failed one are wrong, so
+ * none of them can be used.
+ */
+static void
+segment_writes_fail (SoupCache *cache,
+		     guint32    id)
+{
+	SoupCachePrivate *priv = soup_cache_get_instance_private (cache);
+	GList *l, *next;
+
+	if (priv->current_segment && priv->current_segment->id == id)
+		priv->current_segment = NULL;
+
+	for (l = priv->segment_writes.head; l; l = next) {
+		SegmentWrite *write = l->data;
+
+		next = l->next;
+		if (write->segment != id)
+			continue;
+
+		g_queue_delete_link (&priv->segment_writes, l);
+		segment_write_finish (cache, write, FALSE);
+	}
+}
+
+static void
+segment_written_cb (GOutputStream *stream,
+		    GAsyncResult  *result,
+		    SoupCache     *cache)
+{
+	SoupCachePrivate *priv = soup_cache_get_instance_private (cache);
+	SegmentWrite *write;
+	gboolean success;
+	guint32 id;
+
+	success = g_output_stream_write_all_finish (stream, result, NULL, NULL);
+
+        g_mutex_lock (&priv->mutex);
+	write = g_queue_pop_head (&priv->segment_writes);
+	id = write->segment;
+	if (!success) {
+		segment_writes_fail (cache, id);
+		g_clear_object (&priv->segment_stream);
+	}
+	segment_write_finish (cache, write, success);
+	segment_write_next (cache);
+        g_mutex_unlock (&priv->mutex);
+
+	g_object_unref (cache);
+}
+
+static void
+segment_created_cb (GFile        *file,
+		    GAsyncResult *result,
+		    SoupCache    *cache)
+{
+	SoupCachePrivate *priv = soup_cache_get_instance_private (cache);
+	GFileOutputStream *stream;
+	SegmentWrite *write;
+
+	stream = g_file_create_finish (file, result, NULL);
+
+        g_mutex_lock (&priv->mutex);
+	write = g_queue_peek_head (&priv->segment_writes);
+	if (stream) {
+		priv->segment_stream = G_OUTPUT_STREAM (stream);
+		priv->segment_stream_id = write->segment;
+	} else {
+		/* Once its entries are gone, the segment is deleted
+		 * too, in case it was left behind by a previous run.
+		 */
+		segment_writes_fail (cache, write->segment);
+	}
+	segment_write_next (cache);
+        g_mutex_unlock (&priv->mutex);
+
+	g_object_unref (cache);
+}
+
+/* Starts the first queued write, must be called with the lock held.
+ * Segments are filled in order, so each of them is created when its
+ * first write is reached and never written again once the next one
+ * is.
+ */
+static void
+segment_write_next (SoupCache *cache)
+{
+	SoupCachePrivate *priv = soup_cache_get_instance_private (cache);
+	SegmentWrite *write;
+
+	write = g_queue_peek_head (&priv->segment_writes);
+	if (!write)
+		return;
+
+	if (!priv->segment_stream || priv->segment_stream_id != write->segment) {
+		GFile *file;
+
+		g_clear_object (&priv->segment_stream);
+		file = get_segment_file (cache, write->segment);
+		g_file_create_async (file, G_FILE_CREATE_PRIVATE, G_PRIORITY_LOW, NULL,
+				     (GAsyncReadyCallback)segment_created_cb, g_object_ref (cache));
+		g_object_unref (file);
+		return;
+	}
+
+	g_output_stream_write_all_async (priv->segment_stream,
+					 g_bytes_get_data (write->body, NULL),
+					 g_bytes_get_size (write->body),
+					 G_PRIORITY_LOW, NULL,
+					 (GAsyncReadyCallback)segment_written_cb,
+					 g_object_ref (cache));
+}
+
+/* Appends the resource of @entry to the current segment. It's
+ * written asynchronously, and the entry stays dirty until then.
+ */
+static void
+segment_append (SoupCache      *cache,
+		SoupCacheEntry *entry,
+		GBytes         *body)
+{
+	SoupCachePrivate *priv = soup_cache_get_instance_private (cache);
+	SoupCacheSegment *segment = priv->current_segment;
+	gsize size = g_bytes_get_size (body);
+	SegmentWrite *write;
+
+	if (!segment || segment->size + size > SEGMENT_MAX_SIZE) {
+		if (segment && !segment->live)
+			segment_delete (cache, segment);
+		segment = priv->current_segment = segment_lookup (cache, priv->next_segment_id, TRUE);
+	}
+
+	entry->segment = segment->id;
+	entry->offset = segment->size;
+	segment->size += size;
+	segment->live += size;
+
+	write = g_slice_new (SegmentWrite);
+	write->entry = entry;
+	write->body = g_bytes_ref (body);
+	write->segment = segment->id;
+	g_queue_push_tail (&priv->segment_writes, write);
+	if (priv->segment_writes.length == 1)
+		segment_write_next (cache);
+}
+
 static void
 copy_headers (const char *name, const char *value, SoupMessageHeaders *headers)
 {
@@ -351,27 +1002,147 @@ soup_cache_entry_is_fresh_enough (SoupCacheEntry *entry, gint min_fresh)
 	return entry->freshness_lifetime > limit;
 }
 
-static inline guint32
-get_cache_key_from_uri (const char *uri)
-{
-	return (guint32) g_str_hash (uri);
-}
-
-static void
-soup_cache_entry_set_freshness (SoupCacheEntry *entry, SoupMessage *msg, SoupCache *cache)
+/* Whether @entry is still within the staleness allowed by the
+ * stale-while-revalidate or stale-if-error @directive of its
+ * Cache-Control header (RFC 5861). They are rarely needed, so they
+ * are not kept in the index but parsed when the entry goes stale.
+ * Must be called with the lock held.
+ */
+static gboolean
+soup_cache_entry_is_within_stale_directive (SoupCacheEntry *entry,
+					    const char     *directive)
 {
 	const char *cache_control;
-	const char *expires, *date, *last_modified;
+	GHashTable *hash;
+	gpointer value;
+	guint current_age;
+	gint64 lifetime = 0;
 
-	/* Reset these values. We have to do this to ensure that
-	 * revalidations overwrite previous values for the headers.
-	 */
-	entry->must_revalidate = FALSE;
-	entry->freshness_lifetime = 0;
+	cache_control = soup_message_headers_get_list_common (soup_cache_entry_get_headers (entry), SOUP_HEADER_CACHE_CONTROL);
+	if (!cache_control || !*cache_control)
+		return FALSE;
 
-	cache_control = soup_message_headers_get_list_common (entry->headers, SOUP_HEADER_CACHE_CONTROL);
-	if (cache_control && *cache_control) {
-		const char *max_age, *s_maxage;
+	hash = soup_header_parse_param_list (cache_control);
+	value = g_hash_table_lookup (hash, directive);
+	if (value)
+		lifetime = g_ascii_strtoll (value, NULL, 10);
+	soup_header_free_param_list (hash);
+
+	if (lifetime <= 0)
+		return FALSE;
+
+	current_age = soup_cache_entry_get_current_age (entry);
+	if (current_age <= entry->freshness_lifetime)
+		return TRUE;
+
+	return current_age - entry->freshness_lifetime <= lifetime;
+}
+
+/* Gets how @entry answers the Range header of @msg, if any: with
+ * @status SOUP_STATUS_PARTIAL_CONTENT and the single @range requested,
+ * SOUP_STATUS_REQUESTED_RANGE_NOT_SATISFIABLE, or the whole resource
+ * with SOUP_STATUS_OK. Returns %FALSE if several ranges are requested,
+ * those are left to the server. Must be called with the lock held.
+ */
+static gboolean
+soup_cache_entry_get_range (SoupCacheEntry *entry,
+			    SoupMessage    *msg,
+			    guint          *status,
+			    SoupRange      *range)
+{
+	SoupMessageHeaders *request_headers = soup_message_get_request_headers (msg);
+	SoupMessageHeaders *headers;
+	const char *if_range;
+	SoupRange *ranges;
+	int n_ranges;
+
+	*status = SOUP_STATUS_OK;
+	if (entry->status_code != SOUP_STATUS_OK || !entry->length ||
+	    !soup_message_headers_get_one_common (request_headers, SOUP_HEADER_RANGE))
+		return TRUE;
+
+	/* The whole resource is sent if it's not the one If-Range
+	 * refers to. Weak entity tags never match (RFC 7233 3.2).
+	 */
+	headers = soup_cache_entry_get_headers (entry);
+	if_range = soup_message_headers_get_one_common (request_headers, SOUP_HEADER_IF_RANGE);
+	if (if_range) {
+		const char *validator;
+
+		if (*if_range == '"')
+			validator = soup_message_headers_get_one_common (headers, SOUP_HEADER_ETAG);
+		else
+			validator = soup_message_headers_get_one_common (headers, SOUP_HEADER_LAST_MODIFIED);
+		if (!validator || strcmp (if_range, validator) != 0)
+			return TRUE;
+	}
+
+	*status = soup_message_headers_get_ranges_internal (request_headers, entry->length, TRUE,
+							    &ranges, &n_ranges);
+	if (*status != SOUP_STATUS_PARTIAL_CONTENT)
+		return TRUE;
+
+	if (n_ranges > 1) {
+		soup_message_headers_free_ranges (request_headers, ranges);
+		return FALSE;
+	}
+
+	*range = ranges[0];
+	range->end = MIN (range->end, (goffset) entry->length - 1);
+	soup_message_headers_free_ranges (request_headers, ranges);
+
+	return TRUE;
+}
+
+#define FNV_OFFSET_BASIS G_GUINT64_CONSTANT (0xcbf29ce484222325)
+#define FNV_PRIME G_GUINT64_CONSTANT (0x100000001b3)
+
+static inline guint64
+fnv_hash_string (guint64     hash,
+		 const char *str)
+{
+	const guchar *p;
+
+	for (p = (const guchar *)str; *p; p++) {
+		hash ^= *p;
+		hash *= FNV_PRIME;
+	}
+
+	return hash;
+}
+
+/* FNV-1a over the uri and the variant, they are nul separated so that
+ * different pairs never hash the same string.
+ */
+static inline guint64
+get_cache_key (const char *uri,
+	       const char *variant)
+{
+	guint64 hash = fnv_hash_string (FNV_OFFSET_BASIS, uri);
+
+	if (variant) {
+		hash *= FNV_PRIME;
+		hash = fnv_hash_string (hash, variant);
+	}
+
+	return hash;
+}
+
+static void
+soup_cache_entry_set_freshness (SoupCacheEntry *entry, SoupMessage *msg, SoupCache *cache)
+{
+	const char *cache_control;
+	const char *expires, *date, *last_modified;
+
+	/* Reset these values. We have to do this to ensure that
+	 * revalidations overwrite previous values for the headers.
+	 */
+	entry->must_revalidate = FALSE;
+	entry->freshness_lifetime = 0;
+
+	cache_control = soup_message_headers_get_list_common (soup_cache_entry_get_headers (entry), SOUP_HEADER_CACHE_CONTROL);
+	if (cache_control && *cache_control) {
+		const char *max_age, *s_maxage;
 		gint64 freshness_lifetime = 0;
 		GHashTable *hash;
 		SoupCachePrivate *priv = soup_cache_get_instance_private (cache);
@@ -412,21 +1183,14 @@ soup_cache_entry_set_freshness (SoupCacheEntry *entry, SoupMessage *msg, SoupCac
 	/* If the 'Expires' response header is present, use its value
 	 * minus the value of the 'Date' response header
 	 */
-	expires = soup_message_headers_get_one_common (entry->headers, SOUP_HEADER_EXPIRES);
-	date = soup_message_headers_get_one_common (entry->headers, SOUP_HEADER_DATE);
+	expires = soup_message_headers_get_one_common (soup_cache_entry_get_headers (entry), SOUP_HEADER_EXPIRES);
+	date = soup_message_headers_get_one_common (soup_cache_entry_get_headers (entry), SOUP_HEADER_DATE);
 	if (expires && date) {
-		GDateTime *expires_d, *date_d;
 		gint64 expires_t, date_t;
 
-		expires_d = soup_date_time_new_from_http_string (expires);
-		if (expires_d) {
-			date_d = soup_date_time_new_from_http_string (date);
-
-			expires_t = g_date_time_to_unix (expires_d);
-			date_t = g_date_time_to_unix (date_d);
-
-			g_date_time_unref (expires_d);
-			g_date_time_unref (date_d);
+		if (soup_date_parse_http_time (expires, &expires_t)) {
+			if (!soup_date_parse_http_time (date, &date_t))
+				date_t = 0;
 
 			if (expires_t && date_t) {
 				entry->freshness_lifetime = (guint32) MAX (expires_t - date_t, 0);
@@ -457,19 +1221,17 @@ soup_cache_entry_set_freshness (SoupCacheEntry *entry, SoupMessage *msg, SoupCac
 	   than 24h (section 2.3.1.1) when using heuristics */
 
 	/* Last-Modified based heuristic */
-	last_modified = soup_message_headers_get_one_common (entry->headers, SOUP_HEADER_LAST_MODIFIED);
+	last_modified = soup_message_headers_get_one_common (soup_cache_entry_get_headers (entry), SOUP_HEADER_LAST_MODIFIED);
 	if (last_modified) {
-		GDateTime *soup_date;
 		gint64 now, last_modified_t;
 
-		soup_date = soup_date_time_new_from_http_string (last_modified);
-		last_modified_t = g_date_time_to_unix (soup_date);
+		if (!soup_date_parse_http_time (last_modified, &last_modified_t))
+			last_modified_t = 0;
 		now = time (NULL);
 
 #define HEURISTIC_FACTOR 0.1 /* From Section 2.3.1.1 */
 
 		entry->freshness_lifetime = MAX (0, (now - last_modified_t) * HEURISTIC_FACTOR);
-		g_date_time_unref (soup_date);
 	}
 
 	return;
@@ -495,6 +1257,7 @@ soup_cache_entry_new (SoupCache *cache, SoupMessage *msg, time_t request_time, t
 	/* Headers */
 	entry->headers = soup_message_headers_new (SOUP_MESSAGE_HEADERS_RESPONSE);
 	copy_end_to_end_headers (soup_message_get_response_headers (msg), entry->headers);
+	entry->variant = get_variant (entry->headers, soup_message_get_request_headers (msg));
 
 	/* LRU list */
 	entry->hits = 0;
@@ -506,13 +1269,11 @@ soup_cache_entry_new (SoupCache *cache, SoupMessage *msg, time_t request_time, t
 	date = soup_message_headers_get_one_common (entry->headers, SOUP_HEADER_DATE);
 
 	if (date) {
-		GDateTime *soup_date;
 		const char *age;
 		gint64 date_value, apparent_age, corrected_received_age, response_delay, age_value = 0;
 
-		soup_date = soup_date_time_new_from_http_string (date);
-		date_value = g_date_time_to_unix (soup_date);
-		g_date_time_unref (soup_date);
+		if (!soup_date_parse_http_time (date, &date_value))
+			date_value = 0;
 
 		age = soup_message_headers_get_one_common (entry->headers, SOUP_HEADER_AGE);
 		if (age)
@@ -530,11 +1291,196 @@ soup_cache_entry_new (SoupCache *cache, SoupMessage *msg, time_t request_time, t
 	return entry;
 }
 
+static void
+lru_bucket_free (SoupCache          *cache,
+		 SoupCacheLRUBucket *bucket)
+{
+	SoupCachePrivate *priv = soup_cache_get_instance_private (cache);
+
+	g_queue_unlink (&priv->lru_buckets, &bucket->link);
+	g_hash_table_remove (priv->lru_buckets_by_hits, GUINT_TO_POINTER (bucket->hits));
+	g_slice_free (SoupCacheLRUBucket, bucket);
+}
+
+/* Adds @entry as the most recently used one with its number of hits.
+ * @prev, if given, is a bucket with fewer hits than @entry and no
+ * other bucket between them, like the one @entry was in before its
+ * last hit.
+ */
+static void
+lru_insert (SoupCache          *cache,
+	    SoupCacheEntry     *entry,
+	    SoupCacheLRUBucket *prev)
+{
+	SoupCachePrivate *priv = soup_cache_get_instance_private (cache);
+	SoupCacheLRUBucket *bucket;
+
+	bucket = g_hash_table_lookup (priv->lru_buckets_by_hits, GUINT_TO_POINTER (entry->hits));
+	if (!bucket) {
+		bucket = g_slice_new0 (SoupCacheLRUBucket);
+		bucket->hits = entry->hits;
+		bucket->link.data = bucket;
+		g_hash_table_insert (priv->lru_buckets_by_hits, GUINT_TO_POINTER (bucket->hits), bucket);
+
+		if (!prev) {
+			GList *l;
+
+			/* The number of different hit counts is small, and
+			 * new entries usually go at either end.
+			 */
+			for (l = priv->lru_buckets.tail; l; l = l->prev) {
+				if (((SoupCacheLRUBucket *)l->data)->hits < entry->hits) {
+					prev = l->data;
+					break;
+				}
+			}
+		}
+
+		if (prev)
+			g_queue_insert_after_link (&priv->lru_buckets, &prev->link, &bucket->link);
+		else
+			g_queue_push_head_link (&priv->lru_buckets, &bucket->link);
+	}
+
+	entry->lru_bucket = bucket;
+	entry->lru_link.data = entry;
+	g_queue_push_tail_link (&bucket->entries, &entry->lru_link);
+}
+
+static void
+lru_remove (SoupCache      *cache,
+	    SoupCacheEntry *entry)
+{
+	SoupCacheLRUBucket *bucket = entry->lru_bucket;
+
+	g_queue_unlink (&bucket->entries, &entry->lru_link);
+	entry->lru_bucket = NULL;
+	if (g_queue_is_empty (&bucket->entries))
+		lru_bucket_free (cache, bucket);
+}
+
+/* Counts a hit on @entry and makes it the most recently used one */
+static void
+lru_touch (SoupCache      *cache,
+	   SoupCacheEntry *entry)
+{
+	SoupCacheLRUBucket *bucket = entry->lru_bucket;
+
+	if (entry->hits == G_MAXUINT32)
+		return;
+
+	g_queue_unlink (&bucket->entries, &entry->lru_link);
+	entry->hits++;
+	lru_insert (cache, entry, bucket);
+	if (g_queue_is_empty (&bucket->entries))
+		lru_bucket_free (cache, bucket);
+}
+
+static void
+memory_tier_drop (SoupCache      *cache,
+		  SoupCacheEntry *entry)
+{
+	SoupCachePrivate *priv = soup_cache_get_instance_private (cache);
+
+	if (!entry->body)
+		return;
+
+	g_queue_unlink (&priv->memory_tier, &entry->memory_link);
+	priv->memory_tier_used -= g_bytes_get_size (entry->body);
+	g_clear_pointer (&entry->body, g_bytes_unref);
+}
+
+static void
+memory_tier_shrink (SoupCache *cache)
+{
+	SoupCachePrivate *priv = soup_cache_get_instance_private (cache);
+
+	while (priv->memory_tier_used > priv->memory_tier_size)
+		memory_tier_drop (cache, priv->memory_tier.tail->data);
+}
+
+static gboolean
+memory_tier_accepts (SoupCache      *cache,
+		     SoupCacheEntry *entry)
+{
+	SoupCachePrivate *priv = soup_cache_get_instance_private (cache);
+
+	return priv->memory_tier_size &&
+		entry->hits >= MEMORY_TIER_MIN_HITS &&
+		entry->length <= priv->memory_tier_size / MAX_ENTRY_DATA_PERCENTAGE;
+}
+
+static void
+memory_tier_insert (SoupCache      *cache,
+		    SoupCacheEntry *entry,
+		    GBytes         *body)
+{
+	SoupCachePrivate *priv = soup_cache_get_instance_private (cache);
+
+	entry->body = g_bytes_ref (body);
+	entry->memory_link.data = entry;
+	g_queue_push_head_link (&priv->memory_tier, &entry->memory_link);
+	priv->memory_tier_used += g_bytes_get_size (body);
+	memory_tier_shrink (cache);
+}
+
+static void
+memory_tier_touch (SoupCache      *cache,
+		   SoupCacheEntry *entry)
+{
+	SoupCachePrivate *priv = soup_cache_get_instance_private (cache);
+
+	g_queue_unlink (&priv->memory_tier, &entry->memory_link);
+	g_queue_push_head_link (&priv->memory_tier, &entry->memory_link);
+}
+
+/* Removes @entry from the variants of its uri */
+static gboolean
+soup_cache_entry_unlink (SoupCache      *cache,
+			 SoupCacheEntry *entry)
+{
+	SoupCachePrivate *priv = soup_cache_get_instance_private (cache);
+	SoupCacheEntry *head, **link;
+
+	head = g_hash_table_lookup (priv->cache, entry->uri);
+	for (link = &head; *link && *link != entry; link = &(*link)->next_variant)
+		;
+	if (!*link)
+		return FALSE;
+
+	*link = entry->next_variant;
+	entry->next_variant = NULL;
+
+	/* The table key belongs to the head entry */
+	if (head)
+		g_hash_table_replace (priv->cache, head->uri, head);
+	else
+		g_hash_table_remove (priv->cache, entry->uri);
+
+	return TRUE;
+}
+
+static GList *
+soup_cache_get_all_entries (SoupCache *cache)
+{
+	SoupCachePrivate *priv = soup_cache_get_instance_private (cache);
+	SoupCacheEntry *entry;
+	GHashTableIter iter;
+	GList *entries = NULL;
+
+	g_hash_table_iter_init (&iter, priv->cache);
+	while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&entry)) {
+		for (; entry; entry = entry->next_variant)
+			entries = g_list_prepend (entries, entry);
+	}
+
+	return entries;
+}
+
 static gboolean
 soup_cache_entry_remove (SoupCache *cache, SoupCacheEntry *entry, gboolean purge)
 {
 	SoupCachePrivate *priv = soup_cache_get_instance_private (cache);
-	GList *lru_item;
 
 	if (entry->dirty) {
 		g_cancellable_cancel (entry->cancellable);
@@ -542,27 +1488,30 @@ soup_cache_entry_remove (SoupCache *cache, SoupCacheEntry *entry, gboolean purge
 	}
 
 	g_assert (!entry->dirty);
-	g_assert (g_list_length (priv->lru_start) == g_hash_table_size (priv->cache));
 
-	if (!g_hash_table_remove (priv->cache, GUINT_TO_POINTER (entry->key))) {
+	if (!soup_cache_entry_unlink (cache, entry)) {
                 g_mutex_unlock (&priv->mutex);
 		return FALSE;
         }
 
 	/* Remove from LRU */
-	lru_item = g_list_find (priv->lru_start, entry);
-	priv->lru_start = g_list_delete_link (priv->lru_start, lru_item);
+	lru_remove (cache, entry);
+	memory_tier_drop (cache, entry);
 
 	/* Adjust cache size */
-	priv->size -= entry->length;
-
-	g_assert (g_list_length (priv->lru_start) == g_hash_table_size (priv->cache));
+	priv->size -= entry->stored_length;
 
 	/* Free resources */
+	if (entry->segment)
+		segment_remove_entry (cache, entry, purge);
 	if (purge) {
-		GFile *file = get_file_from_entry (cache, entry);
-		g_file_delete (file, NULL, NULL);
-		g_object_unref (file);
+		if (!entry->segment) {
+			GFile *file = get_file_from_entry (cache, entry);
+			g_file_delete (file, NULL, NULL);
+			g_object_unref (file);
+		}
+
+		journal_append_delete (cache, entry);
 	}
 	soup_cache_entry_free (entry);
 
@@ -595,7 +1544,7 @@ lru_compare_func (gconstpointer a, gconstpointer b)
 		return entry_a->freshness_lifetime - entry_b->freshness_lifetime;
 
 	/* Sort by size */
-	return entry_a->length - entry_b->length;
+	return entry_a->stored_length - entry_b->stored_length;
 }
 
 static gboolean
@@ -608,11 +1557,55 @@ cache_accepts_entries_of_size (SoupCache *cache, guint length_to_add)
 	return length_to_add <= priv->max_entry_data_size;
 }
 
+static void
+soup_cache_entry_evict (SoupCache      *cache,
+			SoupCacheEntry *entry)
+{
+	SoupCachePrivate *priv = soup_cache_get_instance_private (cache);
+	char *uri = NULL;
+
+	/* The uri is freed with the entry */
+	if (g_signal_has_handler_pending (cache, signals[EVICTED], 0, FALSE))
+		uri = g_strdup (entry->uri);
+
+	if (!soup_cache_entry_remove (cache, entry, TRUE)) {
+		g_free (uri);
+		return;
+	}
+
+	STATS_ADD (priv, evictions, 1);
+	if (uri)
+		g_ptr_array_add (priv->evicted_uris, uri);
+}
+
+/* Emits ::evicted for the entries evicted while the lock was held */
+static void
+emit_evictions (SoupCache *cache)
+{
+	SoupCachePrivate *priv = soup_cache_get_instance_private (cache);
+	GPtrArray *evicted_uris;
+	guint i;
+
+        g_mutex_lock (&priv->mutex);
+	if (!priv->evicted_uris->len) {
+                g_mutex_unlock (&priv->mutex);
+		return;
+	}
+	evicted_uris = g_steal_pointer (&priv->evicted_uris);
+	priv->evicted_uris = g_ptr_array_new_with_free_func (g_free);
+        g_mutex_unlock (&priv->mutex);
+
+	for (i = 0; i < evicted_uris->len; i++)
+		g_signal_emit (cache, signals[EVICTED], 0, evicted_uris->pdata[i]);
+	g_ptr_array_unref (evicted_uris);
+}
+
 static void
 make_room_for_new_entry (SoupCache *cache, guint length_to_add)
 {
 	SoupCachePrivate *priv = soup_cache_get_instance_private (cache);
-	GList *lru_entry = priv->lru_start;
+	GList *bucket_link = priv->lru_buckets.head;
+	GList *lru_entry = bucket_link ? ((SoupCacheLRUBucket *)bucket_link->data)->entries.head : NULL;
 
 	/* Check that there is enough room for the new entry. This is
 	   an approximation as we're not working out the size of the
@@ -621,31 +1614,76 @@ make_room_for_new_entry (SoupCache *cache, guint length_to_add)
 
 	while (lru_entry &&
 	       (length_to_add + priv->size > priv->max_size)) {
-		SoupCacheEntry *old_entry = (SoupCacheEntry *)lru_entry->data;
+		GList *next_bucket_link = bucket_link->next;
+		GList *item, *victim = NULL;
+		guint i;
 
-		/* Discard entries. Once cancelled resources will be
-		 * freed in close_ready_cb
+		/* Discard first, among the least recently used entries
+		 * with the fewest hits, the ones that are closer to
+		 * expire and then the smaller ones.
 		 */
-		if (soup_cache_entry_remove (cache, old_entry, TRUE))
-			lru_entry = priv->lru_start;
-		else
-			lru_entry = g_list_next (lru_entry);
+		for (item = lru_entry, i = 0; item && i < LRU_EVICTION_WINDOW; item = item->next, i++) {
+			SoupCacheEntry *old_entry = (SoupCacheEntry *)item->data;
+
+			if (old_entry->dirty)
+				continue;
+			if (!victim || lru_compare_func (old_entry, victim->data) < 0)
+				victim = item;
+		}
+
+		if (victim) {
+			if (victim == lru_entry)
+				lru_entry = lru_entry->next;
+			soup_cache_entry_evict (cache, victim->data);
+		} else {
+			/* Discard entries. Once cancelled resources will be
+			 * freed in close_ready_cb
+			 */
+			for (i = 0; lru_entry && i < LRU_EVICTION_WINDOW; i++) {
+				item = lru_entry;
+				lru_entry = lru_entry->next;
+				soup_cache_entry_evict (cache, item->data);
+			}
+		}
+
+		if (!lru_entry) {
+			bucket_link = next_bucket_link;
+			lru_entry = bucket_link ? ((SoupCacheLRUBucket *)bucket_link->data)->entries.head : NULL;
+		}
+	}
+}
+
+static SoupCacheEntry *
+soup_cache_entry_lookup_variant (SoupCache  *cache,
+				 const char *uri,
+				 const char *variant)
+{
+	SoupCachePrivate *priv = soup_cache_get_instance_private (cache);
+	SoupCacheEntry *entry;
+
+	for (entry = g_hash_table_lookup (priv->cache, uri); entry; entry = entry->next_variant) {
+		if (g_strcmp0 (entry->variant, variant) == 0)
+			break;
 	}
+
+	return entry;
 }
 
 static gboolean
 soup_cache_entry_insert (SoupCache *cache,
-			 SoupCacheEntry *entry,
-			 gboolean sort)
+			 SoupCacheEntry *entry)
 {
 	SoupCachePrivate *priv = soup_cache_get_instance_private (cache);
 	guint length_to_add = 0;
 	SoupCacheEntry *old_entry;
 
 	/* Fill the key */
-	entry->key = get_cache_key_from_uri ((const char *) entry->uri);
+	entry->key = get_cache_key (entry->uri, entry->variant);
 
-	if (soup_message_headers_get_encoding (entry->headers) == SOUP_ENCODING_CONTENT_LENGTH)
+	/* Entries loaded from the index are complete */
+	if (entry->packed_headers)
+		length_to_add = entry->stored_length;
+	else if (soup_message_headers_get_encoding (entry->headers) == SOUP_ENCODING_CONTENT_LENGTH)
 		length_to_add = soup_message_headers_get_content_length (entry->headers);
 
 	/* Check if we are going to store the resource depending on its size */
@@ -658,24 +1696,21 @@ soup_cache_entry_insert (SoupCache *cache,
 	}
 
 	/* Remove any previous entry */
-	if ((old_entry = g_hash_table_lookup (priv->cache, GUINT_TO_POINTER (entry->key))) != NULL) {
+	old_entry = soup_cache_entry_lookup_variant (cache, entry->uri, entry->variant);
+	if (old_entry) {
 		if (!soup_cache_entry_remove (cache, old_entry, TRUE))
 			return FALSE;
 	}
 
-	/* Add to hash table */
-	g_hash_table_insert (priv->cache, GUINT_TO_POINTER (entry->key), entry);
+	/* Add to hash table, as the first variant */
+	entry->next_variant = g_hash_table_lookup (priv->cache, entry->uri);
+	g_hash_table_replace (priv->cache, entry->uri, entry);
 
 	/* Compute new cache size */
 	priv->size += length_to_add;
 
 	/* Update LRU */
-	if (sort)
-		priv->lru_start = g_list_insert_sorted (priv->lru_start, entry, lru_compare_func);
-	else
-		priv->lru_start = g_list_prepend (priv->lru_start, entry);
-
-	g_assert (g_list_length (priv->lru_start) == g_hash_table_size (priv->cache));
+	lru_insert (cache, entry, NULL);
 
 	return TRUE;
 }
@@ -686,61 +1721,91 @@ soup_cache_entry_lookup (SoupCache *cache,
 {
 	SoupCachePrivate *priv = soup_cache_get_instance_private (cache);
 	SoupCacheEntry *entry;
-	guint32 key;
 	char *uri = NULL;
 
 	uri = g_uri_to_string_partial (soup_message_get_uri (msg), G_URI_HIDE_PASSWORD);
-	key = get_cache_key_from_uri ((const char *) uri);
+	entry = g_hash_table_lookup (priv->cache, uri);
+	g_free (uri);
 
-	entry = g_hash_table_lookup (priv->cache, GUINT_TO_POINTER (key));
+	/* Find the variant selected by the request headers */
+	for (; entry; entry = entry->next_variant) {
+		char *variant;
+		gboolean matches;
 
-	if (entry != NULL && (strcmp (entry->uri, uri) != 0))
-		entry = NULL;
+		if (!entry->variant)
+			break;
+
+		variant = get_variant (soup_cache_entry_get_headers (entry), soup_message_get_request_headers (msg));
+		matches = g_strcmp0 (entry->variant, variant) == 0;
+		g_free (variant);
+		if (matches)
+			break;
+	}
 
-	g_free (uri);
 	return entry;
 }
 
-GInputStream *
-soup_cache_send_response (SoupCache *cache, SoupMessage *msg)
-{
-	SoupCachePrivate *priv = soup_cache_get_instance_private (cache);
-	SoupCacheEntry *entry;
-	GInputStream *file_stream, *body_stream, *cache_stream, *client_stream;
-	GFile *file;
-        SoupMessageMetrics *metrics;
-
-	g_return_val_if_fail (SOUP_IS_CACHE (cache), NULL);
-	g_return_val_if_fail (SOUP_IS_MESSAGE (msg), NULL);
+/* What's needed to respond from an entry, which could be gone by the
+ * time its file is open.
+ */
+typedef struct {
+	SoupMessage *msg;
+	SoupMessageHeaders *headers;
+	gsize length;
+	guint32 offset;
+	gboolean compressed;
+	guint16 status_code;
 
-        soup_message_set_metrics_timestamp (msg, SOUP_MESSAGE_METRICS_REQUEST_START);
+	/* The part of the body that is sent, all of it unless a
+	 * single range was requested.
+	 */
+	goffset range_start;
+	gsize range_length;
+	goffset skip;
 
-        g_mutex_lock (&priv->mutex);
-	entry = soup_cache_entry_lookup (cache, msg);
-        g_mutex_unlock (&priv->mutex);
-	g_return_val_if_fail (entry, NULL);
+	/* To find the entry again when its body is read into the
+	 * memory tier.
+	 */
+	gboolean promote;
+	char *uri;
+	char *variant;
+	guint32 response_time;
+	guint32 segment;
+	guint8 *buffer;
 
-	file = get_file_from_entry (cache, entry);
-	file_stream = G_INPUT_STREAM (g_file_read (file, NULL, NULL));
-	g_object_unref (file);
+	/* When it's in the memory tier */
+	GBytes *body;
+} CachedResponse;
 
-	/* Do not change the original message if there is no resource */
-	if (!file_stream)
-		return NULL;
+static void
+cached_response_free (CachedResponse *response)
+{
+	g_object_unref (response->msg);
+	soup_message_headers_unref (response->headers);
+	g_free (response->uri);
+	g_free (response->variant);
+	g_free (response->buffer);
+	g_clear_pointer (&response->body, g_bytes_unref);
+	g_slice_free (CachedResponse, response);
+}
 
-	body_stream = soup_body_input_stream_new (file_stream, SOUP_ENCODING_CONTENT_LENGTH, entry->length);
-	g_object_unref (file_stream);
+/* Returns the response to the task, reading its body from @stream */
+static void
+cached_response_return (GTask        *task,
+			GInputStream *stream)
+{
+	SoupCache *cache = g_task_get_source_object (task);
+	SoupCachePrivate *priv = soup_cache_get_instance_private (cache);
+	CachedResponse *response = g_task_get_task_data (task);
+	SoupMessage *msg = response->msg;
+	GInputStream *body_stream, *cache_stream, *client_stream;
+        SoupMessageMetrics *metrics;
 
-	if (!body_stream)
-		return NULL;
+	body_stream = soup_body_input_stream_new (stream, SOUP_ENCODING_CONTENT_LENGTH, response->range_length);
 
         metrics = soup_message_get_metrics (msg);
         if (metrics)
-                metrics->response_body_size = entry->length;
-
-	/* If we are told to send a response from cache any validation
-	   in course is over by now */
-	entry->being_validated = FALSE;
+                metrics->response_body_size = response->range_length;
 
 	/* Message starting */
 	soup_message_starting (msg);
@@ -748,10 +1813,25 @@ soup_cache_send_response (SoupCache *cache, SoupMessage *msg)
         soup_message_set_metrics_timestamp (msg, SOUP_MESSAGE_METRICS_RESPONSE_START);
 
 	/* Status */
-	soup_message_set_status (msg, entry->status_code, NULL);
+	soup_message_set_status (msg, response->status_code, NULL);
 
 	/* Headers */
-	copy_end_to_end_headers (entry->headers, soup_message_get_response_headers (msg));
+	copy_end_to_end_headers (response->headers, soup_message_get_response_headers (msg));
+	if (response->status_code == SOUP_STATUS_PARTIAL_CONTENT) {
+		soup_message_headers_set_content_range (soup_message_get_response_headers (msg),
+							response->range_start,
+							response->range_start + response->range_length - 1,
+							response->length);
+		soup_message_headers_set_content_length (soup_message_get_response_headers (msg),
+							 response->range_length);
+	} else if (response->status_code == SOUP_STATUS_REQUESTED_RANGE_NOT_SATISFIABLE) {
+		char *content_range = g_strdup_printf ("bytes */%" G_GSIZE_FORMAT, response->length);
+
+		soup_message_headers_replace_common (soup_message_get_response_headers (msg),
+						     SOUP_HEADER_CONTENT_RANGE, content_range);
+		soup_message_headers_set_content_length (soup_message_get_response_headers (msg), 0);
+		g_free (content_range);
+	}
 
 	/* Create the cache stream. */
 	soup_message_disable_feature (msg, SOUP_TYPE_CACHE);
@@ -763,30 +1843,313 @@ soup_cache_send_response (SoupCache *cache, SoupMessage *msg)
 	client_stream = soup_cache_client_input_stream_new (cache_stream);
 	g_object_unref (cache_stream);
 
-	return client_stream;
-}
-
-static void
-msg_got_headers_cb (SoupMessage *msg, gpointer user_data)
-{
-	g_object_set_data (G_OBJECT (msg), "response-time", GINT_TO_POINTER (time (NULL)));
-	g_signal_handlers_disconnect_by_func (msg, msg_got_headers_cb, user_data);
+	g_task_return_pointer (task, client_stream, g_object_unref);
+	g_object_unref (task);
 }
 
+/* Returns the response to the task from the whole @body in memory */
 static void
-msg_starting_cb (SoupMessage *msg, gpointer user_data)
+cached_response_return_bytes (GTask  *task,
+			      GBytes *body)
 {
-	g_object_set_data (G_OBJECT (msg), "request-time", GINT_TO_POINTER (time (NULL)));
-	g_signal_connect (msg, "got-headers", G_CALLBACK (msg_got_headers_cb), user_data);
-	g_signal_handlers_disconnect_by_func (msg, msg_starting_cb, user_data);
+	CachedResponse *response = g_task_get_task_data (task);
+	GInputStream *memory_stream;
+	GBytes *range;
+
+	range = g_bytes_new_from_bytes (body, response->range_start, response->range_length);
+	memory_stream = g_memory_input_stream_new_from_bytes (range);
+	g_bytes_unref (range);
+	cached_response_return (task, memory_stream);
+	g_object_unref (memory_stream);
 }
 
 static void
-request_queued (SoupSessionFeature *feature,
-		SoupMessage        *msg)
+cached_body_read_cb (GInputStream *stream,
+		     GAsyncResult *result,
+		     GTask        *task)
 {
-	g_signal_connect (msg, "starting", G_CALLBACK (msg_starting_cb), feature);
-}
+	SoupCache *cache = g_task_get_source_object (task);
+	SoupCachePrivate *priv = soup_cache_get_instance_private (cache);
+	CachedResponse *response = g_task_get_task_data (task);
+	SoupCacheEntry *entry;
+	GError *error = NULL;
+	gsize bytes_read;
+	GBytes *body;
+
+	if (!g_input_stream_read_all_finish (stream, result, &bytes_read, &error)) {
+		g_task_return_error (task, error);
+		g_object_unref (task);
+		return;
+	}
+
+	if (bytes_read != response->length) {
+		g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_PARTIAL_INPUT,
+					 "Cached resource is truncated");
+		g_object_unref (task);
+		return;
+	}
+
+	body = g_bytes_new_take (g_steal_pointer (&response->buffer), response->length);
+
+	/* Unless it has been replaced while reading it */
+        g_mutex_lock (&priv->mutex);
+	entry = soup_cache_entry_lookup_variant (cache, response->uri, response->variant);
+	if (entry && !entry->body && !entry->dirty &&
+	    entry->response_time == response->response_time &&
+	    entry->length == response->length &&
+	    entry->segment == response->segment &&
+	    entry->offset == response->offset)
+		memory_tier_insert (cache, entry, body);
+        g_mutex_unlock (&priv->mutex);
+
+	cached_response_return_bytes (task, body);
+	g_bytes_unref (body);
+}
+
+static gboolean
+cached_body_ready_cb (GTask *task)
+{
+	CachedResponse *response = g_task_get_task_data (task);
+
+	cached_response_return_bytes (task, response->body);
+
+	return G_SOURCE_REMOVE;
+}
+
+/* Compressed resources can't be seeked, so the beginning of the
+ * range is read and thrown away.
+ */
+static void
+cached_body_skipped_cb (GInputStream *stream,
+			GAsyncResult *result,
+			GTask        *task)
+{
+	CachedResponse *response = g_task_get_task_data (task);
+	GError *error = NULL;
+	gssize skipped;
+
+	skipped = g_input_stream_skip_finish (stream, result, &error);
+	if (skipped <= 0) {
+		if (!error) {
+			error = g_error_new_literal (G_IO_ERROR, G_IO_ERROR_PARTIAL_INPUT,
+						     "Cached resource is truncated");
+		}
+		g_task_return_error (task, error);
+		g_object_unref (task);
+		return;
+	}
+
+	response->skip -= skipped;
+	if (response->skip) {
+		g_input_stream_skip_async (stream, response->skip,
+					   g_task_get_priority (task),
+					   g_task_get_cancellable (task),
+					   (GAsyncReadyCallback)cached_body_skipped_cb, task);
+		return;
+	}
+
+	cached_response_return (task, stream);
+}
+
+static void
+cached_file_read_ready_cb (GFile        *file,
+			   GAsyncResult *result,
+			   GTask        *task)
+{
+	CachedResponse *response = g_task_get_task_data (task);
+	GInputStream *file_stream;
+	goffset offset = response->offset;
+	GError *error = NULL;
+
+	file_stream = G_INPUT_STREAM (g_file_read_finish (file, result, &error));
+
+	/* Do not change the original message if there is no resource */
+	if (!file_stream) {
+		g_task_return_error (task, error);
+		g_object_unref (task);
+		return;
+	}
+
+	/* Packed resources start somewhere in their segment, and the
+	 * range requested somewhere in the resource.
+	 */
+	if (!response->promote && !response->compressed)
+		offset += response->range_start;
+	if (offset &&
+	    !g_seekable_seek (G_SEEKABLE (file_stream), offset, G_SEEK_SET, NULL, &error)) {
+		g_object_unref (file_stream);
+		g_task_return_error (task, error);
+		g_object_unref (task);
+		return;
+	}
+
+	/* Decompressed as it's read, which happens in a thread too */
+	if (response->compressed) {
+		GConverter *decompressor;
+		GInputStream *converter_stream;
+
+		decompressor = G_CONVERTER (g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_GZIP));
+		converter_stream = g_converter_input_stream_new (file_stream, decompressor);
+		g_object_unref (decompressor);
+		g_object_unref (file_stream);
+		file_stream = converter_stream;
+	}
+
+	if (response->promote) {
+		response->buffer = g_malloc (response->length);
+		g_input_stream_read_all_async (file_stream, response->buffer, response->length,
+					       g_task_get_priority (task),
+					       g_task_get_cancellable (task),
+					       (GAsyncReadyCallback)cached_body_read_cb, task);
+		g_object_unref (file_stream);
+		return;
+	}
+
+	if (response->compressed && response->range_start) {
+		response->skip = response->range_start;
+		g_input_stream_skip_async (file_stream, response->skip,
+					   g_task_get_priority (task),
+					   g_task_get_cancellable (task),
+					   (GAsyncReadyCallback)cached_body_skipped_cb, task);
+		g_object_unref (file_stream);
+		return;
+	}
+
+	cached_response_return (task, file_stream);
+	g_object_unref (file_stream);
+}
+
+/* The file is opened in a thread, so that a slow disk doesn't block
+ * the other requests of the session. Bodies in the memory tier don't
+ * need the file at all.
+ */
+void
+soup_cache_send_response_async (SoupCache           *cache,
+				SoupMessage         *msg,
+				int                  io_priority,
+				GCancellable        *cancellable,
+				GAsyncReadyCallback  callback,
+				gpointer             user_data)
+{
+	SoupCachePrivate *priv = soup_cache_get_instance_private (cache);
+	SoupCacheEntry *entry;
+	CachedResponse *response;
+	SoupRange range;
+	guint status;
+	GFile *file;
+	GTask *task;
+
+	g_return_if_fail (SOUP_IS_CACHE (cache));
+	g_return_if_fail (SOUP_IS_MESSAGE (msg));
+
+	task = g_task_new (cache, cancellable, callback, user_data);
+	g_task_set_source_tag (task, soup_cache_send_response_async);
+	g_task_set_priority (task, io_priority);
+
+        soup_message_set_metrics_timestamp (msg, SOUP_MESSAGE_METRICS_REQUEST_START);
+
+        g_mutex_lock (&priv->mutex);
+	entry = soup_cache_entry_lookup (cache, msg);
+	if (!entry) {
+                g_mutex_unlock (&priv->mutex);
+		g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+					 "No cached response");
+		g_object_unref (task);
+		return;
+	}
+
+	response = g_slice_new0 (CachedResponse);
+	response->msg = g_object_ref (msg);
+	response->headers = soup_message_headers_ref (soup_cache_entry_get_headers (entry));
+	response->length = entry->length;
+	response->offset = entry->offset;
+	response->compressed = entry->compressed;
+	response->status_code = entry->status_code;
+	response->range_length = entry->length;
+	g_task_set_task_data (task, response, (GDestroyNotify)cached_response_free);
+
+	/* Several ranges are not served from the cache, but the whole
+	 * resource could still be sent if asked for them.
+	 */
+	if (soup_cache_entry_get_range (entry, msg, &status, &range) && status != SOUP_STATUS_OK) {
+		response->status_code = status;
+		if (status == SOUP_STATUS_PARTIAL_CONTENT) {
+			response->range_start = range.start;
+			response->range_length = range.end - range.start + 1;
+		} else {
+			response->range_length = 0;
+		}
+	}
+
+	/* being_validated is left alone, the entry can be sent stale
+	 * while it's revalidated in the background.
+	 */
+
+	/* Still responded from an idle, like the ones read from disk */
+	if (entry->body) {
+		GSource *source;
+
+		response->body = g_bytes_ref (entry->body);
+		memory_tier_touch (cache, entry);
+		STATS_ADD (priv, memory_hits, 1);
+		STATS_ADD (priv, bytes_from_cache, response->range_length);
+                g_mutex_unlock (&priv->mutex);
+
+		source = g_idle_source_new ();
+		g_task_attach_source (task, source, (GSourceFunc)cached_body_ready_cb);
+		g_source_unref (source);
+		return;
+	}
+
+	STATS_ADD (priv, disk_hits, 1);
+	STATS_ADD (priv, bytes_from_cache, response->range_length);
+	if (memory_tier_accepts (cache, entry)) {
+		response->promote = TRUE;
+		response->uri = g_strdup (entry->uri);
+		response->variant = g_strdup (entry->variant);
+		response->response_time = entry->response_time;
+		response->segment = entry->segment;
+	}
+
+	file = get_file_from_entry (cache, entry);
+        g_mutex_unlock (&priv->mutex);
+
+	g_file_read_async (file, io_priority, cancellable,
+			   (GAsyncReadyCallback)cached_file_read_ready_cb, task);
+	g_object_unref (file);
+}
+
+GInputStream *
+soup_cache_send_response_finish (SoupCache     *cache,
+				 GAsyncResult  *result,
+				 GError       **error)
+{
+	g_return_val_if_fail (g_task_is_valid (result, cache), NULL);
+
+	return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+static void
+msg_got_headers_cb (SoupMessage *msg, gpointer user_data)
+{
+	g_object_set_data (G_OBJECT (msg), "response-time", GINT_TO_POINTER (time (NULL)));
+	g_signal_handlers_disconnect_by_func (msg, msg_got_headers_cb, user_data);
+}
+
+static void
+msg_starting_cb (SoupMessage *msg, gpointer user_data)
+{
+	g_object_set_data (G_OBJECT (msg), "request-time", GINT_TO_POINTER (time (NULL)));
+	g_signal_connect (msg, "got-headers", G_CALLBACK (msg_got_headers_cb), user_data);
+	g_signal_handlers_disconnect_by_func (msg, msg_starting_cb, user_data);
+}
+
+static void
+request_queued (SoupSessionFeature *feature,
+		SoupMessage        *msg)
+{
+	g_signal_connect (msg, "starting", G_CALLBACK (msg_starting_cb), feature);
+}
 
 static void
 attach (SoupSessionFeature *feature, SoupSession *session)
@@ -807,8 +2170,57 @@ soup_cache_session_feature_init (SoupSessionFeatureInterface *feature_interface,
 typedef struct {
 	SoupCache *cache;
 	SoupCacheEntry *entry;
+	gboolean packed;
 } StreamHelper;
 
+static gboolean
+is_compressible_type (const char *content_type)
+{
+	guint i;
+
+	if (g_str_has_suffix (content_type, "+json") || g_str_has_suffix (content_type, "+xml"))
+		return TRUE;
+
+	for (i = 0; compressible_types[i]; i++) {
+		const char *pattern = compressible_types[i];
+		gsize len = strlen (pattern);
+
+		if (pattern[len - 1] == '*') {
+			if (g_ascii_strncasecmp (content_type, pattern, len - 1) == 0)
+				return TRUE;
+		} else if (g_ascii_strcasecmp (content_type, pattern) == 0)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+/* Whether the body of the new @entry should be stored compressed,
+ * the size of the ones without Content-Length is not known yet.
+ */
+static gboolean
+should_compress (SoupCache      *cache,
+		 SoupCacheEntry *entry)
+{
+	SoupCachePrivate *priv = soup_cache_get_instance_private (cache);
+	const char *content_type, *content_encoding;
+
+	if (!priv->compression)
+		return FALSE;
+
+	content_encoding = soup_message_headers_get_list_common (entry->headers, SOUP_HEADER_CONTENT_ENCODING);
+	if (content_encoding && g_ascii_strcasecmp (content_encoding, "identity") != 0)
+		return FALSE;
+
+	if (soup_message_headers_get_encoding (entry->headers) == SOUP_ENCODING_CONTENT_LENGTH &&
+	    soup_message_headers_get_content_length (entry->headers) < COMPRESSION_MIN_SIZE)
+		return FALSE;
+
+	content_type = soup_message_headers_get_content_type (entry->headers, NULL);
+
+	return content_type && is_compressible_type (content_type);
+}
+
 static void
 istream_caching_finished (SoupCacheInputStream *istream,
 			  gsize                 bytes_written,
@@ -822,10 +2234,31 @@ istream_caching_finished (SoupCacheInputStream *istream,
 
         g_mutex_lock (&priv->mutex);
 
+	if (!error) {
+		STATS_ADD (priv, bytes_from_network, bytes_written);
+		entry->length = bytes_written;
+		entry->stored_length = soup_cache_input_stream_get_stored_size (istream);
+
+		/* Room was made for the whole Content-Length */
+		if (entry->compressed &&
+		    soup_message_headers_get_encoding (entry->headers) == SOUP_ENCODING_CONTENT_LENGTH) {
+			priv->size -= soup_message_headers_get_content_length (entry->headers);
+			priv->size += entry->stored_length;
+		}
+	}
+
+	if (helper->packed && !error) {
+		GBytes *body = soup_cache_input_stream_steal_bytes (istream);
+
+		/* The entry stays pending until it's in its segment */
+		segment_append (cache, entry, body);
+		g_bytes_unref (body);
+		goto cleanup;
+	}
+
 	--priv->n_pending;
 
 	entry->dirty = FALSE;
-	entry->length = bytes_written;
 	g_clear_object (&entry->cancellable);
 
 	if (error) {
@@ -840,17 +2273,21 @@ istream_caching_finished (SoupCacheInputStream *istream,
 
 	if (soup_message_headers_get_encoding (entry->headers) != SOUP_ENCODING_CONTENT_LENGTH) {
 
-		if (cache_accepts_entries_of_size (cache, entry->length)) {
-			make_room_for_new_entry (cache, entry->length);
-			priv->size += entry->length;
+		if (cache_accepts_entries_of_size (cache, entry->stored_length)) {
+			make_room_for_new_entry (cache, entry->stored_length);
+			priv->size += entry->stored_length;
 		} else {
 			soup_cache_entry_remove (cache, entry, TRUE);
 			helper->entry = entry = NULL;
 		}
 	}
 
+	if (entry)
+		journal_append (cache, JOURNAL_RECORD_INSERT, soup_cache_entry_serialize (entry));
+
  cleanup:
         g_mutex_unlock (&priv->mutex);
+	emit_evictions (cache);
 	g_object_unref (helper->cache);
 	g_slice_free (StreamHelper, helper);
 }
@@ -869,6 +2306,7 @@ soup_cache_content_processor_wrap_input (SoupContentProcessor *processor,
 	GFile *file;
 	StreamHelper *helper;
 	time_t request_time, response_time;
+	gboolean packed;
 
         g_mutex_lock (&priv->mutex);
 
@@ -877,8 +2315,18 @@ soup_cache_content_processor_wrap_input (SoupContentProcessor *processor,
 	entry = soup_cache_entry_lookup (cache, msg);
 
 	if (cacheability & SOUP_CACHE_INVALIDATES) {
-		if (entry)
+		char *uri;
+
+		/* All the variants are invalidated */
+		uri = g_uri_to_string_partial (soup_message_get_uri (msg), G_URI_HIDE_PASSWORD);
+		entry = g_hash_table_lookup (priv->cache, uri);
+		while (entry) {
+			SoupCacheEntry *next = entry->next_variant;
+
 			soup_cache_entry_remove (cache, entry, TRUE);
+			entry = next;
+		}
+		g_free (uri);
                 g_mutex_unlock (&priv->mutex);
 		return NULL;
 	}
@@ -917,24 +2365,44 @@ soup_cache_content_processor_wrap_input (SoupContentProcessor *processor,
 	entry->dirty = TRUE;
 
 	/* Do not continue if it can not be stored */
-	if (!soup_cache_entry_insert (cache, entry, TRUE)) {
+	if (!soup_cache_entry_insert (cache, entry)) {
 		soup_cache_entry_free (entry);
                 g_mutex_unlock (&priv->mutex);
+		emit_evictions (cache);
 		return NULL;
 	}
 
 	entry->cancellable = g_cancellable_new ();
 	++priv->n_pending;
 
+	/* Small resources are kept in memory and appended to a segment
+	 * once complete, so nothing is written for them before that.
+	 */
+	packed = priv->packed_storage &&
+		soup_message_headers_get_encoding (entry->headers) == SOUP_ENCODING_CONTENT_LENGTH &&
+		soup_message_headers_get_content_length (entry->headers) <= SEGMENT_MAX_RESOURCE_SIZE;
+
+	/* So that the file can be removed if it's never completed */
+	if (!packed)
+		journal_append_pending (cache, entry);
+
+	entry->compressed = should_compress (cache, entry);
+
         g_mutex_unlock (&priv->mutex);
+	emit_evictions (cache);
 
 	helper = g_slice_new (StreamHelper);
 	helper->cache = g_object_ref (cache);
 	helper->entry = entry;
+	helper->packed = packed;
 
-	file = get_file_from_entry (cache, entry);
-	istream = soup_cache_input_stream_new (base_stream, file);
-	g_object_unref (file);
+	if (packed) {
+		istream = soup_cache_input_stream_new (base_stream, NULL, entry->compressed);
+	} else {
+		file = get_file_from_entry (cache, entry);
+		istream = soup_cache_input_stream_new (base_stream, file, entry->compressed);
+		g_object_unref (file);
+	}
 
 	g_signal_connect (istream, "caching-finished", G_CALLBACK (istream_caching_finished), helper);
 
@@ -957,9 +2425,26 @@ soup_cache_init (SoupCache *cache)
 {
 	SoupCachePrivate *priv = soup_cache_get_instance_private (cache);
 
-	priv->cache = g_hash_table_new (g_direct_hash, g_direct_equal);
+	priv->cache = g_hash_table_new (g_str_hash, g_str_equal);
 	/* LRU */
-	priv->lru_start = NULL;
+	g_queue_init (&priv->lru_buckets);
+	priv->lru_buckets_by_hits = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+	/* Packed storage */
+	priv->segments = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL,
+						(GDestroyNotify)segment_free);
+	priv->next_segment_id = 1;
+	g_queue_init (&priv->segment_writes);
+
+	/* Memory tier, disabled by default */
+	g_queue_init (&priv->memory_tier);
+
+	priv->evicted_uris = g_ptr_array_new_with_free_func (g_free);
+
+	/* Journal, at most one thread at a time so records are written in order */
+	priv->journal_buffer = g_byte_array_new ();
+	priv->journal_writer = g_thread_pool_new (journal_write_buffered, cache, 1, FALSE, NULL);
+	g_mutex_init (&priv->journal_mutex);
 
 	/* */
 	priv->n_pending = 0;
@@ -985,16 +2470,33 @@ soup_cache_finalize (GObject *object)
 	SoupCachePrivate *priv = soup_cache_get_instance_private ((SoupCache*)object);
 	GList *entries;
 
+	/* Wait for the journal records still being written */
+	g_thread_pool_free (priv->journal_writer, FALSE, TRUE);
+
 	/* Cannot use g_hash_table_foreach as callbacks must not modify the hash table */
-	entries = g_hash_table_get_values (priv->cache);
+	entries = soup_cache_get_all_entries ((SoupCache *)object);
 	g_list_foreach (entries, remove_cache_item, object);
 	g_list_free (entries);
 
 	g_hash_table_destroy (priv->cache);
 	g_free (priv->cache_dir);
 
-	g_list_free (priv->lru_start);
+	/* Entries still being written are not in the cache anymore */
+	while (!g_queue_is_empty (&priv->lru_buckets)) {
+		SoupCacheLRUBucket *bucket = g_queue_peek_head (&priv->lru_buckets);
 
+		while (!g_queue_is_empty (&bucket->entries))
+			((SoupCacheEntry *)g_queue_pop_head_link (&bucket->entries)->data)->lru_bucket = NULL;
+		lru_bucket_free ((SoupCache *)object, bucket);
+	}
+	g_hash_table_destroy (priv->lru_buckets_by_hits);
+
+	g_hash_table_destroy (priv->segments);
+	g_clear_object (&priv->segment_stream);
+	g_ptr_array_unref (priv->evicted_uris);
+	g_clear_object (&priv->journal);
+	g_byte_array_unref (priv->journal_buffer);
+	g_mutex_clear (&priv->journal_mutex);
         g_mutex_clear (&priv->mutex);
 
 	G_OBJECT_CLASS (soup_cache_parent_class)->finalize (object);
@@ -1088,6 +2590,26 @@ soup_cache_class_init (SoupCacheClass *cache_class)
                                    G_PARAM_STATIC_STRINGS);
 
         g_object_class_install_properties (gobject_class, LAST_PROPERTY, properties);
+
+	/**
+	 * SoupCache::evicted:
+	 * @cache: the cache
+	 * @uri: the uri of the evicted resource
+	 *
+	 * Emitted when a resource is removed from @cache to make room
+	 * for new ones.
+	 *
+	 * Since: 3.4
+	 */
+	signals[EVICTED] =
+		g_signal_new ("evicted",
+			      G_OBJECT_CLASS_TYPE (gobject_class),
+			      G_SIGNAL_RUN_LAST,
+			      0,
+			      NULL, NULL,
+			      NULL,
+			      G_TYPE_NONE, 1,
+			      G_TYPE_STRING);
 }
 
 /**
@@ -1122,57 +2644,47 @@ soup_cache_new (const char *cache_dir, SoupCacheType cache_type)
 			     NULL);
 }
 
-/**
- * soup_cache_has_response:
- * @cache: a #SoupCache
- * @msg: a #SoupMessage
- *
- * This function calculates whether the @cache object has a proper
- * response for the request @msg given the flags both in the request
- * and the cached reply and the time ellapsed since it was cached.
- *
- * Returns: whether or not the @cache has a valid response for @msg
- *
+/* Must be called with the cache mutex held, the entry may be evicted
+ * and freed by another thread otherwise.
  */
-SoupCacheResponse
-soup_cache_has_response (SoupCache *cache, SoupMessage *msg)
+static SoupCacheResponse
+get_cached_response_locked (SoupCache *cache, SoupMessage *msg)
 {
 	SoupCachePrivate *priv = soup_cache_get_instance_private (cache);
 	SoupCacheEntry *entry;
 	const char *cache_control;
 	gpointer value;
 	int max_age, max_stale, min_fresh;
-	GList *lru_item, *item;
-
-        g_mutex_lock (&priv->mutex);
+	gboolean stale_while_revalidate = FALSE;
+	gboolean has_range;
+	SoupRange range;
+	guint status;
 
 	entry = soup_cache_entry_lookup (cache, msg);
 
 	/* 1. The presented Request-URI and that of stored response
 	 * match
 	 */
-	if (!entry) {
-                g_mutex_unlock (&priv->mutex);
+	if (!entry)
 		return SOUP_CACHE_RESPONSE_STALE;
-        }
 
-	/* Increase hit count. Take sorting into account */
-	entry->hits++;
-	lru_item = g_list_find (priv->lru_start, entry);
-	item = lru_item;
-	while (item->next && lru_compare_func (item->data, item->next->data) > 0)
-		item = g_list_next (item);
+	/* Increase hit count */
+	lru_touch (cache, entry);
 
-	if (item != lru_item) {
-		priv->lru_start = g_list_remove_link (priv->lru_start, lru_item);
-		item = g_list_insert_sorted (item, lru_item->data, lru_compare_func);
-                (void)item; // Silence scan-build warning
-		g_list_free (lru_item);
-	}
+	/* While it's being revalidated it can only be used stale, the
+	 * revalidation is not repeated.
+	 */
+	if (entry->being_validated && !entry->dirty &&
+	    soup_cache_entry_is_within_stale_directive (entry, "stale-while-revalidate"))
+		stale_while_revalidate = TRUE;
 
-        g_mutex_unlock (&priv->mutex);
+	has_range = !entry->dirty && soup_cache_entry_get_range (entry, msg, &status, &range);
+
+	if (entry->dirty || (entry->being_validated && !stale_while_revalidate))
+		return SOUP_CACHE_RESPONSE_STALE;
 
-	if (entry->dirty || entry->being_validated)
+	/* Requests for several ranges go to the server */
+	if (!has_range)
 		return SOUP_CACHE_RESPONSE_STALE;
 
 	/* 2. The request method associated with the stored response
@@ -1282,12 +2794,70 @@ soup_cache_has_response (SoupCache *cache, SoupMessage *msg)
 				return SOUP_CACHE_RESPONSE_FRESH;
 		}
 
+		/* Served stale while it's revalidated in the
+		 * background, by the first request only.
+		 */
+		if (entry->being_validated) {
+			/* stale-while-revalidate already checked above */
+			STATS_ADD (priv, stale_hits, 1);
+			return SOUP_CACHE_RESPONSE_FRESH;
+		} else if (soup_cache_entry_is_within_stale_directive (entry, "stale-while-revalidate")) {
+			SoupMessageHeaders *headers = soup_cache_entry_get_headers (entry);
+
+			/* Without validators there's no background
+			 * revalidation, the session does a full request.
+			 */
+			if (soup_message_headers_get_one_common (headers, SOUP_HEADER_ETAG) ||
+			    soup_message_headers_get_one_common (headers, SOUP_HEADER_LAST_MODIFIED)) {
+				STATS_ADD (priv, stale_hits, 1);
+				return SOUP_CACHE_RESPONSE_STALE_WHILE_REVALIDATE;
+			}
+		}
+
 		return SOUP_CACHE_RESPONSE_NEEDS_VALIDATION;
 	}
 
 	return SOUP_CACHE_RESPONSE_FRESH;
 }
 
+static SoupCacheResponse
+get_cached_response (SoupCache *cache, SoupMessage *msg)
+{
+	SoupCachePrivate *priv = soup_cache_get_instance_private (cache);
+	SoupCacheResponse response;
+
+        g_mutex_lock (&priv->mutex);
+	response = get_cached_response_locked (cache, msg);
+        g_mutex_unlock (&priv->mutex);
+
+	return response;
+}
+
+/**
+ * soup_cache_has_response:
+ * @cache: a #SoupCache
+ * @msg: a #SoupMessage
+ *
+ * This function calculates whether the @cache object has a proper
+ * response for the request @msg given the flags both in the request
+ * and the cached reply and the time ellapsed since it was cached.
+ *
+ * Returns: whether or not the @cache has a valid response for @msg
+ *
+ */
+SoupCacheResponse
+soup_cache_has_response (SoupCache *cache, SoupMessage *msg)
+{
+	SoupCachePrivate *priv = soup_cache_get_instance_private (cache);
+	SoupCacheResponse response;
+
+	response = get_cached_response (cache, msg);
+	if (response == SOUP_CACHE_RESPONSE_STALE)
+		STATS_ADD (priv, misses, 1);
+
+	return response;
+}
+
 /**
  * soup_cache_get_cacheability:
  * @cache: a #SoupCache
@@ -1418,12 +2988,17 @@ soup_cache_clear (SoupCache *cache)
 	g_return_if_fail (priv->cache);
 
 	/* Cannot use g_hash_table_foreach as callbacks must not modify the hash table */
-	entries = g_hash_table_get_values (priv->cache);
+	entries = soup_cache_get_all_entries (cache);
 	g_list_foreach (entries, clear_cache_item, cache);
 	g_list_free (entries);
 
 	/* Remove also any file not associated with a cache entry. */
 	clear_cache_files (cache);
+
+	/* Its file is gone, new resources go to a new segment */
+	if (priv->current_segment && !priv->current_segment->live)
+		g_hash_table_remove (priv->segments, GUINT_TO_POINTER (priv->current_segment->id));
+	priv->current_segment = NULL;
 }
 
 SoupMessage *
@@ -1442,6 +3017,8 @@ soup_cache_generate_conditional_request (SoupCache *cache, SoupMessage *original
 	/* Add the validator entries in the header from the cached data */
         g_mutex_lock (&priv->mutex);
 	entry = soup_cache_entry_lookup (cache, original);
+	if (entry)
+		soup_cache_entry_get_headers (entry);
         g_mutex_unlock (&priv->mutex);
 	g_return_val_if_fail (entry, NULL);
 
@@ -1452,6 +3029,7 @@ soup_cache_generate_conditional_request (SoupCache *cache, SoupMessage *original
 		return NULL;
 
 	entry->being_validated = TRUE;
+	STATS_ADD (priv, revalidations, 1);
 
 	/* Copy the data we need from the original message */
 	uri = soup_message_get_uri (original);
@@ -1489,9 +3067,9 @@ soup_cache_cancel_conditional_request (SoupCache   *cache,
 
         g_mutex_lock (&priv->mutex);
 	entry = soup_cache_entry_lookup (cache, msg);
-        g_mutex_unlock (&priv->mutex);
 	if (entry)
 		entry->being_validated = FALSE;
+        g_mutex_unlock (&priv->mutex);
 
 	soup_session_cancel_message (priv->session, msg);
 }
@@ -1505,55 +3083,275 @@ soup_cache_update_from_conditional_request (SoupCache   *cache,
 
         g_mutex_lock (&priv->mutex);
         entry = soup_cache_entry_lookup (cache, msg);
-        g_mutex_unlock (&priv->mutex);
-	if (!entry)
+	if (!entry) {
+                g_mutex_unlock (&priv->mutex);
 		return;
+	}
 
 	entry->being_validated = FALSE;
 
 	if (soup_message_get_status (msg) == SOUP_STATUS_NOT_MODIFIED) {
+		STATS_ADD (priv, not_modified, 1);
 		soup_message_headers_foreach (soup_message_get_response_headers (msg),
 					      (SoupMessageHeadersForeachFunc) remove_headers,
-					      entry->headers);
+					      soup_cache_entry_get_headers (entry));
 		copy_end_to_end_headers (soup_message_get_response_headers (msg), entry->headers);
 
 		soup_cache_entry_set_freshness (entry, msg, cache);
+		journal_append (cache, JOURNAL_RECORD_INSERT, soup_cache_entry_serialize (entry));
+	} else if (SOUP_STATUS_IS_SUCCESSFUL (soup_message_get_status (msg))) {
+		/* The resource changed, so the entry can't be served
+		 * stale anymore.
+		 */
+		soup_cache_entry_remove (cache, entry, TRUE);
 	}
+        g_mutex_unlock (&priv->mutex);
 }
 
-static void
-pack_entry (gpointer data,
-	    gpointer user_data)
+/* Whether the stale response for @msg can be used because its
+ * revalidation failed, as allowed by stale-if-error.
+ */
+gboolean
+soup_cache_allows_stale_if_error (SoupCache   *cache,
+				  SoupMessage *msg)
 {
-	SoupCacheEntry *entry = (SoupCacheEntry *) data;
-	SoupMessageHeadersIter iter;
-	const char *header_key, *header_value;
-	GVariantBuilder *entries_builder = (GVariantBuilder *)user_data;
+        SoupCachePrivate *priv = soup_cache_get_instance_private (cache);
+	SoupCacheEntry *entry;
+	gboolean retval = FALSE;
+
+        g_mutex_lock (&priv->mutex);
+	entry = soup_cache_entry_lookup (cache, msg);
+	if (entry && !entry->dirty && !entry->must_revalidate)
+		retval = soup_cache_entry_is_within_stale_directive (entry, "stale-if-error");
+        g_mutex_unlock (&priv->mutex);
+
+	if (retval)
+		STATS_ADD (priv, stale_hits, 1);
+
+	return retval;
+}
+
+static void
+pack_entry (gpointer data,
+	    gpointer user_data)
+{
+	SoupCacheEntry *entry = (SoupCacheEntry *) data;
+	GVariantBuilder *entries_builder = (GVariantBuilder *)user_data;
 
 	/* Do not store non-consolidated entries */
 	if (entry->dirty || !entry->key)
 		return;
 
-	g_variant_builder_open (entries_builder, G_VARIANT_TYPE (SOUP_CACHE_PHEADERS_FORMAT));
-	g_variant_builder_add (entries_builder, "s", entry->uri);
-	g_variant_builder_add (entries_builder, "b", entry->must_revalidate);
-	g_variant_builder_add (entries_builder, "u", entry->freshness_lifetime);
-	g_variant_builder_add (entries_builder, "u", entry->corrected_initial_age);
-	g_variant_builder_add (entries_builder, "u", entry->response_time);
-	g_variant_builder_add (entries_builder, "u", entry->hits);
-	g_variant_builder_add (entries_builder, "u", entry->length);
-	g_variant_builder_add (entries_builder, "q", entry->status_code);
+	g_variant_builder_add_value (entries_builder, soup_cache_entry_serialize (entry));
+}
+
+static void
+journal_pending_entry (gpointer data,
+		       gpointer user_data)
+{
+	SoupCacheEntry *entry = (SoupCacheEntry *) data;
+
+	if (entry->dirty)
+		journal_append_pending ((SoupCache *) user_data, entry);
+}
 
-	/* Pack headers */
-	g_variant_builder_open (entries_builder, G_VARIANT_TYPE ("a" SOUP_CACHE_HEADERS_FORMAT));
-	soup_message_headers_iter_init (&iter, entry->headers);
-	while (soup_message_headers_iter_next (&iter, &header_key, &header_value)) {
-		if (g_utf8_validate (header_value, -1, NULL))
-			g_variant_builder_add (entries_builder, SOUP_CACHE_HEADERS_FORMAT,
-					       header_key, header_value);
+static gboolean
+journal_is_too_long (SoupCache *cache)
+{
+	SoupCachePrivate *priv = soup_cache_get_instance_private (cache);
+
+	return priv->journal_records > MAX (JOURNAL_MIN_RECORDS, 2 * g_hash_table_size (priv->cache));
+}
+
+static gboolean
+segment_has_writes (SoupCache *cache,
+		    guint32    id)
+{
+	SoupCachePrivate *priv = soup_cache_get_instance_private (cache);
+	GList *l;
+
+	for (l = priv->segment_writes.head; l; l = l->next) {
+		if (((SegmentWrite *)l->data)->segment == id)
+			return TRUE;
 	}
-	g_variant_builder_close (entries_builder); /* "a" SOUP_CACHE_HEADERS_FORMAT */
-	g_variant_builder_close (entries_builder); /* SOUP_CACHE_PHEADERS_FORMAT */
+
+	return FALSE;
+}
+
+static gint
+segment_offset_compare_func (gconstpointer a, gconstpointer b)
+{
+	SoupCacheEntry *entry_a = (SoupCacheEntry *)a;
+	SoupCacheEntry *entry_b = (SoupCacheEntry *)b;
+
+	if (entry_a->segment != entry_b->segment)
+		return entry_a->segment < entry_b->segment ? -1 : 1;
+
+	return entry_a->offset < entry_b->offset ? -1 : entry_a->offset > entry_b->offset;
+}
+
+/* Moves the resources still used in mostly empty segments to new
+ * ones, and deletes the old segments.
+ */
+static void
+compact_segments (SoupCache *cache)
+{
+	SoupCachePrivate *priv = soup_cache_get_instance_private (cache);
+	SoupCacheSegment *segment, *target = NULL;
+	GOutputStream *target_stream = NULL;
+	GInputStream *source = NULL;
+	guint32 source_id = 0;
+	GHashTable *victims;
+	GHashTableIter iter;
+	GList *entries, *l;
+	gpointer value;
+
+	victims = g_hash_table_new (g_direct_hash, g_direct_equal);
+	g_hash_table_iter_init (&iter, priv->segments);
+	while (g_hash_table_iter_next (&iter, NULL, &value)) {
+		segment = value;
+		if (segment != priv->current_segment &&
+		    segment->live * 100 < segment->size * SEGMENT_MIN_LIVE_PERCENTAGE &&
+		    !segment_has_writes (cache, segment->id))
+			g_hash_table_add (victims, GUINT_TO_POINTER (segment->id));
+	}
+
+	if (!g_hash_table_size (victims)) {
+		g_hash_table_destroy (victims);
+		return;
+	}
+
+	entries = soup_cache_get_all_entries (cache);
+	entries = g_list_sort (entries, segment_offset_compare_func);
+	for (l = entries; l; l = l->next) {
+		SoupCacheEntry *entry = l->data;
+		gboolean moved = FALSE;
+		gsize bytes_read;
+		guint8 *buffer;
+
+		if (!entry->segment || !g_hash_table_contains (victims, GUINT_TO_POINTER (entry->segment)))
+			continue;
+
+		if (entry->segment != source_id) {
+			GFile *file = get_segment_file (cache, entry->segment);
+
+			g_clear_object (&source);
+			source = G_INPUT_STREAM (g_file_read (file, NULL, NULL));
+			source_id = entry->segment;
+			g_object_unref (file);
+		}
+
+		if (!target || target->size + entry->stored_length > SEGMENT_MAX_SIZE) {
+			GFile *file;
+
+			g_clear_object (&target_stream);
+			target = segment_lookup (cache, priv->next_segment_id, TRUE);
+			file = get_segment_file (cache, target->id);
+			target_stream = G_OUTPUT_STREAM (g_file_create (file, G_FILE_CREATE_PRIVATE, NULL, NULL));
+			g_object_unref (file);
+		}
+
+		buffer = g_malloc (entry->stored_length);
+		if (source && target_stream &&
+		    g_seekable_seek (G_SEEKABLE (source), entry->offset, G_SEEK_SET, NULL, NULL) &&
+		    g_input_stream_read_all (source, buffer, entry->stored_length, &bytes_read, NULL, NULL) &&
+		    bytes_read == entry->stored_length) {
+			moved = g_output_stream_write_all (target_stream, buffer, entry->stored_length, NULL, NULL, NULL);
+
+			/* The next offsets would be wrong, use another segment */
+			if (!moved) {
+				g_clear_object (&target_stream);
+				if (!target->live)
+					segment_delete (cache, target);
+				target = NULL;
+			}
+		}
+		g_free (buffer);
+
+		if (!moved) {
+			soup_cache_entry_remove (cache, entry, TRUE);
+			continue;
+		}
+
+		segment_remove_entry (cache, entry, FALSE);
+		entry->segment = target->id;
+		entry->offset = target->size;
+		target->size += entry->stored_length;
+		target->live += entry->stored_length;
+		journal_append (cache, JOURNAL_RECORD_INSERT, soup_cache_entry_serialize (entry));
+	}
+	g_list_free (entries);
+
+	g_clear_object (&source);
+	g_clear_object (&target_stream);
+	if (target && !target->live)
+		segment_delete (cache, target);
+
+	g_hash_table_iter_init (&iter, victims);
+	while (g_hash_table_iter_next (&iter, &value, NULL)) {
+		segment = segment_lookup (cache, GPOINTER_TO_UINT (value), FALSE);
+		if (segment)
+			segment_delete (cache, segment);
+	}
+	g_hash_table_destroy (victims);
+}
+
+/* Writes the whole index and empties the journal. A new journal is
+ * only started if @start_journal is %TRUE, otherwise the next
+ * soup_cache_load() looks for files missing from the index.
+ */
+static void
+compact_index (SoupCache *cache,
+	       gboolean   start_journal)
+{
+	SoupCachePrivate *priv = soup_cache_get_instance_private (cache);
+	char *filename;
+	GVariantBuilder entries_builder;
+	GVariant *cache_variant;
+	GFile *file;
+	gboolean written;
+	GList *l;
+
+	/* Create the builder and iterate over all entries */
+	g_variant_builder_init (&entries_builder, G_VARIANT_TYPE (SOUP_CACHE_ENTRIES_FORMAT));
+	g_variant_builder_add (&entries_builder, "q", SOUP_CACHE_CURRENT_VERSION);
+	g_variant_builder_open (&entries_builder, G_VARIANT_TYPE ("a" SOUP_CACHE_PHEADERS_FORMAT));
+	/* In eviction order, so that it's kept when loading */
+	for (l = priv->lru_buckets.head; l; l = l->next)
+		g_queue_foreach (&((SoupCacheLRUBucket *)l->data)->entries, pack_entry, &entries_builder);
+	g_variant_builder_close (&entries_builder);
+
+	/* Serialize and dump */
+	cache_variant = g_variant_builder_end (&entries_builder);
+	g_variant_ref_sink (cache_variant);
+	filename = g_build_filename (priv->cache_dir, SOUP_CACHE_FILE, NULL);
+	written = g_file_set_contents (filename, (const char *) g_variant_get_data (cache_variant),
+				       g_variant_get_size (cache_variant), NULL);
+	g_free (filename);
+	g_variant_unref (cache_variant);
+
+	/* The journal still applies to the previous index */
+	if (!written)
+		return;
+
+	/* The buffered records are in the new index already */
+	g_clear_object (&priv->journal);
+	g_byte_array_set_size (priv->journal_buffer, 0);
+	priv->journal_records = 0;
+	priv->journal_incomplete = FALSE;
+
+	filename = g_build_filename (priv->cache_dir, SOUP_CACHE_JOURNAL_FILE, NULL);
+	g_unlink (filename);
+	if (start_journal) {
+		file = g_file_new_for_path (filename);
+		priv->journal = g_file_create_readwrite (file, G_FILE_CREATE_NONE, NULL, NULL);
+		g_object_unref (file);
+	}
+	g_free (filename);
+
+	/* Entries still being written are not in the index yet */
+	for (l = priv->lru_buckets.head; l; l = l->next)
+		g_queue_foreach (&((SoupCacheLRUBucket *)l->data)->entries, journal_pending_entry, cache);
 }
 
 /**
@@ -1568,43 +3366,53 @@ pack_entry (gpointer data,
  * You must call this before exiting if you want your cache data to
  * persist between sessions.
  *
+ * Once the index has been loaded with [method@Cache.load], changes to
+ * it are saved in a journal from a separate thread shortly after they
+ * happen, and the whole index is only written again when the journal
+ * grows too long compared to it. The hit
+ * counts of the entries are only saved then.
+ *
+ * With [method@Cache.set_packed_storage], the segments mostly used by
+ * resources that are gone are compacted here too.
+ *
  * This is not thread safe and must be called only from the thread that created the #SoupCache
  */
 void
 soup_cache_dump (SoupCache *cache)
 {
 	SoupCachePrivate *priv = soup_cache_get_instance_private (cache);
-	char *filename;
-	GVariantBuilder entries_builder;
-	GVariant *cache_variant;
+	gboolean has_journal;
 
-	if (!g_list_length (priv->lru_start))
+	/* Batches queued for the writer thread find nothing left to write */
+	g_mutex_lock (&priv->journal_mutex);
+        g_mutex_lock (&priv->mutex);
+	compact_segments (cache);
+	has_journal = priv->journal != NULL;
+	if (priv->journal && !priv->journal_incomplete && !journal_is_too_long (cache) &&
+	    journal_write (priv->journal, priv->journal_buffer)) {
+		g_byte_array_set_size (priv->journal_buffer, 0);
+		g_output_stream_flush (g_io_stream_get_output_stream (G_IO_STREAM (priv->journal)), NULL, NULL);
+                g_mutex_unlock (&priv->mutex);
+		g_mutex_unlock (&priv->journal_mutex);
 		return;
+	}
 
-	/* Create the builder and iterate over all entries */
-	g_variant_builder_init (&entries_builder, G_VARIANT_TYPE (SOUP_CACHE_ENTRIES_FORMAT));
-	g_variant_builder_add (&entries_builder, "q", SOUP_CACHE_CURRENT_VERSION);
-	g_variant_builder_open (&entries_builder, G_VARIANT_TYPE ("a" SOUP_CACHE_PHEADERS_FORMAT));
-	g_list_foreach (priv->lru_start, pack_entry, &entries_builder);
-	g_variant_builder_close (&entries_builder);
-
-	/* Serialize and dump */
-	cache_variant = g_variant_builder_end (&entries_builder);
-	g_variant_ref_sink (cache_variant);
-	filename = g_build_filename (priv->cache_dir, SOUP_CACHE_FILE, NULL);
-	g_file_set_contents (filename, (const char *) g_variant_get_data (cache_variant),
-			     g_variant_get_size (cache_variant), NULL);
-	g_free (filename);
-	g_variant_unref (cache_variant);
+	compact_index (cache, has_journal);
+        g_mutex_unlock (&priv->mutex);
+	g_mutex_unlock (&priv->journal_mutex);
 }
 
-static inline guint32
-get_key_from_cache_filename (const char *name)
+static inline gboolean
+is_cache_filename (const char *name)
 {
-	guint64 key;
+	const char *p;
+
+	for (p = name; *p; p++) {
+		if (!g_ascii_isxdigit (*p))
+			return FALSE;
+	}
 
-	key = g_ascii_strtoull (name, NULL, 10);
-	return key ? (guint32)key : 0;
+	return p != name;
 }
 
 static void
@@ -1614,114 +3422,464 @@ insert_cache_file (SoupCache *cache, const char *name, GHashTable *leaked_entrie
 	gchar *path;
 
 	path = g_build_filename (priv->cache_dir, name, NULL);
-	if (g_file_test (path, G_FILE_TEST_IS_REGULAR)) {
-		guint32 key = get_key_from_cache_filename (name);
-
-		if (key) {
-			g_hash_table_insert (leaked_entries, GUINT_TO_POINTER (key), path);
-			return;
-		}
+	if (g_file_test (path, G_FILE_TEST_IS_REGULAR) &&
+	    (is_cache_filename (name) || g_str_has_prefix (name, SEGMENT_FILE_PREFIX))) {
+		g_hash_table_insert (leaked_entries, g_strdup (name), path);
+		return;
 	}
 	g_free (path);
 }
 
-/**
- * soup_cache_load:
- * @cache: a #SoupCache
- *
- * Loads the contents of @cache's index into memory.
- *
- * This is not thread safe and must be called only from the thread that created the #SoupCache
+static void
+remove_leaked_files (GHashTable *leaked_entries)
+{
+	GHashTableIter iter;
+	gpointer value;
+
+	g_hash_table_iter_init (&iter, leaked_entries);
+	while (g_hash_table_iter_next (&iter, NULL, &value))
+		g_unlink ((char *)value);
+	g_hash_table_destroy (leaked_entries);
+}
+
+static void
+delete_entry_file (SoupCache      *cache,
+		   SoupCacheEntry *entry)
+{
+	GFile *file;
+
+	/* Segments are deleted once they are empty */
+	if (entry->segment)
+		return;
+
+	file = get_file_from_entry (cache, entry);
+
+	g_file_delete (file, NULL, NULL);
+	g_object_unref (file);
+}
+
+/* @headers is kept packed in the entry until it's needed */
+static SoupCacheEntry *
+load_entry (const char   *url,
+	    const char   *variant,
+	    gboolean      must_revalidate,
+	    guint32       freshness_lifetime,
+	    guint32       corrected_initial_age,
+	    guint32       response_time,
+	    guint32       hits,
+	    gsize         length,
+	    guint16       status_code,
+	    guint32       segment,
+	    guint32       offset,
+	    gboolean      compressed,
+	    gsize         stored_length,
+	    GVariant     *headers)
+{
+	SoupCacheEntry *entry;
+
+	/* Check that we have headers */
+	if (!g_variant_n_children (headers))
+		return NULL;
+
+	entry = g_slice_new0 (SoupCacheEntry);
+	entry->uri = g_strdup (url);
+	entry->variant = variant && *variant ? g_strdup (variant) : NULL;
+	entry->key = get_cache_key (entry->uri, entry->variant);
+	entry->must_revalidate = must_revalidate;
+	entry->freshness_lifetime = freshness_lifetime;
+	entry->corrected_initial_age = corrected_initial_age;
+	entry->response_time = response_time;
+	entry->hits = hits;
+	entry->length = length;
+	entry->packed_headers = g_variant_ref (headers);
+	entry->status_code = status_code;
+	entry->segment = segment;
+	entry->offset = offset;
+	entry->compressed = compressed;
+	entry->stored_length = compressed ? stored_length : length;
+
+	return entry;
+}
+
+/* Loads a version 5 index, whose files are named after a 32 bits
+ * hash of the uri, and renames them after the new keys. Returns
+ * %FALSE if there isn't one.
  */
-void
-soup_cache_load (SoupCache *cache)
+static gboolean
+load_old_index (SoupCache *cache)
 {
+	SoupCachePrivate *priv = soup_cache_get_instance_private (cache);
 	gboolean must_revalidate;
-	guint32 freshness_lifetime, hits;
+	guint32 freshness_lifetime, hits, length;
 	guint32 corrected_initial_age, response_time;
-	char *url, *filename = NULL, *contents = NULL;
-	GVariant *cache_variant;
-	GVariantIter *entries_iter = NULL, *headers_iter = NULL;
-	gsize length;
-	SoupCacheEntry *entry;
-	SoupCachePrivate *priv = soup_cache_get_instance_private (cache);
+	const char *url;
+	char *filename, *contents = NULL;
+	GVariant *cache_variant, *headers;
+	GVariantIter *entries_iter = NULL;
+	GHashTable *leaked_entries;
+	gsize contents_length;
 	guint16 version, status_code;
-	GHashTable *leaked_entries = NULL;
-	GHashTableIter iter;
-	gpointer value;
 
-	filename = g_build_filename (priv->cache_dir, SOUP_CACHE_FILE, NULL);
-	if (!g_file_get_contents (filename, &contents, &length, NULL)) {
+	filename = g_build_filename (priv->cache_dir, OLD_SOUP_CACHE_FILE, NULL);
+	if (!g_file_get_contents (filename, &contents, &contents_length, NULL)) {
 		g_free (filename);
-		g_free (contents);
-		clear_cache_files (cache);
-		return;
+		return FALSE;
 	}
+	g_unlink (filename);
 	g_free (filename);
 
-	cache_variant = g_variant_new_from_data (G_VARIANT_TYPE (SOUP_CACHE_ENTRIES_FORMAT),
-						 (const char *) contents, length, FALSE, g_free, contents);
-	g_variant_get (cache_variant, SOUP_CACHE_ENTRIES_FORMAT, &version, &entries_iter);
-	if (version != SOUP_CACHE_CURRENT_VERSION) {
+	cache_variant = g_variant_new_from_data (G_VARIANT_TYPE (OLD_SOUP_CACHE_ENTRIES_FORMAT),
+						 (const char *) contents, contents_length, FALSE, g_free, contents);
+	g_variant_get (cache_variant, OLD_SOUP_CACHE_ENTRIES_FORMAT, &version, &entries_iter);
+	if (version != OLD_SOUP_CACHE_VERSION) {
 		g_variant_iter_free (entries_iter);
 		g_variant_unref (cache_variant);
-		clear_cache_files (cache);
-		return;
+		return FALSE;
 	}
 
-	leaked_entries = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, g_free);
+	leaked_entries = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
 	soup_cache_foreach_file (cache, (SoupCacheForeachFileFunc)insert_cache_file, leaked_entries);
 
-	while (g_variant_iter_loop (entries_iter, SOUP_CACHE_PHEADERS_FORMAT,
+	while (g_variant_iter_loop (entries_iter, OLD_SOUP_CACHE_DECODE_PHEADERS_FORMAT,
 				    &url, &must_revalidate, &freshness_lifetime, &corrected_initial_age,
 				    &response_time, &hits, &length, &status_code,
-				    &headers_iter)) {
-		const char *header_key, *header_value;
-		SoupMessageHeaders *headers;
-		SoupMessageHeadersIter soup_headers_iter;
-
-		/* SoupMessage Headers */
-		headers = soup_message_headers_new (SOUP_MESSAGE_HEADERS_RESPONSE);
-		while (g_variant_iter_loop (headers_iter, SOUP_CACHE_HEADERS_FORMAT, &header_key, &header_value))
-			if (*header_key && *header_value)
-				soup_message_headers_append (headers, header_key, header_value);
-
-		/* Check that we have headers */
-		soup_message_headers_iter_init (&soup_headers_iter, headers);
-		if (!soup_message_headers_iter_next (&soup_headers_iter, &header_key, &header_value)) {
-			soup_message_headers_unref (headers);
+				    &headers)) {
+		SoupCacheEntry *entry;
+		char *old_name, *old_path, *new_name, *new_path;
+
+		entry = load_entry (url, NULL, must_revalidate, freshness_lifetime, corrected_initial_age,
+				    response_time, hits, length, status_code, 0, 0, FALSE, 0, headers);
+		if (!entry)
+			continue;
+
+		/* The request headers the response varies on were not
+		 * stored, so it can't be matched to a request anymore.
+		 */
+		if (soup_message_headers_get_list_common (soup_cache_entry_get_headers (entry), SOUP_HEADER_VARY)) {
+			soup_cache_entry_free (entry);
 			continue;
 		}
 
-		/* Insert in cache */
-		entry = g_slice_new0 (SoupCacheEntry);
-		entry->uri = g_strdup (url);
-		entry->must_revalidate = must_revalidate;
-		entry->freshness_lifetime = freshness_lifetime;
-		entry->corrected_initial_age = corrected_initial_age;
-		entry->response_time = response_time;
-		entry->hits = hits;
-		entry->length = length;
-		entry->headers = headers;
-		entry->status_code = status_code;
-
-		if (!soup_cache_entry_insert (cache, entry, FALSE))
+		old_name = g_strdup_printf ("%u", (guint) g_str_hash (url));
+		old_path = g_hash_table_lookup (leaked_entries, old_name);
+		if (!old_path || !soup_cache_entry_insert (cache, entry)) {
 			soup_cache_entry_free (entry);
+			g_free (old_name);
+			continue;
+		}
+
+		new_name = get_filename_from_entry (entry);
+		new_path = g_build_filename (priv->cache_dir, new_name, NULL);
+		if (g_rename (old_path, new_path) == -1)
+			soup_cache_entry_remove (cache, entry, FALSE);
 		else
-			g_hash_table_remove (leaked_entries, GUINT_TO_POINTER (entry->key));
+			g_hash_table_remove (leaked_entries, old_name);
+		g_free (new_path);
+		g_free (new_name);
+		g_free (old_name);
 	}
 
-	/* Remove the leaked files */
-	g_hash_table_iter_init (&iter, leaked_entries);
-	while (g_hash_table_iter_next (&iter, NULL, &value))
-		g_unlink ((char *)value);
-	g_hash_table_destroy (leaked_entries);
+	remove_leaked_files (leaked_entries);
+
+	g_variant_iter_free (entries_iter);
+	g_variant_unref (cache_variant);
+
+	return TRUE;
+}
+
+/* Returns %FALSE if @bytes is not an index of the current version */
+static gboolean
+load_index (SoupCache  *cache,
+	    GBytes     *bytes,
+	    GHashTable *leaked_entries)
+{
+	gboolean must_revalidate;
+	guint32 freshness_lifetime, hits, length;
+	guint32 corrected_initial_age, response_time;
+	guint32 segment, offset, stored_length;
+	gboolean compressed;
+	const char *url, *variant;
+	GVariant *cache_variant, *headers;
+	GVariantIter *entries_iter = NULL;
+	SoupCacheEntry *entry;
+	guint16 version, status_code;
+
+	cache_variant = g_variant_new_from_bytes (G_VARIANT_TYPE (SOUP_CACHE_ENTRIES_FORMAT), bytes, FALSE);
+	g_variant_get (cache_variant, SOUP_CACHE_ENTRIES_FORMAT, &version, &entries_iter);
+	if (version != SOUP_CACHE_CURRENT_VERSION) {
+		g_variant_iter_free (entries_iter);
+		g_variant_unref (cache_variant);
+		return FALSE;
+	}
 
-	priv->lru_start = g_list_reverse (priv->lru_start);
+	while (g_variant_iter_loop (entries_iter, SOUP_CACHE_DECODE_PHEADERS_FORMAT,
+				    &url, &variant, &must_revalidate, &freshness_lifetime, &corrected_initial_age,
+				    &response_time, &hits, &length, &status_code, &segment, &offset,
+				    &compressed, &stored_length, &headers)) {
+		entry = load_entry (url, variant, must_revalidate, freshness_lifetime, corrected_initial_age,
+				    response_time, hits, length, status_code, segment, offset,
+				    compressed, stored_length, headers);
+		if (!entry)
+			continue;
+
+		/* Insert in cache */
+		if (!soup_cache_entry_insert (cache, entry)) {
+			if (!leaked_entries)
+				delete_entry_file (cache, entry);
+			soup_cache_entry_free (entry);
+			continue;
+		}
+
+		segment_add_entry (cache, entry);
+		if (leaked_entries) {
+			char *name = get_filename_from_entry (entry);
+
+			g_hash_table_remove (leaked_entries, name);
+			g_free (name);
+		}
+	}
 
 	/* frees */
 	g_variant_iter_free (entries_iter);
 	g_variant_unref (cache_variant);
+
+	return TRUE;
+}
+
+static void
+replay_journal_record (SoupCache  *cache,
+		       guint8      type,
+		       GBytes     *bytes,
+		       GHashTable *pending)
+{
+	gboolean must_revalidate;
+	guint32 freshness_lifetime, hits, length;
+	guint32 corrected_initial_age, response_time;
+	guint32 segment, offset, stored_length;
+	gboolean compressed;
+	const char *url, *variant;
+	GVariant *record, *headers;
+	SoupCacheEntry *entry, *old_entry;
+	guint16 status_code;
+	guint64 key;
+	char *name;
+
+	switch (type) {
+	case JOURNAL_RECORD_INSERT:
+		record = g_variant_new_from_bytes (G_VARIANT_TYPE (SOUP_CACHE_PHEADERS_FORMAT), bytes, FALSE);
+		g_variant_get (record, SOUP_CACHE_DECODE_PHEADERS_FORMAT,
+			       &url, &variant, &must_revalidate, &freshness_lifetime, &corrected_initial_age,
+			       &response_time, &hits, &length, &status_code, &segment, &offset,
+			       &compressed, &stored_length, &headers);
+		entry = load_entry (url, variant, must_revalidate, freshness_lifetime, corrected_initial_age,
+				    response_time, hits, length, status_code, segment, offset,
+				    compressed, stored_length, headers);
+		g_variant_unref (headers);
+		g_variant_unref (record);
+		if (!entry)
+			break;
+
+		/* The file of the entry being replaced is this one */
+		old_entry = soup_cache_entry_lookup_variant (cache, entry->uri, entry->variant);
+		if (old_entry)
+			soup_cache_entry_remove (cache, old_entry, FALSE);
+
+		name = get_filename_from_entry (entry);
+		g_hash_table_remove (pending, name);
+		g_free (name);
+
+		if (!soup_cache_entry_insert (cache, entry)) {
+			delete_entry_file (cache, entry);
+			soup_cache_entry_free (entry);
+		} else {
+			segment_add_entry (cache, entry);
+		}
+		break;
+	case JOURNAL_RECORD_DELETE:
+		record = g_variant_new_from_bytes (G_VARIANT_TYPE ("(ss)"), bytes, FALSE);
+		g_variant_get (record, "(&s&s)", &url, &variant);
+		old_entry = soup_cache_entry_lookup_variant (cache, url, *variant ? variant : NULL);
+		if (old_entry)
+			soup_cache_entry_remove (cache, old_entry, FALSE);
+		g_variant_unref (record);
+		break;
+	case JOURNAL_RECORD_PENDING:
+		record = g_variant_new_from_bytes (G_VARIANT_TYPE_UINT64, bytes, FALSE);
+		key = g_variant_get_uint64 (record);
+		g_hash_table_add (pending, get_filename_from_key (key));
+		g_variant_unref (record);
+		break;
+	default:
+		break;
+	}
+}
+
+/* Applies the journal records, and returns the size of the complete
+ * ones. Files of entries that were still being written when the
+ * journal ended are removed.
+ */
+static gsize
+replay_journal (SoupCache *cache,
+		GBytes    *bytes)
+{
+	SoupCachePrivate *priv = soup_cache_get_instance_private (cache);
+	const guint8 *data;
+	gsize length, offset = 0;
+	GHashTable *pending;
+	GHashTableIter iter;
+	gpointer name;
+
+	pending = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+	data = g_bytes_get_data (bytes, &length);
+	while (length - offset >= JOURNAL_RECORD_HEADER_SIZE) {
+		GBytes *record;
+		guint32 size;
+
+		memcpy (&size, data + offset, sizeof (size));
+		size = GUINT32_FROM_LE (size);
+		/* Interrupted while it was being written */
+		if (size > length - offset - JOURNAL_RECORD_HEADER_SIZE)
+			break;
+
+		record = g_bytes_new_from_bytes (bytes, offset + JOURNAL_RECORD_HEADER_SIZE, size);
+		replay_journal_record (cache, data[offset + sizeof (size)], record, pending);
+		g_bytes_unref (record);
+
+		offset += JOURNAL_RECORD_HEADER_SIZE + size;
+		priv->journal_records++;
+	}
+
+	g_hash_table_iter_init (&iter, pending);
+	while (g_hash_table_iter_next (&iter, &name, NULL)) {
+		char *path = g_build_filename (priv->cache_dir, name, NULL);
+
+		g_unlink (path);
+		g_free (path);
+	}
+	g_hash_table_destroy (pending);
+
+	return offset;
+}
+
+static void
+journal_open (SoupCache *cache,
+	      gsize      length)
+{
+	SoupCachePrivate *priv = soup_cache_get_instance_private (cache);
+	char *filename;
+	GFile *file;
+
+	filename = g_build_filename (priv->cache_dir, SOUP_CACHE_JOURNAL_FILE, NULL);
+	file = g_file_new_for_path (filename);
+	priv->journal = g_file_open_readwrite (file, NULL, NULL);
+	g_object_unref (file);
+	g_free (filename);
+
+	/* Drop an interrupted record at the end */
+	if (priv->journal &&
+	    (!g_seekable_truncate (G_SEEKABLE (priv->journal), length, NULL, NULL) ||
+	     !g_seekable_seek (G_SEEKABLE (priv->journal), 0, G_SEEK_END, NULL, NULL)))
+		g_clear_object (&priv->journal);
+}
+
+/**
+ * soup_cache_load:
+ * @cache: a #SoupCache
+ *
+ * Loads the contents of @cache's index into memory.
+ *
+ * The changes saved in the journal since the index was last written
+ * are applied too, and from then on new changes are saved to it, see
+ * [method@Cache.dump].
+ *
+ * This is not thread safe and must be called only from the thread that created the #SoupCache
+ */
+void
+soup_cache_load (SoupCache *cache)
+{
+	SoupCachePrivate *priv = soup_cache_get_instance_private (cache);
+	char *filename, *contents;
+	gsize length, journal_length = 0;
+	GBytes *index = NULL, *journal = NULL;
+	GHashTable *leaked_entries = NULL;
+	GHashTableIter iter;
+	gpointer value;
+	gboolean compact = FALSE;
+
+	g_mutex_lock (&priv->journal_mutex);
+	g_clear_object (&priv->journal);
+	g_byte_array_set_size (priv->journal_buffer, 0);
+	priv->journal_records = 0;
+	priv->loading = TRUE;
+
+	filename = g_build_filename (priv->cache_dir, SOUP_CACHE_FILE, NULL);
+	if (g_file_get_contents (filename, &contents, &length, NULL))
+		index = g_bytes_new_take (contents, length);
+	g_free (filename);
+
+	filename = g_build_filename (priv->cache_dir, SOUP_CACHE_JOURNAL_FILE, NULL);
+	if (g_file_get_contents (filename, &contents, &length, NULL))
+		journal = g_bytes_new_take (contents, length);
+	g_free (filename);
+
+	if (!index && !journal) {
+		if (!load_old_index (cache))
+			clear_cache_files (cache);
+		compact = TRUE;
+		goto out;
+	}
+
+	/* Without a journal there's no record of the files written
+	 * since the index, look for them.
+	 */
+	if (!journal) {
+		leaked_entries = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+		soup_cache_foreach_file (cache, (SoupCacheForeachFileFunc)insert_cache_file, leaked_entries);
+		compact = TRUE;
+	}
+
+	if (index && !load_index (cache, index, leaked_entries)) {
+		g_clear_pointer (&leaked_entries, g_hash_table_destroy);
+		clear_cache_files (cache);
+		compact = TRUE;
+		goto out;
+	}
+
+	if (leaked_entries)
+		remove_leaked_files (leaked_entries);
+
+	if (journal)
+		journal_length = replay_journal (cache, journal);
+
+ out:
+	g_clear_pointer (&index, g_bytes_unref);
+	g_clear_pointer (&journal, g_bytes_unref);
+
+	/* Segments whose entries were all removed while loading */
+	g_hash_table_iter_init (&iter, priv->segments);
+	while (g_hash_table_iter_next (&iter, NULL, &value)) {
+		SoupCacheSegment *segment = value;
+		GFile *file;
+
+		if (segment->live)
+			continue;
+
+		file = get_segment_file (cache, segment->id);
+		g_file_delete (file, NULL, NULL);
+		g_object_unref (file);
+		g_hash_table_iter_remove (&iter);
+	}
+	priv->loading = FALSE;
+
+	/* Some entries could have been evicted while loading */
+	if (compact || priv->journal_incomplete || journal_is_too_long (cache))
+		compact_index (cache, TRUE);
+	else
+		journal_open (cache, journal_length);
+	g_mutex_unlock (&priv->journal_mutex);
+
+	emit_evictions (cache);
 }
 
 /**
@@ -1754,3 +3912,336 @@ soup_cache_get_max_size (SoupCache *cache)
 	SoupCachePrivate *priv = soup_cache_get_instance_private (cache);
 	return priv->max_size;
 }
+
+/**
+ * soup_cache_set_packed_storage:
+ * @cache: a #SoupCache
+ * @packed_storage: whether to pack small resources together
+ *
+ * Sets whether small resources are appended to shared segment files
+ * instead of being written each to its own file, which saves a file
+ * per resource when the cache holds many of them.
+ *
+ * Resources already in the cache are kept where they are.
+ *
+ * Since: 3.4
+ */
+void
+soup_cache_set_packed_storage (SoupCache *cache,
+			       gboolean   packed_storage)
+{
+	SoupCachePrivate *priv = soup_cache_get_instance_private (cache);
+
+	g_return_if_fail (SOUP_IS_CACHE (cache));
+
+        g_mutex_lock (&priv->mutex);
+	priv->packed_storage = packed_storage;
+        g_mutex_unlock (&priv->mutex);
+}
+
+/**
+ * soup_cache_get_packed_storage:
+ * @cache: a #SoupCache
+ *
+ * Gets whether small resources are packed together, see
+ * [method@Cache.set_packed_storage].
+ *
+ * Returns: %TRUE if small resources are packed in segment files
+ *
+ * Since: 3.4
+ */
+gboolean
+soup_cache_get_packed_storage (SoupCache *cache)
+{
+	SoupCachePrivate *priv = soup_cache_get_instance_private (cache);
+
+	g_return_val_if_fail (SOUP_IS_CACHE (cache), FALSE);
+
+	return priv->packed_storage;
+}
+
+/**
+ * soup_cache_set_compression:
+ * @cache: a #SoupCache
+ * @compression: whether to compress the resources stored
+ *
+ * Sets whether the bodies of text resources, like HTML, JavaScript or
+ * JSON, are stored compressed. They take less space in the cache
+ * directory, and less of its maximum size, at the cost of compressing
+ * them when they are stored and decompressing them every time they
+ * are sent. Both are done in a thread.
+ *
+ * Small resources and the ones that the server already compressed are
+ * stored as they are. Resources already in the cache are not changed.
+ *
+ * Since: 3.4
+ */
+void
+soup_cache_set_compression (SoupCache *cache,
+			    gboolean   compression)
+{
+	SoupCachePrivate *priv = soup_cache_get_instance_private (cache);
+
+	g_return_if_fail (SOUP_IS_CACHE (cache));
+
+        g_mutex_lock (&priv->mutex);
+	priv->compression = compression;
+        g_mutex_unlock (&priv->mutex);
+}
+
+/**
+ * soup_cache_get_compression:
+ * @cache: a #SoupCache
+ *
+ * Gets whether text resources are stored compressed, see
+ * [method@Cache.set_compression].
+ *
+ * Returns: %TRUE if text resources are stored compressed
+ *
+ * Since: 3.4
+ */
+gboolean
+soup_cache_get_compression (SoupCache *cache)
+{
+	SoupCachePrivate *priv = soup_cache_get_instance_private (cache);
+
+	g_return_val_if_fail (SOUP_IS_CACHE (cache), FALSE);
+
+	return priv->compression;
+}
+
+/**
+ * soup_cache_set_memory_tier_size:
+ * @cache: a #SoupCache
+ * @size: the maximum size of the memory tier, in bytes
+ *
+ * Sets the maximum size of the memory tier, or 0 to disable it, which
+ * is the default.
+ *
+ * The bodies of the resources that are hit often are kept in memory,
+ * so that they can be sent without reading their files again. The
+ * least recently used ones are dropped when @size is exceeded.
+ *
+ * Since: 3.4
+ */
+void
+soup_cache_set_memory_tier_size (SoupCache *cache,
+				 guint      size)
+{
+	SoupCachePrivate *priv = soup_cache_get_instance_private (cache);
+
+	g_return_if_fail (SOUP_IS_CACHE (cache));
+
+        g_mutex_lock (&priv->mutex);
+	priv->memory_tier_size = size;
+	memory_tier_shrink (cache);
+        g_mutex_unlock (&priv->mutex);
+}
+
+/**
+ * soup_cache_get_memory_tier_size:
+ * @cache: a #SoupCache
+ *
+ * Gets the maximum size of the memory tier, see
+ * [method@Cache.set_memory_tier_size].
+ *
+ * Returns: the maximum size of the memory tier, in bytes.
+ *
+ * Since: 3.4
+ */
+guint
+soup_cache_get_memory_tier_size (SoupCache *cache)
+{
+	SoupCachePrivate *priv = soup_cache_get_instance_private (cache);
+
+	g_return_val_if_fail (SOUP_IS_CACHE (cache), 0);
+
+	return priv->memory_tier_size;
+}
+
+/**
+ * soup_cache_get_tier_hits:
+ * @cache: a #SoupCache
+ * @memory_hits: (out) (optional): return location for the number of
+ *   responses sent from the memory tier
+ * @disk_hits: (out) (optional): return location for the number of
+ *   responses read from disk
+ *
+ * Gets how many responses @cache has sent from each tier. A response
+ * read from disk is a miss of the memory tier.
+ *
+ * Since: 3.4
+ */
+void
+soup_cache_get_tier_hits (SoupCache *cache,
+			  guint64   *memory_hits,
+			  guint64   *disk_hits)
+{
+	SoupCachePrivate *priv = soup_cache_get_instance_private (cache);
+
+	g_return_if_fail (SOUP_IS_CACHE (cache));
+
+	if (memory_hits)
+		*memory_hits = STATS_GET (priv, memory_hits);
+	if (disk_hits)
+		*disk_hits = STATS_GET (priv, disk_hits);
+}
+
+/**
+ * soup_cache_get_stats:
+ * @cache: a #SoupCache
+ *
+ * Gets statistics about how @cache has been used since it was
+ * created, as a dictionary of type `a{st}` with these keys:
+ *
+ * - `hits`: responses sent from the cache
+ * - `memory-hits` and `disk-hits`: the same, by tier, see
+ *   [method@Cache.get_tier_hits]
+ * - `stale-hits`: stale responses used, as allowed by
+ *   stale-while-revalidate or stale-if-error
+ * - `misses`: requests that the cache could not answer
+ * - `revalidations`: conditional requests made for cached responses
+ * - `not-modified`: revalidations that kept the cached response
+ * - `evictions`: responses removed to make room for new ones, see
+ *   [signal@Cache::evicted]
+ * - `bytes-from-cache`: body bytes sent from the cache
+ * - `bytes-from-network`: body bytes read from the network and cached
+ * - `entries`, `size` and `max-size`: the current contents of the cache
+ *
+ * The counters are updated without locking, so this is cheap enough
+ * to be called often.
+ *
+ * Returns: (transfer full): a #GVariant with the statistics
+ *
+ * Since: 3.4
+ */
+GVariant *
+soup_cache_get_stats (SoupCache *cache)
+{
+	SoupCachePrivate *priv = soup_cache_get_instance_private (cache);
+	GVariantBuilder builder;
+	guint64 entries = 0, size, max_size;
+	GList *l;
+
+	g_return_val_if_fail (SOUP_IS_CACHE (cache), NULL);
+
+        g_mutex_lock (&priv->mutex);
+	for (l = priv->lru_buckets.head; l; l = l->next)
+		entries += ((SoupCacheLRUBucket *)l->data)->entries.length;
+	size = priv->size;
+	max_size = priv->max_size;
+        g_mutex_unlock (&priv->mutex);
+
+	g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{st}"));
+	g_variant_builder_add (&builder, "{st}", "hits",
+			       (guint64) (STATS_GET (priv, memory_hits) + STATS_GET (priv, disk_hits)));
+	g_variant_builder_add (&builder, "{st}", "memory-hits", (guint64) STATS_GET (priv, memory_hits));
+	g_variant_builder_add (&builder, "{st}", "disk-hits", (guint64) STATS_GET (priv, disk_hits));
+	g_variant_builder_add (&builder, "{st}", "stale-hits", (guint64) STATS_GET (priv, stale_hits));
+	g_variant_builder_add (&builder, "{st}", "misses", (guint64) STATS_GET (priv, misses));
+	g_variant_builder_add (&builder, "{st}", "revalidations", (guint64) STATS_GET (priv, revalidations));
+	g_variant_builder_add (&builder, "{st}", "not-modified", (guint64) STATS_GET (priv, not_modified));
+	g_variant_builder_add (&builder, "{st}", "evictions", (guint64) STATS_GET (priv, evictions));
+	g_variant_builder_add (&builder, "{st}", "bytes-from-cache", (guint64) STATS_GET (priv, bytes_from_cache));
+	g_variant_builder_add (&builder, "{st}", "bytes-from-network", (guint64) STATS_GET (priv, bytes_from_network));
+	g_variant_builder_add (&builder, "{st}", "entries", entries);
+	g_variant_builder_add (&builder, "{st}", "size", size);
+	g_variant_builder_add (&builder, "{st}", "max-size", max_size);
+
+	return g_variant_ref_sink (g_variant_builder_end (&builder));
+}
+
+typedef struct {
+	guint64 entries;
+	guint64 size;
+	guint64 hits;
+	guint64 oldest_age;
+} OriginStats;
+
+/**
+ * soup_cache_get_origin_stats:
+ * @cache: a #SoupCache
+ *
+ * Gets what @cache holds for each origin, as a dictionary of type
+ * `a{sa{st}}` from the origins, like `https://example.com`, to
+ * dictionaries with these keys:
+ *
+ * - `entries`: the number of cached responses
+ * - `size`: the size of their bodies
+ * - `hits`: the number of times they have been requested
+ * - `oldest-age`: the age in seconds of the oldest one
+ *
+ * Unlike [method@Cache.get_stats], this walks all the entries of
+ * @cache.
+ *
+ * Returns: (transfer full): a #GVariant with the statistics
+ *
+ * Since: 3.4
+ */
+GVariant *
+soup_cache_get_origin_stats (SoupCache *cache)
+{
+	SoupCachePrivate *priv = soup_cache_get_instance_private (cache);
+	GVariantBuilder builder;
+	GHashTable *origins;
+	GHashTableIter iter;
+	gpointer key, value;
+	GList *entries, *l;
+
+	g_return_val_if_fail (SOUP_IS_CACHE (cache), NULL);
+
+	origins = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+        g_mutex_lock (&priv->mutex);
+	entries = soup_cache_get_all_entries (cache);
+	for (l = entries; l; l = l->next) {
+		SoupCacheEntry *entry = l->data;
+		OriginStats *stats;
+		GUri *uri;
+		char *origin;
+
+		if (entry->dirty)
+			continue;
+
+		uri = g_uri_parse (entry->uri, SOUP_HTTP_URI_FLAGS, NULL);
+		if (!uri)
+			continue;
+		origin = g_uri_join (G_URI_FLAGS_NONE, g_uri_get_scheme (uri), NULL,
+				     g_uri_get_host (uri), g_uri_get_port (uri), "", NULL, NULL);
+		g_uri_unref (uri);
+
+		stats = g_hash_table_lookup (origins, origin);
+		if (!stats) {
+			stats = g_new0 (OriginStats, 1);
+			g_hash_table_insert (origins, origin, stats);
+		} else {
+			g_free (origin);
+		}
+
+		stats->entries++;
+		stats->size += entry->stored_length;
+		stats->hits += entry->hits;
+		stats->oldest_age = MAX (stats->oldest_age, soup_cache_entry_get_current_age (entry));
+	}
+	g_list_free (entries);
+        g_mutex_unlock (&priv->mutex);
+
+	g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sa{st}}"));
+	g_hash_table_iter_init (&iter, origins);
+	while (g_hash_table_iter_next (&iter, &key, &value)) {
+		OriginStats *stats = value;
+
+		g_variant_builder_open (&builder, G_VARIANT_TYPE ("{sa{st}}"));
+		g_variant_builder_add (&builder, "s", key);
+		g_variant_builder_open (&builder, G_VARIANT_TYPE ("a{st}"));
+		g_variant_builder_add (&builder, "{st}", "entries", stats->entries);
+		g_variant_builder_add (&builder, "{st}", "size", stats->size);
+		g_variant_builder_add (&builder, "{st}", "hits", stats->hits);
+		g_variant_builder_add (&builder, "{st}", "oldest-age", stats->oldest_age);
+		g_variant_builder_close (&builder);
+		g_variant_builder_close (&builder);
+	}
+	g_hash_table_destroy (origins);
+
+	return g_variant_ref_sink (g_variant_builder_end (&builder));
+}
@@ -70,4 +70,32 @@ void       soup_cache_set_max_size (SoupCache     *cache,
 SOUP_AVAILABLE_IN_ALL
 guint      soup_cache_get_max_size (SoupCache     *cache);
 
+SOUP_AVAILABLE_IN_3_4
+void       soup_cache_set_packed_storage (SoupCache *cache,
+					  gboolean   packed_storage);
+SOUP_AVAILABLE_IN_3_4
+gboolean   soup_cache_get_packed_storage (SoupCache *cache);
+
+SOUP_AVAILABLE_IN_3_4
+void       soup_cache_set_compression    (SoupCache *cache,
+					  gboolean   compression);
+SOUP_AVAILABLE_IN_3_4
+gboolean   soup_cache_get_compression    (SoupCache *cache);
+
+SOUP_AVAILABLE_IN_3_4
+void       soup_cache_set_memory_tier_size (SoupCache *cache,
+					    guint      size);
+SOUP_AVAILABLE_IN_3_4
+guint      soup_cache_get_memory_tier_size (SoupCache *cache);
+
+SOUP_AVAILABLE_IN_3_4
+void       soup_cache_get_tier_hits        (SoupCache *cache,
+					    guint64   *memory_hits,
+					    guint64   *disk_hits);
+
+SOUP_AVAILABLE_IN_3_4
+GVariant  *soup_cache_get_stats            (SoupCache *cache);
+SOUP_AVAILABLE_IN_3_4
+GVariant  *soup_cache_get_origin_stats     (SoupCache *cache);
+
 G_END_DECLS
@@ -49,15 +49,34 @@ struct _SoupCookieJarDB {
 typedef struct {
 	char *filename;
 	sqlite3 *db;
+	sqlite3_stmt *insert_stmt;
+	sqlite3_stmt *delete_stmt;
+
+	/* Changes are grouped in a transaction that is committed
+	 * after COMMIT_DELAY or COMMIT_MAX_CHANGES changes.
+	 */
+	GMutex mutex;
+	GMainContext *context;
+	GSource *commit_source;
+	guint pending_changes;
 } SoupCookieJarDBPrivate;
 
+#define COMMIT_DELAY 500
+#define COMMIT_MAX_CHANGES 1000
+
 G_DEFINE_FINAL_TYPE_WITH_PRIVATE (SoupCookieJarDB, soup_cookie_jar_db, SOUP_TYPE_COOKIE_JAR)
 
 static void load (SoupCookieJar *jar);
+static void commit_changes (SoupCookieJarDB *jar);
 
 static void
 soup_cookie_jar_db_init (SoupCookieJarDB *db)
 {
+	SoupCookieJarDBPrivate *priv =
+		soup_cookie_jar_db_get_instance_private (db);
+
+	g_mutex_init (&priv->mutex);
+	priv->context = g_main_context_ref_thread_default ();
 }
 
 static void
@@ -66,8 +85,14 @@ soup_cookie_jar_db_finalize (GObject *object)
 	SoupCookieJarDBPrivate *priv =
 		soup_cookie_jar_db_get_instance_private (SOUP_COOKIE_JAR_DB (object));
 
+	commit_changes (SOUP_COOKIE_JAR_DB (object));
+
 	g_free (priv->filename);
+	g_clear_pointer (&priv->insert_stmt, sqlite3_finalize);
+	g_clear_pointer (&priv->delete_stmt, sqlite3_finalize);
 	g_clear_pointer (&priv->db, sqlite3_close);
+	g_main_context_unref (priv->context);
+	g_mutex_clear (&priv->mutex);
 
 	G_OBJECT_CLASS (soup_cookie_jar_db_parent_class)->finalize (object);
 }
@@ -117,7 +142,8 @@ soup_cookie_jar_db_get_property (GObject *object, guint prop_id,
  * @filename will be read in at startup to create an initial set of cookies. If
  * @read_only is %FALSE, then the non-session cookies will be written to
  * @filename when the [signal@CookieJar::changed] signal is emitted from the
- * jar. (If @read_only is %TRUE, then the cookie jar will only be used for this
+ * jar, with changes made in quick succession being committed together. (If
+ * @read_only is %TRUE, then the cookie jar will only be used for this
  * session, and changes made to it will be lost when the jar is destroyed.)
  *
  * Returns: the new #SoupCookieJar
@@ -134,9 +160,10 @@ soup_cookie_jar_db_new (const char *filename, gboolean read_only)
 }
 
 #define QUERY_ALL "SELECT id, name, value, host, path, expiry, lastAccessed, isSecure, isHttpOnly, sameSite FROM moz_cookies;"
-#define CREATE_TABLE "CREATE TABLE moz_cookies (id INTEGER PRIMARY KEY, name TEXT, value TEXT, host TEXT, path TEXT, expiry INTEGER, lastAccessed INTEGER, isSecure INTEGER, isHttpOnly INTEGER, sameSite INTEGER)"
-#define QUERY_INSERT "INSERT INTO moz_cookies VALUES(NULL, %Q, %Q, %Q, %Q, %d, NULL, %d, %d, %d);"
-#define QUERY_DELETE "DELETE FROM moz_cookies WHERE name=%Q AND host=%Q;"
+#define CREATE_TABLE "CREATE TABLE IF NOT EXISTS moz_cookies (id INTEGER PRIMARY KEY, name TEXT, value TEXT, host TEXT, path TEXT, expiry INTEGER, lastAccessed INTEGER, isSecure INTEGER, isHttpOnly INTEGER, sameSite INTEGER)"
+#define CREATE_INDEX "CREATE INDEX IF NOT EXISTS moz_cookies_host_name_path ON moz_cookies (host, name, path)"
+#define QUERY_INSERT "INSERT INTO moz_cookies VALUES(NULL, ?, ?, ?, ?, ?, NULL, ?, ?, ?);"
+#define QUERY_DELETE "DELETE FROM moz_cookies WHERE name=? AND host=?;"
 
 enum {
 	COL_ID,
@@ -196,40 +223,19 @@ callback (void *data, int argc, char **argv, char **colname)
 }
 
 static void
-try_create_table (sqlite3 *db)
+exec_query (sqlite3 *db,
+	    const char *sql,
+	    int (*callback)(void*,int,char**,char**),
+	    void *argument)
 {
 	char *error = NULL;
 
-	if (sqlite3_exec (db, CREATE_TABLE, NULL, NULL, &error)) {
+	if (sqlite3_exec (db, sql, callback, argument, &error)) {
 		g_warning ("Failed to execute query: %s", error);
 		sqlite3_free (error);
 	}
 }
 
-static void
-exec_query_with_try_create_table (sqlite3 *db,
-				  const char *sql,
-				  int (*callback)(void*,int,char**,char**),
-				  void *argument)
-{
-	char *error = NULL;
-	gboolean try_create = TRUE;
-
-try_exec:
-	if (sqlite3_exec (db, sql, callback, argument, &error)) {
-		if (try_create) {
-			try_create = FALSE;
-			try_create_table (db);
-			sqlite3_free (error);
-			error = NULL;
-			goto try_exec;
-		} else {
-			g_warning ("Failed to execute query: %s", error);
-			sqlite3_free (error);
-		}
-	}
-}
-
 /* Follows sqlite3 convention; returns TRUE on error */
 static gboolean
 open_db (SoupCookieJar *jar)
@@ -237,8 +243,6 @@ open_db (SoupCookieJar *jar)
 	SoupCookieJarDBPrivate *priv =
 		soup_cookie_jar_db_get_instance_private (SOUP_COOKIE_JAR_DB (jar));
 
-	char *error = NULL;
-
 	if (sqlite3_open (priv->filename, &priv->db)) {
 		sqlite3_close (priv->db);
 		priv->db = NULL;
@@ -246,15 +250,24 @@ open_db (SoupCookieJar *jar)
 		return TRUE;
 	}
 
-	if (sqlite3_exec (priv->db, "PRAGMA synchronous = OFF; PRAGMA secure_delete = 1;", NULL, NULL, &error)) {
-		g_warning ("Failed to execute query: %s", error);
-		sqlite3_free (error);
-	}
+	exec_query (priv->db, "PRAGMA synchronous = OFF; PRAGMA secure_delete = 1; PRAGMA journal_mode = WAL;", NULL, NULL);
+	exec_query (priv->db, CREATE_TABLE, NULL, NULL);
 
 	/* Migrate old DB to include same-site info. We simply always run this as it
 	   will safely handle a column with the same name existing */
 	sqlite3_exec (priv->db, "ALTER TABLE moz_cookies ADD COLUMN sameSite INTEGER DEFAULT 0", NULL, NULL, NULL);
 
+	exec_query (priv->db, CREATE_INDEX, NULL, NULL);
+
+	if (sqlite3_prepare_v2 (priv->db, QUERY_INSERT, -1, &priv->insert_stmt, NULL) ||
+	    sqlite3_prepare_v2 (priv->db, QUERY_DELETE, -1, &priv->delete_stmt, NULL)) {
+		g_warning ("Failed to prepare statement: %s", sqlite3_errmsg (priv->db));
+		g_clear_pointer (&priv->insert_stmt, sqlite3_finalize);
+		g_clear_pointer (&priv->delete_stmt, sqlite3_finalize);
+		g_clear_pointer (&priv->db, sqlite3_close);
+		return TRUE;
+	}
+
 	return FALSE;
 }
 
@@ -269,7 +282,54 @@ load (SoupCookieJar *jar)
 			return;
 	}
 
-	exec_query_with_try_create_table (priv->db, QUERY_ALL, callback, jar);
+	exec_query (priv->db, QUERY_ALL, callback, jar);
+}
+
+static void
+step_statement (sqlite3 *db, sqlite3_stmt *stmt)
+{
+	if (sqlite3_step (stmt) != SQLITE_DONE)
+		g_warning ("Failed to execute query: %s", sqlite3_errmsg (db));
+	sqlite3_reset (stmt);
+	sqlite3_clear_bindings (stmt);
+}
+
+/* Must be called with the mutex held */
+static void
+commit_changes_locked (SoupCookieJarDB *jar)
+{
+	SoupCookieJarDBPrivate *priv =
+		soup_cookie_jar_db_get_instance_private (jar);
+
+	if (priv->commit_source) {
+		g_source_destroy (priv->commit_source);
+		g_clear_pointer (&priv->commit_source, g_source_unref);
+	}
+
+	if (priv->pending_changes == 0)
+		return;
+
+	exec_query (priv->db, "COMMIT;", NULL, NULL);
+	priv->pending_changes = 0;
+}
+
+static void
+commit_changes (SoupCookieJarDB *jar)
+{
+	SoupCookieJarDBPrivate *priv =
+		soup_cookie_jar_db_get_instance_private (jar);
+
+        g_mutex_lock (&priv->mutex);
+	commit_changes_locked (jar);
+        g_mutex_unlock (&priv->mutex);
+}
+
+static gboolean
+commit_timeout (gpointer user_data)
+{
+	commit_changes (user_data);
+
+	return G_SOURCE_REMOVE;
 }
 
 static void
@@ -279,37 +339,50 @@ soup_cookie_jar_db_changed (SoupCookieJar *jar,
 {
 	SoupCookieJarDBPrivate *priv =
 		soup_cookie_jar_db_get_instance_private (SOUP_COOKIE_JAR_DB (jar));
-	char *query;
+
+	if (!old_cookie && !soup_cookie_get_expires (new_cookie))
+		return;
+
+        g_mutex_lock (&priv->mutex);
 
 	if (priv->db == NULL) {
-		if (open_db (jar))
+		if (open_db (jar)) {
+                        g_mutex_unlock (&priv->mutex);
 			return;
+                }
+	}
+
+	if (priv->pending_changes++ == 0) {
+		exec_query (priv->db, "BEGIN;", NULL, NULL);
+
+		priv->commit_source = g_timeout_source_new (COMMIT_DELAY);
+		g_source_set_name (priv->commit_source, "SoupCookieJarDB commit");
+		g_source_set_callback (priv->commit_source, commit_timeout, jar, NULL);
+		g_source_attach (priv->commit_source, priv->context);
 	}
 
 	if (old_cookie) {
-		query = sqlite3_mprintf (QUERY_DELETE,
-					 soup_cookie_get_name (old_cookie),
-					 soup_cookie_get_domain (old_cookie));
-		exec_query_with_try_create_table (priv->db, query, NULL, NULL);
-		sqlite3_free (query);
+		sqlite3_bind_text (priv->delete_stmt, 1, soup_cookie_get_name (old_cookie), -1, SQLITE_STATIC);
+		sqlite3_bind_text (priv->delete_stmt, 2, soup_cookie_get_domain (old_cookie), -1, SQLITE_STATIC);
+		step_statement (priv->db, priv->delete_stmt);
 	}
 
 	if (new_cookie && soup_cookie_get_expires (new_cookie)) {
-		gulong expires;
-		
-		expires = (gulong)g_date_time_to_unix (soup_cookie_get_expires (new_cookie));
-		query = sqlite3_mprintf (QUERY_INSERT, 
-					 soup_cookie_get_name (new_cookie),
-					 soup_cookie_get_value (new_cookie),
-					 soup_cookie_get_domain (new_cookie),
-					 soup_cookie_get_path (new_cookie),
-					 expires,
-					 soup_cookie_get_secure (new_cookie),
-					 soup_cookie_get_http_only (new_cookie),
-					 soup_cookie_get_same_site_policy (new_cookie));
-		exec_query_with_try_create_table (priv->db, query, NULL, NULL);
-		sqlite3_free (query);
+		sqlite3_bind_text (priv->insert_stmt, 1, soup_cookie_get_name (new_cookie), -1, SQLITE_STATIC);
+		sqlite3_bind_text (priv->insert_stmt, 2, soup_cookie_get_value (new_cookie), -1, SQLITE_STATIC);
+		sqlite3_bind_text (priv->insert_stmt, 3, soup_cookie_get_domain (new_cookie), -1, SQLITE_STATIC);
+		sqlite3_bind_text (priv->insert_stmt, 4, soup_cookie_get_path (new_cookie), -1, SQLITE_STATIC);
+		sqlite3_bind_int64 (priv->insert_stmt, 5, g_date_time_to_unix (soup_cookie_get_expires (new_cookie)));
+		sqlite3_bind_int (priv->insert_stmt, 6, soup_cookie_get_secure (new_cookie));
+		sqlite3_bind_int (priv->insert_stmt, 7, soup_cookie_get_http_only (new_cookie));
+		sqlite3_bind_int (priv->insert_stmt, 8, soup_cookie_get_same_site_policy (new_cookie));
+		step_statement (priv->db, priv->insert_stmt);
 	}
+
+	if (priv->pending_changes >= COMMIT_MAX_CHANGES)
+		commit_changes_locked (SOUP_COOKIE_JAR_DB (jar));
+
+        g_mutex_unlock (&priv->mutex);
 }
 
 static gboolean
@@ -9,7 +9,6 @@
 #include <config.h>
 #endif
 
-#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -44,23 +43,62 @@ struct _SoupCookieJarText {
 typedef struct {
 	char *filename;
 
+	/* Changes are not written right away, but coalesced and
+	 * flushed from a worker thread after FLUSH_DELAY. Every
+	 * snapshot of the jar gets a generation, so that a slow
+	 * write never replaces the file with older contents.
+	 */
+	GMutex mutex;
+	GMainContext *context;
+	GSource *flush_source;
+	gboolean dirty;
+	guint generation;
+
+	GMutex write_mutex;
+	guint written_generation;
 } SoupCookieJarTextPrivate;
 
+#define FLUSH_DELAY 500
+
 G_DEFINE_FINAL_TYPE_WITH_PRIVATE (SoupCookieJarText, soup_cookie_jar_text, SOUP_TYPE_COOKIE_JAR)
 
 static void load (SoupCookieJar *jar);
+static char *take_snapshot (SoupCookieJarText *jar, guint *generation);
+static void write_snapshot (SoupCookieJarText *jar, const char *contents, guint generation);
 
 static void
 soup_cookie_jar_text_init (SoupCookieJarText *text)
 {
+	SoupCookieJarTextPrivate *priv =
+		soup_cookie_jar_text_get_instance_private (text);
+
+	g_mutex_init (&priv->mutex);
+	g_mutex_init (&priv->write_mutex);
+	priv->context = g_main_context_ref_thread_default ();
 }
 
 static void
 soup_cookie_jar_text_finalize (GObject *object)
 {
+	SoupCookieJarText *text = SOUP_COOKIE_JAR_TEXT (object);
 	SoupCookieJarTextPrivate *priv =
-		soup_cookie_jar_text_get_instance_private (SOUP_COOKIE_JAR_TEXT (object));
+		soup_cookie_jar_text_get_instance_private (text);
+
+	/* Pending writes hold a reference, so only a scheduled flush
+	 * can be left at this point.
+	 */
+	if (priv->dirty) {
+		char *contents;
+		guint generation;
+
+		contents = take_snapshot (text, &generation);
+		write_snapshot (text, contents, generation);
+		g_free (contents);
+	}
 
+	g_main_context_unref (priv->context);
+	g_mutex_clear (&priv->mutex);
+	g_mutex_clear (&priv->write_mutex);
 	g_free (priv->filename);
 
 	G_OBJECT_CLASS (soup_cookie_jar_text_parent_class)->finalize (object);
@@ -110,9 +148,11 @@ soup_cookie_jar_text_get_property (GObject *object, guint prop_id,
  *
  * @filename will be read in at startup to create an initial set of cookies. If
  * @read_only is %FALSE, then the non-session cookies will be written to
- * @filename when the [signal@CookieJar::changed] signal is emitted from the
- * jar. (If @read_only is %TRUE, then the cookie jar will only be used for this
- * session, and changes made to it will be lost when the jar is destroyed.)
+ * @filename shortly after the [signal@CookieJar::changed] signal is emitted
+ * from the jar, several changes being written at once, and when the jar is
+ * destroyed. (If @read_only is %TRUE, then the cookie jar will only be used
+ * for this session, and changes made to it will be lost when the jar is
+ * destroyed.)
  *
  * Returns: the new #SoupCookieJar
  **/
@@ -155,10 +195,12 @@ same_site_policy_to_string (SoupSameSitePolicy policy)
 	g_return_val_if_reached ("Lax");
 }
 
+#define MAX_FIELDS 8
+
 static SoupCookie*
 parse_cookie (char *line, time_t now)
 {
-	char **result;
+	char *result[MAX_FIELDS];
 	SoupCookie *cookie = NULL;
 	gboolean http_only;
 	gulong expire_time;
@@ -174,16 +216,28 @@ parse_cookie (char *line, time_t now)
 	else
 		http_only = FALSE;
 
-	result = g_strsplit (line, "\t", -1);
-	result_length = g_strv_length (result);
+	/* Split the line in place, fields past MAX_FIELDS are
+	 * only counted.
+	 */
+	result_length = 0;
+	while (line) {
+		char *tab = strchr (line, '\t');
+
+		if (tab)
+			*tab = '\0';
+		if (result_length < MAX_FIELDS)
+			result[result_length] = line;
+		result_length++;
+		line = tab ? tab + 1 : NULL;
+	}
 	if (result_length < 7)
-		goto out;
+		return NULL;
 
 	/* Check this first */
 	expires = result[4];
 	expire_time = strtoul (expires, NULL, 10);
 	if (now >= expire_time)
-		goto out;
+		return NULL;
 	max_age = (expire_time - now <= G_MAXINT ? expire_time - now : G_MAXINT);
 
 	host = result[0];
@@ -213,9 +267,6 @@ parse_cookie (char *line, time_t now)
 	if (http_only)
 		soup_cookie_set_http_only (cookie, TRUE);
 
- out:
-	g_strfreev (result);
-
 	return cookie;
 }
 
@@ -234,86 +285,173 @@ load (SoupCookieJar *jar)
 {
 	SoupCookieJarTextPrivate *priv =
 		soup_cookie_jar_text_get_instance_private (SOUP_COOKIE_JAR_TEXT (jar));
-	char *contents = NULL, *line, *p;
-	gsize length = 0;
+	GFile *file;
+	GFileInputStream *istream;
+	GDataInputStream *data;
+	char *line;
 	time_t now = time (NULL);
 
+	file = g_file_new_for_path (priv->filename);
+	istream = g_file_read (file, NULL, NULL);
+	g_object_unref (file);
 	/* FIXME: error? */
-	if (!g_file_get_contents (priv->filename, &contents, &length, NULL))
+	if (!istream)
 		return;
 
-	line = contents;
-	for (p = contents; *p; p++) {
-		/* \r\n comes out as an extra empty line and gets ignored */
-		if (*p == '\r' || *p == '\n') {
-			*p = '\0';
-			parse_line (jar, line, now);
-			line = p + 1;
-		}
+	data = g_data_input_stream_new (G_INPUT_STREAM (istream));
+	g_data_input_stream_set_newline_type (data, G_DATA_STREAM_NEWLINE_TYPE_ANY);
+	while ((line = g_data_input_stream_read_line (data, NULL, NULL, NULL))) {
+		parse_line (jar, line, now);
+		g_free (line);
 	}
-	parse_line (jar, line, now);
 
-	g_free (contents);
+	g_object_unref (data);
+	g_object_unref (istream);
 }
 
 static void
-write_cookie (FILE *out, SoupCookie *cookie)
+write_cookie (GString *out, SoupCookie *cookie)
 {
-	fseek (out, 0, SEEK_END);
-
-	fprintf (out, "%s%s\t%s\t%s\t%s\t%lu\t%s\t%s\t%s\n",
-		 soup_cookie_get_http_only (cookie) ? "#HttpOnly_" : "",
-		 soup_cookie_get_domain (cookie),
-		 *soup_cookie_get_domain (cookie) == '.' ? "TRUE" : "FALSE",
-		 soup_cookie_get_path (cookie),
-		 soup_cookie_get_secure (cookie) ? "TRUE" : "FALSE",
-		 (gulong)g_date_time_to_unix (soup_cookie_get_expires (cookie)),
-		 soup_cookie_get_name (cookie),
-		 soup_cookie_get_value (cookie),
-		 same_site_policy_to_string (soup_cookie_get_same_site_policy (cookie)));
+	g_string_append_printf (out, "%s%s\t%s\t%s\t%s\t%lu\t%s\t%s\t%s\n",
+				soup_cookie_get_http_only (cookie) ? "#HttpOnly_" : "",
+				soup_cookie_get_domain (cookie),
+				*soup_cookie_get_domain (cookie) == '.' ? "TRUE" : "FALSE",
+				soup_cookie_get_path (cookie),
+				soup_cookie_get_secure (cookie) ? "TRUE" : "FALSE",
+				(gulong)g_date_time_to_unix (soup_cookie_get_expires (cookie)),
+				soup_cookie_get_name (cookie),
+				soup_cookie_get_value (cookie),
+				same_site_policy_to_string (soup_cookie_get_same_site_policy (cookie)));
 }
 
-static void
-delete_cookie (const char *filename, SoupCookie *cookie)
+/* Serializes every persistent cookie in @jar. Must not be called
+ * from the changed handler, which runs with the jar's lock held.
+ */
+static char *
+take_snapshot (SoupCookieJarText *jar, guint *generation)
 {
-	char *contents = NULL, *line, *p;
-	gsize length = 0;
-	FILE *f;
-	SoupCookie *c;
-	time_t now = time (NULL);
+	SoupCookieJarTextPrivate *priv =
+		soup_cookie_jar_text_get_instance_private (jar);
+	GSList *cookies, *l;
+	GString *out;
+
+        g_mutex_lock (&priv->mutex);
+	if (priv->flush_source) {
+		g_source_destroy (priv->flush_source);
+		g_source_unref (priv->flush_source);
+		priv->flush_source = NULL;
+	}
+	priv->dirty = FALSE;
+	*generation = ++priv->generation;
+        g_mutex_unlock (&priv->mutex);
+
+	out = g_string_new ("# HTTP Cookie File\n"
+			    "# http://www.netscape.com/newsref/std/cookie_spec.html\n"
+			    "# This is a generated file!  Do not edit.\n"
+			    "# To delete cookies, use the Cookie Manager.\n\n");
+
+	cookies = soup_cookie_jar_all_cookies (SOUP_COOKIE_JAR (jar));
+	/* all_cookies() returns them in reverse order */
+	cookies = g_slist_reverse (cookies);
+	for (l = cookies; l; l = l->next) {
+		if (soup_cookie_get_expires (l->data))
+			write_cookie (out, l->data);
+	}
+	g_slist_free_full (cookies, (GDestroyNotify)soup_cookie_free);
 
-	if (!g_file_get_contents (filename, &contents, &length, NULL))
-		return;
+	return g_string_free (out, FALSE);
+}
 
-	f = fopen (filename, "w");
-	if (!f) {
-		g_free (contents);
-		return;
-	}
+/* Replaces the file atomically, unless a newer snapshot has already
+ * been written. Can be called from any thread.
+ */
+static void
+write_snapshot (SoupCookieJarText *jar, const char *contents, guint generation)
+{
+	SoupCookieJarTextPrivate *priv =
+		soup_cookie_jar_text_get_instance_private (jar);
 
-	line = contents;
-	for (p = contents; *p; p++) {
-		/* \r\n comes out as an extra empty line and gets ignored */
-		if (*p == '\r' || *p == '\n') {
-			*p = '\0';
-			c = parse_cookie (line, now);
-			line = p + 1;
-			if (!c)
-				continue;
-			if (!soup_cookie_equal (cookie, c))
-				write_cookie (f, c);
-			soup_cookie_free (c);
-		}
-	}
-	c = parse_cookie (line, now);
-	if (c) {
-		if (!soup_cookie_equal (cookie, c))
-			write_cookie (f, c);
-		soup_cookie_free (c);
+        g_mutex_lock (&priv->write_mutex);
+	if ((int)(generation - priv->written_generation) > 0) {
+		/* FIXME: error? */
+		g_file_set_contents (priv->filename, contents, -1, NULL);
+		priv->written_generation = generation;
 	}
+        g_mutex_unlock (&priv->write_mutex);
+}
+
+typedef struct {
+	char *contents;
+	guint generation;
+} FlushData;
+
+static void
+flush_data_free (FlushData *data)
+{
+	g_free (data->contents);
+	g_free (data);
+}
+
+static void
+flush_thread (GTask        *task,
+	      gpointer      source_object,
+	      gpointer      task_data,
+	      GCancellable *cancellable)
+{
+	FlushData *data = task_data;
+
+	write_snapshot (source_object, data->contents, data->generation);
+	g_task_return_boolean (task, TRUE);
+}
+
+static gboolean
+flush_timeout (gpointer user_data)
+{
+	SoupCookieJarText *jar = user_data;
+	FlushData *data;
+	GTask *task;
 
+	data = g_new (FlushData, 1);
+	data->contents = take_snapshot (jar, &data->generation);
+
+	task = g_task_new (jar, NULL, NULL, NULL);
+	g_task_set_source_tag (task, flush_timeout);
+	g_task_set_task_data (task, data, (GDestroyNotify)flush_data_free);
+	g_task_run_in_thread (task, flush_thread);
+	g_object_unref (task);
+
+	return G_SOURCE_REMOVE;
+}
+
+/**
+ * soup_cookie_jar_text_flush:
+ * @jar: a #SoupCookieJarText
+ *
+ * Writes any pending change in @jar to its file right away, instead of
+ * waiting for the next scheduled write.
+ *
+ * Since: 3.4
+ */
+void
+soup_cookie_jar_text_flush (SoupCookieJarText *jar)
+{
+	SoupCookieJarTextPrivate *priv;
+	char *contents;
+	guint generation;
+	gboolean dirty;
+
+	g_return_if_fail (SOUP_IS_COOKIE_JAR_TEXT (jar));
+
+	priv = soup_cookie_jar_text_get_instance_private (jar);
+        g_mutex_lock (&priv->mutex);
+	dirty = priv->dirty;
+        g_mutex_unlock (&priv->mutex);
+	if (!dirty)
+		return;
+
+	contents = take_snapshot (jar, &generation);
+	write_snapshot (jar, contents, generation);
 	g_free (contents);
-	fclose (f);
 }
 
 static void
@@ -321,50 +459,23 @@ soup_cookie_jar_text_changed (SoupCookieJar *jar,
 			      SoupCookie    *old_cookie,
 			      SoupCookie    *new_cookie)
 {
-	FILE *out;
 	SoupCookieJarTextPrivate *priv =
 		soup_cookie_jar_text_get_instance_private (SOUP_COOKIE_JAR_TEXT (jar));
 
-	/* We can sort of ignore the semantics of the 'changed'
-	 * signal here and simply delete the old cookie if present
-	 * and write the new cookie if present. That will do the
-	 * right thing for all 'added', 'deleted' and 'modified'
-	 * meanings.
-	 */
-	/* Also, delete_cookie takes the filename and write_cookie
-	 * a FILE pointer. Seems more convenient that way considering
-	 * the implementations of the functions
-	 */
-	if (old_cookie)
-		delete_cookie (priv->filename, old_cookie);
-
-	if (new_cookie) {
-		gboolean write_header = FALSE;
-
-		if (!g_file_test (priv->filename, G_FILE_TEST_EXISTS))
-			write_header = TRUE;
-
-		out = fopen (priv->filename, "a");
-		if (!out) {
-			/* FIXME: error? */
-			return;
-		}
-
-		if (write_header) {
-			fprintf (out, "# HTTP Cookie File\n");
-			fprintf (out, "# http://www.netscape.com/newsref/std/cookie_spec.html\n");
-			fprintf (out, "# This is a generated file!  Do not edit.\n");
-			fprintf (out, "# To delete cookies, use the Cookie Manager.\n\n");
-		}
-
-		if (soup_cookie_get_expires (new_cookie))
-			write_cookie (out, new_cookie);
-
-		if (fclose (out) != 0) {
-			/* FIXME: error? */
-			return;
-		}
+	/* Session cookies are never written */
+	if ((!old_cookie || !soup_cookie_get_expires (old_cookie)) &&
+	    (!new_cookie || !soup_cookie_get_expires (new_cookie)))
+		return;
+
+        g_mutex_lock (&priv->mutex);
+	priv->dirty = TRUE;
+	if (!priv->flush_source) {
+		priv->flush_source = g_timeout_source_new (FLUSH_DELAY);
+		g_source_set_name (priv->flush_source, "SoupCookieJarText flush");
+		g_source_set_callback (priv->flush_source, flush_timeout, jar, NULL);
+		g_source_attach (priv->flush_source, priv->context);
 	}
+        g_mutex_unlock (&priv->mutex);
 }
 
 static gboolean
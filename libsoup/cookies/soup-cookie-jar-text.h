@@ -17,5 +17,8 @@ SOUP_AVAILABLE_IN_ALL
 SoupCookieJar *soup_cookie_jar_text_new (const char *filename,
 					 gboolean    read_only);
 
+SOUP_AVAILABLE_IN_3_4
+void           soup_cookie_jar_text_flush (SoupCookieJarText *jar);
+
 G_END_DECLS
 
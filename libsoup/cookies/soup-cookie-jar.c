@@ -12,10 +12,12 @@
 #include <string.h>
 
 #include "soup-cookie-jar.h"
+#include "soup-cookie-private.h"
 #include "soup-date-utils-private.h"
 #include "soup-message-private.h"
 #include "soup-message-headers-private.h"
 #include "soup-misc.h"
+#include "soup-origin.h"
 #include "soup.h"
 #include "soup-session-feature-private.h"
 #include "soup-uri-utils-private.h"
@@ -58,10 +60,38 @@ typedef struct {
 	GHashTable *domains, *serials;
 	guint serial;
 	SoupCookieJarAcceptPolicy accept_policy;
+
+	/* Cookie header per request context, see get_cookie_header() */
+	GHashTable *headers;
+
+	/* Min-heap of cookie expiration times, see remove_expired_cookies() */
+	GArray *expirations;
+	GMainContext *context;
+	GSource *sweep_source;
 } SoupCookieJarPrivate;
 
+/* Each cached header remembers the jar serial it was built at and
+ * the earliest expiration date of the cookies it contains.
+ */
+typedef struct {
+	char *header;
+	guint serial;
+	gint64 expires;
+} SoupCookieHeader;
+
+#define COOKIE_HEADER_CACHE_MAX_ENTRIES 256
+
 static void soup_cookie_jar_session_feature_init (SoupSessionFeatureInterface *feature_interface, gpointer interface_data);
 
+static void
+soup_cookie_header_free (gpointer data)
+{
+	SoupCookieHeader *cached = data;
+
+	g_free (cached->header);
+	g_free (cached);
+}
+
 G_DEFINE_TYPE_WITH_CODE (SoupCookieJar, soup_cookie_jar, G_TYPE_OBJECT,
                          G_ADD_PRIVATE (SoupCookieJar)
 			 G_IMPLEMENT_INTERFACE (SOUP_TYPE_SESSION_FEATURE,
@@ -76,6 +106,10 @@ soup_cookie_jar_init (SoupCookieJar *jar)
 					       soup_str_case_equal,
 					       g_free, NULL);
 	priv->serials = g_hash_table_new (NULL, NULL);
+	priv->headers = g_hash_table_new_full (g_str_hash, g_str_equal,
+					       g_free, soup_cookie_header_free);
+	priv->expirations = g_array_new (FALSE, FALSE, sizeof (gint64));
+	priv->context = g_main_context_ref_thread_default ();
 	priv->accept_policy = SOUP_COOKIE_JAR_ACCEPT_ALWAYS;
         g_mutex_init (&priv->mutex);
 }
@@ -97,11 +131,19 @@ soup_cookie_jar_finalize (GObject *object)
 	GHashTableIter iter;
 	gpointer key, value;
 
+	if (priv->sweep_source) {
+		g_source_destroy (priv->sweep_source);
+		g_source_unref (priv->sweep_source);
+	}
+	g_main_context_unref (priv->context);
+	g_array_free (priv->expirations, TRUE);
+
 	g_hash_table_iter_init (&iter, priv->domains);
 	while (g_hash_table_iter_next (&iter, &key, &value))
 		soup_cookies_free (value);
 	g_hash_table_destroy (priv->domains);
 	g_hash_table_destroy (priv->serials);
+	g_hash_table_destroy (priv->headers);
         g_mutex_clear (&priv->mutex);
 
 	G_OBJECT_CLASS (soup_cookie_jar_parent_class)->finalize (object);
@@ -244,12 +286,14 @@ soup_cookie_jar_changed (SoupCookieJar *jar,
 {
 	SoupCookieJarPrivate *priv = soup_cookie_jar_get_instance_private (jar);
 
+	/* The serial is bumped on every change, not only on additions,
+	 * since it also invalidates the cached Cookie headers.
+	 */
+	priv->serial++;
 	if (old && old != new)
 		g_hash_table_remove (priv->serials, old);
-	if (new) {
-		priv->serial++;
+	if (new)
 		g_hash_table_insert (priv->serials, new, GUINT_TO_POINTER (priv->serial));
-	}
 
 	if (priv->read_only || !priv->constructed)
 		return;
@@ -257,6 +301,215 @@ soup_cookie_jar_changed (SoupCookieJar *jar,
 	g_signal_emit (jar, signals[CHANGED], 0, old, new);
 }
 
+static void
+expirations_push (GArray *heap, gint64 expires)
+{
+	gint64 *items;
+	guint i;
+
+	g_array_append_val (heap, expires);
+	items = (gint64 *)heap->data;
+	for (i = heap->len - 1; i > 0 && items[(i - 1) / 2] > expires; i = (i - 1) / 2)
+		items[i] = items[(i - 1) / 2];
+	items[i] = expires;
+}
+
+static void
+expirations_pop (GArray *heap)
+{
+	gint64 *items = (gint64 *)heap->data;
+	gint64 last;
+	guint i, child;
+
+	last = items[heap->len - 1];
+	g_array_set_size (heap, heap->len - 1);
+	if (heap->len == 0)
+		return;
+
+	for (i = 0; (child = 2 * i + 1) < heap->len; i = child) {
+		if (child + 1 < heap->len && items[child + 1] < items[child])
+			child++;
+		if (items[child] >= last)
+			break;
+		items[i] = items[child];
+	}
+	items[i] = last;
+}
+
+typedef struct {
+	GSource source;
+	GWeakRef jar;
+} SoupCookieJarSweepSource;
+
+static void remove_expired_cookies (SoupCookieJar *jar);
+static void schedule_sweep (SoupCookieJar *jar);
+
+static gboolean
+sweep_dispatch (GSource    *source,
+		GSourceFunc callback,
+		gpointer    user_data)
+{
+	SoupCookieJarSweepSource *sweep_source = (SoupCookieJarSweepSource *)source;
+	SoupCookieJar *jar = g_weak_ref_get (&sweep_source->jar);
+	SoupCookieJarPrivate *priv;
+
+	if (!jar)
+		return G_SOURCE_REMOVE;
+
+	priv = soup_cookie_jar_get_instance_private (jar);
+	g_source_set_ready_time (source, -1);
+
+        g_mutex_lock (&priv->mutex);
+	remove_expired_cookies (jar);
+	/* In case the clocks disagreed and nothing was removed */
+	schedule_sweep (jar);
+        g_mutex_unlock (&priv->mutex);
+
+	g_object_unref (jar);
+
+	return G_SOURCE_CONTINUE;
+}
+
+static void
+sweep_finalize (GSource *source)
+{
+	SoupCookieJarSweepSource *sweep_source = (SoupCookieJarSweepSource *)source;
+
+	g_weak_ref_clear (&sweep_source->jar);
+}
+
+static GSourceFuncs sweep_source_funcs = {
+	NULL,
+	NULL,
+	sweep_dispatch,
+	sweep_finalize,
+	NULL, NULL
+};
+
+/* Arms the sweep source for the earliest expiration in the jar. Must
+ * be called with the mutex held.
+ */
+static void
+schedule_sweep (SoupCookieJar *jar)
+{
+	SoupCookieJarPrivate *priv = soup_cookie_jar_get_instance_private (jar);
+	gint64 delay;
+
+	if (priv->expirations->len == 0) {
+		if (priv->sweep_source)
+			g_source_set_ready_time (priv->sweep_source, -1);
+		return;
+	}
+
+	if (!priv->sweep_source) {
+		SoupCookieJarSweepSource *sweep_source;
+
+		priv->sweep_source = g_source_new (&sweep_source_funcs, sizeof (SoupCookieJarSweepSource));
+		sweep_source = (SoupCookieJarSweepSource *)priv->sweep_source;
+		g_weak_ref_init (&sweep_source->jar, jar);
+		g_source_set_name (priv->sweep_source, "SoupCookieJar expiration sweep");
+		g_source_set_ready_time (priv->sweep_source, -1);
+		g_source_attach (priv->sweep_source, priv->context);
+	}
+
+	/* A cookie expires once its expiration date is in the past */
+	delay = g_array_index (priv->expirations, gint64, 0) + 1 - g_get_real_time () / G_USEC_PER_SEC;
+	g_source_set_ready_time (priv->sweep_source,
+				 g_get_monotonic_time () + MAX (delay, 0) * G_USEC_PER_SEC);
+}
+
+/* Removes every expired cookie from the jar in a single pass over the
+ * domains, once the earliest expiration time has been reached. Must be
+ * called with the mutex held.
+ */
+static void
+remove_expired_cookies (SoupCookieJar *jar)
+{
+	SoupCookieJarPrivate *priv = soup_cookie_jar_get_instance_private (jar);
+	GSList *removed = NULL, *p;
+	GHashTableIter iter;
+	gpointer value;
+	gint64 now;
+
+	now = g_get_real_time () / G_USEC_PER_SEC;
+	if (priv->expirations->len == 0 ||
+	    g_array_index (priv->expirations, gint64, 0) >= now)
+		return;
+
+	while (priv->expirations->len > 0 &&
+	       g_array_index (priv->expirations, gint64, 0) < now)
+		expirations_pop (priv->expirations);
+	schedule_sweep (jar);
+
+	g_hash_table_iter_init (&iter, priv->domains);
+	while (g_hash_table_iter_next (&iter, NULL, &value)) {
+		GSList *cookies = value, *next;
+		gboolean changed = FALSE;
+
+		for (p = cookies; p; p = next) {
+			GDateTime *expires = soup_cookie_get_expires (p->data);
+
+			next = p->next;
+			if (expires && g_date_time_to_unix (expires) < now) {
+				removed = g_slist_prepend (removed, p->data);
+				cookies = g_slist_delete_link (cookies, p);
+				changed = TRUE;
+			}
+		}
+
+		if (changed)
+			g_hash_table_iter_replace (&iter, cookies);
+	}
+
+	removed = g_slist_reverse (removed);
+	for (p = removed; p; p = p->next) {
+		SoupCookie *cookie = p->data;
+
+		soup_cookie_jar_changed (jar, cookie, NULL);
+		soup_cookie_free (cookie);
+	}
+	g_slist_free (removed);
+}
+
+/* Records @cookie's expiration date. Entries for cookies that have
+ * been replaced or deleted are left in the heap, and only cause a
+ * harmless extra sweep, unless they start to outnumber the cookies.
+ * Must be called with the mutex held.
+ */
+static void
+track_expiration (SoupCookieJar *jar, SoupCookie *cookie)
+{
+	SoupCookieJarPrivate *priv = soup_cookie_jar_get_instance_private (jar);
+	GDateTime *expires = soup_cookie_get_expires (cookie);
+	gint64 first;
+
+	if (!expires)
+		return;
+
+	first = priv->expirations->len ? g_array_index (priv->expirations, gint64, 0) : G_MAXINT64;
+
+	if (priv->expirations->len > 2 * g_hash_table_size (priv->serials) + 64) {
+		GHashTableIter iter;
+		gpointer value;
+
+		g_array_set_size (priv->expirations, 0);
+		g_hash_table_iter_init (&iter, priv->domains);
+		while (g_hash_table_iter_next (&iter, NULL, &value)) {
+			GSList *p;
+
+			for (p = value; p; p = p->next) {
+				if (soup_cookie_get_expires (p->data))
+					expirations_push (priv->expirations,
+							  g_date_time_to_unix (soup_cookie_get_expires (p->data)));
+			}
+		}
+	} else
+		expirations_push (priv->expirations, g_date_time_to_unix (expires));
+
+	if (g_array_index (priv->expirations, gint64, 0) != first)
+		schedule_sweep (jar);
+}
+
 static int
 compare_cookies (gconstpointer a, gconstpointer b, gpointer jar)
 {
@@ -283,6 +536,53 @@ compare_cookies (gconstpointer a, gconstpointer b, gpointer jar)
 	return aserial - bserial;
 }
 
+/* The per-domain lists in priv->domains are kept in compare_cookies()
+ * order, so that get_cookies() only has to merge them. @cookie must be
+ * the most recently changed cookie in the jar, which means it goes
+ * after every cookie with a path at least as long as its own.
+ */
+static GSList *
+insert_cookie (GSList *cookies, SoupCookie *cookie)
+{
+	GSList *p, *prev = NULL;
+	gsize len;
+
+	len = soup_cookie_get_path (cookie) ? strlen (soup_cookie_get_path (cookie)) : 0;
+	for (p = cookies; p; p = p->next) {
+		const char *path = soup_cookie_get_path (p->data);
+
+		if ((path ? strlen (path) : 0) < len)
+			break;
+		prev = p;
+	}
+
+	if (!prev)
+		return g_slist_prepend (cookies, cookie);
+
+	prev->next = g_slist_prepend (prev->next, cookie);
+	return cookies;
+}
+
+static GSList *
+merge_cookies (SoupCookieJar *jar, GSList *a, GSList *b)
+{
+	GSList head = { NULL, NULL }, *tail = &head;
+
+	while (a && b) {
+		if (compare_cookies (a->data, b->data, jar) <= 0) {
+			tail->next = a;
+			a = a->next;
+		} else {
+			tail->next = b;
+			b = b->next;
+		}
+		tail = tail->next;
+	}
+	tail->next = a ? a : b;
+
+	return head.next;
+}
+
 static gboolean
 cookie_is_valid_for_same_site_policy (SoupCookie *cookie,
                                       gboolean    is_safe_method,
@@ -321,9 +621,8 @@ get_cookies (SoupCookieJar *jar,
              gboolean       copy_cookies)
 {
 	SoupCookieJarPrivate *priv;
-	GSList *cookies, *domain_cookies;
+	GSList *cookies, *p;
 	char *domain, *cur, *next_domain;
-	GSList *new_head, *cookies_to_remove = NULL, *p;
         const char *host = g_uri_get_host (uri);
 
 	priv = soup_cookie_jar_get_instance_private (jar);
@@ -347,45 +646,113 @@ get_cookies (SoupCookieJar *jar,
 
         g_mutex_lock (&priv->mutex);
 
+	remove_expired_cookies (jar);
+
 	do {
-		new_head = domain_cookies = g_hash_table_lookup (priv->domains, cur);
-		while (domain_cookies) {
-			GSList *next = domain_cookies->next;
-			SoupCookie *cookie = domain_cookies->data;
-
-			if (soup_cookie_get_expires (cookie) && soup_date_time_is_past (soup_cookie_get_expires (cookie))) {
-				cookies_to_remove = g_slist_append (cookies_to_remove,
-								    cookie);
-				new_head = g_slist_delete_link (new_head, domain_cookies);
-				g_hash_table_insert (priv->domains,
-						     g_strdup (cur),
-						     new_head);
-			} else if (soup_cookie_applies_to_uri (cookie, uri) &&
-			           cookie_is_valid_for_same_site_policy (cookie, is_safe_method, uri, top_level,
-				                                         site_for_cookies, is_top_level_navigation,
-									 for_http) &&
-				   (for_http || !soup_cookie_get_http_only (cookie)))
-				cookies = g_slist_append (cookies, copy_cookies ? soup_cookie_copy (cookie) : cookie);
-
-			domain_cookies = next;
+		GSList *matches = NULL;
+
+		for (p = g_hash_table_lookup (priv->domains, cur); p; p = p->next) {
+			SoupCookie *cookie = p->data;
+
+			if (soup_cookie_applies_to_uri (cookie, uri) &&
+			    cookie_is_valid_for_same_site_policy (cookie, is_safe_method, uri, top_level,
+			                                          site_for_cookies, is_top_level_navigation,
+			                                          for_http) &&
+			    (for_http || !soup_cookie_get_http_only (cookie)))
+				matches = g_slist_prepend (matches, cookie);
 		}
+
+		/* Each domain's list is already sorted */
+		cookies = merge_cookies (jar, cookies, g_slist_reverse (matches));
+
 		cur = next_domain;
 		if (cur)
 			next_domain = strchr (cur + 1, '.');
 	} while (cur);
 	g_free (domain);
 
-	for (p = cookies_to_remove; p; p = p->next) {
-		SoupCookie *cookie = p->data;
+	if (copy_cookies) {
+		for (p = cookies; p; p = p->next)
+			p->data = soup_cookie_copy (p->data);
+	}
 
-		soup_cookie_jar_changed (jar, cookie, NULL);
-		soup_cookie_free (cookie);
+        g_mutex_unlock (&priv->mutex);
+
+	return cookies;
+}
+
+/* Like get_cookies(), but returns the serialized Cookie header. Headers
+ * are cached per request context and reused until the jar changes or
+ * one of their cookies expires.
+ */
+static char *
+get_cookie_header (SoupCookieJar *jar,
+                   GUri          *uri,
+                   GUri          *top_level,
+                   GUri          *site_for_cookies,
+                   gboolean       is_safe_method,
+                   gboolean       for_http,
+                   gboolean       is_top_level_navigation)
+{
+	SoupCookieJarPrivate *priv = soup_cookie_jar_get_instance_private (jar);
+	SoupCookieHeader *cached;
+	GSList *cookies, *p;
+	char *key, *header;
+	gint64 expires;
+	guint serial;
+
+	if (!g_uri_get_host (uri))
+		return NULL;
+
+	key = g_strdup_printf ("%c%c%c%c%c%s\n%s\n%s\n%s\n%s",
+			       for_http ? 'h' : '-',
+			       is_safe_method ? 's' : '-',
+			       is_top_level_navigation ? 'n' : '-',
+			       top_level ? 't' : '-',
+			       site_for_cookies ? 'c' : '-',
+			       g_uri_get_scheme (uri),
+			       top_level && g_uri_get_host (top_level) ? g_uri_get_host (top_level) : "",
+			       site_for_cookies && g_uri_get_host (site_for_cookies) ? g_uri_get_host (site_for_cookies) : "",
+			       g_uri_get_host (uri),
+			       g_uri_get_path (uri));
+
+        g_mutex_lock (&priv->mutex);
+	cached = g_hash_table_lookup (priv->headers, key);
+	if (cached && cached->serial == priv->serial &&
+	    g_get_real_time () / G_USEC_PER_SEC <= cached->expires) {
+		header = g_strdup (cached->header);
+                g_mutex_unlock (&priv->mutex);
+		g_free (key);
+		return header;
+	}
+	serial = priv->serial;
+        g_mutex_unlock (&priv->mutex);
+
+	cookies = get_cookies (jar, uri, top_level, site_for_cookies, is_safe_method,
+			       for_http, is_top_level_navigation, TRUE);
+	header = cookies ? soup_cookies_to_cookie_header (cookies) : NULL;
+
+	expires = G_MAXINT64;
+	for (p = cookies; p; p = p->next) {
+		GDateTime *cookie_expires = soup_cookie_get_expires (p->data);
+
+		if (cookie_expires)
+			expires = MIN (expires, g_date_time_to_unix (cookie_expires));
 	}
-	g_slist_free (cookies_to_remove);
+	g_slist_free_full (cookies, (GDestroyNotify)soup_cookie_free);
+
+	cached = g_new (SoupCookieHeader, 1);
+	cached->header = g_strdup (header);
+	cached->serial = serial;
+	cached->expires = expires;
 
+        g_mutex_lock (&priv->mutex);
+	if (g_hash_table_size (priv->headers) >= COOKIE_HEADER_CACHE_MAX_ENTRIES)
+		g_hash_table_remove_all (priv->headers);
+	g_hash_table_replace (priv->headers, key, cached);
         g_mutex_unlock (&priv->mutex);
 
-	return g_slist_sort_with_data (cookies, compare_cookies, jar);
+	return header;
 }
 
 /**
@@ -413,24 +780,17 @@ char *
 soup_cookie_jar_get_cookies (SoupCookieJar *jar, GUri *uri,
 			     gboolean for_http)
 {
-	GSList *cookies;
+	char *result;
 
 	g_return_val_if_fail (SOUP_IS_COOKIE_JAR (jar), NULL);
 	g_return_val_if_fail (uri != NULL, NULL);
 
-	cookies = get_cookies (jar, uri, NULL, NULL, TRUE, for_http, FALSE, FALSE);
-
-	if (cookies) {
-		char *result = soup_cookies_to_cookie_header (cookies);
-		g_slist_free (cookies);
-
-		if (!*result) {
-			g_free (result);
-			result = NULL;
-		}
-		return result;
-	} else
-		return NULL;
+	result = get_cookie_header (jar, uri, NULL, NULL, TRUE, for_http, FALSE);
+	if (result && !*result) {
+		g_free (result);
+		result = NULL;
+	}
+	return result;
 }
 
 /**
@@ -513,15 +873,16 @@ normalize_cookie_domain (const char *domain)
 
 static gboolean
 incoming_cookie_is_third_party (SoupCookieJar            *jar,
-				SoupCookie               *cookie,
+				const char               *cookie_domain,
 				GUri                     *first_party,
+				SoupOrigin               *first_party_origin,
 				SoupCookieJarAcceptPolicy policy)
 {
 	SoupCookieJarPrivate *priv;
 	const char *normalized_cookie_domain;
 	const char *cookie_base_domain;
+	const char *first_party_host;
 	const char *first_party_base_domain;
-        const char *first_party_host;
         gboolean retval;
 
 	if (policy != SOUP_COOKIE_JAR_ACCEPT_NO_THIRD_PARTY &&
@@ -535,12 +896,16 @@ incoming_cookie_is_third_party (SoupCookieJar            *jar,
         if (first_party_host == NULL)
 		return TRUE;
 
-	normalized_cookie_domain = normalize_cookie_domain (soup_cookie_get_domain (cookie));
+	normalized_cookie_domain = normalize_cookie_domain (cookie_domain);
 	cookie_base_domain = soup_tld_get_base_domain (normalized_cookie_domain, NULL);
 	if (cookie_base_domain == NULL)
-		cookie_base_domain = soup_cookie_get_domain (cookie);
+		cookie_base_domain = cookie_domain;
 
-	first_party_base_domain = soup_tld_get_base_domain (first_party_host, NULL);
+        /* The message's first party origin caches its base domain */
+        if (first_party_origin)
+                first_party_base_domain = soup_origin_get_base_domain (first_party_origin);
+        else
+                first_party_base_domain = soup_tld_get_base_domain (first_party_host, NULL);
 	if (first_party_base_domain == NULL)
 		first_party_base_domain = first_party_host;
 
@@ -558,123 +923,41 @@ incoming_cookie_is_third_party (SoupCookieJar            *jar,
 	 */
 	priv = soup_cookie_jar_get_instance_private (jar);
         g_mutex_lock (&priv->mutex);
-	retval = !g_hash_table_lookup (priv->domains, soup_cookie_get_domain (cookie));
+	retval = !g_hash_table_lookup (priv->domains, cookie_domain);
         g_mutex_unlock (&priv->mutex);
 
         return retval;
 }
 
 static gboolean
-string_contains_ctrlcode (const char *s)
+cookie_domain_is_acceptable (SoupCookieJar *jar,
+			     const char    *domain,
+			     GUri          *first_party,
+			     SoupOrigin    *first_party_origin)
 {
-	const char *p;
-
-	p = s;
-	while (*p != '\0') {
-		if (g_ascii_iscntrl (*p) && *p != 0x09)
-			return TRUE;
-		
-		p++;
-	}
-	return FALSE;
-}
-
-/**
- * soup_cookie_jar_add_cookie_full:
- * @jar: a #SoupCookieJar
- * @cookie: (transfer full): a #SoupCookie
- * @uri: (nullable): the URI setting the cookie
- * @first_party: (nullable): the URI for the main document
- *
- * Adds @cookie to @jar.
- *
- * Emits the [signal@CookieJar::changed] signal if we are modifying an existing
- * cookie or adding a valid new cookie ('valid' means that the cookie's expire
- * date is not in the past).
- *
- * @first_party will be used to reject cookies coming from third party
- * resources in case such a security policy is set in the @jar.
- *
- * @uri will be used to reject setting or overwriting secure cookies
- * from insecure origins. %NULL is treated as secure.
- * 
- * @cookie will be 'stolen' by the jar, so don't free it afterwards.
- **/
-void
-soup_cookie_jar_add_cookie_full (SoupCookieJar *jar, SoupCookie *cookie, GUri *uri, GUri *first_party)
-{
-	SoupCookieJarPrivate *priv;
-	GSList *old_cookies, *oc, *last = NULL;
-	SoupCookie *old_cookie;
-
-	g_return_if_fail (SOUP_IS_COOKIE_JAR (jar));
-	g_return_if_fail (cookie != NULL);
+	SoupCookieJarPrivate *priv = soup_cookie_jar_get_instance_private (jar);
 
 	/* Never accept cookies for public domains. */
-	if (!g_hostname_is_ip_address (soup_cookie_get_domain (cookie)) &&
-	    soup_tld_domain_is_public_suffix (soup_cookie_get_domain (cookie))) {
-		soup_cookie_free (cookie);
-		return;
-	}
-
-	priv = soup_cookie_jar_get_instance_private (jar);
+	if (!g_hostname_is_ip_address (domain) &&
+	    soup_tld_domain_is_public_suffix (domain))
+		return FALSE;
 
         if (first_party != NULL) {
                 if (priv->accept_policy == SOUP_COOKIE_JAR_ACCEPT_NEVER ||
-                    incoming_cookie_is_third_party (jar, cookie, first_party, priv->accept_policy)) {
-                        soup_cookie_free (cookie);
-                        return;
-                }
+                    incoming_cookie_is_third_party (jar, domain, first_party, first_party_origin, priv->accept_policy))
+                        return FALSE;
         }
 
-	/* Cannot set a secure cookie over http */
-	if (uri != NULL && !soup_uri_is_https (uri) && soup_cookie_get_secure (cookie)) {
-		soup_cookie_free (cookie);
-		return;
-	}
-
-	/* SameSite=None cookies are rejected unless the Secure attribute is set. */
-	if (soup_cookie_get_same_site_policy (cookie) == SOUP_SAME_SITE_POLICY_NONE && !soup_cookie_get_secure (cookie)) {
-		soup_cookie_free (cookie);
-		return;
-	}
-
-        /* See https://datatracker.ietf.org/doc/html/draft-ietf-httpbis-cookie-prefixes-00 for handling the prefixes,
-         * which has been implemented by Firefox and Chrome. */
-#define MATCH_PREFIX(name, prefix) (!g_ascii_strncasecmp (name, prefix, strlen(prefix)))
+	return TRUE;
+}
 
-	/* Cookies with a "__Secure-" prefix should have Secure attribute set and it must be for a secure host. */
-	if (MATCH_PREFIX (soup_cookie_get_name (cookie), "__Secure-") && !soup_cookie_get_secure (cookie) ) {
-		soup_cookie_free (cookie);
-		return;
-	}
-        /* Path=/ and Secure attributes are required; Domain attribute must not be present.
-         Note that SoupCookie always sets the domain so we ensure its not a subdomain match. */
-	if (MATCH_PREFIX (soup_cookie_get_name (cookie), "__Host-")) {
-		if (!soup_cookie_get_secure (cookie) ||
-		    strcmp (soup_cookie_get_path (cookie), "/") != 0 ||
-                    soup_cookie_get_domain (cookie)[0] == '.') {
-			soup_cookie_free (cookie);
-			return;
-		}
-	}
+static void
+add_cookie (SoupCookieJar *jar, SoupCookie *cookie, GUri *uri)
+{
+	SoupCookieJarPrivate *priv = soup_cookie_jar_get_instance_private (jar);
+	GSList *old_cookies, *oc;
+	SoupCookie *old_cookie;
 
-	/* Cookies should not take control characters %x00-1F / %x7F (defined by RFC 5234) in names or values,
-	 * with the exception of %x09 (the tab character).
-	 */    
-	const char *name, *value;
-	name = soup_cookie_get_name (cookie);
-	value = soup_cookie_get_value (cookie);
-	if (string_contains_ctrlcode (name) || string_contains_ctrlcode (value)) {
-		soup_cookie_free (cookie);
-		return;
-	}
-	
-	if (strlen(name) > 4096 || strlen(value) > 4096) {
-		soup_cookie_free (cookie);
-		return;
-	}
-	
         g_mutex_lock (&priv->mutex);
 
 	old_cookies = g_hash_table_lookup (priv->domains, soup_cookie_get_domain (cookie));
@@ -701,16 +984,23 @@ soup_cookie_jar_add_cookie_full (SoupCookieJar *jar, SoupCookie *cookie, GUri *u
 				soup_cookie_free (old_cookie);
 				soup_cookie_free (cookie);
 			} else {
-				oc->data = cookie;
+				/* The replacement is now the newest cookie,
+				 * so it may have to move further down.
+				 */
+				old_cookies = g_slist_delete_link (old_cookies, oc);
+				old_cookies = insert_cookie (old_cookies, cookie);
+				g_hash_table_insert (priv->domains,
+						     g_strdup (soup_cookie_get_domain (cookie)),
+						     old_cookies);
 				soup_cookie_jar_changed (jar, old_cookie, cookie);
 				soup_cookie_free (old_cookie);
+				track_expiration (jar, cookie);
 			}
 
                         g_mutex_unlock (&priv->mutex);
 
 			return;
 		}
-		last = oc;
 	}
 
 	/* The new cookie is... a new cookie */
@@ -720,19 +1010,52 @@ soup_cookie_jar_add_cookie_full (SoupCookieJar *jar, SoupCookie *cookie, GUri *u
 		return;
 	}
 
-	if (last)
-		last->next = g_slist_append (NULL, cookie);
-	else {
-		old_cookies = g_slist_append (NULL, cookie);
-		g_hash_table_insert (priv->domains, g_strdup (soup_cookie_get_domain (cookie)),
-				     old_cookies);
-	}
+	old_cookies = insert_cookie (old_cookies, cookie);
+	g_hash_table_insert (priv->domains, g_strdup (soup_cookie_get_domain (cookie)),
+			     old_cookies);
 
 	soup_cookie_jar_changed (jar, NULL, cookie);
+	track_expiration (jar, cookie);
 
         g_mutex_unlock (&priv->mutex);
 }
 
+/**
+ * soup_cookie_jar_add_cookie_full:
+ * @jar: a #SoupCookieJar
+ * @cookie: (transfer full): a #SoupCookie
+ * @uri: (nullable): the URI setting the cookie
+ * @first_party: (nullable): the URI for the main document
+ *
+ * Adds @cookie to @jar.
+ *
+ * Emits the [signal@CookieJar::changed] signal if we are modifying an existing
+ * cookie or adding a valid new cookie ('valid' means that the cookie's expire
+ * date is not in the past).
+ *
+ * @first_party will be used to reject cookies coming from third party
+ * resources in case such a security policy is set in the @jar.
+ *
+ * @uri will be used to reject setting or overwriting secure cookies
+ * from insecure origins. %NULL is treated as secure.
+ * 
+ * @cookie will be 'stolen' by the jar, so don't free it afterwards.
+ **/
+void
+soup_cookie_jar_add_cookie_full (SoupCookieJar *jar, SoupCookie *cookie, GUri *uri, GUri *first_party)
+{
+	g_return_if_fail (SOUP_IS_COOKIE_JAR (jar));
+	g_return_if_fail (cookie != NULL);
+
+	if (!cookie_domain_is_acceptable (jar, soup_cookie_get_domain (cookie), first_party, NULL) ||
+	    !soup_cookie_is_acceptable (cookie, uri)) {
+		soup_cookie_free (cookie);
+		return;
+	}
+
+	add_cookie (jar, cookie, uri);
+}
+
 /**
  * soup_cookie_jar_add_cookie:
  * @jar: a #SoupCookieJar
@@ -859,43 +1182,72 @@ soup_cookie_jar_set_cookie_with_first_party (SoupCookieJar *jar,
 	}
 }
 
+typedef struct {
+	SoupCookieJar *jar;
+	GUri *first_party;
+	SoupOrigin *first_party_origin;
+} SetCookieData;
+
+static gboolean
+set_cookie_domain_filter (const char *domain,
+			  gpointer    user_data)
+{
+	SetCookieData *data = user_data;
+
+	return cookie_domain_is_acceptable (data->jar, domain, data->first_party, data->first_party_origin);
+}
+
 static void
 process_set_cookie_header (SoupMessage *msg, gpointer user_data)
 {
 	SoupCookieJar *jar = user_data;
 	SoupCookieJarPrivate *priv = soup_cookie_jar_get_instance_private (jar);
-	GSList *new_cookies, *nc;
-	GUri *first_party, *uri;
+	SoupMessageHeadersIter iter;
+	SetCookieData data;
+	const char *name, *value;
+	GUri *uri;
 
 	if (priv->accept_policy == SOUP_COOKIE_JAR_ACCEPT_NEVER)
 		return;
 
-	new_cookies = soup_cookies_from_response (msg);
-	first_party = soup_message_get_first_party (msg);
+	data.jar = jar;
+	data.first_party = soup_message_get_first_party (msg);
+	data.first_party_origin = soup_message_get_first_party_origin (msg);
 	uri = soup_message_get_uri (msg);
-	for (nc = new_cookies; nc; nc = nc->next) {		
-		soup_cookie_jar_add_cookie_full (jar, g_steal_pointer (&nc->data), uri, first_party);
+
+	/* Each header is checked against the jar's policy before its
+	 * cookie is created, so rejected cookies cost no allocations.
+	 * See soup_cookies_from_response() for why the headers are
+	 * iterated.
+	 */
+	soup_message_headers_iter_init (&iter, soup_message_get_response_headers (msg));
+	while (soup_message_headers_iter_next (&iter, &name, &value)) {
+		SoupCookie *cookie;
+
+		if (g_ascii_strcasecmp (name, "Set-Cookie") != 0)
+			continue;
+
+		cookie = soup_cookie_parse_acceptable (value, uri, set_cookie_domain_filter, &data);
+		if (cookie)
+			add_cookie (jar, cookie, uri);
 	}
-	g_slist_free (new_cookies);
 }
 
 static void
 msg_starting_cb (SoupMessage *msg, gpointer feature)
 {
 	SoupCookieJar *jar = SOUP_COOKIE_JAR (feature);
-	GSList *cookies;
-
-	cookies = soup_cookie_jar_get_cookie_list_with_same_site_info (jar, soup_message_get_uri (msg),
-	                                                               soup_message_get_first_party (msg),
-							               soup_message_get_site_for_cookies (msg),
-								       TRUE,
-							               SOUP_METHOD_IS_SAFE (soup_message_get_method (msg)),
-							               soup_message_get_is_top_level_navigation (msg));
-	if (cookies != NULL) {
-		char *cookie_header = soup_cookies_to_cookie_header (cookies);
+	char *cookie_header;
+
+	cookie_header = get_cookie_header (jar, soup_message_get_uri (msg),
+					   soup_message_get_first_party (msg),
+					   soup_message_get_site_for_cookies (msg),
+					   SOUP_METHOD_IS_SAFE (soup_message_get_method (msg)),
+					   TRUE,
+					   soup_message_get_is_top_level_navigation (msg));
+	if (cookie_header != NULL) {
 		soup_message_headers_replace_common (soup_message_get_request_headers (msg), SOUP_HEADER_COOKIE, cookie_header);
 		g_free (cookie_header);
-		g_slist_free_full (cookies, (GDestroyNotify)soup_cookie_free);
 	} else {
 		soup_message_headers_remove_common (soup_message_get_request_headers (msg), SOUP_HEADER_COOKIE);
 	}
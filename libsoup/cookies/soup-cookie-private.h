@@ -0,0 +1,20 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*- */
+
+#pragma once
+
+#include "soup-cookie.h"
+
+G_BEGIN_DECLS
+
+typedef gboolean (*SoupCookieDomainFilter) (const char *domain,
+                                            gpointer    user_data);
+
+gboolean    soup_cookie_is_acceptable    (SoupCookie            *cookie,
+                                          GUri                  *uri);
+
+SoupCookie *soup_cookie_parse_acceptable (const char            *header,
+                                          GUri                  *origin,
+                                          SoupCookieDomainFilter filter,
+                                          gpointer               user_data);
+
+G_END_DECLS
@@ -12,7 +12,7 @@
 #include <stdlib.h>
 #include <string.h>
 
-#include "soup-cookie.h"
+#include "soup-cookie-private.h"
 #include "soup-date-utils-private.h"
 #include "soup-message-headers-private.h"
 #include "soup-misc.h"
@@ -133,11 +133,10 @@ unskip_lws (const char *s, const char *start)
 #define is_attr_ender(ch) ((ch) == '\0' || (ch) == ';' || (ch) == ',' || (ch) == '=')
 #define is_value_ender(ch) ((ch) == '\0' || (ch) == ';')
 
-static char *
-parse_value (const char **val_p, gboolean copy)
+static const char *
+parse_value (const char **val_p, gsize *length)
 {
 	const char *start, *end, *p;
-	char *value;
 
 	p = *val_p;
 	if (*p == '=')
@@ -147,36 +146,41 @@ parse_value (const char **val_p, gboolean copy)
 		;
 	end = unskip_lws (p, start);
 
-	if (copy)
-		value = g_strndup (start, end - start);
-	else
-		value = NULL;
-
+	*length = end - start;
 	*val_p = p;
-	return value;
+	return start;
 }
 
-static GDateTime *
-parse_date (const char **val_p)
-{
-	char *value;
-	GDateTime *date;
-
-	value = parse_value (val_p, TRUE);
-	date = soup_date_time_new_from_http_string (value);
-	g_free (value);
-	return date;
-}
+/* A Set-Cookie header split into its attributes. Every string points
+ * into the header, so that cookies can be checked, and rejected,
+ * before anything is allocated for them.
+ */
+typedef enum {
+	COOKIE_EXPIRY_NONE,
+	COOKIE_EXPIRY_EXPIRES,
+	COOKIE_EXPIRY_MAX_AGE
+} CookieExpiry;
+
+typedef struct {
+	const char *name, *value, *domain, *path, *expires;
+	gsize name_len, value_len, domain_len, path_len, expires_len;
+	CookieExpiry expiry;
+	long max_age;
+	gboolean secure;
+	gboolean http_only;
+	SoupSameSitePolicy same_site_policy;
+} CookieTokens;
 
-static SoupCookie *
-parse_one_cookie (const char *header, GUri *origin)
+static void
+tokenize_cookie (const char   *header,
+		 CookieTokens *tokens)
 {
-	const char *start, *end, *p;
+	const char *start, *end, *p, *value;
+	gsize value_len;
 	gboolean has_value;
-	SoupCookie *cookie;
 
-	cookie = g_slice_new0 (SoupCookie);
-	soup_cookie_set_same_site_policy (cookie, SOUP_SAME_SITE_POLICY_LAX);
+	memset (tokens, 0, sizeof (CookieTokens));
+	tokens->same_site_policy = SOUP_SAME_SITE_POLICY_LAX;
 
 	/* Parse the NAME */
 	start = skip_lws (header);
@@ -184,19 +188,20 @@ parse_one_cookie (const char *header, GUri *origin)
 		;
 	if (*p == '=') {
 		end = unskip_lws (p, start);
-		cookie->name = g_strndup (start, end - start);
+		tokens->name = start;
+		tokens->name_len = end - start;
 	} else {
-		/* No NAME; Set cookie->name to "" and then rewind to
+		/* No NAME; Set name to "" and then rewind to
 		 * re-parse the string as a VALUE.
 		 */
-		cookie->name = g_strdup ("");
+		tokens->name = "";
 		p = start;
 	}
 
 	/* Parse the VALUE */
-	cookie->value = parse_value (&p, TRUE);
+	tokens->value = parse_value (&p, &tokens->value_len);
 
-	/* Parse attributes */
+	/* Parse attributes. Later attributes override earlier ones. */
 	while (*p == ';') {
 		start = skip_lws (p + 1);
 		for (p = start; !is_attr_ender (*p); p++)
@@ -204,124 +209,308 @@ parse_one_cookie (const char *header, GUri *origin)
 		end = unskip_lws (p, start);
 
 		has_value = (*p == '=');
+		if (has_value)
+			value = parse_value (&p, &value_len);
+		else {
+			value = NULL;
+			value_len = 0;
+		}
+
 #define MATCH_NAME(name) ((end - start == strlen (name)) && !g_ascii_strncasecmp (start, name, end - start))
+#define MATCH_VALUE(v) ((value_len == strlen (v)) && !g_ascii_strncasecmp (value, v, value_len))
 
 		if (MATCH_NAME ("domain") && has_value) {
-			cookie->domain = parse_value (&p, TRUE);
-			if (!*cookie->domain) {
-				g_free (cookie->domain);
-				cookie->domain = NULL;
-			}
+			tokens->domain = value_len ? value : NULL;
+			tokens->domain_len = value_len;
 		} else if (MATCH_NAME ("expires") && has_value) {
-			cookie->expires = parse_date (&p);
+			tokens->expires = value;
+			tokens->expires_len = value_len;
+			tokens->expiry = COOKIE_EXPIRY_EXPIRES;
 		} else if (MATCH_NAME ("httponly")) {
-			cookie->http_only = TRUE;
-			if (has_value)
-				parse_value (&p, FALSE);
+			tokens->http_only = TRUE;
 		} else if (MATCH_NAME ("max-age") && has_value) {
-			char *max_age_str = parse_value (&p, TRUE), *mae;
-			long max_age = strtol (max_age_str, &mae, 10);
-			if (!*mae) {
-				if (max_age < 0)
-					max_age = 0;
-				soup_cookie_set_max_age (cookie, max_age);
+			char *mae;
+			long max_age = strtol (value, &mae, 10);
+
+			/* The digits can't run past the value, which is
+			 * followed by whitespace, ';' or the end of the
+			 * header.
+			 */
+			if (mae == value + value_len) {
+				tokens->max_age = MAX (max_age, 0);
+				tokens->expiry = COOKIE_EXPIRY_MAX_AGE;
 			}
-			g_free (max_age_str);
 		} else if (MATCH_NAME ("path") && has_value) {
-			cookie->path = parse_value (&p, TRUE);
-			if (*cookie->path != '/') {
-				g_free (cookie->path);
-				cookie->path = NULL;
-			}
+			tokens->path = *value == '/' ? value : NULL;
+			tokens->path_len = value_len;
 		} else if (MATCH_NAME ("secure")) {
-			cookie->secure = TRUE;
-			if (has_value)
-				parse_value (&p, FALSE);
+			tokens->secure = TRUE;
 		} else if (MATCH_NAME ("samesite")) {
-			if (has_value) {
-				char *policy = parse_value (&p, TRUE);
-				if (g_ascii_strcasecmp (policy, "None") == 0)
-					soup_cookie_set_same_site_policy (cookie, SOUP_SAME_SITE_POLICY_NONE);
-				else if (g_ascii_strcasecmp (policy, "Strict") == 0)
-					soup_cookie_set_same_site_policy (cookie, SOUP_SAME_SITE_POLICY_STRICT);
-				/* There is an explicit "Lax" value which is the default */
-				g_free (policy);
-			}
+			if (MATCH_VALUE ("None"))
+				tokens->same_site_policy = SOUP_SAME_SITE_POLICY_NONE;
+			else if (MATCH_VALUE ("Strict"))
+				tokens->same_site_policy = SOUP_SAME_SITE_POLICY_STRICT;
+			/* There is an explicit "Lax" value which is the default */
 			/* Note that earlier versions of the same-site RFC treated invalid values as strict but
 			   the latest revision assigns invalid SameSite values to Lax. */
-		} else {
-			/* Ignore unknown attributes, but we still have
-			 * to skip over the value.
-			 */
-			if (has_value)
-				parse_value (&p, FALSE);
 		}
+		/* Unknown attributes are ignored */
+
+#undef MATCH_NAME
+#undef MATCH_VALUE
 	}
+}
+
+static gboolean
+contains_ctrlcode (const char *s, gsize length)
+{
+	gsize i;
+
+	for (i = 0; i < length; i++) {
+		if (g_ascii_iscntrl (s[i]) && s[i] != 0x09)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+static gboolean
+has_prefix (const char *name, gsize length, const char *prefix)
+{
+	gsize prefix_len = strlen (prefix);
+
+	return length >= prefix_len && !g_ascii_strncasecmp (name, prefix, prefix_len);
+}
+
+/* The rules a cookie set by @uri must follow, no matter what the
+ * accept policy of the jar is.
+ */
+static gboolean
+attributes_are_acceptable (const char        *name,
+			   gsize              name_len,
+			   const char        *value,
+			   gsize              value_len,
+			   const char        *domain,
+			   const char        *path,
+			   gsize              path_len,
+			   gboolean           secure,
+			   SoupSameSitePolicy same_site_policy,
+			   GUri              *uri)
+{
+	/* Cannot set a secure cookie over http */
+	if (uri != NULL && !soup_uri_is_https (uri) && secure)
+		return FALSE;
+
+	/* SameSite=None cookies are rejected unless the Secure attribute is set. */
+	if (same_site_policy == SOUP_SAME_SITE_POLICY_NONE && !secure)
+		return FALSE;
+
+        /* See https://datatracker.ietf.org/doc/html/draft-ietf-httpbis-cookie-prefixes-00 for handling the prefixes,
+         * which has been implemented by Firefox and Chrome. */
+
+	/* Cookies with a "__Secure-" prefix should have Secure attribute set and it must be for a secure host. */
+	if (has_prefix (name, name_len, "__Secure-") && !secure)
+		return FALSE;
+
+        /* Path=/ and Secure attributes are required; Domain attribute must not be present.
+         Note that SoupCookie always sets the domain so we ensure its not a subdomain match. */
+	if (has_prefix (name, name_len, "__Host-")) {
+		if (!secure ||
+		    path_len != 1 || *path != '/' ||
+		    (domain && domain[0] == '.'))
+			return FALSE;
+	}
+
+	/* Cookies should not take control characters %x00-1F / %x7F (defined by RFC 5234) in names or values,
+	 * with the exception of %x09 (the tab character).
+	 */
+	if (contains_ctrlcode (name, name_len) || contains_ctrlcode (value, value_len))
+		return FALSE;
+
+	if (name_len > 4096 || value_len > 4096)
+		return FALSE;
+
+	return TRUE;
+}
+
+/**
+ * soup_cookie_is_acceptable:
+ * @cookie: a #SoupCookie
+ * @uri: (nullable): the URI setting the cookie
+ *
+ * Checks the rules every cookie set by @uri must follow before it
+ * can be stored. %NULL @uri is treated as secure.
+ *
+ * Returns: %TRUE if @cookie can be stored
+ */
+gboolean
+soup_cookie_is_acceptable (SoupCookie *cookie,
+			   GUri       *uri)
+{
+	return attributes_are_acceptable (cookie->name, strlen (cookie->name),
+					  cookie->value, strlen (cookie->value),
+					  cookie->domain,
+					  cookie->path, cookie->path ? strlen (cookie->path) : 0,
+					  cookie->secure, cookie->same_site_policy,
+					  uri);
+}
+
+#define DOMAIN_BUFFER_SIZE 256
+#define DATE_BUFFER_SIZE 64
+
+static SoupCookie *
+parse_one_cookie (const char            *header,
+		  GUri                  *origin,
+		  gboolean               check_acceptable,
+		  SoupCookieDomainFilter filter,
+		  gpointer               user_data)
+{
+	CookieTokens tokens;
+	SoupCookie *cookie = NULL;
+	GUri *normalized_origin = NULL;
+	char domain_buffer[DOMAIN_BUFFER_SIZE];
+	char *domain_storage = NULL;
+	const char *domain = NULL;
+	const char *path;
+	gsize path_len;
+
+	tokenize_cookie (header, &tokens);
+
+	if (tokens.domain) {
+		char *copy;
 
-	if (cookie->domain) {
 		/* Domain must have at least one '.' (not counting an
 		 * initial one. (We check this now, rather than
 		 * bailing out sooner, because we don't want to force
 		 * any cookies after this one in the Set-Cookie header
 		 * to be discarded.)
 		 */
-		if (!strchr (cookie->domain + 1, '.')) {
-			soup_cookie_free (cookie);
+		if (tokens.domain_len < 2 || !memchr (tokens.domain + 1, '.', tokens.domain_len - 1))
 			return NULL;
-		}
+
+		/* Leave room to prepend a '.' */
+		if (tokens.domain_len + 2 <= DOMAIN_BUFFER_SIZE)
+			copy = domain_buffer;
+		else
+			copy = domain_storage = g_malloc (tokens.domain_len + 2);
+		memcpy (copy + 1, tokens.domain, tokens.domain_len);
+		copy[tokens.domain_len + 1] = '\0';
 
 		/* If the domain string isn't an IP addr, and doesn't
 		 * start with a '.', prepend one.
 		 */
-		if (!g_hostname_is_ip_address (cookie->domain) &&
-		    cookie->domain[0] != '.') {
-			char *tmp = g_strdup_printf (".%s", cookie->domain);
-			g_free (cookie->domain);
-			cookie->domain = tmp;
-		}
+		if (tokens.domain[0] != '.' && !g_hostname_is_ip_address (copy + 1)) {
+			copy[0] = '.';
+			domain = copy;
+		} else
+			domain = copy + 1;
 	}
 
 	if (origin) {
 		/* Sanity-check domain */
-		if (cookie->domain) {
-			if (!soup_cookie_domain_matches (cookie, g_uri_get_host (origin))) {
-				soup_cookie_free (cookie);
-				return NULL;
-			}
+		if (domain) {
+			if (!soup_host_matches_host (domain, g_uri_get_host (origin)))
+				goto out;
 		} else
-			cookie->domain = g_strdup (g_uri_get_host (origin));
-
-		/* The original cookie spec didn't say that pages
-		 * could only set cookies for paths they were under.
-		 * RFC 2109 adds that requirement, but some sites
-		 * depend on the old behavior
-		 * (https://bugzilla.mozilla.org/show_bug.cgi?id=156725#c20).
-		 * So we don't check the path.
-		 */
-
-		if (!cookie->path) {
-                        GUri *normalized_origin = soup_uri_copy_with_normalized_flags (origin);
-			char *slash;
-                        const char *origin_path = g_uri_get_path (normalized_origin);
-
-			slash = strrchr (origin_path, '/');
-			if (!slash || slash == origin_path)
-				cookie->path = g_strdup ("/");
-			else {
-				cookie->path = g_strndup (origin_path,
-							  slash - origin_path);
-			}
+			domain = g_uri_get_host (origin);
+	}
 
-                        g_uri_unref (normalized_origin);
+	/* The original cookie spec didn't say that pages could only
+	 * set cookies for paths they were under. RFC 2109 adds that
+	 * requirement, but some sites depend on the old behavior
+	 * (https://bugzilla.mozilla.org/show_bug.cgi?id=156725#c20).
+	 * So we don't check the path.
+	 */
+	if (tokens.path) {
+		path = tokens.path;
+		path_len = tokens.path_len;
+	} else {
+		const char *slash = NULL;
+
+		path = "/";
+		path_len = 1;
+		if (origin) {
+			/* This is usually just a new reference */
+			normalized_origin = soup_uri_copy_with_normalized_flags (origin);
+			path = g_uri_get_path (normalized_origin);
+			slash = strrchr (path, '/');
+		}
+		if (slash && slash != path)
+			path_len = slash - path;
+		else {
+			path = "/";
+			path_len = 1;
 		}
+	}
 
-	} else if (!cookie->path) {
-		cookie->path = g_strdup ("/");
+	if (check_acceptable) {
+		if (!attributes_are_acceptable (tokens.name, tokens.name_len,
+						tokens.value, tokens.value_len,
+						domain, path, path_len,
+						tokens.secure, tokens.same_site_policy,
+						origin))
+			goto out;
+
+		if (filter && !filter (domain, user_data))
+			goto out;
 	}
 
+	cookie = g_slice_new0 (SoupCookie);
+	cookie->name = g_strndup (tokens.name, tokens.name_len);
+	cookie->value = g_strndup (tokens.value, tokens.value_len);
+	cookie->domain = g_strdup (domain);
+	cookie->path = g_strndup (path, path_len);
+	cookie->secure = tokens.secure;
+	cookie->http_only = tokens.http_only;
+	cookie->same_site_policy = tokens.same_site_policy;
+
+	if (tokens.expiry == COOKIE_EXPIRY_MAX_AGE)
+		soup_cookie_set_max_age (cookie, tokens.max_age);
+	else if (tokens.expiry == COOKIE_EXPIRY_EXPIRES) {
+		char date_buffer[DATE_BUFFER_SIZE];
+		char *date;
+
+		if (tokens.expires_len < DATE_BUFFER_SIZE) {
+			memcpy (date_buffer, tokens.expires, tokens.expires_len);
+			date_buffer[tokens.expires_len] = '\0';
+			date = date_buffer;
+		} else
+			date = g_strndup (tokens.expires, tokens.expires_len);
+
+		cookie->expires = soup_date_time_new_from_http_string (date);
+		if (date != date_buffer)
+			g_free (date);
+	}
+
+ out:
+	g_free (domain_storage);
+	g_clear_pointer (&normalized_origin, g_uri_unref);
+
 	return cookie;
 }
 
+/**
+ * soup_cookie_parse_acceptable:
+ * @header: the value of a Set-Cookie header
+ * @origin: the URI the header was received from
+ * @filter: (nullable): function deciding whether to accept cookies
+ *   for a domain
+ * @user_data: data for @filter
+ *
+ * Parses @header like soup_cookie_parse(), but only creates the cookie
+ * if it passes soup_cookie_is_acceptable() and @filter accepts its
+ * domain. Cookies that get rejected are never allocated.
+ *
+ * Returns: (nullable): a new #SoupCookie, or %NULL
+ */
+SoupCookie *
+soup_cookie_parse_acceptable (const char            *header,
+			      GUri                  *origin,
+			      SoupCookieDomainFilter filter,
+			      gpointer               user_data)
+{
+	return parse_one_cookie (header, origin, TRUE, filter, user_data);
+}
+
 static SoupCookie *
 cookie_new_internal (const char *name, const char *value,
 		     const char *domain, const char *path,
@@ -421,7 +610,7 @@ soup_cookie_parse (const char *cookie, GUri *origin)
         g_return_val_if_fail (cookie != NULL, NULL);
         g_return_val_if_fail (origin == NULL || g_uri_get_host (origin) != NULL, NULL);
 
-	return parse_one_cookie (cookie, origin);
+	return parse_one_cookie (cookie, origin, FALSE, NULL, NULL);
 }
 
 /**
@@ -885,7 +1074,7 @@ soup_cookies_from_response (SoupMessage *msg)
 		if (g_ascii_strcasecmp (name, "Set-Cookie") != 0)
 			continue;
 
-		cookie = parse_one_cookie (value, origin);
+		cookie = parse_one_cookie (value, origin, FALSE, NULL, NULL);
 		if (cookie)
 			cookies = g_slist_prepend (cookies, cookie);
 	}
@@ -31,6 +31,7 @@ enum {
 	PROP_0,
 
 	PROP_FILENAME,
+	PROP_EXPIRY_THRESHOLD,
 
 	LAST_PROPERTY
 };
@@ -43,17 +44,60 @@ struct _SoupHSTSEnforcerDB {
 
 typedef struct {
 	char *filename;
+	/* Opened once at construction and never changed afterwards,
+	 * so @writer can use them without holding @mutex.
+	 */
 	sqlite3 *db;
+	sqlite3_stmt *insert_stmt;
+	sqlite3_stmt *delete_stmt;
+	gboolean loading;
+
+	/* Changes are queued in @pending, by host, and written
+	 * in a single transaction by @writer after FLUSH_DELAY.
+	 * @written holds the last policy queued for each host.
+	 */
+	GMutex mutex;
+	GMainContext *context;
+	GSource *flush_source;
+	GHashTable *pending;
+	GHashTable *written;
+	GThreadPool *writer;
+	guint expiry_threshold;
 } SoupHSTSEnforcerDBPrivate;
 
+#define FLUSH_DELAY 500
+
 G_DEFINE_FINAL_TYPE_WITH_CODE (SoupHSTSEnforcerDB, soup_hsts_enforcer_db, SOUP_TYPE_HSTS_ENFORCER,
 			       G_ADD_PRIVATE(SoupHSTSEnforcerDB))
 
 static void load (SoupHSTSEnforcer *hsts_enforcer);
+static void write_changes (gpointer data, gpointer user_data);
+
+static void
+policy_free (gpointer policy)
+{
+	/* NULL stands for a deleted policy in the pending changes */
+	if (policy)
+		soup_hsts_policy_free (policy);
+}
+
+static GHashTable *
+changes_new (void)
+{
+	return g_hash_table_new_full (g_str_hash, g_str_equal, g_free, policy_free);
+}
 
 static void
 soup_hsts_enforcer_db_init (SoupHSTSEnforcerDB *db)
 {
+        SoupHSTSEnforcerDBPrivate *priv = soup_hsts_enforcer_db_get_instance_private (db);
+
+	g_mutex_init (&priv->mutex);
+	priv->context = g_main_context_ref_thread_default ();
+	priv->pending = changes_new ();
+	priv->written = changes_new ();
+	/* At most one thread at a time, so batches are written in order */
+	priv->writer = g_thread_pool_new (write_changes, db, 1, FALSE, NULL);
 }
 
 static void
@@ -61,7 +105,22 @@ soup_hsts_enforcer_db_finalize (GObject *object)
 {
         SoupHSTSEnforcerDBPrivate *priv = soup_hsts_enforcer_db_get_instance_private ((SoupHSTSEnforcerDB*)object);
 
+	if (priv->flush_source) {
+		g_source_destroy (priv->flush_source);
+		g_source_unref (priv->flush_source);
+	}
+
+	/* Wait for queued batches, then write what is left */
+	g_thread_pool_free (priv->writer, FALSE, TRUE);
+	write_changes (g_steal_pointer (&priv->pending), object);
+
+	g_hash_table_destroy (priv->written);
+	g_main_context_unref (priv->context);
+	g_mutex_clear (&priv->mutex);
+
 	g_free (priv->filename);
+	g_clear_pointer (&priv->insert_stmt, sqlite3_finalize);
+	g_clear_pointer (&priv->delete_stmt, sqlite3_finalize);
 	sqlite3_close (priv->db);
 
 	G_OBJECT_CLASS (soup_hsts_enforcer_db_parent_class)->finalize (object);
@@ -78,6 +137,10 @@ soup_hsts_enforcer_db_set_property (GObject *object, guint prop_id,
 		priv->filename = g_value_dup_string (value);
 		load (SOUP_HSTS_ENFORCER (object));
 		break;
+	case PROP_EXPIRY_THRESHOLD:
+		soup_hsts_enforcer_db_set_expiry_threshold ((SoupHSTSEnforcerDB*)object,
+							    g_value_get_uint (value));
+		break;
 	default:
 		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
 		break;
@@ -94,6 +157,9 @@ soup_hsts_enforcer_db_get_property (GObject *object, guint prop_id,
 	case PROP_FILENAME:
 		g_value_set_string (value, priv->filename);
 		break;
+	case PROP_EXPIRY_THRESHOLD:
+		g_value_set_uint (value, priv->expiry_threshold);
+		break;
 	default:
 		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
 		break;
@@ -110,8 +176,9 @@ soup_hsts_enforcer_db_get_property (GObject *object, guint prop_id,
  * #SoupHSTSEnforcerDB, in order to create an initial set of HSTS
  * policies. If the file doesn't exist, a new database will be created
  * and initialized. Changes to the policies during the lifetime of a
- * #SoupHSTSEnforcerDB will be written to @filename when
- * [signal@HSTSEnforcer::changed] is emitted.
+ * #SoupHSTSEnforcerDB will be written to @filename shortly after
+ * [signal@HSTSEnforcer::changed] is emitted, from a separate thread and
+ * several changes at once, and when the enforcer is destroyed.
  *
  * Returns: the new #SoupHSTSEnforcer
  **/
@@ -126,9 +193,9 @@ soup_hsts_enforcer_db_new (const char *filename)
 }
 
 #define QUERY_ALL "SELECT id, host, max_age, expiry, include_subdomains FROM soup_hsts_policies;"
-#define CREATE_TABLE "CREATE TABLE soup_hsts_policies (id INTEGER PRIMARY KEY, host TEXT UNIQUE, max_age INTEGER, expiry INTEGER, include_subdomains INTEGER)"
-#define QUERY_INSERT "INSERT OR REPLACE INTO soup_hsts_policies VALUES((SELECT id FROM soup_hsts_policies WHERE host=%Q), %Q, %lu, %lu, %u);"
-#define QUERY_DELETE "DELETE FROM soup_hsts_policies WHERE host=%Q;"
+#define CREATE_TABLE "CREATE TABLE IF NOT EXISTS soup_hsts_policies (id INTEGER PRIMARY KEY, host TEXT UNIQUE, max_age INTEGER, expiry INTEGER, include_subdomains INTEGER)"
+#define QUERY_INSERT "INSERT OR REPLACE INTO soup_hsts_policies VALUES((SELECT id FROM soup_hsts_policies WHERE host=?1), ?1, ?2, ?3, ?4);"
+#define QUERY_DELETE "DELETE FROM soup_hsts_policies WHERE host=?1;"
 
 enum {
 	COL_ID,
@@ -144,6 +211,7 @@ query_all_callback (void *data, int argc, char **argv, char **colname)
 {
 	SoupHSTSPolicy *policy = NULL;
 	SoupHSTSEnforcer *hsts_enforcer = SOUP_HSTS_ENFORCER (data);
+        SoupHSTSEnforcerDBPrivate *priv = soup_hsts_enforcer_db_get_instance_private ((SoupHSTSEnforcerDB*)hsts_enforcer);
 
 	char *host;
 	gulong expire_time;
@@ -168,47 +236,26 @@ query_all_callback (void *data, int argc, char **argv, char **colname)
 
 	if (policy) {
 		soup_hsts_enforcer_set_policy (hsts_enforcer, policy);
-		soup_hsts_policy_free (policy);
+		g_hash_table_replace (priv->written, g_strdup (host), policy);
 	} else
 		g_date_time_unref (expires);
 
 	return 0;
 }
 
-static void
-try_create_table (sqlite3 *db)
-{
-	char *error = NULL;
-
-	if (sqlite3_exec (db, CREATE_TABLE, NULL, NULL, &error)) {
-		g_warning ("Failed to execute query: %s", error);
-		sqlite3_free (error);
-	}
-}
-
 typedef int (*ExecQueryCallback) (void *, int, char**, char**);
 
 static void
-exec_query_with_try_create_table (sqlite3 *db,
-				  const char *sql,
-				  ExecQueryCallback callback,
-				  void *argument)
+exec_query (sqlite3 *db,
+	    const char *sql,
+	    ExecQueryCallback callback,
+	    void *argument)
 {
 	char *error = NULL;
-	gboolean try_create = TRUE;
 
-try_exec:
 	if (sqlite3_exec (db, sql, callback, argument, &error)) {
-		if (try_create) {
-			try_create = FALSE;
-			try_create_table (db);
-			sqlite3_free (error);
-			error = NULL;
-			goto try_exec;
-		} else {
-			g_warning ("Failed to execute query: %s", error);
-			sqlite3_free (error);
-		}
+		g_warning ("Failed to execute query: %s", error);
+		sqlite3_free (error);
 	}
 }
 
@@ -218,8 +265,6 @@ open_db (SoupHSTSEnforcer *hsts_enforcer)
 {
 	SoupHSTSEnforcerDBPrivate *priv = soup_hsts_enforcer_db_get_instance_private ((SoupHSTSEnforcerDB*)hsts_enforcer);
 
-	char *error = NULL;
-
 	if (sqlite3_open (priv->filename, &priv->db)) {
 		sqlite3_close (priv->db);
 		priv->db = NULL;
@@ -227,9 +272,16 @@ open_db (SoupHSTSEnforcer *hsts_enforcer)
 		return TRUE;
 	}
 
-	if (sqlite3_exec (priv->db, "PRAGMA synchronous = OFF; PRAGMA secure_delete = 1;", NULL, NULL, &error)) {
-		g_warning ("Failed to execute query: %s", error);
-		sqlite3_free (error);
+	exec_query (priv->db, "PRAGMA synchronous = OFF; PRAGMA secure_delete = 1; PRAGMA journal_mode = WAL;", NULL, NULL);
+	exec_query (priv->db, CREATE_TABLE, NULL, NULL);
+
+	if (sqlite3_prepare_v2 (priv->db, QUERY_INSERT, -1, &priv->insert_stmt, NULL) ||
+	    sqlite3_prepare_v2 (priv->db, QUERY_DELETE, -1, &priv->delete_stmt, NULL)) {
+		g_warning ("Failed to prepare statement: %s", sqlite3_errmsg (priv->db));
+		g_clear_pointer (&priv->insert_stmt, sqlite3_finalize);
+		g_clear_pointer (&priv->delete_stmt, sqlite3_finalize);
+		g_clear_pointer (&priv->db, sqlite3_close);
+		return TRUE;
 	}
 
 	return FALSE;
@@ -240,12 +292,105 @@ load (SoupHSTSEnforcer *hsts_enforcer)
 {
 	SoupHSTSEnforcerDBPrivate *priv = soup_hsts_enforcer_db_get_instance_private ((SoupHSTSEnforcerDB*)hsts_enforcer);
 
-	if (priv->db == NULL) {
-		if (open_db (hsts_enforcer))
-			return;
+	if (open_db (hsts_enforcer))
+		return;
+
+	/* The policies are already in the database */
+	priv->loading = TRUE;
+	exec_query (priv->db, QUERY_ALL, query_all_callback, hsts_enforcer);
+	priv->loading = FALSE;
+}
+
+static void
+step_statement (sqlite3 *db, sqlite3_stmt *stmt)
+{
+	if (sqlite3_step (stmt) != SQLITE_DONE)
+		g_warning ("Failed to execute query: %s", sqlite3_errmsg (db));
+	sqlite3_reset (stmt);
+	sqlite3_clear_bindings (stmt);
+}
+
+/* Runs in the writer thread, or at finalization */
+static void
+write_changes (gpointer data,
+	       gpointer user_data)
+{
+	GHashTable *changes = data;
+	SoupHSTSEnforcerDBPrivate *priv = soup_hsts_enforcer_db_get_instance_private (user_data);
+	GHashTableIter iter;
+	gpointer key, value;
+
+	if (g_hash_table_size (changes) == 0 || priv->db == NULL) {
+		g_hash_table_destroy (changes);
+		return;
+	}
+
+	exec_query (priv->db, "BEGIN;", NULL, NULL);
+
+	g_hash_table_iter_init (&iter, changes);
+	while (g_hash_table_iter_next (&iter, &key, &value)) {
+		SoupHSTSPolicy *policy = value;
+
+		if (!policy) {
+			sqlite3_bind_text (priv->delete_stmt, 1, key, -1, SQLITE_STATIC);
+			step_statement (priv->db, priv->delete_stmt);
+			continue;
+		}
+
+		sqlite3_bind_text (priv->insert_stmt, 1, key, -1, SQLITE_STATIC);
+		sqlite3_bind_int64 (priv->insert_stmt, 2, soup_hsts_policy_get_max_age (policy));
+		sqlite3_bind_int64 (priv->insert_stmt, 3, g_date_time_to_unix (soup_hsts_policy_get_expires (policy)));
+		sqlite3_bind_int (priv->insert_stmt, 4, soup_hsts_policy_includes_subdomains (policy));
+		step_statement (priv->db, priv->insert_stmt);
 	}
 
-	exec_query_with_try_create_table (priv->db, QUERY_ALL, query_all_callback, hsts_enforcer);
+	exec_query (priv->db, "COMMIT;", NULL, NULL);
+	g_hash_table_destroy (changes);
+}
+
+static gboolean
+flush_timeout (gpointer user_data)
+{
+	SoupHSTSEnforcerDBPrivate *priv = soup_hsts_enforcer_db_get_instance_private (user_data);
+	GHashTable *changes;
+
+	g_mutex_lock (&priv->mutex);
+	g_clear_pointer (&priv->flush_source, g_source_unref);
+	changes = priv->pending;
+	priv->pending = changes_new ();
+	g_mutex_unlock (&priv->mutex);
+
+	g_thread_pool_push (priv->writer, changes, NULL);
+
+	return G_SOURCE_REMOVE;
+}
+
+/* Whether @new_policy only moves the expiration of the policy last
+ * written for its host by less than the configured threshold.
+ */
+static gboolean
+is_minor_refresh (SoupHSTSEnforcerDBPrivate *priv,
+		  SoupHSTSPolicy            *new_policy)
+{
+	SoupHSTSPolicy *written;
+	gint64 delta;
+
+	if (priv->expiry_threshold == 0)
+		return FALSE;
+
+	/* Never skip over a pending deletion */
+	if (g_hash_table_contains (priv->pending, soup_hsts_policy_get_domain (new_policy)))
+		return FALSE;
+
+	written = g_hash_table_lookup (priv->written, soup_hsts_policy_get_domain (new_policy));
+	if (!written ||
+	    soup_hsts_policy_get_max_age (written) != soup_hsts_policy_get_max_age (new_policy) ||
+	    soup_hsts_policy_includes_subdomains (written) != soup_hsts_policy_includes_subdomains (new_policy))
+		return FALSE;
+
+	delta = g_date_time_to_unix (soup_hsts_policy_get_expires (new_policy)) -
+		g_date_time_to_unix (soup_hsts_policy_get_expires (written));
+	return ABS (delta) < priv->expiry_threshold;
 }
 
 static void
@@ -254,41 +399,100 @@ soup_hsts_enforcer_db_changed (SoupHSTSEnforcer *hsts_enforcer,
 			       SoupHSTSPolicy   *new_policy)
 {
 	SoupHSTSEnforcerDBPrivate *priv = soup_hsts_enforcer_db_get_instance_private ((SoupHSTSEnforcerDB*)hsts_enforcer);
-	char *query;
+	const char *domain;
 
 	/* Session policies do not need to be stored in the database. */
 	if ((old_policy && soup_hsts_policy_is_session_policy (old_policy)) ||
 	    (new_policy && soup_hsts_policy_is_session_policy (new_policy)))
 		return;
 
-	if (priv->db == NULL) {
-		if (open_db (hsts_enforcer))
-			return;
-	}
+	if (priv->loading)
+		return;
+
+	if (new_policy && !soup_hsts_policy_get_expires (new_policy))
+		return;
 
-	if (old_policy && !new_policy) {
-		query = sqlite3_mprintf (QUERY_DELETE,
-					 soup_hsts_policy_get_domain (old_policy));
-		g_assert (query);
-		exec_query_with_try_create_table (priv->db, query, NULL, NULL);
-		sqlite3_free (query);
+	/* The database could not be opened at construction */
+	if (priv->db == NULL)
+		return;
+
+	g_mutex_lock (&priv->mutex);
+
+	if (new_policy && is_minor_refresh (priv, new_policy)) {
+		g_mutex_unlock (&priv->mutex);
+		return;
 	}
 
-	/* Insert the new policy or update the existing one. */
-	if (new_policy && soup_hsts_policy_get_expires (new_policy)) {
-		gulong expires;
-
-		expires = (gulong)g_date_time_to_unix (soup_hsts_policy_get_expires (new_policy));
-		query = sqlite3_mprintf (QUERY_INSERT,
-					 soup_hsts_policy_get_domain (new_policy),
-					 soup_hsts_policy_get_domain (new_policy),
-					 soup_hsts_policy_get_max_age (new_policy),
-					 expires,
-					 soup_hsts_policy_includes_subdomains (new_policy));
-		g_assert (query);
-		exec_query_with_try_create_table (priv->db, query, NULL, NULL);
-		sqlite3_free (query);
+	/* Insert the new policy, update the existing one or delete it. */
+	domain = soup_hsts_policy_get_domain (new_policy ? new_policy : old_policy);
+	g_hash_table_replace (priv->pending, g_strdup (domain),
+			      new_policy ? soup_hsts_policy_copy (new_policy) : NULL);
+	if (new_policy)
+		g_hash_table_replace (priv->written, g_strdup (domain), soup_hsts_policy_copy (new_policy));
+	else
+		g_hash_table_remove (priv->written, domain);
+
+	if (!priv->flush_source) {
+		priv->flush_source = g_timeout_source_new (FLUSH_DELAY);
+		g_source_set_name (priv->flush_source, "SoupHSTSEnforcerDB flush");
+		g_source_set_callback (priv->flush_source, flush_timeout, hsts_enforcer, NULL);
+		g_source_attach (priv->flush_source, priv->context);
 	}
+
+	g_mutex_unlock (&priv->mutex);
+}
+
+/**
+ * soup_hsts_enforcer_db_set_expiry_threshold: (attributes org.gtk.Method.set_property=expiry-threshold)
+ * @hsts_enforcer_db: a #SoupHSTSEnforcerDB
+ * @threshold: a number of seconds
+ *
+ * Sets the smallest change of a policy's expiration date, in seconds, that
+ * is written to the database when nothing else in the policy changed.
+ *
+ * Servers usually send the same Strict-Transport-Security header with every
+ * response, which only pushes the expiration date forward. With a non-zero
+ * @threshold, the expiration date stored for a host may lag behind by up to
+ * @threshold seconds, in exchange for far fewer writes.
+ *
+ * Since: 3.4
+ */
+void
+soup_hsts_enforcer_db_set_expiry_threshold (SoupHSTSEnforcerDB *hsts_enforcer_db,
+					    guint               threshold)
+{
+        SoupHSTSEnforcerDBPrivate *priv;
+
+	g_return_if_fail (SOUP_IS_HSTS_ENFORCER_DB (hsts_enforcer_db));
+
+	priv = soup_hsts_enforcer_db_get_instance_private (hsts_enforcer_db);
+	if (priv->expiry_threshold == threshold)
+		return;
+
+	priv->expiry_threshold = threshold;
+	g_object_notify_by_pspec (G_OBJECT (hsts_enforcer_db), properties[PROP_EXPIRY_THRESHOLD]);
+}
+
+/**
+ * soup_hsts_enforcer_db_get_expiry_threshold: (attributes org.gtk.Method.get_property=expiry-threshold)
+ * @hsts_enforcer_db: a #SoupHSTSEnforcerDB
+ *
+ * Gets the threshold set with
+ * [method@HSTSEnforcerDB.set_expiry_threshold].
+ *
+ * Returns: the threshold, in seconds
+ *
+ * Since: 3.4
+ */
+guint
+soup_hsts_enforcer_db_get_expiry_threshold (SoupHSTSEnforcerDB *hsts_enforcer_db)
+{
+        SoupHSTSEnforcerDBPrivate *priv;
+
+	g_return_val_if_fail (SOUP_IS_HSTS_ENFORCER_DB (hsts_enforcer_db), 0);
+
+	priv = soup_hsts_enforcer_db_get_instance_private (hsts_enforcer_db);
+	return priv->expiry_threshold;
 }
 
 static gboolean
@@ -339,5 +543,21 @@ soup_hsts_enforcer_db_class_init (SoupHSTSEnforcerDBClass *db_class)
 				     G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY |
 				     G_PARAM_STATIC_STRINGS);
 
+	/**
+	 * SoupHSTSEnforcerDB:expiry-threshold: (attributes org.gtk.Property.get=soup_hsts_enforcer_db_get_expiry_threshold org.gtk.Property.set=soup_hsts_enforcer_db_set_expiry_threshold)
+	 *
+	 * The smallest change of a policy's expiration date, in seconds,
+	 * that is written to the database on its own.
+	 *
+	 * Since: 3.4
+	 **/
+        properties[PROP_EXPIRY_THRESHOLD] =
+		g_param_spec_uint ("expiry-threshold",
+				   "Expiry threshold",
+				   "Smallest expiration change written on its own",
+				   0, G_MAXUINT, 0,
+				   G_PARAM_READWRITE |
+				   G_PARAM_STATIC_STRINGS);
+
         g_object_class_install_properties (object_class, LAST_PROPERTY, properties);
 }
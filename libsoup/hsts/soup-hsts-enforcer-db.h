@@ -17,4 +17,10 @@ G_DECLARE_FINAL_TYPE (SoupHSTSEnforcerDB, soup_hsts_enforcer_db, SOUP, HSTS_ENFO
 SOUP_AVAILABLE_IN_ALL
 SoupHSTSEnforcer *soup_hsts_enforcer_db_new (const char *filename);
 
+SOUP_AVAILABLE_IN_3_4
+void              soup_hsts_enforcer_db_set_expiry_threshold (SoupHSTSEnforcerDB *hsts_enforcer_db,
+							      guint               threshold);
+SOUP_AVAILABLE_IN_3_4
+guint             soup_hsts_enforcer_db_get_expiry_threshold (SoupHSTSEnforcerDB *hsts_enforcer_db);
+
 G_END_DECLS
@@ -11,6 +11,7 @@
 #endif
 
 #include "soup-hsts-enforcer.h"
+#include "soup-hsts-preload-list.h"
 #include "soup-misc.h"
 #include "soup.h"
 #include "soup-session-private.h"
@@ -59,6 +60,8 @@ typedef struct {
         GMutex mutex;
 	GHashTable *host_policies;
 	GHashTable *session_policies;
+        SoupHSTSPreloadList *preload;
+        GSList *retired_preloads;
 } SoupHSTSEnforcerPrivate;
 
 G_DEFINE_TYPE_WITH_CODE (SoupHSTSEnforcer, soup_hsts_enforcer, G_TYPE_OBJECT,
@@ -98,6 +101,9 @@ soup_hsts_enforcer_finalize (GObject *object)
 		soup_hsts_policy_free (value);
 	g_hash_table_destroy (priv->session_policies);
 
+        g_clear_pointer (&priv->preload, soup_hsts_preload_list_free);
+        g_slist_free_full (priv->retired_preloads, (GDestroyNotify)soup_hsts_preload_list_free);
+
         g_mutex_clear (&priv->mutex);
 
 	G_OBJECT_CLASS (soup_hsts_enforcer_parent_class)->finalize (object);
@@ -430,9 +436,15 @@ soup_hsts_enforcer_must_enforce_secure_transport (SoupHSTSEnforcer *hsts_enforce
 {
         SoupHSTSEnforcerPrivate *priv = soup_hsts_enforcer_get_instance_private (hsts_enforcer);
 	const char *super_domain = domain;
+        SoupHSTSPreloadList *preload;
 
 	g_return_val_if_fail (domain != NULL, FALSE);
 
+        /* The preload list is immutable, so it's checked without locking */
+        preload = g_atomic_pointer_get (&priv->preload);
+        if (preload && soup_hsts_preload_list_matches (preload, domain))
+                return TRUE;
+
         g_mutex_lock (&priv->mutex);
 
 	if (soup_hsts_enforcer_has_valid_policy (hsts_enforcer, domain)) {
@@ -705,3 +717,53 @@ soup_hsts_enforcer_get_policies (SoupHSTSEnforcer *hsts_enforcer,
 
 	return policies;
 }
+
+/**
+ * soup_hsts_enforcer_load_preload_list:
+ * @hsts_enforcer: a #SoupHSTSEnforcer
+ * @json: the contents of an HSTS preload list
+ * @error: return location for a #GError, or %NULL
+ *
+ * Loads a list of hosts that must always be contacted over HTTPS, in
+ * addition to the policies learned from the Strict-Transport-Security
+ * header. @json uses the format of Chromium's
+ * `transport_security_state_static.json`; only its entries with a
+ * "force-https" mode are used.
+ *
+ * The list replaces any previously loaded one. It can't be modified
+ * afterwards, and it's neither persisted nor returned by
+ * [method@HSTSEnforcer.get_policies].
+ *
+ * Returns: %TRUE if the list was loaded, or %FALSE if @json could not
+ *   be parsed
+ *
+ * Since: 3.4
+ **/
+gboolean
+soup_hsts_enforcer_load_preload_list (SoupHSTSEnforcer *hsts_enforcer,
+                                      GBytes           *json,
+                                      GError          **error)
+{
+        SoupHSTSEnforcerPrivate *priv;
+        SoupHSTSPreloadList *preload;
+
+	g_return_val_if_fail (SOUP_IS_HSTS_ENFORCER (hsts_enforcer), FALSE);
+	g_return_val_if_fail (json != NULL, FALSE);
+
+        preload = soup_hsts_preload_list_new_from_json (json, error);
+        if (!preload)
+                return FALSE;
+
+        priv = soup_hsts_enforcer_get_instance_private (hsts_enforcer);
+
+        /* Lookups in other threads may still be using the old list,
+         * so it's only freed along with the enforcer.
+         */
+        g_mutex_lock (&priv->mutex);
+        if (priv->preload)
+                priv->retired_preloads = g_slist_prepend (priv->retired_preloads, priv->preload);
+        g_atomic_pointer_set (&priv->preload, preload);
+        g_mutex_unlock (&priv->mutex);
+
+        return TRUE;
+}
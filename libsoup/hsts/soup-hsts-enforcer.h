@@ -66,4 +66,9 @@ SOUP_AVAILABLE_IN_ALL
 GList            *soup_hsts_enforcer_get_policies                  (SoupHSTSEnforcer *hsts_enforcer,
 								    gboolean          session_policies);
 
+SOUP_AVAILABLE_IN_3_4
+gboolean          soup_hsts_enforcer_load_preload_list             (SoupHSTSEnforcer *hsts_enforcer,
+								    GBytes           *json,
+								    GError          **error);
+
 G_END_DECLS
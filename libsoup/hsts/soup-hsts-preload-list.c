@@ -0,0 +1,499 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*- */
+/*
+ * soup-hsts-preload-list.c: immutable HSTS preload list
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+
+#include <glib/gi18n-lib.h>
+#include <gio/gio.h>
+
+#include "soup-hsts-preload-list.h"
+
+/* The list is built once and never modified afterwards, so it can be
+ * queried from any thread without locking. Entries live in an open
+ * addressing hash table, keyed by host name, whose names are all
+ * stored in a single string pool.
+ */
+
+typedef struct {
+        guint32 hash;
+        guint32 name; /* offset + 1 in names, 0 for an empty slot */
+        gboolean include_subdomains;
+} SoupHSTSPreloadEntry;
+
+struct _SoupHSTSPreloadList {
+        char *names;
+        SoupHSTSPreloadEntry *entries;
+        guint32 mask;
+        guint size;
+};
+
+#define MAX_DEPTH 32
+
+static guint32
+hash_name (const char *name,
+           gsize       length)
+{
+        guint32 hash = 2166136261u;
+        gsize i;
+
+        for (i = 0; i < length; i++) {
+                hash ^= (guchar)g_ascii_tolower (name[i]);
+                hash *= 16777619u;
+        }
+
+        return hash;
+}
+
+static SoupHSTSPreloadEntry *
+lookup_entry (SoupHSTSPreloadList *list,
+              const char          *names,
+              const char          *name,
+              gsize                length)
+{
+        guint32 hash = hash_name (name, length);
+        guint32 i;
+
+        for (i = hash & list->mask; list->entries[i].name; i = (i + 1) & list->mask) {
+                SoupHSTSPreloadEntry *entry = &list->entries[i];
+                const char *entry_name = names + entry->name - 1;
+
+                if (entry->hash == hash &&
+                    !g_ascii_strncasecmp (entry_name, name, length) &&
+                    entry_name[length] == '\0')
+                        return entry;
+        }
+
+        return &list->entries[i];
+}
+
+/* Chromium's transport_security_state_static.json is JSON with
+ * comments. Only the "name", "mode" and "include_subdomains" members
+ * of the "entries" are used, everything else is skipped.
+ */
+typedef struct {
+        const char *p;
+        const char *end;
+        GError **error;
+} JsonScanner;
+
+static gboolean
+json_error (JsonScanner *scanner)
+{
+        if (scanner->error && !*scanner->error) {
+                g_set_error_literal (scanner->error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                                     _("Invalid HSTS preload list"));
+        }
+        return FALSE;
+}
+
+static char
+json_peek (JsonScanner *scanner)
+{
+        while (scanner->p < scanner->end) {
+                if (g_ascii_isspace (*scanner->p)) {
+                        scanner->p++;
+                } else if (scanner->p + 1 < scanner->end && scanner->p[0] == '/' && scanner->p[1] == '/') {
+                        while (scanner->p < scanner->end && *scanner->p != '\n')
+                                scanner->p++;
+                } else if (scanner->p + 1 < scanner->end && scanner->p[0] == '/' && scanner->p[1] == '*') {
+                        const char *close = g_strstr_len (scanner->p + 2, scanner->end - scanner->p - 2, "*/");
+
+                        scanner->p = close ? close + 2 : scanner->end;
+                } else
+                        return *scanner->p;
+        }
+
+        return '\0';
+}
+
+static gboolean
+json_expect (JsonScanner *scanner,
+             char         c)
+{
+        if (json_peek (scanner) != c)
+                return json_error (scanner);
+        scanner->p++;
+        return TRUE;
+}
+
+static gboolean
+json_parse_string (JsonScanner *scanner,
+                   GString     *out)
+{
+        if (!json_expect (scanner, '"'))
+                return FALSE;
+
+        while (scanner->p < scanner->end && *scanner->p != '"') {
+                char c = *scanner->p++;
+
+                if (c != '\\') {
+                        if (out)
+                                g_string_append_c (out, c);
+                        continue;
+                }
+
+                if (scanner->p >= scanner->end)
+                        return json_error (scanner);
+
+                c = *scanner->p++;
+                if (c == 'u') {
+                        char hex[5] = { 0, };
+                        char *hex_end;
+                        gunichar ch;
+
+                        if (scanner->end - scanner->p < 4)
+                                return json_error (scanner);
+                        memcpy (hex, scanner->p, 4);
+                        ch = strtoul (hex, &hex_end, 16);
+                        if (hex_end != hex + 4)
+                                return json_error (scanner);
+                        scanner->p += 4;
+                        if (out)
+                                g_string_append_unichar (out, g_unichar_validate (ch) ? ch : 0xFFFD);
+                        continue;
+                }
+
+                if (out) {
+                        switch (c) {
+                        case 'b':
+                                c = '\b';
+                                break;
+                        case 'f':
+                                c = '\f';
+                                break;
+                        case 'n':
+                                c = '\n';
+                                break;
+                        case 'r':
+                                c = '\r';
+                                break;
+                        case 't':
+                                c = '\t';
+                                break;
+                        }
+                        g_string_append_c (out, c);
+                }
+        }
+
+        return json_expect (scanner, '"');
+}
+
+/* true, false, null and numbers */
+static gboolean
+json_parse_literal (JsonScanner *scanner,
+                    gboolean    *is_true)
+{
+        const char *start = scanner->p;
+
+        while (scanner->p < scanner->end &&
+               (g_ascii_isalnum (*scanner->p) || strchr ("+-.", *scanner->p)))
+                scanner->p++;
+
+        if (scanner->p == start)
+                return json_error (scanner);
+
+        if (is_true)
+                *is_true = scanner->p - start == 4 && !strncmp (start, "true", 4);
+        return TRUE;
+}
+
+static gboolean
+json_skip_value (JsonScanner *scanner,
+                 guint        depth)
+{
+        char c = json_peek (scanner);
+
+        if (depth > MAX_DEPTH)
+                return json_error (scanner);
+
+        switch (c) {
+        case '"':
+                return json_parse_string (scanner, NULL);
+        case '{':
+        case '[': {
+                char close = c == '{' ? '}' : ']';
+
+                scanner->p++;
+                if (json_peek (scanner) == close) {
+                        scanner->p++;
+                        return TRUE;
+                }
+
+                do {
+                        if (c == '{') {
+                                if (!json_parse_string (scanner, NULL) ||
+                                    !json_expect (scanner, ':'))
+                                        return FALSE;
+                        }
+                        if (!json_skip_value (scanner, depth + 1))
+                                return FALSE;
+                } while (json_peek (scanner) == ',' && scanner->p++);
+
+                return json_expect (scanner, close);
+        }
+        default:
+                return json_parse_literal (scanner, NULL);
+        }
+}
+
+typedef struct {
+        GString *names;
+        GArray *entries;
+} PreloadBuilder;
+
+static void
+builder_add (PreloadBuilder *builder,
+             const char     *name,
+             gboolean        include_subdomains)
+{
+        SoupHSTSPreloadEntry entry;
+        char *unicode = NULL;
+        gsize length;
+
+        length = strlen (name);
+        while (length > 0 && name[length - 1] == '.')
+                length--;
+        if (length == 0)
+                return;
+
+        /* Hosts are matched in their Unicode form, as SoupHSTSEnforcer
+         * canonicalizes them.
+         */
+        if (g_hostname_is_ascii_encoded (name)) {
+                unicode = g_hostname_to_unicode (name);
+                if (!unicode)
+                        return;
+                name = unicode;
+                length = strlen (name);
+                while (length > 0 && name[length - 1] == '.')
+                        length--;
+        }
+
+        entry.hash = hash_name (name, length);
+        entry.name = builder->names->len + 1;
+        entry.include_subdomains = include_subdomains;
+        g_string_append_len (builder->names, name, length);
+        g_string_append_c (builder->names, '\0');
+        g_array_append_val (builder->entries, entry);
+
+        g_free (unicode);
+}
+
+static gboolean
+json_parse_entry (JsonScanner    *scanner,
+                  PreloadBuilder *builder)
+{
+        GString *key, *name, *mode;
+        gboolean include_subdomains = FALSE;
+        gboolean retval = FALSE;
+
+        if (!json_expect (scanner, '{'))
+                return FALSE;
+        if (json_peek (scanner) == '}') {
+                scanner->p++;
+                return TRUE;
+        }
+
+        key = g_string_new (NULL);
+        name = g_string_new (NULL);
+        mode = g_string_new (NULL);
+
+        do {
+                g_string_truncate (key, 0);
+                if (!json_parse_string (scanner, key) ||
+                    !json_expect (scanner, ':'))
+                        goto out;
+
+                if (!strcmp (key->str, "name")) {
+                        g_string_truncate (name, 0);
+                        if (!json_parse_string (scanner, name))
+                                goto out;
+                } else if (!strcmp (key->str, "mode")) {
+                        g_string_truncate (mode, 0);
+                        if (!json_parse_string (scanner, mode))
+                                goto out;
+                } else if (!strcmp (key->str, "include_subdomains")) {
+                        if (!json_parse_literal (scanner, &include_subdomains))
+                                goto out;
+                } else if (!json_skip_value (scanner, 2))
+                        goto out;
+        } while (json_peek (scanner) == ',' && scanner->p++);
+
+        if (!json_expect (scanner, '}'))
+                goto out;
+
+        /* Entries without a mode only carry key pins */
+        if (!strcmp (mode->str, "force-https"))
+                builder_add (builder, name->str, include_subdomains);
+        retval = TRUE;
+
+ out:
+        g_string_free (key, TRUE);
+        g_string_free (name, TRUE);
+        g_string_free (mode, TRUE);
+
+        return retval;
+}
+
+static gboolean
+json_parse_preload_list (JsonScanner    *scanner,
+                         PreloadBuilder *builder)
+{
+        GString *key;
+        gboolean retval = FALSE;
+
+        if (!json_expect (scanner, '{'))
+                return FALSE;
+        if (json_peek (scanner) == '}') {
+                scanner->p++;
+                return TRUE;
+        }
+
+        key = g_string_new (NULL);
+        do {
+                g_string_truncate (key, 0);
+                if (!json_parse_string (scanner, key) ||
+                    !json_expect (scanner, ':'))
+                        goto out;
+
+                if (strcmp (key->str, "entries") != 0) {
+                        if (!json_skip_value (scanner, 1))
+                                goto out;
+                        continue;
+                }
+
+                if (!json_expect (scanner, '['))
+                        goto out;
+                if (json_peek (scanner) != ']') {
+                        do {
+                                if (!json_parse_entry (scanner, builder))
+                                        goto out;
+                        } while (json_peek (scanner) == ',' && scanner->p++);
+                }
+                if (!json_expect (scanner, ']'))
+                        goto out;
+        } while (json_peek (scanner) == ',' && scanner->p++);
+
+        retval = json_expect (scanner, '}');
+
+ out:
+        g_string_free (key, TRUE);
+
+        return retval;
+}
+
+/**
+ * soup_hsts_preload_list_new_from_json:
+ * @json: a preload list, in the format used by Chromium
+ * @error: return location for a #GError
+ *
+ * Parses @json into an immutable preload list. Only entries with a
+ * "force-https" mode are kept.
+ *
+ * Returns: (transfer full): a new #SoupHSTSPreloadList, or %NULL on error
+ */
+SoupHSTSPreloadList *
+soup_hsts_preload_list_new_from_json (GBytes  *json,
+                                      GError **error)
+{
+        SoupHSTSPreloadList *list;
+        PreloadBuilder builder;
+        JsonScanner scanner;
+        gsize length, n_slots;
+        guint i;
+
+        scanner.p = g_bytes_get_data (json, &length);
+        scanner.end = scanner.p + length;
+        scanner.error = error;
+
+        builder.names = g_string_new (NULL);
+        builder.entries = g_array_new (FALSE, FALSE, sizeof (SoupHSTSPreloadEntry));
+
+        if (!json_parse_preload_list (&scanner, &builder) ||
+            json_peek (&scanner) != '\0' ||
+            builder.names->len >= G_MAXUINT32) {
+                json_error (&scanner);
+                g_string_free (builder.names, TRUE);
+                g_array_free (builder.entries, TRUE);
+                return NULL;
+        }
+
+        /* Keep the table at most half full */
+        for (n_slots = 16; n_slots < builder.entries->len * 2; n_slots *= 2)
+                ;
+
+        list = g_new0 (SoupHSTSPreloadList, 1);
+        list->mask = n_slots - 1;
+        list->entries = g_new0 (SoupHSTSPreloadEntry, n_slots);
+        list->names = g_string_free (builder.names, FALSE);
+
+        for (i = 0; i < builder.entries->len; i++) {
+                SoupHSTSPreloadEntry *entry = &g_array_index (builder.entries, SoupHSTSPreloadEntry, i);
+                const char *name = list->names + entry->name - 1;
+                SoupHSTSPreloadEntry *slot;
+
+                /* Later entries replace earlier ones for the same host */
+                slot = lookup_entry (list, list->names, name, strlen (name));
+                if (!slot->name)
+                        list->size++;
+                *slot = *entry;
+        }
+        g_array_free (builder.entries, TRUE);
+
+        return list;
+}
+
+void
+soup_hsts_preload_list_free (SoupHSTSPreloadList *list)
+{
+        g_free (list->entries);
+        g_free (list->names);
+        g_free (list);
+}
+
+guint
+soup_hsts_preload_list_get_size (SoupHSTSPreloadList *list)
+{
+        return list->size;
+}
+
+/**
+ * soup_hsts_preload_list_matches:
+ * @list: a #SoupHSTSPreloadList
+ * @domain: a canonicalized host name
+ *
+ * Checks whether @list has an entry for @domain, or one for any of
+ * its super-domains that includes subdomains.
+ *
+ * Returns: %TRUE if secure transport must be enforced for @domain
+ */
+gboolean
+soup_hsts_preload_list_matches (SoupHSTSPreloadList *list,
+                                const char          *domain)
+{
+        const char *name = domain;
+        gboolean exact = TRUE;
+
+        while (*name) {
+                SoupHSTSPreloadEntry *entry;
+                const char *dot;
+
+                entry = lookup_entry (list, list->names, name, strlen (name));
+                if (entry->name && (exact || entry->include_subdomains))
+                        return TRUE;
+
+                dot = strchr (name, '.');
+                if (!dot)
+                        break;
+                name = dot + 1;
+                exact = FALSE;
+        }
+
+        return FALSE;
+}
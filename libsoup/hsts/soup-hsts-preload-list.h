@@ -0,0 +1,19 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*- */
+
+#pragma once
+
+#include "soup-types.h"
+
+G_BEGIN_DECLS
+
+typedef struct _SoupHSTSPreloadList SoupHSTSPreloadList;
+
+SoupHSTSPreloadList *soup_hsts_preload_list_new_from_json (GBytes              *json,
+                                                           GError             **error);
+void                 soup_hsts_preload_list_free          (SoupHSTSPreloadList *list);
+
+guint                soup_hsts_preload_list_get_size      (SoupHSTSPreloadList *list);
+gboolean             soup_hsts_preload_list_matches       (SoupHSTSPreloadList *list,
+                                                           const char          *domain);
+
+G_END_DECLS
@@ -525,3 +525,11 @@ soup_body_input_stream_new (GInputStream *base_stream,
 			     "content-length", content_length,
 			     NULL);
 }
+
+gboolean
+soup_body_input_stream_is_eof (SoupBodyInputStream *bistream)
+{
+        SoupBodyInputStreamPrivate *priv = soup_body_input_stream_get_instance_private (bistream);
+
+        return priv->eof;
+}
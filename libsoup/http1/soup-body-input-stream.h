@@ -19,4 +19,6 @@ GInputStream *soup_body_input_stream_new (GInputStream *base_stream,
 					  SoupEncoding  encoding,
 					  goffset       content_length);
 
+gboolean      soup_body_input_stream_is_eof (SoupBodyInputStream *bistream);
+
 G_END_DECLS
@@ -59,6 +59,7 @@ G_DEFINE_FINAL_TYPE_WITH_CODE (SoupBodyInputStreamHttp2, soup_body_input_stream_
 
 enum {
         NEED_MORE_DATA,
+        READ_DATA,
         LAST_SIGNAL
 };
 
@@ -175,6 +176,9 @@ soup_body_input_stream_http2_read_real (GInputStream  *stream,
 
         priv->pos += count;
 
+        if (count > 0)
+                g_signal_emit (memory_stream, signals[READ_DATA], 0, (guint64)count);
+
         /* We need to block until the read is completed.
          * So emit a signal saying we need more data. */
         if (count == 0 && blocking && !priv->completed) {
@@ -254,6 +258,9 @@ soup_body_input_stream_http2_skip (GInputStream  *stream,
         count = MIN (count, priv->len - priv->pos);
         priv->pos += count;
 
+        if (count > 0)
+                g_signal_emit (memory_stream, signals[READ_DATA], 0, (guint64)count);
+
         /* Remove all skipped chunks */
         gsize offset = priv->start_offset;
         for (GSList *l = priv->chunks; l; l = l->next) {
@@ -431,4 +438,14 @@ soup_body_input_stream_http2_class_init (SoupBodyInputStreamHttp2Class *klass)
                               G_TYPE_ERROR,
                               2, G_TYPE_BOOLEAN,
                               G_TYPE_CANCELLABLE);
+
+        signals[READ_DATA] =
+                g_signal_new ("read-data",
+                              G_OBJECT_CLASS_TYPE (object_class),
+                              G_SIGNAL_RUN_FIRST,
+                              0,
+                              NULL, NULL,
+                              NULL,
+                              G_TYPE_NONE,
+                              1, G_TYPE_UINT64);
 }
@@ -33,6 +33,7 @@
 #include <libsoup/soup-auth-domain.h>
 #include <libsoup/soup-auth-domain-basic.h>
 #include <libsoup/soup-auth-domain-digest.h>
+#include <libsoup/soup-content-encoder.h>
 #include <libsoup/soup-server.h>
 #include <libsoup/soup-server-message.h>
 #include <libsoup/soup-session.h>
@@ -10,6 +10,12 @@
 #endif
 
 #include <glib/gi18n-lib.h>
+#include <string.h>
+
+#ifdef HAVE_SENDFILE
+#include <errno.h>
+#include <sys/sendfile.h>
+#endif
 
 #include "soup-server-message-io-http1.h"
 #include "soup.h"
@@ -27,11 +33,18 @@ typedef struct {
         SoupServerMessage *msg;
 
         GBytes  *write_chunk;
+        GBytes  *write_data;
 	goffset  write_body_offset;
 
         GSource *unpause_source;
 
 	GMainContext *async_context;
+
+        gboolean request_body_streamed;
+        gboolean use_sendfile;
+
+        /* Set when reading a pipelined request failed */
+        GError *read_error;
 } SoupMessageIOHTTP1;
 
 typedef struct {
@@ -45,16 +58,22 @@ typedef struct {
         gpointer started_user_data;
 
         gboolean in_io_run;
+        gboolean in_read_ahead;
 
+        /* The message whose response is being written */
         SoupMessageIOHTTP1 *msg_io;
+        /* Pipelined requests read after msg_io, in order */
+        GQueue pipeline;
 } SoupServerMessageIOHTTP1;
 
 #define RESPONSE_BLOCK_SIZE 8192
 #define HEADER_SIZE_LIMIT (64 * 1024)
+#define PIPELINE_MAX_REQUESTS 8
 
 static gboolean io_run_ready (SoupServerMessage *msg,
                               gpointer           user_data);
 static void io_run (SoupServerMessageIOHTTP1 *server_io);
+static void io_read_ahead (SoupServerMessageIOHTTP1 *server_io);
 
 static SoupMessageIOHTTP1 *
 soup_message_io_http1_new (SoupServerMessage *msg)
@@ -86,18 +105,53 @@ soup_message_io_http1_free (SoupMessageIOHTTP1 *msg_io)
         g_clear_object (&msg_io->msg);
         g_clear_pointer (&msg_io->async_context, g_main_context_unref);
         g_clear_pointer (&msg_io->write_chunk, g_bytes_unref);
+        g_clear_pointer (&msg_io->write_data, g_bytes_unref);
+        g_clear_error (&msg_io->read_error);
 
         g_free (msg_io);
 }
 
+static SoupMessageIOHTTP1 *
+lookup_msg_io (SoupServerMessageIOHTTP1 *io,
+               SoupServerMessage        *msg)
+{
+        GList *l;
+
+        if (io->msg_io && io->msg_io->msg == msg)
+                return io->msg_io;
+
+        for (l = io->pipeline.head; l; l = l->next) {
+                SoupMessageIOHTTP1 *msg_io = l->data;
+
+                if (msg_io->msg == msg)
+                        return msg_io;
+        }
+
+        return NULL;
+}
+
 static void
 soup_server_message_io_http1_destroy (SoupServerMessageIO *iface)
 {
         SoupServerMessageIOHTTP1 *io = (SoupServerMessageIOHTTP1 *)iface;
+        SoupMessageIOHTTP1 *msg_io;
 
         g_clear_object (&io->iostream);
         g_clear_pointer (&io->msg_io, soup_message_io_http1_free);
 
+        /* Requests read ahead will never get a response */
+        while ((msg_io = g_queue_peek_head (&io->pipeline))) {
+                SoupServerMessage *msg = g_object_ref (msg_io->msg);
+                SoupMessageIOCompletionFn completion_cb = msg_io->base.completion_cb;
+                gpointer completion_data = msg_io->base.completion_data;
+
+                if (completion_cb)
+                        completion_cb (G_OBJECT (msg), SOUP_MESSAGE_IO_INTERRUPTED, completion_data);
+                g_queue_remove (&io->pipeline, msg_io);
+                soup_message_io_http1_free (msg_io);
+                g_object_unref (msg);
+        }
+
         g_slice_free (SoupServerMessageIOHTTP1, io);
 }
 
@@ -126,7 +180,14 @@ soup_server_message_io_http1_finished (SoupServerMessageIO *iface,
 	if (completion_cb) {
                 completion_cb (G_OBJECT (msg), completion, completion_data);
                 if (soup_server_connection_is_connected (conn)) {
-                        io->msg_io = soup_message_io_http1_new (soup_server_message_new (conn));
+                        /* Continue with the next pipelined request, if any */
+                        io->msg_io = g_queue_pop_head (&io->pipeline);
+                        if (!io->msg_io)
+                                io->msg_io = soup_message_io_http1_new (soup_server_message_new (conn));
+                        else if (io->msg_io->base.io_source) {
+                                g_source_destroy (io->msg_io->base.io_source);
+                                g_clear_pointer (&io->msg_io->base.io_source, g_source_unref);
+                        }
                         io->msg_io->base.io_source = soup_message_io_data_get_source (&io->msg_io->base,
                                                                                       G_OBJECT (io->msg_io->msg),
                                                                                       io->istream,
@@ -161,6 +222,7 @@ soup_server_message_io_http1_steal (SoupServerMessageIO *iface)
         msg = io->msg_io->msg;
         g_object_ref (msg);
         g_clear_pointer (&io->msg_io, soup_message_io_http1_free);
+        /* Pipelined requests are aborted when @io is destroyed */
         if (completion_cb)
                 completion_cb (G_OBJECT (msg), SOUP_MESSAGE_IO_STOLEN, completion_data);
         g_object_unref (msg);
@@ -263,7 +325,14 @@ handle_partial_get (SoupServerMessage *msg)
         } else if (status != SOUP_STATUS_PARTIAL_CONTENT)
                 return;
 
-        full_response = soup_message_body_flatten (response_body);
+        /* Avoid copying the body when it's a single chunk, so that
+         * file responses are still served from the mapped file.
+         */
+        full_response = soup_message_body_get_chunk (response_body, 0);
+        if (full_response && g_bytes_get_size (full_response) != (gsize)response_body->length)
+                g_clear_pointer (&full_response, g_bytes_unref);
+        if (!full_response)
+                full_response = soup_message_body_flatten (response_body);
         if (!full_response) {
                 soup_message_headers_free_ranges (request_headers, ranges);
                 return;
@@ -330,6 +399,66 @@ handle_partial_get (SoupServerMessage *msg)
         soup_message_headers_free_ranges (request_headers, ranges);
 }
 
+/* Status lines for the status codes libsoup knows about, for both
+ * HTTP/1.0 and HTTP/1.1, so they don't need to be formatted again for
+ * every response that uses the default reason phrase.
+ */
+#define STATUS_LINE_MIN 100
+#define STATUS_LINE_MAX 599
+
+typedef struct {
+        const char *reason_phrase;
+        char *line[2];
+        gsize line_len;
+} StatusLine;
+
+static StatusLine *
+get_status_lines (void)
+{
+        static StatusLine *status_lines = NULL;
+
+        if (g_once_init_enter (&status_lines)) {
+                StatusLine *lines = g_new0 (StatusLine, STATUS_LINE_MAX - STATUS_LINE_MIN + 1);
+                guint code;
+
+                for (code = STATUS_LINE_MIN; code <= STATUS_LINE_MAX; code++) {
+                        StatusLine *line = &lines[code - STATUS_LINE_MIN];
+                        const char *phrase = soup_status_get_phrase (code);
+
+                        if (!strcmp (phrase, "Unknown Error"))
+                                continue;
+
+                        line->reason_phrase = phrase;
+                        line->line[0] = g_strdup_printf ("HTTP/1.0 %u %s\r\n", code, phrase);
+                        line->line[1] = g_strdup_printf ("HTTP/1.1 %u %s\r\n", code, phrase);
+                        line->line_len = strlen (line->line[0]);
+                }
+
+                g_once_init_leave (&status_lines, lines);
+        }
+
+        return status_lines;
+}
+
+static const StatusLine *
+get_status_line (guint       status_code,
+                 const char *reason_phrase)
+{
+        const StatusLine *line;
+
+        if (status_code < STATUS_LINE_MIN || status_code > STATUS_LINE_MAX)
+                return NULL;
+
+        line = &get_status_lines ()[status_code - STATUS_LINE_MIN];
+        if (!line->reason_phrase)
+                return NULL;
+        if (reason_phrase && reason_phrase != line->reason_phrase &&
+            strcmp (reason_phrase, line->reason_phrase) != 0)
+                return NULL;
+
+        return line;
+}
+
 static void
 write_headers (SoupServerMessage  *msg,
                GString            *headers,
@@ -342,19 +471,22 @@ write_headers (SoupServerMessage  *msg,
 	const char *reason_phrase;
 	const char *method;
 	SoupMessageHeaders *response_headers;
+        SoupMessageHeaders *template;
+        GBytes *template_bytes = NULL;
+        const StatusLine *status_line;
+        SoupHTTPVersion version;
+        gsize headers_len;
 
         if (soup_server_message_get_status (msg) == 0)
                 soup_server_message_set_status (msg, SOUP_STATUS_INTERNAL_SERVER_ERROR, NULL);
 
         handle_partial_get (msg);
+        version = soup_server_message_get_http_version (msg);
+        soup_server_message_prepare_response (msg, version == SOUP_HTTP_1_1);
 
 	status_code = soup_server_message_get_status (msg);
         reason_phrase = soup_server_message_get_reason_phrase (msg);
 
-        g_string_append_printf (headers, "HTTP/1.%c %d %s\r\n",
-				soup_server_message_get_http_version (msg) == SOUP_HTTP_1_0 ? '0' : '1',
-				status_code, reason_phrase);
-
 	method = soup_server_message_get_method (msg);
 	response_headers = soup_server_message_get_response_headers (msg);
         claimed_encoding = soup_message_headers_get_encoding (response_headers);
@@ -385,12 +517,151 @@ write_headers (SoupServerMessage  *msg,
                                                          response_body->length);
         }
 
+        template = soup_server_message_get_response_headers_template (msg);
+        if (template)
+                template_bytes = soup_message_headers_get_serialized (template);
+
+        /* Work out the size of the whole header block first, so that
+         * @headers only has to be allocated once.
+         */
+        status_line = get_status_line (status_code, reason_phrase);
+        if (status_line)
+                headers_len = status_line->line_len;
+        else
+                headers_len = strlen ("HTTP/1.x 000 \r\n") + (reason_phrase ? strlen (reason_phrase) : 0);
         soup_message_headers_iter_init (&iter, response_headers);
         while (soup_message_headers_iter_next (&iter, &name, &value))
-                g_string_append_printf (headers, "%s: %s\r\n", name, value);
-        g_string_append (headers, "\r\n");
+                headers_len += strlen (name) + strlen (value) + 4;
+        if (template_bytes)
+                headers_len += g_bytes_get_size (template_bytes);
+        headers_len += 2;
+
+        if (headers->allocated_len <= headers->len + headers_len) {
+                gsize len = headers->len;
+
+                g_string_set_size (headers, len + headers_len);
+                g_string_truncate (headers, len);
+        }
+
+        if (status_line) {
+                g_string_append_len (headers, status_line->line[version == SOUP_HTTP_1_0 ? 0 : 1],
+                                     status_line->line_len);
+        } else {
+                g_string_append_printf (headers, "HTTP/1.%c %d %s\r\n",
+                                        version == SOUP_HTTP_1_0 ? '0' : '1',
+                                        status_code, reason_phrase);
+        }
+
+        soup_message_headers_iter_init (&iter, response_headers);
+        while (soup_message_headers_iter_next (&iter, &name, &value)) {
+                g_string_append (headers, name);
+                g_string_append_len (headers, ": ", 2);
+                g_string_append (headers, value);
+                g_string_append_len (headers, "\r\n", 2);
+        }
+        if (template_bytes) {
+                gsize size;
+                gconstpointer data = g_bytes_get_data (template_bytes, &size);
+
+                g_string_append_len (headers, data, size);
+                g_bytes_unref (template_bytes);
+        }
+        g_string_append_len (headers, "\r\n", 2);
 }
 
+#ifdef HAVE_SENDFILE
+/* The body of a file response can be written straight from the file
+ * to the socket when it's sent as-is over a plain connection.
+ */
+static gboolean
+response_can_use_sendfile (SoupServerMessage *msg,
+                           SoupMessageIOData *io)
+{
+        SoupServerConnection *conn;
+        SoupServerFile *file;
+        SoupMessageBody *response_body;
+        GBytes *chunk;
+        goffset offset;
+        gboolean can_use;
+
+        file = soup_server_message_get_response_file (msg);
+        if (!file ||
+            io->write_encoding != SOUP_ENCODING_CONTENT_LENGTH ||
+            !io->write_length)
+                return FALSE;
+
+        conn = soup_server_message_get_connection (msg);
+        if (soup_server_connection_is_ssl (conn) ||
+            !soup_server_connection_get_socket (conn))
+                return FALSE;
+
+        response_body = soup_server_message_get_response_body (msg);
+        chunk = soup_message_body_get_chunk (response_body, 0);
+        if (!chunk)
+                return FALSE;
+
+        can_use = g_bytes_get_size (chunk) == (gsize)response_body->length &&
+                g_bytes_get_size (chunk) <= (gsize)io->write_length &&
+                soup_server_file_get_offset (file, chunk, &offset);
+        g_bytes_unref (chunk);
+
+        return can_use;
+}
+
+static gssize
+write_chunk_with_sendfile (SoupServerMessageIOHTTP1 *server_io,
+                           GError                  **error)
+{
+        SoupServerMessage *msg = server_io->msg_io->msg;
+        SoupMessageIOData *io = &server_io->msg_io->base;
+        SoupServerFile *file;
+        GSocket *socket;
+        goffset chunk_offset;
+        off_t offset;
+        gssize nwrote;
+
+        file = soup_server_message_get_response_file (msg);
+        if (!soup_server_file_get_offset (file, server_io->msg_io->write_chunk, &chunk_offset)) {
+                g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                                     _("Response body is not part of the response file"));
+                return -1;
+        }
+
+        socket = soup_server_connection_get_socket (soup_server_message_get_connection (msg));
+        offset = chunk_offset + io->written;
+        do {
+                nwrote = sendfile (g_socket_get_fd (socket),
+                                   soup_server_file_get_fd (file),
+                                   &offset,
+                                   g_bytes_get_size (server_io->msg_io->write_chunk) - io->written);
+        } while (nwrote == -1 && errno == EINTR);
+
+        if (nwrote == -1) {
+                int errsv = errno;
+
+                if (errsv == EAGAIN || errsv == EWOULDBLOCK) {
+                        g_set_error_literal (error, G_IO_ERROR,
+                                             G_IO_ERROR_WOULD_BLOCK,
+                                             _("Operation would block"));
+                } else {
+                        g_set_error_literal (error, G_IO_ERROR,
+                                             g_io_error_from_errno (errsv),
+                                             g_strerror (errsv));
+                }
+                return -1;
+        }
+
+        if (nwrote == 0) {
+                g_set_error_literal (error, G_IO_ERROR,
+                                     G_IO_ERROR_PARTIAL_INPUT,
+                                     _("Response file was truncated"));
+                return -1;
+        }
+
+        return nwrote;
+}
+#endif
+
 /* Attempts to push forward the writing side of @msg's I/O. Returns
  * %TRUE if it manages to make some progress, and it is likely that
  * further progress can be made. Returns %FALSE if it has reached a
@@ -428,8 +699,20 @@ io_write (SoupServerMessageIOHTTP1 *server_io,
                         soup_server_message_set_status (msg, SOUP_STATUS_CONTINUE, NULL);
                 }
 
-                if (!io->write_buf->len)
+                if (!io->write_buf->len) {
+                        /* If the handler didn't read the whole request body
+                         * we can't find where the next request starts, so
+                         * the connection can't be reused.
+                         */
+                        if (server_io->msg_io->request_body_streamed &&
+                            !SOUP_STATUS_IS_INFORMATIONAL (soup_server_message_get_status (msg)) &&
+                            !soup_body_input_stream_is_eof (SOUP_BODY_INPUT_STREAM (io->body_istream))) {
+                                soup_message_headers_replace_common (soup_server_message_get_response_headers (msg),
+                                                                     SOUP_HEADER_CONNECTION, "close");
+                        }
+
                         write_headers (msg, io->write_buf, &io->write_encoding);
+                }
 
                 while (io->written < io->write_buf->len) {
                         nwrote = g_pollable_stream_write (server_io->ostream,
@@ -492,6 +775,9 @@ io_write (SoupServerMessageIOHTTP1 *server_io,
                 io->body_ostream = soup_body_output_stream_new (server_io->ostream,
                                                                 io->write_encoding,
                                                                 io->write_length);
+#ifdef HAVE_SENDFILE
+                server_io->msg_io->use_sendfile = response_can_use_sendfile (msg, io);
+#endif
                 io->write_state = SOUP_MESSAGE_IO_STATE_BODY;
                 break;
 
@@ -510,26 +796,41 @@ io_write (SoupServerMessageIOHTTP1 *server_io,
                                 soup_server_message_pause (msg);
                                 return FALSE;
                         }
-                        if (!g_bytes_get_size (server_io->msg_io->write_chunk)) {
-                                io->write_state = SOUP_MESSAGE_IO_STATE_BODY_FLUSH;
+
+                        /* This is the chunk itself unless the response is
+                         * being compressed as it's written.
+                         */
+                        server_io->msg_io->write_data = soup_server_message_encode_response_chunk (msg, server_io->msg_io->write_chunk, error);
+                        if (!server_io->msg_io->write_data)
+                                return FALSE;
+                        if (!g_bytes_get_size (server_io->msg_io->write_data)) {
+                                if (g_bytes_get_size (server_io->msg_io->write_chunk))
+                                        io->write_state = SOUP_MESSAGE_IO_STATE_BODY_DATA;
+                                else
+                                        io->write_state = SOUP_MESSAGE_IO_STATE_BODY_FLUSH;
                                 break;
                         }
                 }
 
+#ifdef HAVE_SENDFILE
+                if (server_io->msg_io->use_sendfile)
+                        nwrote = write_chunk_with_sendfile (server_io, error);
+                else
+#endif
                 nwrote = g_pollable_stream_write (io->body_ostream,
-                                                  (guchar*)g_bytes_get_data (server_io->msg_io->write_chunk, NULL) + io->written,
-                                                  g_bytes_get_size (server_io->msg_io->write_chunk) - io->written,
+                                                  (guchar*)g_bytes_get_data (server_io->msg_io->write_data, NULL) + io->written,
+                                                  g_bytes_get_size (server_io->msg_io->write_data) - io->written,
                                                   FALSE,
                                                   NULL, error);
                 if (nwrote == -1)
                         return FALSE;
 
-                chunk = g_bytes_new_from_bytes (server_io->msg_io->write_chunk, io->written, nwrote);
+                chunk = g_bytes_new_from_bytes (server_io->msg_io->write_data, io->written, nwrote);
                 io->written += nwrote;
                 if (io->write_length)
                         io->write_length -= nwrote;
 
-                if (io->written == g_bytes_get_size (server_io->msg_io->write_chunk))
+                if (io->written == g_bytes_get_size (server_io->msg_io->write_data))
                         io->write_state = SOUP_MESSAGE_IO_STATE_BODY_DATA;
 
                 soup_server_message_wrote_body_data (msg, g_bytes_get_size (chunk));
@@ -547,6 +848,7 @@ io_write (SoupServerMessageIOHTTP1 *server_io,
 					       server_io->msg_io->write_chunk);
                 server_io->msg_io->write_body_offset += g_bytes_get_size (server_io->msg_io->write_chunk);
                 g_clear_pointer (&server_io->msg_io->write_chunk, g_bytes_unref);
+                g_clear_pointer (&server_io->msg_io->write_data, g_bytes_unref);
 
                 io->write_state = SOUP_MESSAGE_IO_STATE_BODY;
                 soup_server_message_wrote_chunk (msg);
@@ -720,10 +1022,11 @@ parse_headers (SoupServerMessage *msg,
  */
 static gboolean
 io_read (SoupServerMessageIOHTTP1 *server_io,
+         SoupMessageIOHTTP1       *msg_io,
          GError                  **error)
 {
-        SoupServerMessage *msg = server_io->msg_io->msg;
-	SoupMessageIOData *io = &server_io->msg_io->base;
+        SoupServerMessage *msg = msg_io->msg;
+	SoupMessageIOData *io = &msg_io->base;
         gssize nread;
         guint status;
 	SoupMessageHeaders *request_headers;
@@ -794,6 +1097,12 @@ io_read (SoupServerMessageIOHTTP1 *server_io,
 
                 }
 
+                if (msg_io->request_body_streamed) {
+                        /* The handler reads the body from the stream */
+                        io->read_state = SOUP_MESSAGE_IO_STATE_BODY_DONE;
+                        break;
+                }
+
                 io->read_state = SOUP_MESSAGE_IO_STATE_BODY;
                 break;
 
@@ -843,6 +1152,118 @@ io_read (SoupServerMessageIOHTTP1 *server_io,
         return TRUE;
 }
 
+/* Requests pipelined by the client are read, and their handlers run,
+ * while the response to the previous one is still being written, so
+ * that a slow response doesn't delay the ones after it. At most
+ * PIPELINE_MAX_REQUESTS are read ahead, and their responses are only
+ * written once they get to the head of the queue, so they are still
+ * sent in order.
+ */
+static gboolean
+can_read_after (SoupMessageIOHTTP1 *msg_io)
+{
+        SoupServerMessage *msg = msg_io->msg;
+        SoupMessageHeaders *request_headers;
+        const char *method;
+
+        /* The request body must have been read already to know where
+         * the next request starts.
+         */
+        if (msg_io->base.read_state < SOUP_MESSAGE_IO_STATE_FINISHING ||
+            msg_io->request_body_streamed ||
+            msg_io->read_error)
+                return FALSE;
+
+        /* Only run handlers early after requests with safe methods,
+         * as the result of the others might affect later requests.
+         */
+        method = soup_server_message_get_method (msg);
+        if (soup_server_message_get_http_version (msg) != SOUP_HTTP_1_1 ||
+            (method != SOUP_METHOD_GET && method != SOUP_METHOD_HEAD && method != SOUP_METHOD_OPTIONS))
+                return FALSE;
+
+        /* Nothing can follow a request that closes or upgrades the connection */
+        request_headers = soup_server_message_get_request_headers (msg);
+        if (soup_message_headers_header_contains_common (request_headers, SOUP_HEADER_CONNECTION, "close") ||
+            soup_message_headers_get_one_common (request_headers, SOUP_HEADER_UPGRADE))
+                return FALSE;
+
+        return TRUE;
+}
+
+static gboolean
+io_read_ahead_ready (SoupServerMessage *msg,
+                     gpointer           user_data)
+{
+        SoupServerMessageIOHTTP1 *io = (SoupServerMessageIOHTTP1 *)soup_server_message_get_io_data (msg);
+        SoupMessageIOHTTP1 *msg_io = lookup_msg_io (io, msg);
+
+        g_clear_pointer (&msg_io->base.io_source, g_source_unref);
+        io_read_ahead (io);
+        return FALSE;
+}
+
+static void
+io_read_ahead (SoupServerMessageIOHTTP1 *server_io)
+{
+        SoupMessageIOHTTP1 *msg_io;
+        SoupServerMessage *msg;
+        GError *error = NULL;
+        gboolean progress;
+
+        if (server_io->in_io_run || server_io->in_read_ahead || !server_io->msg_io)
+                return;
+
+        server_io->in_read_ahead = TRUE;
+        while (TRUE) {
+                msg_io = g_queue_peek_tail (&server_io->pipeline);
+                if (!msg_io || msg_io->base.read_state >= SOUP_MESSAGE_IO_STATE_FINISHING) {
+                        if (!can_read_after (msg_io ? msg_io : server_io->msg_io) ||
+                            server_io->pipeline.length >= PIPELINE_MAX_REQUESTS)
+                                break;
+
+                        msg_io = soup_message_io_http1_new (soup_server_message_new (soup_server_message_get_connection (server_io->msg_io->msg)));
+                        g_queue_push_tail (&server_io->pipeline, msg_io);
+                }
+
+                /* Already waiting for input, for the application, or
+                 * to send "100 Continue", which can't happen until
+                 * the previous responses have been written.
+                 */
+                if (msg_io->base.io_source || msg_io->base.paused ||
+                    !SOUP_MESSAGE_IO_STATE_ACTIVE (msg_io->base.read_state))
+                        break;
+
+                msg = g_object_ref (msg_io->msg);
+                progress = io_read (server_io, msg_io, &error);
+                if (soup_server_message_get_io_data (msg) != (SoupServerMessageIO *)server_io) {
+                        g_object_unref (msg);
+                        g_clear_error (&error);
+                        return;
+                }
+                g_object_unref (msg);
+
+                if (progress)
+                        continue;
+
+                if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK)) {
+                        g_clear_error (&error);
+                        msg_io->base.io_source = soup_message_io_data_get_source (&msg_io->base, G_OBJECT (msg_io->msg),
+                                                                                  server_io->istream,
+                                                                                  NULL,
+                                                                                  NULL,
+                                                                                  (SoupMessageIOSourceFunc)io_read_ahead_ready,
+                                                                                  NULL);
+                        g_source_attach (msg_io->base.io_source, msg_io->async_context);
+                } else {
+                        /* Reported once the request gets to the head of the queue */
+                        msg_io->read_error = g_steal_pointer (&error);
+                }
+                break;
+        }
+        server_io->in_read_ahead = FALSE;
+}
+
 static gboolean
 io_run_until (SoupServerMessageIOHTTP1 *server_io,
               SoupMessageIOState        read_state,
@@ -857,13 +1278,19 @@ io_run_until (SoupServerMessageIOHTTP1 *server_io,
         if (!io)
                 return FALSE;
 
+        /* A pipelined request that failed to be read */
+        if (server_io->msg_io->read_error) {
+                g_propagate_error (error, g_steal_pointer (&server_io->msg_io->read_error));
+                return FALSE;
+        }
+
         g_object_ref (msg);
 
         while (progress && soup_server_message_get_io_data (msg) == (SoupServerMessageIO *)server_io && !io->paused && !io->async_wait &&
                (io->read_state < read_state || io->write_state < write_state)) {
 
                 if (SOUP_MESSAGE_IO_STATE_ACTIVE (io->read_state))
-                        progress = io_read (server_io, &my_error);
+                        progress = io_read (server_io, server_io->msg_io, &my_error);
                 else if (SOUP_MESSAGE_IO_STATE_ACTIVE (io->write_state))
                         progress = io_write (server_io, &my_error);
                 else
@@ -947,6 +1374,9 @@ io_run (SoupServerMessageIOHTTP1 *server_io)
 								 (SoupMessageIOSourceFunc)io_run_ready,
 								 NULL);
                 g_source_attach (io->io_source, server_io->msg_io->async_context);
+
+                /* While waiting, read the requests the client pipelined */
+                io_read_ahead (server_io);
         } else if (soup_server_message_get_io_data (msg) == (SoupServerMessageIO *)server_io) {
 		soup_server_message_set_status (msg, SOUP_STATUS_INTERNAL_SERVER_ERROR, error ? error->message : NULL);
 		soup_server_message_finish (msg);
@@ -962,14 +1392,15 @@ soup_server_message_io_http1_read_request (SoupServerMessageIO      *iface,
                                            gpointer                  user_data)
 {
         SoupServerMessageIOHTTP1 *io = (SoupServerMessageIOHTTP1 *)iface;
-        SoupMessageIOHTTP1 *msg_io = io->msg_io;
+        SoupMessageIOHTTP1 *msg_io = lookup_msg_io (io, msg);
 
-        g_assert (msg_io->msg == msg);
+        g_assert (msg_io);
 
         msg_io->base.completion_cb = completion_cb;
         msg_io->base.completion_data = user_data;
 
-        if (!io->in_io_run)
+        /* Pipelined requests keep being read by io_read_ahead() */
+        if (msg_io == io->msg_io && !io->in_io_run)
                 io_run (io);
 }
 
@@ -978,25 +1409,38 @@ soup_server_message_io_http1_pause (SoupServerMessageIO *iface,
                                     SoupServerMessage   *msg)
 {
         SoupServerMessageIOHTTP1 *io = (SoupServerMessageIOHTTP1 *)iface;
+        SoupMessageIOHTTP1 *msg_io = lookup_msg_io (io, msg);
 
-        g_assert (io->msg_io && io->msg_io->msg == msg);
+        g_assert (msg_io);
 
-	if (io->msg_io->unpause_source) {
-                g_source_destroy (io->msg_io->unpause_source);
-                g_clear_pointer (&io->msg_io->unpause_source, g_source_unref);
+	if (msg_io->unpause_source) {
+                g_source_destroy (msg_io->unpause_source);
+                g_clear_pointer (&msg_io->unpause_source, g_source_unref);
 	}
 
-	soup_message_io_data_pause (&io->msg_io->base);
+	soup_message_io_data_pause (&msg_io->base);
 }
 
 static gboolean
-io_unpause_internal (SoupServerMessageIOHTTP1 *io)
+io_unpause_internal (SoupMessageIOHTTP1 *msg_io)
 {
-	g_assert (io != NULL && io->msg_io != NULL);
+        SoupServerMessageIOHTTP1 *io;
+
+	g_assert (msg_io != NULL);
+
+	g_clear_pointer (&msg_io->unpause_source, g_source_unref);
+	soup_message_io_data_unpause (&msg_io->base);
 
-	g_clear_pointer (&io->msg_io->unpause_source, g_source_unref);
-	soup_message_io_data_unpause (&io->msg_io->base);
-        if (io->msg_io->base.io_source)
+        io = (SoupServerMessageIOHTTP1 *)soup_server_message_get_io_data (msg_io->msg);
+        if (msg_io != io->msg_io) {
+                /* A pipelined request, its response will be written
+                 * once it's at the head of the queue.
+                 */
+                io_read_ahead (io);
+                return FALSE;
+        }
+
+        if (msg_io->base.io_source)
 		return FALSE;
 
         io_run (io);
@@ -1008,13 +1452,14 @@ soup_server_message_io_http1_unpause (SoupServerMessageIO *iface,
                                       SoupServerMessage   *msg)
 {
         SoupServerMessageIOHTTP1 *io = (SoupServerMessageIOHTTP1 *)iface;
+        SoupMessageIOHTTP1 *msg_io = lookup_msg_io (io, msg);
 
-        g_assert (io->msg_io && io->msg_io->msg == msg);
+        g_assert (msg_io);
 
-        if (!io->msg_io->unpause_source) {
-	        io->msg_io->unpause_source = soup_add_completion_reffed (io->msg_io->async_context,
-                                                                         (GSourceFunc)io_unpause_internal,
-                                                                         io, NULL);
+        if (!msg_io->unpause_source) {
+	        msg_io->unpause_source = soup_add_completion_reffed (msg_io->async_context,
+                                                                     (GSourceFunc)io_unpause_internal,
+                                                                     msg_io, NULL);
         }
 }
 
@@ -1023,10 +1468,40 @@ soup_server_message_io_http1_is_paused (SoupServerMessageIO *iface,
                                         SoupServerMessage   *msg)
 {
         SoupServerMessageIOHTTP1 *io = (SoupServerMessageIOHTTP1 *)iface;
+        SoupMessageIOHTTP1 *msg_io = lookup_msg_io (io, msg);
+
+        g_assert (msg_io);
 
-        g_assert (io->msg_io && io->msg_io->msg == msg);
+	return msg_io->base.paused;
+}
+
+static GInputStream *
+soup_server_message_io_http1_get_request_body_stream (SoupServerMessageIO *iface,
+                                                      SoupServerMessage   *msg)
+{
+        SoupServerMessageIOHTTP1 *io = (SoupServerMessageIOHTTP1 *)iface;
+        SoupMessageIOHTTP1 *http1_msg_io = lookup_msg_io (io, msg);
+        SoupMessageIOData *msg_io;
+
+        g_assert (http1_msg_io);
+
+        msg_io = &http1_msg_io->base;
+        if (http1_msg_io->request_body_streamed)
+                return msg_io->body_istream;
+
+        /* The body can only be handed over before we start reading it */
+        if (msg_io->read_state != SOUP_MESSAGE_IO_STATE_BLOCKING &&
+            msg_io->read_state != SOUP_MESSAGE_IO_STATE_BODY_START)
+                return NULL;
+
+        if (!msg_io->body_istream) {
+                msg_io->body_istream = soup_body_input_stream_new (io->istream,
+                                                                   msg_io->read_encoding,
+                                                                   msg_io->read_length);
+        }
+        http1_msg_io->request_body_streamed = TRUE;
 
-	return io->msg_io->base.paused;
+        return msg_io->body_istream;
 }
 
 static const SoupServerMessageIOFuncs io_funcs = {
@@ -1036,7 +1511,8 @@ static const SoupServerMessageIOFuncs io_funcs = {
         soup_server_message_io_http1_read_request,
         soup_server_message_io_http1_pause,
         soup_server_message_io_http1_unpause,
-        soup_server_message_io_http1_is_paused
+        soup_server_message_io_http1_is_paused,
+        soup_server_message_io_http1_get_request_body_stream
 };
 
 SoupServerMessageIO *
@@ -1058,6 +1534,7 @@ soup_server_message_io_http1_new (SoupServerConnection  *conn,
         io->iface.funcs = &io_funcs;
 
         io->msg_io = soup_message_io_http1_new (msg);
+        g_queue_init (&io->pipeline);
 
         return (SoupServerMessageIO *)io;
 }
@@ -17,6 +17,7 @@
 #include "soup-server-message-io-http2.h"
 #include "soup.h"
 #include "soup-body-input-stream.h"
+#include "soup-body-input-stream-http2.h"
 #include "soup-body-output-stream.h"
 #include "soup-filter-input-stream.h"
 #include "soup-message-io-data.h"
@@ -42,6 +43,9 @@ typedef struct {
         GBytes *write_chunk;
         goffset write_offset;
         goffset chunk_written;
+
+        GInputStream *body_istream;
+        gsize body_unconsumed;
 } SoupMessageIOHTTP2;
 
 typedef struct {
@@ -72,6 +76,7 @@ typedef struct {
 
 static void soup_server_message_io_http2_send_response (SoupServerMessageIOHTTP2 *io,
                                                         SoupMessageIOHTTP2       *msg_io);
+static void io_try_write (SoupServerMessageIOHTTP2 *io);
 
 G_GNUC_PRINTF(3, 0)
 static void
@@ -132,6 +137,11 @@ soup_message_io_http2_free (SoupMessageIOHTTP2 *msg_io)
                 g_source_destroy (msg_io->unpause_source);
                 g_source_unref (msg_io->unpause_source);
         }
+        if (msg_io->body_istream) {
+                g_signal_handlers_disconnect_by_data (msg_io->body_istream, msg_io);
+                soup_body_input_stream_http2_complete (SOUP_BODY_INPUT_STREAM_HTTP2 (msg_io->body_istream));
+                g_object_unref (msg_io->body_istream);
+        }
         g_clear_object (&msg_io->msg);
         g_free (msg_io->scheme);
         g_free (msg_io->authority);
@@ -179,6 +189,14 @@ soup_server_message_io_http2_finished (SoupServerMessageIO *iface,
         completion_cb = msg_io->completion_cb;
         completion_data = msg_io->completion_data;
 
+        /* Give back the connection window held by request body
+         * data that the handler never read.
+         */
+        if (msg_io->body_unconsumed > 0) {
+                nghttp2_session_consume_connection (io->session, msg_io->body_unconsumed);
+                io_try_write (io);
+        }
+
         g_object_ref (msg);
         soup_message_io_http2_free (msg_io);
 
@@ -306,6 +324,51 @@ soup_server_message_io_http2_is_paused (SoupServerMessageIO *iface,
         return msg_io->paused;
 }
 
+static void
+request_body_stream_read_data (SoupBodyInputStreamHttp2 *stream,
+                               guint64                   bytes_read,
+                               SoupMessageIOHTTP2       *msg_io)
+{
+        SoupServerMessageIOHTTP2 *io;
+
+        io = (SoupServerMessageIOHTTP2 *)soup_server_message_get_io_data (msg_io->msg);
+        if (!io)
+                return;
+
+        /* Only open the flow control window once the handler has
+         * actually consumed the data.
+         */
+        msg_io->body_unconsumed -= bytes_read;
+        nghttp2_session_consume (io->session, msg_io->stream_id, bytes_read);
+        io_try_write (io);
+}
+
+static GInputStream *
+soup_server_message_io_http2_get_request_body_stream (SoupServerMessageIO *iface,
+                                                      SoupServerMessage   *msg)
+{
+        SoupServerMessageIOHTTP2 *io = (SoupServerMessageIOHTTP2 *)iface;
+        SoupMessageIOHTTP2 *msg_io;
+
+        msg_io = g_hash_table_lookup (io->messages, msg);
+        g_assert (msg_io);
+
+        if (msg_io->body_istream)
+                return msg_io->body_istream;
+
+        /* The body can only be handed over before we start reading it */
+        if (msg_io->state != STATE_READ_DATA)
+                return NULL;
+
+        h2_debug (io, msg_io, "[SESSION] Streaming request body");
+
+        msg_io->body_istream = soup_body_input_stream_http2_new ();
+        g_signal_connect (msg_io->body_istream, "read-data",
+                          G_CALLBACK (request_body_stream_read_data), msg_io);
+
+        return msg_io->body_istream;
+}
+
 static const SoupServerMessageIOFuncs io_funcs = {
         soup_server_message_io_http2_destroy,
         soup_server_message_io_http2_finished,
@@ -313,7 +376,8 @@ static const SoupServerMessageIOFuncs io_funcs = {
         soup_server_message_io_http2_read_request,
         soup_server_message_io_http2_pause,
         soup_server_message_io_http2_unpause,
-        soup_server_message_io_http2_is_paused
+        soup_server_message_io_http2_is_paused,
+        soup_server_message_io_http2_get_request_body_stream
 };
 
 static gboolean
@@ -602,6 +666,15 @@ on_data_chunk_recv_callback (nghttp2_session *session,
 
         io->in_callback++;
 
+        if (msg_io->body_istream) {
+                msg_io->body_unconsumed += len;
+                soup_body_input_stream_http2_add_data (SOUP_BODY_INPUT_STREAM_HTTP2 (msg_io->body_istream), data, len);
+                io->in_callback--;
+                return 0;
+        }
+
+        nghttp2_session_consume (session, stream_id, len);
+
         bytes = g_bytes_new (data, len);
         soup_message_body_got_chunk (soup_server_message_get_request_body (msg_io->msg), bytes);
         soup_server_message_got_chunk (msg_io->msg, bytes);
@@ -683,6 +756,8 @@ soup_server_message_io_http2_send_response (SoupServerMessageIOHTTP2 *io,
                 status_code = SOUP_STATUS_INTERNAL_SERVER_ERROR;
                 soup_server_message_set_status (msg, status_code, NULL);
         }
+        soup_server_message_prepare_response (msg, FALSE);
+
         char *status = g_strdup_printf ("%u", status_code);
         const nghttp2_nv status_nv = MAKE_NV2 (":status", status);
         g_array_append_val (headers, status_nv);
@@ -705,6 +780,15 @@ soup_server_message_io_http2_send_response (SoupServerMessageIOHTTP2 *io,
                 g_array_append_val (headers, nv);
         }
 
+        SoupMessageHeaders *template = soup_server_message_get_response_headers_template (msg);
+        if (template) {
+                soup_message_headers_iter_init (&iter, template);
+                while (soup_message_headers_iter_next (&iter, &name, &value)) {
+                        const nghttp2_nv nv = MAKE_NV2 (name, value);
+                        g_array_append_val (headers, nv);
+                }
+        }
+
         advance_state_from (msg_io, STATE_READ_DONE, STATE_WRITE_HEADERS);
 
         nghttp2_data_provider data_provider;
@@ -744,9 +828,28 @@ on_frame_recv_callback (nghttp2_session     *session,
 
                 advance_state_from (msg_io, STATE_READ_HEADERS, STATE_READ_DATA);
                 soup_server_message_got_headers (msg_io->msg);
+
+                if (msg_io->body_istream) {
+                        /* The handler reads the body from the stream, so it
+                         * can run right away.
+                         */
+                        if (frame->hd.flags & NGHTTP2_FLAG_END_STREAM)
+                                soup_body_input_stream_http2_complete (SOUP_BODY_INPUT_STREAM_HTTP2 (msg_io->body_istream));
+                        advance_state_from (msg_io, STATE_READ_DATA, STATE_READ_DONE);
+                        soup_server_message_got_body (msg_io->msg);
+                        soup_server_message_io_http2_send_response (io, msg_io);
+                        io->in_callback--;
+                        return 0;
+                }
                 break;
         }
         case NGHTTP2_DATA:
+                if (msg_io->body_istream) {
+                        if (frame->hd.flags & NGHTTP2_FLAG_END_STREAM)
+                                soup_body_input_stream_http2_complete (SOUP_BODY_INPUT_STREAM_HTTP2 (msg_io->body_istream));
+                        io->in_callback--;
+                        return 0;
+                }
                 break;
         default:
                 io->in_callback--;
@@ -788,6 +891,12 @@ on_frame_send_callback (nghttp2_session     *session,
                 if (frame->hd.flags & NGHTTP2_FLAG_END_STREAM) {
                         advance_state_from (msg_io, STATE_WRITE_DATA, STATE_WRITE_DONE);
                         soup_server_message_wrote_body (msg_io->msg);
+
+                        /* The response is complete but the client is still
+                         * sending a body that nobody is going to read.
+                         */
+                        if (msg_io->body_istream && !nghttp2_session_get_stream_remote_close (session, frame->hd.stream_id))
+                                nghttp2_submit_rst_stream (session, NGHTTP2_FLAG_NONE, frame->hd.stream_id, NGHTTP2_NO_ERROR);
                 }
                 break;
         default:
@@ -814,6 +923,9 @@ on_stream_close_callback (nghttp2_session *session,
 
         io->in_callback++;
 
+        if (msg_io->body_istream)
+                soup_body_input_stream_http2_complete (SOUP_BODY_INPUT_STREAM_HTTP2 (msg_io->body_istream));
+
         if (!msg_io->paused)
                 soup_server_message_finish (msg_io->msg);
 
@@ -825,6 +937,7 @@ static void
 soup_server_message_io_http2_init (SoupServerMessageIOHTTP2 *io)
 {
         nghttp2_session_callbacks *callbacks;
+        nghttp2_option *option;
 
         soup_http2_debug_init ();
 
@@ -836,8 +949,15 @@ soup_server_message_io_http2_init (SoupServerMessageIOHTTP2 *io)
         nghttp2_session_callbacks_set_on_frame_send_callback (callbacks, on_frame_send_callback);
         nghttp2_session_callbacks_set_on_stream_close_callback (callbacks, on_stream_close_callback);
 
-        nghttp2_session_server_new (&io->session, callbacks, io);
+        /* Window updates are sent manually, so that handlers streaming
+         * the request body get backpressure.
+         */
+        nghttp2_option_new (&option);
+        nghttp2_option_set_no_auto_window_update (option, 1);
+
+        nghttp2_session_server_new2 (&io->session, callbacks, io, option);
         nghttp2_session_callbacks_del (callbacks);
+        nghttp2_option_del (option);
 }
 
 SoupServerMessageIO *
@@ -0,0 +1,16 @@
+#pragma once
+
+#include "soup-content-encoder.h"
+
+void        soup_content_encoder_process_response (SoupContentEncoder *encoder,
+                                                   SoupServerMessage  *msg);
+void        soup_content_encoder_process_not_modified (SoupContentEncoder *encoder,
+                                                       SoupServerMessage  *msg,
+                                                       const char         *content_type,
+                                                       gsize               length);
+GConverter *soup_content_encoder_prepare_response (SoupContentEncoder *encoder,
+                                                   SoupServerMessage  *msg,
+                                                   gboolean            can_stream);
+GBytes     *soup_content_encoder_encode_chunk     (GConverter         *converter,
+                                                   GBytes             *chunk,
+                                                   GError            **error);
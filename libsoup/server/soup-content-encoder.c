@@ -0,0 +1,1026 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*- */
+/*
+ * soup-content-encoder.c
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+
+#include "soup-content-encoder.h"
+#include "soup-content-encoder-private.h"
+#include "soup.h"
+#include "soup-message-headers-private.h"
+#include "soup-server-message-private.h"
+
+/**
+ * SoupContentEncoder:
+ *
+ * Compresses responses of a [class@Server].
+ *
+ * #SoupContentEncoder handles the "Accept-Encoding" header of requests
+ * and sets the "Content-Encoding" of the responses accordingly.
+ * Currently it supports the "gzip" and "deflate" content codings.
+ *
+ * To use it, create one with [ctor@ContentEncoder.new] and add it to
+ * the server with [method@Server.set_content_encoder].
+ *
+ * Only successful responses whose Content-Type is one of
+ * [property@ContentEncoder:mime-types] are compressed, and, if the
+ * whole body is known when the response is sent, only those of at
+ * least [property@ContentEncoder:min-size] bytes. Bodies sent with
+ * %SOUP_ENCODING_CHUNKED are compressed as they are written. Responses
+ * that already have a "Content-Encoding", and partial responses, are
+ * left untouched.
+ *
+ * Compressed bodies of responses with an "ETag" are kept in a cache
+ * of [property@ContentEncoder:cache-size] bytes, so that static
+ * resources don't need to be compressed again for every request. The
+ * ETag of responses that can be compressed for the request is turned
+ * into a weak one, also when they are answered with
+ * %SOUP_STATUS_NOT_MODIFIED by [method@ServerMessage.set_response_file].
+ *
+ * Since: 3.4
+ */
+
+struct _SoupContentEncoder {
+        GObject parent;
+
+        int level;
+        guint min_size;
+        char **mime_types;
+        gboolean use_thread_pool;
+
+        GMutex cache_mutex;
+        guint cache_size;
+        gsize cache_used;
+        GHashTable *cache;
+        GQueue cache_lru;
+};
+
+G_DEFINE_FINAL_TYPE (SoupContentEncoder, soup_content_encoder, G_TYPE_OBJECT)
+
+enum {
+        PROP_0,
+
+        PROP_LEVEL,
+        PROP_MIN_SIZE,
+        PROP_MIME_TYPES,
+        PROP_USE_THREAD_POOL,
+        PROP_CACHE_SIZE,
+
+        LAST_PROPERTY
+};
+
+static GParamSpec *properties[LAST_PROPERTY] = { NULL, };
+
+static const char * const default_mime_types[] = {
+        "text/*",
+        "application/javascript",
+        "application/json",
+        "application/xml",
+        "application/xhtml+xml",
+        "image/svg+xml",
+        NULL
+};
+
+typedef struct {
+        char *key;
+        GBytes *bytes;
+        GList link;
+} CacheEntry;
+
+static void
+cache_entry_free (CacheEntry *entry)
+{
+        g_free (entry->key);
+        g_bytes_unref (entry->bytes);
+        g_free (entry);
+}
+
+static void
+soup_content_encoder_init (SoupContentEncoder *encoder)
+{
+        encoder->level = -1;
+        g_mutex_init (&encoder->cache_mutex);
+        encoder->cache = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+                                                (GDestroyNotify)cache_entry_free);
+}
+
+static void
+soup_content_encoder_finalize (GObject *object)
+{
+        SoupContentEncoder *encoder = SOUP_CONTENT_ENCODER (object);
+
+        g_strfreev (encoder->mime_types);
+        g_queue_clear (&encoder->cache_lru);
+        g_hash_table_destroy (encoder->cache);
+        g_mutex_clear (&encoder->cache_mutex);
+
+        G_OBJECT_CLASS (soup_content_encoder_parent_class)->finalize (object);
+}
+
+static void
+soup_content_encoder_set_property (GObject *object, guint prop_id,
+                                   const GValue *value, GParamSpec *pspec)
+{
+        SoupContentEncoder *encoder = SOUP_CONTENT_ENCODER (object);
+
+        switch (prop_id) {
+        case PROP_LEVEL:
+                soup_content_encoder_set_level (encoder, g_value_get_int (value));
+                break;
+        case PROP_MIN_SIZE:
+                soup_content_encoder_set_min_size (encoder, g_value_get_uint (value));
+                break;
+        case PROP_MIME_TYPES:
+                soup_content_encoder_set_mime_types (encoder, g_value_get_boxed (value));
+                break;
+        case PROP_USE_THREAD_POOL:
+                soup_content_encoder_set_use_thread_pool (encoder, g_value_get_boolean (value));
+                break;
+        case PROP_CACHE_SIZE:
+                soup_content_encoder_set_cache_size (encoder, g_value_get_uint (value));
+                break;
+        default:
+                G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+                break;
+        }
+}
+
+static void
+soup_content_encoder_get_property (GObject *object, guint prop_id,
+                                   GValue *value, GParamSpec *pspec)
+{
+        SoupContentEncoder *encoder = SOUP_CONTENT_ENCODER (object);
+
+        switch (prop_id) {
+        case PROP_LEVEL:
+                g_value_set_int (value, encoder->level);
+                break;
+        case PROP_MIN_SIZE:
+                g_value_set_uint (value, encoder->min_size);
+                break;
+        case PROP_MIME_TYPES:
+                g_value_set_boxed (value, soup_content_encoder_get_mime_types (encoder));
+                break;
+        case PROP_USE_THREAD_POOL:
+                g_value_set_boolean (value, encoder->use_thread_pool);
+                break;
+        case PROP_CACHE_SIZE:
+                g_value_set_uint (value, encoder->cache_size);
+                break;
+        default:
+                G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+                break;
+        }
+}
+
+static void
+soup_content_encoder_class_init (SoupContentEncoderClass *encoder_class)
+{
+        GObjectClass *object_class = G_OBJECT_CLASS (encoder_class);
+
+        object_class->finalize = soup_content_encoder_finalize;
+        object_class->set_property = soup_content_encoder_set_property;
+        object_class->get_property = soup_content_encoder_get_property;
+
+        /**
+         * SoupContentEncoder:level: (attributes org.gtk.Property.get=soup_content_encoder_get_level org.gtk.Property.set=soup_content_encoder_set_level)
+         *
+         * The compression level, from 0 (no compression) to 9 (best
+         * compression), or -1 for the zlib default.
+         *
+         * Since: 3.4
+         */
+        properties[PROP_LEVEL] =
+                g_param_spec_int ("level",
+                                  "Level",
+                                  "The compression level",
+                                  -1, 9, -1,
+                                  G_PARAM_READWRITE |
+                                  G_PARAM_STATIC_STRINGS);
+
+        /**
+         * SoupContentEncoder:min-size: (attributes org.gtk.Property.get=soup_content_encoder_get_min_size org.gtk.Property.set=soup_content_encoder_set_min_size)
+         *
+         * The minimum size of a response body for it to be compressed.
+         * Compressing smaller bodies is usually not worth the
+         * overhead.
+         *
+         * Since: 3.4
+         */
+        properties[PROP_MIN_SIZE] =
+                g_param_spec_uint ("min-size",
+                                   "Minimum size",
+                                   "The minimum size of a response body to compress",
+                                   0, G_MAXUINT, 1024,
+                                   G_PARAM_READWRITE |
+                                   G_PARAM_CONSTRUCT |
+                                   G_PARAM_STATIC_STRINGS);
+
+        /**
+         * SoupContentEncoder:mime-types: (attributes org.gtk.Property.get=soup_content_encoder_get_mime_types org.gtk.Property.set=soup_content_encoder_set_mime_types)
+         *
+         * The MIME types of the responses to compress. A type ending in
+         * "/\*", like "text/\*", matches all of its subtypes.
+         *
+         * By default, text types, JavaScript, JSON, XML and SVG are
+         * compressed.
+         *
+         * Since: 3.4
+         */
+        properties[PROP_MIME_TYPES] =
+                g_param_spec_boxed ("mime-types",
+                                    "MIME types",
+                                    "The MIME types of the responses to compress",
+                                    G_TYPE_STRV,
+                                    G_PARAM_READWRITE |
+                                    G_PARAM_STATIC_STRINGS);
+
+        /**
+         * SoupContentEncoder:use-thread-pool: (attributes org.gtk.Property.get=soup_content_encoder_get_use_thread_pool org.gtk.Property.set=soup_content_encoder_set_use_thread_pool)
+         *
+         * Whether to compress response bodies in a worker thread.
+         *
+         * When %TRUE, the response body set by a handler is compressed
+         * in a thread while the message is paused, so that compressing
+         * large bodies doesn't block the server's main context. Bodies
+         * set after the handler returns, and chunked bodies, are still
+         * compressed in the server's thread.
+         *
+         * Since: 3.4
+         */
+        properties[PROP_USE_THREAD_POOL] =
+                g_param_spec_boolean ("use-thread-pool",
+                                      "Use thread pool",
+                                      "Whether to compress response bodies in a worker thread",
+                                      FALSE,
+                                      G_PARAM_READWRITE |
+                                      G_PARAM_STATIC_STRINGS);
+
+        /**
+         * SoupContentEncoder:cache-size: (attributes org.gtk.Property.get=soup_content_encoder_get_cache_size org.gtk.Property.set=soup_content_encoder_set_cache_size)
+         *
+         * The maximum size, in bytes, of the cache of compressed bodies
+         * of responses with an ETag, or 0 to not cache them.
+         *
+         * Since: 3.4
+         */
+        properties[PROP_CACHE_SIZE] =
+                g_param_spec_uint ("cache-size",
+                                   "Cache size",
+                                   "The maximum size of the cache of compressed bodies",
+                                   0, G_MAXUINT, 4 * 1024 * 1024,
+                                   G_PARAM_READWRITE |
+                                   G_PARAM_CONSTRUCT |
+                                   G_PARAM_STATIC_STRINGS);
+
+        g_object_class_install_properties (object_class, LAST_PROPERTY, properties);
+}
+
+/**
+ * soup_content_encoder_new:
+ *
+ * Creates a new #SoupContentEncoder with the default settings.
+ *
+ * Returns: (transfer full): a new #SoupContentEncoder
+ *
+ * Since: 3.4
+ */
+SoupContentEncoder *
+soup_content_encoder_new (void)
+{
+        return g_object_new (SOUP_TYPE_CONTENT_ENCODER, NULL);
+}
+
+static void
+cache_clear (SoupContentEncoder *encoder,
+             gsize               max_size)
+{
+        while (encoder->cache_used > max_size) {
+                CacheEntry *entry = g_queue_peek_tail (&encoder->cache_lru);
+
+                g_queue_unlink (&encoder->cache_lru, &entry->link);
+                encoder->cache_used -= g_bytes_get_size (entry->bytes);
+                g_hash_table_remove (encoder->cache, entry->key);
+        }
+}
+
+/**
+ * soup_content_encoder_set_level: (attributes org.gtk.Method.set_property=level)
+ * @encoder: a #SoupContentEncoder
+ * @level: the compression level, or -1 for the default
+ *
+ * Sets the compression level used by @encoder.
+ *
+ * Since: 3.4
+ */
+void
+soup_content_encoder_set_level (SoupContentEncoder *encoder,
+                                int                 level)
+{
+        g_return_if_fail (SOUP_IS_CONTENT_ENCODER (encoder));
+        g_return_if_fail (level >= -1 && level <= 9);
+
+        if (encoder->level == level)
+                return;
+
+        encoder->level = level;
+
+        g_mutex_lock (&encoder->cache_mutex);
+        cache_clear (encoder, 0);
+        g_mutex_unlock (&encoder->cache_mutex);
+
+        g_object_notify_by_pspec (G_OBJECT (encoder), properties[PROP_LEVEL]);
+}
+
+/**
+ * soup_content_encoder_get_level: (attributes org.gtk.Method.get_property=level)
+ * @encoder: a #SoupContentEncoder
+ *
+ * Gets the compression level used by @encoder.
+ *
+ * Returns: the compression level
+ *
+ * Since: 3.4
+ */
+int
+soup_content_encoder_get_level (SoupContentEncoder *encoder)
+{
+        g_return_val_if_fail (SOUP_IS_CONTENT_ENCODER (encoder), -1);
+
+        return encoder->level;
+}
+
+/**
+ * soup_content_encoder_set_min_size: (attributes org.gtk.Method.set_property=min-size)
+ * @encoder: a #SoupContentEncoder
+ * @min_size: the minimum body size to compress
+ *
+ * Sets the minimum size of the response bodies compressed by @encoder.
+ *
+ * Since: 3.4
+ */
+void
+soup_content_encoder_set_min_size (SoupContentEncoder *encoder,
+                                   guint               min_size)
+{
+        g_return_if_fail (SOUP_IS_CONTENT_ENCODER (encoder));
+
+        if (encoder->min_size == min_size)
+                return;
+
+        encoder->min_size = min_size;
+        g_object_notify_by_pspec (G_OBJECT (encoder), properties[PROP_MIN_SIZE]);
+}
+
+/**
+ * soup_content_encoder_get_min_size: (attributes org.gtk.Method.get_property=min-size)
+ * @encoder: a #SoupContentEncoder
+ *
+ * Gets the minimum size of the response bodies compressed by @encoder.
+ *
+ * Returns: the minimum body size
+ *
+ * Since: 3.4
+ */
+guint
+soup_content_encoder_get_min_size (SoupContentEncoder *encoder)
+{
+        g_return_val_if_fail (SOUP_IS_CONTENT_ENCODER (encoder), 0);
+
+        return encoder->min_size;
+}
+
+/**
+ * soup_content_encoder_set_mime_types: (attributes org.gtk.Method.set_property=mime-types)
+ * @encoder: a #SoupContentEncoder
+ * @mime_types: (nullable) (array zero-terminated=1): the MIME types to
+ *   compress, or %NULL for the default ones
+ *
+ * Sets the MIME types of the responses compressed by @encoder.
+ *
+ * Since: 3.4
+ */
+void
+soup_content_encoder_set_mime_types (SoupContentEncoder *encoder,
+                                     const char * const *mime_types)
+{
+        g_return_if_fail (SOUP_IS_CONTENT_ENCODER (encoder));
+
+        g_strfreev (encoder->mime_types);
+        encoder->mime_types = g_strdupv ((char **)(mime_types ? mime_types : default_mime_types));
+        g_object_notify_by_pspec (G_OBJECT (encoder), properties[PROP_MIME_TYPES]);
+}
+
+/**
+ * soup_content_encoder_get_mime_types: (attributes org.gtk.Method.get_property=mime-types)
+ * @encoder: a #SoupContentEncoder
+ *
+ * Gets the MIME types of the responses compressed by @encoder.
+ *
+ * Returns: (transfer none) (array zero-terminated=1): the MIME types
+ *
+ * Since: 3.4
+ */
+const char * const *
+soup_content_encoder_get_mime_types (SoupContentEncoder *encoder)
+{
+        g_return_val_if_fail (SOUP_IS_CONTENT_ENCODER (encoder), NULL);
+
+        return (const char * const *)(encoder->mime_types ? encoder->mime_types : (char **)default_mime_types);
+}
+
+/**
+ * soup_content_encoder_set_use_thread_pool: (attributes org.gtk.Method.set_property=use-thread-pool)
+ * @encoder: a #SoupContentEncoder
+ * @use_thread_pool: whether to compress in a worker thread
+ *
+ * Sets whether @encoder compresses response bodies in a worker thread.
+ *
+ * Since: 3.4
+ */
+void
+soup_content_encoder_set_use_thread_pool (SoupContentEncoder *encoder,
+                                          gboolean            use_thread_pool)
+{
+        g_return_if_fail (SOUP_IS_CONTENT_ENCODER (encoder));
+
+        if (encoder->use_thread_pool == use_thread_pool)
+                return;
+
+        encoder->use_thread_pool = use_thread_pool;
+        g_object_notify_by_pspec (G_OBJECT (encoder), properties[PROP_USE_THREAD_POOL]);
+}
+
+/**
+ * soup_content_encoder_get_use_thread_pool: (attributes org.gtk.Method.get_property=use-thread-pool)
+ * @encoder: a #SoupContentEncoder
+ *
+ * Gets whether @encoder compresses response bodies in a worker thread.
+ *
+ * Returns: %TRUE if a worker thread is used
+ *
+ * Since: 3.4
+ */
+gboolean
+soup_content_encoder_get_use_thread_pool (SoupContentEncoder *encoder)
+{
+        g_return_val_if_fail (SOUP_IS_CONTENT_ENCODER (encoder), FALSE);
+
+        return encoder->use_thread_pool;
+}
+
+/**
+ * soup_content_encoder_set_cache_size: (attributes org.gtk.Method.set_property=cache-size)
+ * @encoder: a #SoupContentEncoder
+ * @cache_size: the maximum size of the cache, in bytes
+ *
+ * Sets the maximum size of the cache of compressed bodies of @encoder.
+ *
+ * Since: 3.4
+ */
+void
+soup_content_encoder_set_cache_size (SoupContentEncoder *encoder,
+                                     guint               cache_size)
+{
+        g_return_if_fail (SOUP_IS_CONTENT_ENCODER (encoder));
+
+        g_mutex_lock (&encoder->cache_mutex);
+        if (encoder->cache_size == cache_size) {
+                g_mutex_unlock (&encoder->cache_mutex);
+                return;
+        }
+
+        encoder->cache_size = cache_size;
+        cache_clear (encoder, cache_size);
+        g_mutex_unlock (&encoder->cache_mutex);
+
+        g_object_notify_by_pspec (G_OBJECT (encoder), properties[PROP_CACHE_SIZE]);
+}
+
+/**
+ * soup_content_encoder_get_cache_size: (attributes org.gtk.Method.get_property=cache-size)
+ * @encoder: a #SoupContentEncoder
+ *
+ * Gets the maximum size of the cache of compressed bodies of @encoder.
+ *
+ * Returns: the maximum size of the cache, in bytes
+ *
+ * Since: 3.4
+ */
+guint
+soup_content_encoder_get_cache_size (SoupContentEncoder *encoder)
+{
+        g_return_val_if_fail (SOUP_IS_CONTENT_ENCODER (encoder), 0);
+
+        return encoder->cache_size;
+}
+
+static GBytes *
+cache_lookup (SoupContentEncoder *encoder,
+              const char         *key)
+{
+        CacheEntry *entry;
+        GBytes *bytes = NULL;
+
+        g_mutex_lock (&encoder->cache_mutex);
+        entry = g_hash_table_lookup (encoder->cache, key);
+        if (entry) {
+                g_queue_unlink (&encoder->cache_lru, &entry->link);
+                g_queue_push_head_link (&encoder->cache_lru, &entry->link);
+                bytes = g_bytes_ref (entry->bytes);
+        }
+        g_mutex_unlock (&encoder->cache_mutex);
+
+        return bytes;
+}
+
+static void
+cache_insert (SoupContentEncoder *encoder,
+              const char         *key,
+              GBytes             *bytes)
+{
+        CacheEntry *entry;
+        gsize size = g_bytes_get_size (bytes);
+
+        g_mutex_lock (&encoder->cache_mutex);
+        if (size > encoder->cache_size || g_hash_table_contains (encoder->cache, key)) {
+                g_mutex_unlock (&encoder->cache_mutex);
+                return;
+        }
+
+        cache_clear (encoder, encoder->cache_size - size);
+
+        entry = g_new0 (CacheEntry, 1);
+        entry->key = g_strdup (key);
+        entry->bytes = g_bytes_ref (bytes);
+        entry->link.data = entry;
+        g_hash_table_insert (encoder->cache, entry->key, entry);
+        g_queue_push_head_link (&encoder->cache_lru, &entry->link);
+        encoder->cache_used += size;
+        g_mutex_unlock (&encoder->cache_mutex);
+}
+
+static GConverter *
+create_converter (const char *coding,
+                  int         level)
+{
+        return G_CONVERTER (g_zlib_compressor_new (strcmp (coding, "gzip") == 0 ?
+                                                   G_ZLIB_COMPRESSOR_FORMAT_GZIP :
+                                                   G_ZLIB_COMPRESSOR_FORMAT_ZLIB,
+                                                   level));
+}
+
+static GBytes *
+convert_bytes (GConverter     *converter,
+               GBytes         *input,
+               GConverterFlags flags,
+               GError        **error)
+{
+        const guint8 *data;
+        gsize size, out_len = 0;
+        GByteArray *out;
+
+        data = g_bytes_get_data (input, &size);
+        out = g_byte_array_sized_new (size + size / 1000 + 64);
+        g_byte_array_set_size (out, size + size / 1000 + 64);
+
+        while (TRUE) {
+                GConverterResult result;
+                gsize bytes_read, bytes_written;
+                GError *my_error = NULL;
+
+                result = g_converter_convert (converter, data, size,
+                                              out->data + out_len, out->len - out_len,
+                                              flags, &bytes_read, &bytes_written,
+                                              &my_error);
+                if (result == G_CONVERTER_ERROR) {
+                        if (g_error_matches (my_error, G_IO_ERROR, G_IO_ERROR_NO_SPACE)) {
+                                g_clear_error (&my_error);
+                                g_byte_array_set_size (out, out->len * 2);
+                                continue;
+                        }
+
+                        g_propagate_error (error, my_error);
+                        g_byte_array_unref (out);
+                        return NULL;
+                }
+
+                data += bytes_read;
+                size -= bytes_read;
+                out_len += bytes_written;
+
+                if (result == G_CONVERTER_FINISHED ||
+                    (result == G_CONVERTER_FLUSHED && size == 0))
+                        break;
+
+                if (out_len == out->len)
+                        g_byte_array_set_size (out, out->len * 2);
+        }
+
+        g_byte_array_set_size (out, out_len);
+        return g_byte_array_free_to_bytes (out);
+}
+
+static gboolean
+mime_type_matches (SoupContentEncoder *encoder,
+                   const char         *content_type)
+{
+        const char * const *mime_types = soup_content_encoder_get_mime_types (encoder);
+        guint i;
+
+        for (i = 0; mime_types[i]; i++) {
+                const char *pattern = mime_types[i];
+                gsize len = strlen (pattern);
+
+                if (len >= 2 && pattern[len - 2] == '/' && pattern[len - 1] == '*') {
+                        if (g_ascii_strncasecmp (content_type, pattern, len - 1) == 0)
+                                return TRUE;
+                } else if (g_ascii_strcasecmp (content_type, pattern) == 0)
+                        return TRUE;
+        }
+
+        return FALSE;
+}
+
+static const char *
+negotiate_coding (SoupServerMessage *msg)
+{
+        const char *header;
+        GSList *codings, *unacceptable = NULL, *l;
+        const char *coding = NULL;
+
+        header = soup_message_headers_get_list_common (soup_server_message_get_request_headers (msg),
+                                                       SOUP_HEADER_ACCEPT_ENCODING);
+        if (!header)
+                return NULL;
+
+        codings = soup_header_parse_quality_list (header, &unacceptable);
+        for (l = codings; l && !coding; l = l->next) {
+                const char *name = l->data;
+
+                if (!g_ascii_strcasecmp (name, "gzip") || !g_ascii_strcasecmp (name, "x-gzip"))
+                        coding = "gzip";
+                else if (!g_ascii_strcasecmp (name, "deflate"))
+                        coding = "deflate";
+                else if (!strcmp (name, "*") &&
+                         !g_slist_find_custom (unacceptable, "gzip", (GCompareFunc)g_ascii_strcasecmp))
+                        coding = "gzip";
+        }
+        soup_header_free_list (codings);
+        soup_header_free_list (unacceptable);
+
+        return coding;
+}
+
+/* Sets the headers of a compressible response of @msg and returns the
+ * coding to compress it with, or %NULL if the client doesn't accept any.
+ */
+static const char *
+negotiate_response_coding (SoupServerMessage *msg)
+{
+        SoupMessageHeaders *response_headers;
+        const char *coding, *etag;
+
+        response_headers = soup_server_message_get_response_headers (msg);
+        if (!soup_message_headers_header_contains_common (response_headers, SOUP_HEADER_VARY, "Accept-Encoding"))
+                soup_message_headers_append_common (response_headers, SOUP_HEADER_VARY, "Accept-Encoding");
+
+        coding = negotiate_coding (msg);
+        if (!coding)
+                return NULL;
+
+        /* The encoded body is not byte-for-byte the same representation.
+         * The ETag doesn't depend on whether compressing the body pays
+         * off, so that 304 responses can have the same one.
+         */
+        etag = soup_message_headers_get_one_common (response_headers, SOUP_HEADER_ETAG);
+        if (etag && !g_str_has_prefix (etag, "W/")) {
+                char *weak_etag = g_strdup_printf ("W/%s", etag);
+
+                soup_message_headers_replace_common (response_headers, SOUP_HEADER_ETAG, weak_etag);
+                g_free (weak_etag);
+        }
+
+        return coding;
+}
+
+/* Returns the coding to compress @msg's response with, or %NULL if it
+ * shouldn't be compressed. Also marks compressible responses as varying
+ * on Accept-Encoding.
+ */
+static const char *
+get_coding_for_response (SoupContentEncoder *encoder,
+                         SoupServerMessage  *msg,
+                         gboolean            can_stream)
+{
+        SoupMessageHeaders *response_headers;
+        SoupMessageBody *response_body;
+        const char *content_type;
+        guint status;
+
+        status = soup_server_message_get_status (msg);
+        if (!SOUP_STATUS_IS_SUCCESSFUL (status) ||
+            status == SOUP_STATUS_NO_CONTENT ||
+            status == SOUP_STATUS_PARTIAL_CONTENT)
+                return NULL;
+
+        if (soup_server_message_get_method (msg) == SOUP_METHOD_CONNECT)
+                return NULL;
+
+        response_headers = soup_server_message_get_response_headers (msg);
+        if (soup_message_headers_get_one_common (response_headers, SOUP_HEADER_CONTENT_ENCODING) ||
+            soup_message_headers_get_one_common (response_headers, SOUP_HEADER_CONTENT_RANGE))
+                return NULL;
+
+        content_type = soup_message_headers_get_content_type (response_headers, NULL);
+        if (!content_type || !mime_type_matches (encoder, content_type))
+                return NULL;
+
+        response_body = soup_server_message_get_response_body (msg);
+        switch (soup_message_headers_get_encoding (response_headers)) {
+        case SOUP_ENCODING_CONTENT_LENGTH:
+                if (!soup_message_body_get_accumulate (response_body) ||
+                    response_body->length < encoder->min_size)
+                        return NULL;
+                if (soup_message_headers_get_one_common (response_headers, SOUP_HEADER_CONTENT_LENGTH) &&
+                    soup_message_headers_get_content_length (response_headers) != response_body->length)
+                        return NULL;
+                break;
+        case SOUP_ENCODING_CHUNKED:
+                if (!can_stream)
+                        return NULL;
+                break;
+        default:
+                return NULL;
+        }
+
+        return negotiate_response_coding (msg);
+}
+
+static void
+set_encoded_headers (SoupServerMessage *msg,
+                     const char        *coding)
+{
+        soup_message_headers_replace_common (soup_server_message_get_response_headers (msg),
+                                             SOUP_HEADER_CONTENT_ENCODING, coding);
+}
+
+static void
+set_encoded_body (SoupServerMessage *msg,
+                  const char        *coding,
+                  GBytes            *encoded)
+{
+        SoupMessageBody *response_body;
+
+        response_body = soup_server_message_get_response_body (msg);
+        soup_message_body_truncate (response_body);
+        soup_message_body_append_bytes (response_body, encoded);
+        soup_message_headers_set_content_length (soup_server_message_get_response_headers (msg),
+                                                 g_bytes_get_size (encoded));
+        set_encoded_headers (msg, coding);
+}
+
+static GBytes *
+get_response_body_bytes (SoupServerMessage *msg)
+{
+        SoupMessageBody *response_body;
+        GBytes *bytes;
+
+        response_body = soup_server_message_get_response_body (msg);
+        bytes = soup_message_body_get_chunk (response_body, 0);
+        if (bytes && g_bytes_get_size (bytes) == (gsize)response_body->length)
+                return bytes;
+
+        g_clear_pointer (&bytes, g_bytes_unref);
+        return soup_message_body_flatten (response_body);
+}
+
+static char *
+get_cache_key (SoupServerMessage *msg,
+               const char        *coding)
+{
+        const char *etag;
+        char *uri, *key;
+
+        etag = soup_message_headers_get_one_common (soup_server_message_get_response_headers (msg),
+                                                    SOUP_HEADER_ETAG);
+        if (!etag)
+                return NULL;
+
+        /* ETags are only unique per resource, and the same server can
+         * serve several hosts, so the whole request URI is part of the key.
+         */
+        uri = g_uri_to_string_partial (soup_server_message_get_uri (msg),
+                                       G_URI_HIDE_USERINFO | G_URI_HIDE_FRAGMENT);
+        key = g_strdup_printf ("%s %s %s", coding, etag, uri);
+        g_free (uri);
+
+        return key;
+}
+
+typedef struct {
+        SoupServerMessage *msg;
+        const char *coding;
+        int level;
+        GBytes *body;
+        char *cache_key;
+} EncodeData;
+
+static void
+encode_data_free (EncodeData *data)
+{
+        g_object_unref (data->msg);
+        g_bytes_unref (data->body);
+        g_free (data->cache_key);
+        g_free (data);
+}
+
+static GBytes *
+encode_body (const char *coding,
+             int         level,
+             GBytes     *body,
+             GError    **error)
+{
+        GConverter *converter;
+        GBytes *encoded;
+
+        converter = create_converter (coding, level);
+        encoded = convert_bytes (converter, body, G_CONVERTER_INPUT_AT_END, error);
+        g_object_unref (converter);
+
+        return encoded;
+}
+
+static void
+encode_body_thread (GTask        *task,
+                    gpointer      source_object,
+                    gpointer      task_data,
+                    GCancellable *cancellable)
+{
+        EncodeData *data = task_data;
+        GBytes *encoded;
+        GError *error = NULL;
+
+        encoded = encode_body (data->coding, data->level, data->body, &error);
+        if (encoded)
+                g_task_return_pointer (task, encoded, (GDestroyNotify)g_bytes_unref);
+        else
+                g_task_return_error (task, error);
+}
+
+static void
+encode_body_thread_done (SoupContentEncoder *encoder,
+                         GAsyncResult       *result,
+                         gpointer            user_data)
+{
+        EncodeData *data = g_task_get_task_data (G_TASK (result));
+        GBytes *encoded;
+
+        encoded = g_task_propagate_pointer (G_TASK (result), NULL);
+        if (encoded) {
+                if (data->cache_key)
+                        cache_insert (encoder, data->cache_key, encoded);
+                if (g_bytes_get_size (encoded) < g_bytes_get_size (data->body))
+                        set_encoded_body (data->msg, data->coding, encoded);
+                g_bytes_unref (encoded);
+        }
+
+        soup_server_message_unpause (data->msg);
+}
+
+/* Called when the handler has set the response of @msg. If the body is
+ * to be compressed in a worker thread, starts doing it and pauses @msg
+ * until it's done.
+ */
+void
+soup_content_encoder_process_response (SoupContentEncoder *encoder,
+                                       SoupServerMessage  *msg)
+{
+        const char *coding;
+        EncodeData *data;
+        GBytes *cached;
+        GTask *task;
+
+        if (!encoder->use_thread_pool)
+                return;
+
+        coding = get_coding_for_response (encoder, msg, FALSE);
+        if (!coding)
+                return;
+
+        soup_server_message_set_response_encoded (msg);
+
+        data = g_new0 (EncodeData, 1);
+        data->msg = g_object_ref (msg);
+        data->coding = coding;
+        data->level = encoder->level;
+        data->body = get_response_body_bytes (msg);
+        data->cache_key = get_cache_key (msg, coding);
+
+        cached = data->cache_key ? cache_lookup (encoder, data->cache_key) : NULL;
+        if (cached) {
+                if (g_bytes_get_size (cached) < g_bytes_get_size (data->body))
+                        set_encoded_body (msg, coding, cached);
+                g_bytes_unref (cached);
+                encode_data_free (data);
+                return;
+        }
+
+        soup_server_message_pause (msg);
+
+        task = g_task_new (encoder, NULL, (GAsyncReadyCallback)encode_body_thread_done, NULL);
+        g_task_set_source_tag (task, soup_content_encoder_process_response);
+        g_task_set_task_data (task, data, (GDestroyNotify)encode_data_free);
+        g_task_run_in_thread (task, encode_body_thread);
+        g_object_unref (task);
+}
+
+/* Called when a conditional request of @msg for a body of @content_type
+ * and @length bytes is answered with %SOUP_STATUS_NOT_MODIFIED. Sets the
+ * Vary and ETag headers the full response would have had.
+ */
+void
+soup_content_encoder_process_not_modified (SoupContentEncoder *encoder,
+                                           SoupServerMessage  *msg,
+                                           const char         *content_type,
+                                           gsize               length)
+{
+        char *mime_type;
+        gboolean matches;
+
+        if (length < encoder->min_size)
+                return;
+
+        mime_type = g_strndup (content_type, strcspn (content_type, "; \t"));
+        matches = mime_type_matches (encoder, mime_type);
+        g_free (mime_type);
+        if (!matches)
+                return;
+
+        negotiate_response_coding (msg);
+}
+
+/* Called right before the response headers of @msg are written.
+ * Complete bodies are compressed right away; for chunked ones,
+ * a #GConverter to compress each chunk with is returned.
+ */
+GConverter *
+soup_content_encoder_prepare_response (SoupContentEncoder *encoder,
+                                       SoupServerMessage  *msg,
+                                       gboolean            can_stream)
+{
+        SoupMessageHeaders *response_headers;
+        const char *coding;
+        GBytes *body, *encoded;
+        char *cache_key;
+        GError *error = NULL;
+
+        coding = get_coding_for_response (encoder, msg, can_stream);
+        if (!coding)
+                return NULL;
+
+        response_headers = soup_server_message_get_response_headers (msg);
+        if (soup_message_headers_get_encoding (response_headers) == SOUP_ENCODING_CHUNKED) {
+                set_encoded_headers (msg, coding);
+                return create_converter (coding, encoder->level);
+        }
+
+        body = get_response_body_bytes (msg);
+        cache_key = get_cache_key (msg, coding);
+        encoded = cache_key ? cache_lookup (encoder, cache_key) : NULL;
+        if (!encoded) {
+                encoded = encode_body (coding, encoder->level, body, &error);
+                if (!encoded) {
+                        g_warning ("Failed to compress response body: %s", error->message);
+                        g_clear_error (&error);
+                } else if (cache_key)
+                        cache_insert (encoder, cache_key, encoded);
+        }
+
+        if (encoded && g_bytes_get_size (encoded) < g_bytes_get_size (body))
+                set_encoded_body (msg, coding, encoded);
+
+        g_clear_pointer (&encoded, g_bytes_unref);
+        g_bytes_unref (body);
+        g_free (cache_key);
+
+        return NULL;
+}
+
+/* Compresses a chunk of a streamed response body. An empty @chunk
+ * marks the end of the body.
+ */
+GBytes *
+soup_content_encoder_encode_chunk (GConverter *converter,
+                                   GBytes     *chunk,
+                                   GError    **error)
+{
+        return convert_bytes (converter, chunk,
+                              g_bytes_get_size (chunk) ? G_CONVERTER_FLUSH : G_CONVERTER_INPUT_AT_END,
+                              error);
+}
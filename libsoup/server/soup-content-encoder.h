@@ -0,0 +1,46 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*- */
+
+#pragma once
+
+#include "soup-types.h"
+
+G_BEGIN_DECLS
+
+#define SOUP_TYPE_CONTENT_ENCODER (soup_content_encoder_get_type ())
+SOUP_AVAILABLE_IN_3_4
+G_DECLARE_FINAL_TYPE (SoupContentEncoder, soup_content_encoder, SOUP, CONTENT_ENCODER, GObject)
+
+SOUP_AVAILABLE_IN_3_4
+SoupContentEncoder  *soup_content_encoder_new                 (void);
+
+SOUP_AVAILABLE_IN_3_4
+void                 soup_content_encoder_set_level           (SoupContentEncoder  *encoder,
+                                                               int                  level);
+SOUP_AVAILABLE_IN_3_4
+int                  soup_content_encoder_get_level           (SoupContentEncoder  *encoder);
+
+SOUP_AVAILABLE_IN_3_4
+void                 soup_content_encoder_set_min_size        (SoupContentEncoder  *encoder,
+                                                               guint                min_size);
+SOUP_AVAILABLE_IN_3_4
+guint                soup_content_encoder_get_min_size        (SoupContentEncoder  *encoder);
+
+SOUP_AVAILABLE_IN_3_4
+void                 soup_content_encoder_set_mime_types      (SoupContentEncoder  *encoder,
+                                                               const char * const  *mime_types);
+SOUP_AVAILABLE_IN_3_4
+const char * const  *soup_content_encoder_get_mime_types      (SoupContentEncoder  *encoder);
+
+SOUP_AVAILABLE_IN_3_4
+void                 soup_content_encoder_set_use_thread_pool (SoupContentEncoder  *encoder,
+                                                               gboolean             use_thread_pool);
+SOUP_AVAILABLE_IN_3_4
+gboolean             soup_content_encoder_get_use_thread_pool (SoupContentEncoder  *encoder);
+
+SOUP_AVAILABLE_IN_3_4
+void                 soup_content_encoder_set_cache_size      (SoupContentEncoder  *encoder,
+                                                               guint                cache_size);
+SOUP_AVAILABLE_IN_3_4
+guint                soup_content_encoder_get_cache_size      (SoupContentEncoder  *encoder);
+
+G_END_DECLS
@@ -562,9 +562,12 @@ soup_server_connection_steal (SoupServerConnection *conn)
         soup_server_connection_get_local_address (conn);
         soup_server_connection_get_remote_address (conn);
 
-        g_clear_pointer (&priv->io_data, soup_server_message_io_destroy);
+        /* Forget the stream before destroying the I/O, so that
+         * aborting the requests still queued there doesn't close it.
+         */
         g_clear_object (&priv->conn);
         g_clear_object (&priv->iostream);
+        g_clear_pointer (&priv->io_data, soup_server_message_io_destroy);
 
         g_signal_emit (conn, signals[DISCONNECTED], 0);
 
@@ -0,0 +1,364 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*- */
+/*
+ * soup-server-file-cache.c: cache of open files served by SoupServer
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <glib/gi18n-lib.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+
+#include "soup-server-file-cache.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+
+/* Hot files are kept open and mapped, so that serving them again
+ * doesn't need an open(), fstat() and mmap() every time. Each SoupServer
+ * has its own cache, which is cleared when the server is disposed.
+ * Entries are checked against the file system at most once per
+ * FILE_CACHE_VALIDITY, the least recently used ones are closed once
+ * there are more than FILE_CACHE_MAX_ENTRIES, and the ones that haven't
+ * been used for FILE_CACHE_MAX_IDLE are closed on the next lookup, so
+ * that deleted and replaced files aren't kept open for long.
+ */
+#define FILE_CACHE_MAX_ENTRIES 256
+#define FILE_CACHE_VALIDITY G_USEC_PER_SEC
+#define FILE_CACHE_MAX_IDLE (30 * G_USEC_PER_SEC)
+
+struct _SoupServerFile {
+        gatomicrefcount ref_count;
+
+        char *path;
+        int fd;
+        GMappedFile *mapped;
+        GBytes *bytes;
+
+        goffset size;
+        gint64 mtime;
+        guint64 inode;
+        GDateTime *modification_time;
+        char *etag;
+
+        /* Protected by the cache mutex */
+        gint64 validated;
+        gint64 last_used;
+        GList link;
+};
+
+struct _SoupServerFileCache {
+        gatomicrefcount ref_count;
+
+        GMutex mutex;
+        GHashTable *files;
+        GQueue lru;
+};
+
+static SoupServerFile *
+soup_server_file_new (const char *path,
+                      gint64      now,
+                      GError    **error)
+{
+        SoupServerFile *file;
+        GMappedFile *mapped;
+        GStatBuf st;
+        int fd;
+
+        fd = g_open (path, O_RDONLY | O_BINARY | O_CLOEXEC, 0);
+        if (fd == -1) {
+                int errsv = errno;
+
+                g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+                             _("Could not open %s: %s"), path, g_strerror (errsv));
+                return NULL;
+        }
+
+#ifndef G_OS_WIN32
+        if (fstat (fd, &st) == -1) {
+#else
+        if (g_stat (path, &st) == -1) {
+#endif
+                int errsv = errno;
+
+                g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+                             _("Could not open %s: %s"), path, g_strerror (errsv));
+                g_close (fd, NULL);
+                return NULL;
+        }
+
+        if ((st.st_mode & S_IFMT) != S_IFREG) {
+                g_set_error (error, G_IO_ERROR,
+                             (st.st_mode & S_IFMT) == S_IFDIR ? G_IO_ERROR_IS_DIRECTORY : G_IO_ERROR_NOT_REGULAR_FILE,
+                             _("%s is not a regular file"), path);
+                g_close (fd, NULL);
+                return NULL;
+        }
+
+        mapped = g_mapped_file_new_from_fd (fd, FALSE, error);
+        if (!mapped) {
+                g_close (fd, NULL);
+                return NULL;
+        }
+
+        file = g_new0 (SoupServerFile, 1);
+        g_atomic_ref_count_init (&file->ref_count);
+        file->path = g_strdup (path);
+        file->fd = fd;
+        file->mapped = mapped;
+        file->bytes = g_mapped_file_get_bytes (mapped);
+        file->size = st.st_size;
+        file->mtime = st.st_mtime;
+        file->inode = st.st_ino;
+        file->modification_time = g_date_time_new_from_unix_utc (st.st_mtime);
+        file->etag = g_strdup_printf ("\"%" G_GINT64_MODIFIER "x-%" G_GINT64_MODIFIER "x\"",
+                                      file->mtime, (gint64)file->size);
+        file->validated = now;
+        file->last_used = now;
+        file->link.data = file;
+
+        return file;
+}
+
+SoupServerFile *
+soup_server_file_ref (SoupServerFile *file)
+{
+        g_atomic_ref_count_inc (&file->ref_count);
+        return file;
+}
+
+void
+soup_server_file_unref (SoupServerFile *file)
+{
+        if (!g_atomic_ref_count_dec (&file->ref_count))
+                return;
+
+        g_bytes_unref (file->bytes);
+        g_mapped_file_unref (file->mapped);
+        g_close (file->fd, NULL);
+        g_date_time_unref (file->modification_time);
+        g_free (file->etag);
+        g_free (file->path);
+        g_free (file);
+}
+
+static gboolean
+soup_server_file_is_valid (SoupServerFile *file,
+                           gint64          now)
+{
+        GStatBuf st;
+
+        if (now - file->validated < FILE_CACHE_VALIDITY)
+                return TRUE;
+
+        if (g_stat (file->path, &st) == -1)
+                return FALSE;
+
+        if (st.st_size != file->size ||
+            st.st_mtime != file->mtime ||
+            (guint64)st.st_ino != file->inode)
+                return FALSE;
+
+        file->validated = now;
+        return TRUE;
+}
+
+SoupServerFileCache *
+soup_server_file_cache_new (void)
+{
+        SoupServerFileCache *cache;
+
+        cache = g_new0 (SoupServerFileCache, 1);
+        g_atomic_ref_count_init (&cache->ref_count);
+        g_mutex_init (&cache->mutex);
+        cache->files = g_hash_table_new (g_str_hash, g_str_equal);
+        g_queue_init (&cache->lru);
+
+        return cache;
+}
+
+SoupServerFileCache *
+soup_server_file_cache_ref (SoupServerFileCache *cache)
+{
+        g_atomic_ref_count_inc (&cache->ref_count);
+        return cache;
+}
+
+void
+soup_server_file_cache_unref (SoupServerFileCache *cache)
+{
+        if (!g_atomic_ref_count_dec (&cache->ref_count))
+                return;
+
+        soup_server_file_cache_clear (cache);
+        g_hash_table_destroy (cache->files);
+        g_mutex_clear (&cache->mutex);
+        g_free (cache);
+}
+
+static void
+file_cache_remove (SoupServerFileCache *cache,
+                   SoupServerFile      *file)
+{
+        g_hash_table_remove (cache->files, file->path);
+        g_queue_unlink (&cache->lru, &file->link);
+        soup_server_file_unref (file);
+}
+
+/**
+ * soup_server_file_cache_clear:
+ * @cache: a #SoupServerFileCache
+ *
+ * Drops all the files in @cache. Files still being served are closed
+ * once their responses are done with them.
+ */
+void
+soup_server_file_cache_clear (SoupServerFileCache *cache)
+{
+        g_mutex_lock (&cache->mutex);
+        while (cache->lru.length > 0)
+                file_cache_remove (cache, g_queue_peek_tail (&cache->lru));
+        g_mutex_unlock (&cache->mutex);
+}
+
+static void
+file_cache_expire (SoupServerFileCache *cache,
+                   gint64               now)
+{
+        SoupServerFile *file;
+
+        while ((file = g_queue_peek_tail (&cache->lru))) {
+                if (cache->lru.length <= FILE_CACHE_MAX_ENTRIES &&
+                    now - file->last_used < FILE_CACHE_MAX_IDLE)
+                        break;
+
+                file_cache_remove (cache, file);
+        }
+}
+
+/**
+ * soup_server_file_cache_lookup:
+ * @cache: (nullable): a #SoupServerFileCache
+ * @path: a local file path
+ * @error: return location for a #GError
+ *
+ * Gets the open and mapped file at @path, reusing one cached in @cache
+ * if the file has not changed since it was opened. If @cache is %NULL,
+ * the file is opened without being cached.
+ *
+ * Returns: (transfer full): a #SoupServerFile, or %NULL on error
+ */
+SoupServerFile *
+soup_server_file_cache_lookup (SoupServerFileCache *cache,
+                               const char          *path,
+                               GError             **error)
+{
+        SoupServerFile *file, *old;
+        gint64 now = g_get_monotonic_time ();
+
+        if (!cache)
+                return soup_server_file_new (path, now, error);
+
+        g_mutex_lock (&cache->mutex);
+        file = g_hash_table_lookup (cache->files, path);
+        if (file) {
+                if (soup_server_file_is_valid (file, now)) {
+                        file->last_used = now;
+                        g_queue_unlink (&cache->lru, &file->link);
+                        g_queue_push_head_link (&cache->lru, &file->link);
+                        soup_server_file_ref (file);
+                        file_cache_expire (cache, now);
+                        g_mutex_unlock (&cache->mutex);
+
+                        return file;
+                }
+
+                file_cache_remove (cache, file);
+        }
+        file_cache_expire (cache, now);
+        g_mutex_unlock (&cache->mutex);
+
+        file = soup_server_file_new (path, now, error);
+        if (!file)
+                return NULL;
+
+        g_mutex_lock (&cache->mutex);
+        old = g_hash_table_lookup (cache->files, path);
+        if (old)
+                file_cache_remove (cache, old);
+
+        g_hash_table_insert (cache->files, file->path, soup_server_file_ref (file));
+        g_queue_push_head_link (&cache->lru, &file->link);
+        file_cache_expire (cache, now);
+        g_mutex_unlock (&cache->mutex);
+
+        return file;
+}
+
+int
+soup_server_file_get_fd (SoupServerFile *file)
+{
+        return file->fd;
+}
+
+GBytes *
+soup_server_file_get_bytes (SoupServerFile *file)
+{
+        return file->bytes;
+}
+
+goffset
+soup_server_file_get_size (SoupServerFile *file)
+{
+        return file->size;
+}
+
+GDateTime *
+soup_server_file_get_modification_time (SoupServerFile *file)
+{
+        return file->modification_time;
+}
+
+const char *
+soup_server_file_get_etag (SoupServerFile *file)
+{
+        return file->etag;
+}
+
+/**
+ * soup_server_file_get_offset:
+ * @file: a #SoupServerFile
+ * @bytes: a #GBytes
+ * @offset: (out): return location for the offset of @bytes in @file
+ *
+ * Checks whether @bytes is a slice of @file's mapping, as returned by
+ * soup_server_file_get_bytes() or a sub-#GBytes of it.
+ *
+ * Returns: %TRUE if @bytes is part of @file, %FALSE otherwise
+ */
+gboolean
+soup_server_file_get_offset (SoupServerFile *file,
+                             GBytes         *bytes,
+                             goffset        *offset)
+{
+        guintptr contents, data;
+        gsize size;
+
+        contents = (guintptr)g_mapped_file_get_contents (file->mapped);
+        data = (guintptr)g_bytes_get_data (bytes, &size);
+        if (!contents || !data || data < contents || data + size > contents + file->size)
+                return FALSE;
+
+        *offset = data - contents;
+        return TRUE;
+}
@@ -0,0 +1,32 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*- */
+
+#pragma once
+
+#include "soup-types.h"
+
+G_BEGIN_DECLS
+
+typedef struct _SoupServerFile SoupServerFile;
+typedef struct _SoupServerFileCache SoupServerFileCache;
+
+SoupServerFileCache *soup_server_file_cache_new        (void);
+SoupServerFileCache *soup_server_file_cache_ref        (SoupServerFileCache *cache);
+void                 soup_server_file_cache_unref      (SoupServerFileCache *cache);
+void                 soup_server_file_cache_clear      (SoupServerFileCache *cache);
+SoupServerFile      *soup_server_file_cache_lookup     (SoupServerFileCache *cache,
+                                                        const char          *path,
+                                                        GError             **error);
+
+SoupServerFile *soup_server_file_ref                   (SoupServerFile  *file);
+void            soup_server_file_unref                 (SoupServerFile  *file);
+
+int             soup_server_file_get_fd                (SoupServerFile  *file);
+GBytes         *soup_server_file_get_bytes             (SoupServerFile  *file);
+goffset         soup_server_file_get_size              (SoupServerFile  *file);
+GDateTime      *soup_server_file_get_modification_time (SoupServerFile  *file);
+const char     *soup_server_file_get_etag              (SoupServerFile  *file);
+gboolean        soup_server_file_get_offset            (SoupServerFile  *file,
+                                                        GBytes          *bytes,
+                                                        goffset         *offset);
+
+G_END_DECLS
@@ -60,3 +60,10 @@ soup_server_message_io_is_paused (SoupServerMessageIO *io,
 {
         return io->funcs->is_paused (io, msg);
 }
+
+GInputStream *
+soup_server_message_io_get_request_body_stream (SoupServerMessageIO *io,
+                                                SoupServerMessage   *msg)
+{
+        return io->funcs->get_request_body_stream (io, msg);
+}
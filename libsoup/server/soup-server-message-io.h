@@ -25,6 +25,8 @@ typedef struct {
                                     SoupServerMessage         *msg);
         gboolean   (*is_paused)    (SoupServerMessageIO       *io,
                                     SoupServerMessage         *msg);
+        GInputStream *(*get_request_body_stream) (SoupServerMessageIO *io,
+                                                  SoupServerMessage   *msg);
 } SoupServerMessageIOFuncs;
 
 struct _SoupServerMessageIO {
@@ -48,3 +50,5 @@ void       soup_server_message_io_unpause      (SoupServerMessageIO       *io,
                                                 SoupServerMessage         *msg);
 gboolean   soup_server_message_io_is_paused    (SoupServerMessageIO       *io,
                                                 SoupServerMessage         *msg);
+GInputStream *soup_server_message_io_get_request_body_stream (SoupServerMessageIO *io,
+                                                              SoupServerMessage   *msg);
@@ -9,6 +9,8 @@
 #include "soup-auth-domain.h"
 #include "soup-message-io-data.h"
 #include "soup-server-connection.h"
+#include "soup-server-file-cache.h"
+#include "soup-content-encoder.h"
 
 SoupServerMessage *soup_server_message_new                 (SoupServerConnection     *conn);
 void               soup_server_message_set_uri             (SoupServerMessage        *msg,
@@ -43,5 +45,19 @@ void               soup_server_message_set_options_ping    (SoupServerMessage
 
 SoupServerMessageIO *soup_server_message_get_io_data       (SoupServerMessage        *msg);
 
+SoupServerFile     *soup_server_message_get_response_file  (SoupServerMessage        *msg);
+SoupMessageHeaders *soup_server_message_get_response_headers_template (SoupServerMessage *msg);
+
+void               soup_server_message_set_content_encoder   (SoupServerMessage        *msg,
+                                                              SoupContentEncoder       *encoder);
+void               soup_server_message_set_file_cache        (SoupServerMessage        *msg,
+                                                              SoupServerFileCache      *file_cache);
+void               soup_server_message_set_response_encoded  (SoupServerMessage        *msg);
+void               soup_server_message_prepare_response      (SoupServerMessage        *msg,
+                                                              gboolean                  can_stream);
+GBytes            *soup_server_message_encode_response_chunk (SoupServerMessage        *msg,
+                                                              GBytes                   *chunk,
+                                                              GError                  **error);
+
 
 #endif /* __SOUP_SERVER_MESSAGE_PRIVATE_H__ */
@@ -14,6 +14,9 @@
 #include "soup.h"
 #include "soup-connection.h"
 #include "soup-server-message-private.h"
+#include "soup-server-file-cache.h"
+#include "soup-content-encoder-private.h"
+#include "soup-date-utils-private.h"
 #include "soup-message-headers-private.h"
 #include "soup-uri-utils-private.h"
 
@@ -57,6 +60,13 @@ struct _SoupServerMessage {
 
         SoupMessageBody    *response_body;
         SoupMessageHeaders *response_headers;
+        SoupMessageHeaders *response_headers_template;
+        SoupServerFile     *response_file;
+        SoupServerFileCache *file_cache;
+
+        SoupContentEncoder *content_encoder;
+        GConverter         *response_converter;
+        gboolean            response_encoded;
 
         SoupServerMessageIO *io_data;
 
@@ -136,6 +146,11 @@ soup_server_message_finalize (GObject *object)
         soup_message_headers_unref (msg->request_headers);
         soup_message_body_unref (msg->response_body);
         soup_message_headers_unref (msg->response_headers);
+        g_clear_pointer (&msg->response_headers_template, soup_message_headers_unref);
+        g_clear_pointer (&msg->response_file, soup_server_file_unref);
+        g_clear_pointer (&msg->file_cache, soup_server_file_cache_unref);
+        g_clear_object (&msg->content_encoder);
+        g_clear_object (&msg->response_converter);
 
         G_OBJECT_CLASS (soup_server_message_parent_class)->finalize (object);
 }
@@ -630,6 +645,10 @@ soup_server_message_cleanup_response (SoupServerMessage *msg)
 {
         soup_message_body_truncate (msg->response_body);
         soup_message_headers_clear (msg->response_headers);
+        g_clear_pointer (&msg->response_headers_template, soup_message_headers_unref);
+        g_clear_pointer (&msg->response_file, soup_server_file_unref);
+        g_clear_object (&msg->response_converter);
+        msg->response_encoded = FALSE;
         soup_message_headers_set_encoding (msg->response_headers,
                                            SOUP_ENCODING_CONTENT_LENGTH);
         msg->status_code = SOUP_STATUS_NONE;
@@ -637,6 +656,51 @@ soup_server_message_cleanup_response (SoupServerMessage *msg)
         msg->http_version = msg->orig_http_version;
 }
 
+void
+soup_server_message_set_content_encoder (SoupServerMessage  *msg,
+                                         SoupContentEncoder *encoder)
+{
+        g_set_object (&msg->content_encoder, encoder);
+}
+
+void
+soup_server_message_set_file_cache (SoupServerMessage   *msg,
+                                    SoupServerFileCache *file_cache)
+{
+        if (file_cache)
+                soup_server_file_cache_ref (file_cache);
+        g_clear_pointer (&msg->file_cache, soup_server_file_cache_unref);
+        msg->file_cache = file_cache;
+}
+
+void
+soup_server_message_set_response_encoded (SoupServerMessage *msg)
+{
+        msg->response_encoded = TRUE;
+}
+
+void
+soup_server_message_prepare_response (SoupServerMessage *msg,
+                                      gboolean           can_stream)
+{
+        if (!msg->content_encoder || msg->response_encoded)
+                return;
+
+        msg->response_encoded = TRUE;
+        msg->response_converter = soup_content_encoder_prepare_response (msg->content_encoder, msg, can_stream);
+}
+
+GBytes *
+soup_server_message_encode_response_chunk (SoupServerMessage *msg,
+                                           GBytes            *chunk,
+                                           GError           **error)
+{
+        if (!msg->response_converter)
+                return g_bytes_ref (chunk);
+
+        return soup_content_encoder_encode_chunk (msg->response_converter, chunk, error);
+}
+
 void
 soup_server_message_wrote_informational (SoupServerMessage *msg)
 {
@@ -743,6 +807,46 @@ soup_server_message_get_request_body (SoupServerMessage *msg)
         return msg->request_body;
 }
 
+/**
+ * soup_server_message_set_response_headers_template:
+ * @msg: a #SoupServerMessage
+ * @headers: (nullable): a #SoupMessageHeaders, or %NULL
+ *
+ * Adds the headers in @headers to the response of @msg, in addition to
+ * its [method@ServerMessage.get_response_headers].
+ *
+ * This is meant for headers that are the same for many responses, like
+ * `Cache-Control` or security policy headers. @headers is not copied;
+ * it can be set on any number of messages, and for HTTP/1 it is only
+ * serialized the first time it's written, so @headers must not be
+ * modified while it's in use.
+ *
+ * The headers in @headers are not taken into account when processing
+ * the response, so it must not contain headers like `Content-Length`,
+ * `Content-Type`, `Content-Encoding`, `Transfer-Encoding` or
+ * `Connection`, nor any header also set in the response headers.
+ *
+ * Since: 3.4
+ */
+void
+soup_server_message_set_response_headers_template (SoupServerMessage  *msg,
+                                                   SoupMessageHeaders *headers)
+{
+        g_return_if_fail (SOUP_IS_SERVER_MESSAGE (msg));
+        g_return_if_fail (headers == NULL || soup_message_headers_get_headers_type (headers) == SOUP_MESSAGE_HEADERS_RESPONSE);
+
+        if (headers)
+                soup_message_headers_ref (headers);
+        g_clear_pointer (&msg->response_headers_template, soup_message_headers_unref);
+        msg->response_headers_template = headers;
+}
+
+SoupMessageHeaders *
+soup_server_message_get_response_headers_template (SoupServerMessage *msg)
+{
+        return msg->response_headers_template;
+}
+
 /**
  * soup_server_message_get_response_body:
  * @msg: a #SoupServerMessage
@@ -949,6 +1053,159 @@ soup_server_message_set_response (SoupServerMessage *msg,
         }
 }
 
+static gboolean
+etag_list_matches (const char *header,
+                   const char *etag)
+{
+        GSList *etags, *l;
+        gboolean match = FALSE;
+
+        /* Weak comparison, see RFC 9110, section 13.1.2 */
+        if (g_str_has_prefix (etag, "W/"))
+                etag += 2;
+
+        etags = soup_header_parse_list (header);
+        for (l = etags; l && !match; l = l->next) {
+                const char *candidate = l->data;
+
+                if (g_str_has_prefix (candidate, "W/"))
+                        candidate += 2;
+                match = strcmp (candidate, "*") == 0 || strcmp (candidate, etag) == 0;
+        }
+        soup_header_free_list (etags);
+
+        return match;
+}
+
+static gboolean
+response_file_not_modified (SoupServerMessage *msg,
+                            SoupServerFile    *file)
+{
+        const char *header;
+
+        header = soup_message_headers_get_list_common (msg->request_headers, SOUP_HEADER_IF_NONE_MATCH);
+        if (header)
+                return etag_list_matches (header, soup_server_file_get_etag (file));
+
+        header = soup_message_headers_get_one_common (msg->request_headers, SOUP_HEADER_IF_MODIFIED_SINCE);
+        if (header && (msg->method == SOUP_METHOD_GET || msg->method == SOUP_METHOD_HEAD)) {
+                gint64 date;
+
+                if (!soup_date_parse_http_time (header, &date))
+                        return FALSE;
+
+                /* HTTP dates have a resolution of one second */
+                return g_date_time_to_unix (soup_server_file_get_modification_time (file)) <= date;
+        }
+
+        return FALSE;
+}
+
+/**
+ * soup_server_message_set_response_file:
+ * @msg: the message
+ * @content_type: (nullable): MIME Content-Type of the body
+ * @file: the #GFile to respond with
+ * @error: return location for a #GError, or %NULL
+ *
+ * Convenience function to respond to @msg with the contents of @file.
+ *
+ * For local files, the file is memory-mapped rather than read, and when
+ * possible its contents are written to the client directly from the file
+ * descriptor with `sendfile()`, so the data never has to be copied through
+ * user space. Open files are cached by the server and shared between
+ * requests, so serving the same file again doesn't need to open it again.
+ * The file must not be truncated while it is being served; it should be
+ * replaced by renaming a new file over it instead.
+ *
+ * This sets the `ETag` and `Last-Modified` response headers, and the status
+ * code of @msg: %SOUP_STATUS_NOT_MODIFIED or
+ * %SOUP_STATUS_PRECONDITION_FAILED if the request's `If-None-Match` or
+ * `If-Modified-Since` headers say so, and %SOUP_STATUS_OK otherwise. `Range`
+ * requests are handled as for any other response body.
+ *
+ * Returns: %TRUE on success, or %FALSE if @file could not be opened, in
+ *   which case @msg is left unchanged.
+ *
+ * Since: 3.4
+ */
+gboolean
+soup_server_message_set_response_file (SoupServerMessage *msg,
+                                       const char        *content_type,
+                                       GFile             *file,
+                                       GError           **error)
+{
+        SoupServerFile *server_file;
+        const char *path;
+        char *last_modified;
+
+        g_return_val_if_fail (SOUP_IS_SERVER_MESSAGE (msg), FALSE);
+        g_return_val_if_fail (G_IS_FILE (file), FALSE);
+        g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+
+        path = g_file_peek_path (file);
+        if (!path) {
+                GBytes *bytes;
+
+                bytes = g_file_load_bytes (file, NULL, NULL, error);
+                if (!bytes)
+                        return FALSE;
+
+                soup_server_message_set_status (msg, SOUP_STATUS_OK, NULL);
+                soup_server_message_set_response (msg, content_type ? content_type : "application/octet-stream",
+                                                  SOUP_MEMORY_STATIC, NULL, 0);
+                soup_message_body_append_bytes (msg->response_body, bytes);
+                g_bytes_unref (bytes);
+
+                return TRUE;
+        }
+
+        server_file = soup_server_file_cache_lookup (msg->file_cache, path, error);
+        if (!server_file)
+                return FALSE;
+
+        soup_message_headers_replace_common (msg->response_headers, SOUP_HEADER_ETAG,
+                                             soup_server_file_get_etag (server_file));
+        last_modified = soup_date_time_to_string (soup_server_file_get_modification_time (server_file),
+                                                  SOUP_DATE_HTTP);
+        soup_message_headers_replace_common (msg->response_headers, SOUP_HEADER_LAST_MODIFIED, last_modified);
+        g_free (last_modified);
+
+        if (!content_type)
+                content_type = "application/octet-stream";
+
+        if (response_file_not_modified (msg, server_file)) {
+                if (msg->method == SOUP_METHOD_GET || msg->method == SOUP_METHOD_HEAD) {
+                        soup_server_message_set_status (msg, SOUP_STATUS_NOT_MODIFIED, NULL);
+                        /* Same ETag as the possibly compressed 200 response */
+                        if (msg->content_encoder)
+                                soup_content_encoder_process_not_modified (msg->content_encoder, msg, content_type,
+                                                                           g_bytes_get_size (soup_server_file_get_bytes (server_file)));
+                } else
+                        soup_server_message_set_status (msg, SOUP_STATUS_PRECONDITION_FAILED, NULL);
+                soup_message_body_truncate (msg->response_body);
+                soup_server_file_unref (server_file);
+
+                return TRUE;
+        }
+
+        soup_server_message_set_status (msg, SOUP_STATUS_OK, NULL);
+        soup_server_message_set_response (msg, content_type, SOUP_MEMORY_STATIC, NULL, 0);
+        soup_message_headers_replace_common (msg->response_headers, SOUP_HEADER_ACCEPT_RANGES, "bytes");
+        soup_message_body_append_bytes (msg->response_body, soup_server_file_get_bytes (server_file));
+
+        g_clear_pointer (&msg->response_file, soup_server_file_unref);
+        msg->response_file = server_file;
+
+        return TRUE;
+}
+
+SoupServerFile *
+soup_server_message_get_response_file (SoupServerMessage *msg)
+{
+        return msg->response_file;
+}
+
 /**
  * soup_server_message_set_redirect:
  * @msg: a #SoupServerMessage
@@ -1150,3 +1407,42 @@ soup_server_message_get_tls_peer_certificate_errors (SoupServerMessage *msg)
 
         return msg->tls_peer_certificate_errors;
 }
+
+/**
+ * soup_server_message_get_request_body_stream:
+ * @msg: a #SoupServerMessage
+ *
+ * Gets a stream to read the request body of @msg incrementally.
+ *
+ * This must be called from an early handler (see
+ * [method@Server.add_early_handler]) or a [signal@ServerMessage::got-headers]
+ * handler, before the request body has started to be read. After calling it,
+ * the request body is no longer read into the message's request-body, and
+ * [signal@ServerMessage::got-chunk] is not emitted; instead
+ * [signal@ServerMessage::got-body] is emitted right away, so that the
+ * non-early handler can read the body from the returned stream.
+ *
+ * The returned stream is pollable, and data is only read from the network
+ * as it is read from the stream, so slow readers apply backpressure to the
+ * client. You will normally want to call [method@ServerMessage.pause] from
+ * the handler and [method@ServerMessage.unpause] once the response is ready.
+ *
+ * If the response is sent before the whole request body has been read, the
+ * connection will be closed after the response.
+ *
+ * Returns: (transfer none) (nullable): a #GInputStream to read the request
+ *   body from, valid until @msg is finished, or %NULL if the request body
+ *   has already started to be read.
+ *
+ * Since: 3.4
+ */
+GInputStream *
+soup_server_message_get_request_body_stream (SoupServerMessage *msg)
+{
+        g_return_val_if_fail (SOUP_IS_SERVER_MESSAGE (msg), NULL);
+
+        if (!msg->io_data)
+                return NULL;
+
+        return soup_server_message_io_get_request_body_stream (msg->io_data, msg);
+}
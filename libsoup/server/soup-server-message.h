@@ -92,6 +92,19 @@ GTlsCertificate     *soup_server_message_get_tls_peer_certificate          (Soup
 SOUP_AVAILABLE_IN_3_2
 GTlsCertificateFlags soup_server_message_get_tls_peer_certificate_errors   (SoupServerMessage *msg);
 
+SOUP_AVAILABLE_IN_3_4
+GInputStream        *soup_server_message_get_request_body_stream           (SoupServerMessage *msg);
+
+SOUP_AVAILABLE_IN_3_4
+void                 soup_server_message_set_response_headers_template (SoupServerMessage  *msg,
+                                                                        SoupMessageHeaders *headers);
+
+SOUP_AVAILABLE_IN_3_4
+gboolean             soup_server_message_set_response_file (SoupServerMessage *msg,
+                                                            const char        *content_type,
+                                                            GFile             *file,
+                                                            GError           **error);
+
 G_END_DECLS
 
 #endif /* __SOUP_SERVER_MESSAGE_H__ */
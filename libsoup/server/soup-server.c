@@ -15,7 +15,9 @@
 
 #include "soup-server-private.h"
 #include "soup-server-message-private.h"
+#include "soup-content-encoder-private.h"
 #include "soup-message-headers-private.h"
+#include "soup-date-utils-private.h"
 #include "soup.h"
 #include "soup-misc.h"
 #include "soup-path-map.h"
@@ -163,6 +165,9 @@ typedef struct {
 
 	GPtrArray         *websocket_extension_types;
 
+	SoupContentEncoder *content_encoder;
+	SoupServerFileCache *file_cache;
+
 	gboolean           disposed;
         gboolean           http2_enabled;
 
@@ -213,6 +218,7 @@ soup_server_init (SoupServer *server)
 
         priv->http2_enabled = !!g_getenv ("SOUP_SERVER_HTTP2");
 	priv->handlers = soup_path_map_new ((GDestroyNotify)free_handler);
+	priv->file_cache = soup_server_file_cache_new ();
 
 	priv->websocket_extension_types = g_ptr_array_new_with_free_func ((GDestroyNotify)g_type_class_unref);
 
@@ -228,6 +234,7 @@ soup_server_dispose (GObject *object)
 
 	priv->disposed = TRUE;
 	soup_server_disconnect (server);
+	soup_server_file_cache_clear (priv->file_cache);
 
 	G_OBJECT_CLASS (soup_server_parent_class)->dispose (object);
 }
@@ -251,6 +258,9 @@ soup_server_finalize (GObject *object)
 
 	g_ptr_array_free (priv->websocket_extension_types, TRUE);
 
+	g_clear_object (&priv->content_encoder);
+	soup_server_file_cache_unref (priv->file_cache);
+
 	G_OBJECT_CLASS (soup_server_parent_class)->finalize (object);
 }
 
@@ -836,8 +846,7 @@ got_headers (SoupServer        *server,
 	SoupServerPrivate *priv = soup_server_get_instance_private (server);
 	SoupServerHandler *handler;
 	GUri *uri;
-	GDateTime *date;
-	char *date_string;
+	char date_string[SOUP_HTTP_DATE_BUFFER_SIZE];
 	SoupAuthDomain *domain;
 	GSList *iter;
 	gboolean rejected = FALSE;
@@ -848,11 +857,8 @@ got_headers (SoupServer        *server,
 	/* Add required response headers */
 	headers = soup_server_message_get_response_headers (msg);
 
-	date = g_date_time_new_now_utc ();
-	date_string = soup_date_time_to_string (date, SOUP_DATE_HTTP);
+	soup_date_get_http_now (date_string);
 	soup_message_headers_replace_common (headers, SOUP_HEADER_DATE, date_string);
-	g_free (date_string);
-	g_date_time_unref (date);
 
 	if (soup_server_message_get_status (msg) != 0)
 		return;
@@ -977,8 +983,13 @@ got_body (SoupServer        *server,
 	}
 
 	call_handler (server, handler, msg, FALSE);
-	if (soup_server_message_get_status (msg) != 0)
+	if (soup_server_message_get_status (msg) != 0) {
+		SoupServerPrivate *priv = soup_server_get_instance_private (server);
+
+		if (priv->content_encoder && !soup_server_message_is_io_paused (msg))
+			soup_content_encoder_process_response (priv->content_encoder, msg);
 		return;
+	}
 
 	if (handler->websocket_callback) {
 		SoupServerPrivate *priv;
@@ -1029,6 +1040,10 @@ request_started_cb (SoupServer           *server,
                                  G_CALLBACK (got_body),
                                  server, G_CONNECT_SWAPPED);
 
+        if (priv->content_encoder)
+                soup_server_message_set_content_encoder (msg, priv->content_encoder);
+        soup_server_message_set_file_cache (msg, priv->file_cache);
+
         if (priv->server_header) {
                 SoupMessageHeaders *headers;
 
@@ -1717,6 +1732,11 @@ soup_server_add_handler (SoupServer            *server,
  * long as you have not set the status-code by the time
  * [signal@ServerMessage::got-body] is emitted, the non-early handler will be
  * run as well.
+ *
+ * Alternatively, call [method@ServerMessage.get_request_body_stream] from the
+ * early handler to read the request body yourself. The non-early handler will
+ * then be run right away, and the body is only read from the network as fast
+ * as you read it from the stream.
  **/
 void
 soup_server_add_early_handler (SoupServer            *server,
@@ -2001,6 +2021,53 @@ soup_server_remove_websocket_extension (SoupServer *server, GType extension_type
         }
 }
 
+/**
+ * soup_server_set_content_encoder:
+ * @server: a #SoupServer
+ * @encoder: (nullable): a #SoupContentEncoder, or %NULL
+ *
+ * Sets the [class@ContentEncoder] used to compress the responses of
+ * @server, or disables response compression if @encoder is %NULL.
+ *
+ * Only requests started after this call are affected.
+ *
+ * Since: 3.4
+ */
+void
+soup_server_set_content_encoder (SoupServer         *server,
+                                 SoupContentEncoder *encoder)
+{
+        SoupServerPrivate *priv;
+
+        g_return_if_fail (SOUP_IS_SERVER (server));
+        g_return_if_fail (encoder == NULL || SOUP_IS_CONTENT_ENCODER (encoder));
+
+        priv = soup_server_get_instance_private (server);
+        g_set_object (&priv->content_encoder, encoder);
+}
+
+/**
+ * soup_server_get_content_encoder:
+ * @server: a #SoupServer
+ *
+ * Gets the [class@ContentEncoder] used to compress the responses of
+ * @server.
+ *
+ * Returns: (transfer none) (nullable): a #SoupContentEncoder, or %NULL
+ *
+ * Since: 3.4
+ */
+SoupContentEncoder *
+soup_server_get_content_encoder (SoupServer *server)
+{
+        SoupServerPrivate *priv;
+
+        g_return_val_if_fail (SOUP_IS_SERVER (server), NULL);
+
+        priv = soup_server_get_instance_private (server);
+        return priv->content_encoder;
+}
+
 void
 soup_server_set_http2_enabled (SoupServer *server,
                                gboolean    enabled)
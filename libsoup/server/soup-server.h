@@ -7,6 +7,7 @@
 
 #include "soup-types.h"
 #include "soup-uri-utils.h"
+#include "soup-content-encoder.h"
 #include "soup-websocket-connection.h"
 
 G_BEGIN_DECLS
@@ -138,6 +139,12 @@ SOUP_AVAILABLE_IN_ALL
 void            soup_server_remove_websocket_extension (SoupServer *server,
 							GType       extension_type);
 
+SOUP_AVAILABLE_IN_3_4
+void                soup_server_set_content_encoder (SoupServer         *server,
+                                                     SoupContentEncoder *encoder);
+SOUP_AVAILABLE_IN_3_4
+SoupContentEncoder *soup_server_get_content_encoder (SoupServer         *server);
+
 SOUP_AVAILABLE_IN_ALL
 void            soup_server_remove_handler     (SoupServer         *server,
 					        const char         *path);
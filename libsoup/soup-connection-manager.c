@@ -11,7 +11,6 @@
 #include "soup-message-private.h"
 #include "soup-misc.h"
 #include "soup-session-private.h"
-#include "soup-uri-utils-private.h"
 #include "soup.h"
 
 struct _SoupConnectionManager {
@@ -24,15 +23,14 @@ struct _SoupConnectionManager {
         guint max_conns_per_host;
         guint num_conns;
 
-        GHashTable *http_hosts;
-        GHashTable *https_hosts;
+        GHashTable *hosts;
         GHashTable *conns;
 
         guint64 last_connection_id;
 };
 
 typedef struct {
-        GUri *uri;
+        SoupOrigin *origin;
         GMutex *mutex;
         GHashTable *owner_map;
         GNetworkAddress *addr;
@@ -47,33 +45,27 @@ typedef struct {
 #define HOST_KEEP_ALIVE 5 * 60 * 1000 /* 5 min in msecs */
 
 static SoupHost *
-soup_host_new (GUri         *uri,
+soup_host_new (SoupOrigin   *origin,
                GHashTable   *owner_map,
                GMutex       *mutex,
                GMainContext *context)
 {
         SoupHost *host;
-        const char *scheme = g_uri_get_scheme (uri);
 
         host = g_new0 (SoupHost, 1);
         host->owner_map = owner_map;
         host->mutex = mutex;
-        if (g_strcmp0 (scheme, "http") != 0 && g_strcmp0 (scheme, "https") != 0) {
-                host->uri = soup_uri_copy (uri,
-                                           SOUP_URI_SCHEME, soup_uri_is_https (uri) ? "https" : "http",
-                                           SOUP_URI_NONE);
-        } else
-                host->uri = g_uri_ref (uri);
+        host->origin = soup_origin_ref (origin);
 
         host->addr = g_object_new (G_TYPE_NETWORK_ADDRESS,
-                                   "hostname", g_uri_get_host (host->uri),
-                                   "port", g_uri_get_port (host->uri),
-                                   "scheme", g_uri_get_scheme (host->uri),
+                                   "hostname", soup_origin_get_host (origin),
+                                   "port", soup_origin_get_port (origin),
+                                   "scheme", soup_origin_get_scheme (origin),
                                    NULL);
 
         host->context = context;
 
-        g_hash_table_insert (host->owner_map, host->uri, host);
+        g_hash_table_insert (host->owner_map, host->origin, host);
 
         return host;
 }
@@ -88,43 +80,11 @@ soup_host_free (SoupHost *host)
                 g_source_unref (host->keep_alive_src);
         }
 
-        g_uri_unref (host->uri);
+        soup_origin_unref (host->origin);
         g_object_unref (host->addr);
         g_free (host);
 }
 
-/* Note that we can't use soup_uri_host_hash() and soup_uri_host_equal()
- * because we want to ignore the protocol; http://example.com and
- * webcal://example.com are the same host.
- */
-static guint
-soup_host_uri_hash (gconstpointer key)
-{
-        GUri *uri = (GUri*)key;
-
-        g_warn_if_fail (uri != NULL && g_uri_get_host (uri) != NULL);
-
-        return g_uri_get_port (uri) + soup_str_case_hash (g_uri_get_host (uri));
-}
-
-static gboolean
-soup_host_uri_equal (gconstpointer v1, gconstpointer v2)
-{
-        GUri *one = (GUri*)v1;
-        GUri *two = (GUri*)v2;
-
-        g_warn_if_fail (one != NULL && two != NULL);
-
-        const char *one_host = g_uri_get_host (one);
-        const char *two_host = g_uri_get_host (two);
-        g_warn_if_fail (one_host != NULL && two_host != NULL);
-
-        if (g_uri_get_port (one) != g_uri_get_port (two))
-                return FALSE;
-
-        return g_ascii_strcasecmp (one_host, two_host) == 0;
-}
-
 static gboolean
 free_unused_host (gpointer user_data)
 {
@@ -137,7 +97,7 @@ free_unused_host (gpointer user_data)
 
         if (!host->conns) {
                 /* This will free the host in addition to removing it from the hash table */
-                g_hash_table_remove (host->owner_map, host->uri);
+                g_hash_table_remove (host->owner_map, host->origin);
         }
 
         g_mutex_unlock (mutex);
@@ -179,29 +139,27 @@ soup_host_remove_connection (SoupHost       *host,
         }
 }
 
+/* Hosts are keyed by the interned origin of the message, which
+ * ignores the protocol: http://example.com and webcal://example.com
+ * are the same host.
+ */
 static SoupHost *
 soup_connection_manager_get_host_for_message (SoupConnectionManager *manager,
                                               SoupMessage           *msg)
 {
-        GUri *uri = soup_message_get_uri (msg);
-        GHashTable *map;
-
-        map = soup_uri_is_https (uri) ?  manager->https_hosts : manager->http_hosts;
-        return g_hash_table_lookup (map, uri);
+        return g_hash_table_lookup (manager->hosts, soup_message_get_origin (msg));
 }
 
 static SoupHost *
 soup_connection_manager_get_or_create_host_for_item (SoupConnectionManager *manager,
                                                      SoupMessageQueueItem  *item)
 {
-        GUri *uri = soup_message_get_uri (item->msg);
-        GHashTable *map;
+        SoupOrigin *origin = soup_message_get_origin (item->msg);
         SoupHost *host;
 
-        map = soup_uri_is_https (uri) ?  manager->https_hosts : manager->http_hosts;
-        host = g_hash_table_lookup (map, uri);
+        host = g_hash_table_lookup (manager->hosts, origin);
         if (!host)
-                host = soup_host_new (uri, map, &manager->mutex, soup_session_get_context (item->session));
+                host = soup_host_new (origin, manager->hosts, &manager->mutex, soup_session_get_context (item->session));
 
         return host;
 }
@@ -217,14 +175,8 @@ soup_connection_manager_new (SoupSession *session,
         manager->session = session;
         manager->max_conns = max_conns;
         manager->max_conns_per_host = max_conns_per_host;
-        manager->http_hosts = g_hash_table_new_full (soup_host_uri_hash,
-                                                     soup_host_uri_equal,
-                                                     NULL,
-                                                     (GDestroyNotify)soup_host_free);
-        manager->https_hosts = g_hash_table_new_full (soup_host_uri_hash,
-                                                      soup_host_uri_equal,
-                                                      NULL,
-                                                      (GDestroyNotify)soup_host_free);
+        manager->hosts = g_hash_table_new_full (NULL, NULL, NULL,
+                                                (GDestroyNotify)soup_host_free);
         manager->conns = g_hash_table_new (NULL, NULL);
         g_mutex_init (&manager->mutex);
         g_cond_init (&manager->cond);
@@ -236,8 +188,7 @@ void
 soup_connection_manager_free (SoupConnectionManager *manager)
 {
         g_clear_object (&manager->remote_connectable);
-        g_hash_table_destroy (manager->http_hosts);
-        g_hash_table_destroy (manager->https_hosts);
+        g_hash_table_destroy (manager->hosts);
         g_hash_table_destroy (manager->conns);
         g_mutex_clear (&manager->mutex);
         g_cond_clear (&manager->cond);
@@ -490,7 +441,7 @@ soup_connection_manager_get_connection_locked (SoupConnectionManager *manager,
                              "id", ++manager->last_connection_id,
                              "context", soup_session_get_context (item->session),
                              "remote-connectable", remote_connectable,
-                             "ssl", soup_uri_is_https (host->uri),
+                             "ssl", soup_origin_is_https (host->origin),
                              "socket-properties", socket_props,
                              "force-http-version", force_http_version,
                              NULL);
@@ -20,11 +20,23 @@
 #pragma once
 
 #include "soup-types.h"
+#include "soup-date-utils.h"
 
 G_BEGIN_DECLS
 
 gboolean        soup_date_time_is_past          (GDateTime      *date);
 
+/* "Sun, 06 Nov 1994 08:49:37 GMT" plus the nul terminator */
+#define SOUP_HTTP_DATE_BUFFER_SIZE 30
+
+void            soup_date_get_http_now          (char           *buffer);
+
+void            soup_date_format_http_time      (gint64          time,
+                                                 SoupDateFormat  format,
+                                                 char           *buffer);
+gboolean        soup_date_parse_http_time       (const char     *date_string,
+                                                 gint64         *time);
+
 G_END_DECLS
 
 
@@ -22,6 +22,7 @@
 #endif
 
 #include <stdlib.h>
+#include <string.h>
 
 #include "soup-date-utils.h"
 #include "soup-date-utils-private.h"
@@ -68,10 +69,85 @@ static const char *const months[] = {
 };
 
 /* Do not internationalize */
-static const char *const days[] = {
+static const char *const days_of_week[] = {
 	"Mon", "Tue", "Wed", "Thu", "Fri", "Sat", "Sun"
 };
 
+/* The range of years GDateTime supports */
+#define MIN_UNIX_TIME G_GINT64_CONSTANT (-62135596800) /* 0001-01-01 00:00:00 */
+#define MAX_UNIX_TIME G_GINT64_CONSTANT (253402300799) /* 9999-12-31 23:59:59 */
+
+/* Converts between Unix days and proleptic Gregorian dates, without
+ * going through GDateTime. See
+ * http://howardhinnant.github.io/date_algorithms.html
+ */
+static gint64
+days_from_civil (int year, int month, int day)
+{
+        gint64 era;
+        int year_of_era, day_of_year, day_of_era;
+
+        year -= month <= 2;
+        era = (year >= 0 ? year : year - 399) / 400;
+        year_of_era = year - era * 400;
+        day_of_year = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+        day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+
+        return era * 146097 + day_of_era - 719468;
+}
+
+static void
+civil_from_days (gint64 days, int *year, int *month, int *day)
+{
+        gint64 era;
+        int year_of_era, day_of_year, day_of_era, mp;
+
+        days += 719468;
+        era = (days >= 0 ? days : days - 146096) / 146097;
+        day_of_era = days - era * 146097;
+        year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524 - day_of_era / 146096) / 365;
+        day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+        mp = (5 * day_of_year + 2) / 153;
+
+        *day = day_of_year - (153 * mp + 2) / 5 + 1;
+        *month = mp < 10 ? mp + 3 : mp - 9;
+        *year = year_of_era + era * 400 + (*month <= 2);
+}
+
+/**
+ * soup_date_format_http_time:
+ * @time: a Unix time
+ * @format: %SOUP_DATE_HTTP or %SOUP_DATE_COOKIE
+ * @buffer: a buffer of at least %SOUP_HTTP_DATE_BUFFER_SIZE bytes
+ *
+ * Writes @time to @buffer in @format, like soup_date_time_to_string()
+ * but without creating a #GDateTime.
+ */
+void
+soup_date_format_http_time (gint64          time,
+                            SoupDateFormat  format,
+                            char           *buffer)
+{
+        gint64 days, seconds;
+        int year, month, day;
+
+        time = CLAMP (time, MIN_UNIX_TIME, MAX_UNIX_TIME);
+        days = time / 86400;
+        seconds = time % 86400;
+        if (seconds < 0) {
+                seconds += 86400;
+                days--;
+        }
+        civil_from_days (days, &year, &month, &day);
+
+        /* 1970-01-01 was a Thursday */
+        g_snprintf (buffer, SOUP_HTTP_DATE_BUFFER_SIZE,
+                    format == SOUP_DATE_COOKIE ? "%s, %02d-%s-%04d %02d:%02d:%02d GMT" : "%s, %02d %s %04d %02d:%02d:%02d GMT",
+                    days_of_week[((days + 3) % 7 + 7) % 7],
+                    day, months[month - 1], year,
+                    (int)(seconds / 3600), (int)(seconds / 60 % 60), (int)(seconds % 60));
+}
+
 /**
  * soup_date_time_to_string:
  * @date: a #GDateTime
@@ -88,35 +164,44 @@ soup_date_time_to_string (GDateTime      *date,
 	g_return_val_if_fail (date != NULL, NULL);
 
 	if (format == SOUP_DATE_HTTP || format == SOUP_DATE_COOKIE) {
-		/* HTTP and COOKIE formats require UTC timestamp, so coerce
-		 * @date if it's non-UTC.
-		 */
-		GDateTime *utcdate = g_date_time_to_utc (date);
-                char *date_format;
-                char *formatted_date;
-
-                // We insert days/months ourselves to avoid locale specific formatting
-                if (format == SOUP_DATE_HTTP) {
-			/* "Sun, 06 Nov 1994 08:49:37 GMT" */
-                        date_format = g_strdup_printf ("%s, %%d %s %%Y %%T GMT",
-                                                       days[g_date_time_get_day_of_week (utcdate) - 1],
-                                                       months[g_date_time_get_month (utcdate) - 1]);
-                } else {
-			/* "Sun, 06-Nov-1994 08:49:37 GMT" */
-                        date_format = g_strdup_printf ("%s, %%d-%s-%%Y %%T GMT",
-                                                       days[g_date_time_get_day_of_week (utcdate) - 1],
-                                                       months[g_date_time_get_month (utcdate) - 1]);
-		}
+                char buffer[SOUP_HTTP_DATE_BUFFER_SIZE];
 
-                formatted_date = g_date_time_format (utcdate, (const char*)date_format);
-                g_date_time_unref (utcdate);
-                g_free (date_format);
-                return formatted_date;
+		/* HTTP and COOKIE formats require UTC timestamp, which
+		 * the Unix time already is.
+		 */
+                soup_date_format_http_time (g_date_time_to_unix (date), format, buffer);
+                return g_strdup (buffer);
 	}
 
         g_return_val_if_reached (NULL);
 }
 
+static GMutex http_now_mutex;
+static gint64 http_now_time = -1;
+static char http_now[SOUP_HTTP_DATE_BUFFER_SIZE];
+
+/**
+ * soup_date_get_http_now:
+ * @buffer: a buffer of at least %SOUP_HTTP_DATE_BUFFER_SIZE bytes
+ *
+ * Writes the current time in %SOUP_DATE_HTTP format to @buffer. The
+ * string is only formatted again when the time changes, once per
+ * second, and is shared by all threads.
+ */
+void
+soup_date_get_http_now (char *buffer)
+{
+        gint64 now = g_get_real_time () / G_USEC_PER_SEC;
+
+        g_mutex_lock (&http_now_mutex);
+        if (now != http_now_time) {
+                soup_date_format_http_time (now, SOUP_DATE_HTTP, http_now);
+                http_now_time = now;
+        }
+        memcpy (buffer, http_now, SOUP_HTTP_DATE_BUFFER_SIZE);
+        g_mutex_unlock (&http_now_mutex);
+}
+
 static inline gboolean
 parse_day (int *day, const char **date_string)
 {
@@ -241,6 +326,105 @@ parse_timezone (GTimeZone **timezone, const char **date_string)
 	return TRUE;
 }
 
+static inline int
+parse_digits (const char *s, int n_digits)
+{
+        int value = 0;
+        int i;
+
+        for (i = 0; i < n_digits; i++) {
+                if (!g_ascii_isdigit (s[i]))
+                        return -1;
+                value = value * 10 + s[i] - '0';
+        }
+
+        return value;
+}
+
+static gboolean
+is_leap_year (int year)
+{
+        return (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
+}
+
+/* Parses the IMF-fixdate format that RFC 7231 requires senders to use,
+ * "Sun, 06 Nov 1994 08:49:37 GMT", straight into a Unix time. Anything
+ * else is left to parse_textual_date().
+ */
+static gboolean
+parse_imf_fixdate (const char *date_string, gint64 *time)
+{
+        static const int days_in_month[] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+        const char *s = date_string;
+        int day, month, year, hour, minute, second;
+
+        /* Every check stops at the nul terminator, so the string is
+         * never read past its end.
+         */
+        if (!g_ascii_isalpha (s[0]) || !g_ascii_isalpha (s[1]) || !g_ascii_isalpha (s[2]) ||
+            s[3] != ',' || s[4] != ' ')
+                return FALSE;
+
+        day = parse_digits (s + 5, 2);
+        if (day < 0 || s[7] != ' ')
+                return FALSE;
+
+        for (month = 0; month < G_N_ELEMENTS (months); month++) {
+                if (!g_ascii_strncasecmp (s + 8, months[month], 3))
+                        break;
+        }
+        if (month == G_N_ELEMENTS (months) || s[11] != ' ')
+                return FALSE;
+        month++;
+
+        year = parse_digits (s + 12, 4);
+        if (year < 0 || s[16] != ' ')
+                return FALSE;
+
+        hour = parse_digits (s + 17, 2);
+        if (hour < 0 || s[19] != ':')
+                return FALSE;
+        minute = parse_digits (s + 20, 2);
+        if (minute < 0 || s[22] != ':')
+                return FALSE;
+        second = parse_digits (s + 23, 2);
+        if (second < 0 || strcmp (s + 25, " GMT") != 0)
+                return FALSE;
+
+        /* Out of range values are rejected by GDateTime, so let
+         * parse_textual_date() handle them.
+         */
+        if (year < 1 || day < 1 ||
+            day > days_in_month[month - 1] + (month == 2 && is_leap_year (year)) ||
+            hour > 23 || minute > 59 || second > 59)
+                return FALSE;
+
+        *time = days_from_civil (year, month, day) * 86400 + hour * 3600 + minute * 60 + second;
+        return TRUE;
+}
+
+static const char *
+skip_to_date (const char *date_string)
+{
+	while (g_ascii_isspace (*date_string))
+		date_string++;
+
+        /* If it starts with a digit, it's either an ISO 8601 date, or
+         * an RFC2822 date without the optional weekday; in the later
+         * case, there will be a month name later on, so look for one
+         * of the month-start letters.
+         * Previous versions of this library supported parsing iso8601 strings
+         * however g_date_time_new_from_iso8601() should be used now. Just
+         * catch those in case for testing.
+         */
+	if (G_UNLIKELY (g_ascii_isdigit (*date_string) && !strpbrk (date_string, "JFMASOND"))) {
+                g_debug ("Unsupported format passed to soup_date_time_new_from_http_string(): %s", date_string);
+                return NULL;
+        }
+
+        return date_string;
+}
+
 static GDateTime *
 parse_textual_date (const char *date_string)
 {
@@ -310,23 +494,89 @@ parse_textual_date (const char *date_string)
 GDateTime *
 soup_date_time_new_from_http_string (const char *date_string)
 {
-        g_return_val_if_fail (date_string != NULL, NULL);
+        gint64 time;
 
-	while (g_ascii_isspace (*date_string))
-		date_string++;
+        g_return_val_if_fail (date_string != NULL, NULL);
 
-        /* If it starts with a digit, it's either an ISO 8601 date, or
-         * an RFC2822 date without the optional weekday; in the later
-         * case, there will be a month name later on, so look for one
-         * of the month-start letters.
-         * Previous versions of this library supported parsing iso8601 strings
-         * however g_date_time_new_from_iso8601() should be used now. Just
-         * catch those in case for testing.
-         */
-	if (G_UNLIKELY (g_ascii_isdigit (*date_string) && !strpbrk (date_string, "JFMASOND"))) {
-                g_debug ("Unsupported format passed to soup_date_time_new_from_http_string(): %s", date_string);
+        date_string = skip_to_date (date_string);
+        if (!date_string)
                 return NULL;
-        }
+
+        if (parse_imf_fixdate (date_string, &time))
+                return g_date_time_new_from_unix_utc (time);
 
 	return parse_textual_date (date_string);
 }
+
+/* Dates in the other formats are remembered, as the same Date and
+ * Expires values tend to be seen many times in a row.
+ */
+#define DATE_CACHE_SIZE 8
+#define DATE_CACHE_MAX_LENGTH 40
+
+typedef struct {
+        char date_string[DATE_CACHE_MAX_LENGTH];
+        gint64 time;
+} SoupDateCacheEntry;
+
+static GMutex date_cache_mutex;
+static SoupDateCacheEntry date_cache[DATE_CACHE_SIZE];
+static guint date_cache_next;
+
+/**
+ * soup_date_parse_http_time:
+ * @date_string: the date as a string
+ * @time: (out): return location for the Unix time
+ *
+ * Parses @date_string like soup_date_time_new_from_http_string(), but
+ * into a Unix time.
+ *
+ * Returns: %TRUE if @date_string could be parsed
+ */
+gboolean
+soup_date_parse_http_time (const char *date_string,
+                           gint64     *time)
+{
+        GDateTime *date;
+        gsize length;
+        guint i;
+
+        g_return_val_if_fail (date_string != NULL, FALSE);
+
+        date_string = skip_to_date (date_string);
+        if (!date_string)
+                return FALSE;
+
+        if (parse_imf_fixdate (date_string, time))
+                return TRUE;
+
+        length = strlen (date_string);
+        if (length > 0 && length < DATE_CACHE_MAX_LENGTH) {
+                g_mutex_lock (&date_cache_mutex);
+                for (i = 0; i < DATE_CACHE_SIZE; i++) {
+                        if (!strcmp (date_cache[i].date_string, date_string)) {
+                                *time = date_cache[i].time;
+                                g_mutex_unlock (&date_cache_mutex);
+                                return TRUE;
+                        }
+                }
+                g_mutex_unlock (&date_cache_mutex);
+        }
+
+        date = parse_textual_date (date_string);
+        if (!date)
+                return FALSE;
+
+        *time = g_date_time_to_unix (date);
+        g_date_time_unref (date);
+
+        if (length > 0 && length < DATE_CACHE_MAX_LENGTH) {
+                g_mutex_lock (&date_cache_mutex);
+                memcpy (date_cache[date_cache_next].date_string, date_string, length + 1);
+                date_cache[date_cache_next].time = *time;
+                date_cache_next = (date_cache_next + 1) % DATE_CACHE_SIZE;
+                g_mutex_unlock (&date_cache_mutex);
+        }
+
+        return TRUE;
+}
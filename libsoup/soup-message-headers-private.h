@@ -31,5 +31,6 @@ gboolean    soup_message_headers_header_contains_common (SoupMessageHeaders *hdr
 gboolean    soup_message_headers_header_equals_common   (SoupMessageHeaders *hdrs,
                                                          SoupHeaderName      name,
                                                          const char         *value);
+GBytes     *soup_message_headers_get_serialized         (SoupMessageHeaders *hdrs);
 
 G_END_DECLS
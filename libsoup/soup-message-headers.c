@@ -56,6 +56,9 @@ struct _SoupMessageHeaders {
 	goffset content_length;
 	SoupExpectation expectations;
 	char *content_type;
+
+        /* HTTP/1 wire format, see soup_message_headers_get_serialized() */
+        GBytes *serialized;
 };
 
 /**
@@ -217,6 +220,8 @@ soup_message_headers_clear (SoupMessageHeaders *hdrs)
 {
 	guint i;
 
+        g_clear_pointer (&hdrs->serialized, g_bytes_unref);
+
         if (hdrs->common_headers) {
                 SoupCommonHeader *hdr_array_common = (SoupCommonHeader *)hdrs->common_headers->data;
 
@@ -282,6 +287,7 @@ soup_message_headers_append_common (SoupMessageHeaders *hdrs,
         g_array_append_val (hdrs->common_headers, header);
         if (hdrs->common_concat)
                 g_hash_table_remove (hdrs->common_concat, GUINT_TO_POINTER (header.name));
+        g_clear_pointer (&hdrs->serialized, g_bytes_unref);
 
         soup_message_headers_set (hdrs, name, value);
 }
@@ -344,6 +350,7 @@ soup_message_headers_append (SoupMessageHeaders *hdrs,
 	g_array_append_val (hdrs->uncommon_headers, header);
 	if (hdrs->uncommon_concat)
 		g_hash_table_remove (hdrs->uncommon_concat, header.name);
+        g_clear_pointer (&hdrs->serialized, g_bytes_unref);
 }
 
 /*
@@ -478,6 +485,7 @@ soup_message_headers_remove_common (SoupMessageHeaders *hdrs,
 
         if (hdrs->common_concat)
                 g_hash_table_remove (hdrs->common_concat, GUINT_TO_POINTER (name));
+        g_clear_pointer (&hdrs->serialized, g_bytes_unref);
 
         soup_message_headers_set (hdrs, name, NULL);
 }
@@ -519,6 +527,7 @@ soup_message_headers_remove (SoupMessageHeaders *hdrs, const char *name)
 
 	if (hdrs->uncommon_concat)
 		g_hash_table_remove (hdrs->uncommon_concat, name);
+        g_clear_pointer (&hdrs->serialized, g_bytes_unref);
 }
 
 const char *
@@ -841,6 +850,50 @@ soup_message_headers_iter_next (SoupMessageHeadersIter *iter,
         return FALSE;
 }
 
+/*
+ * soup_message_headers_get_serialized:
+ * @hdrs: a #SoupMessageHeaders
+ *
+ * Gets @hdrs in HTTP/1 wire format, a "Name: value\r\n" line per
+ * header. The result is cached until @hdrs is modified, so headers
+ * that are sent many times are only serialized once.
+ *
+ * Returns: (transfer full): the serialized headers
+ */
+GBytes *
+soup_message_headers_get_serialized (SoupMessageHeaders *hdrs)
+{
+        SoupMessageHeadersIter iter;
+        const char *name, *value;
+        GBytes *serialized;
+        GString *str;
+        gsize len = 0;
+
+        serialized = g_atomic_pointer_get (&hdrs->serialized);
+        if (serialized)
+                return g_bytes_ref (serialized);
+
+        soup_message_headers_iter_init (&iter, hdrs);
+        while (soup_message_headers_iter_next (&iter, &name, &value))
+                len += strlen (name) + strlen (value) + 4;
+
+        str = g_string_sized_new (len + 1);
+        soup_message_headers_iter_init (&iter, hdrs);
+        while (soup_message_headers_iter_next (&iter, &name, &value)) {
+                g_string_append (str, name);
+                g_string_append_len (str, ": ", 2);
+                g_string_append (str, value);
+                g_string_append_len (str, "\r\n", 2);
+        }
+        serialized = g_string_free_to_bytes (str);
+
+        /* Templates may be shared by servers running in different threads */
+        if (!g_atomic_pointer_compare_and_exchange (&hdrs->serialized, NULL, serialized))
+                return serialized;
+
+        return g_bytes_ref (serialized);
+}
+
 /**
  * SoupMessageHeadersForeachFunc:
  * @name: the header name
@@ -12,6 +12,7 @@
 #include "auth/soup-auth.h"
 #include "content-sniffer/soup-content-sniffer.h"
 #include "soup-session.h"
+#include "soup-origin.h"
 
 void             soup_message_set_status       (SoupMessage      *msg,
 						guint             status_code,
@@ -43,6 +44,9 @@ void           soup_message_set_proxy_auth (SoupMessage *msg,
 SoupAuth      *soup_message_get_proxy_auth (SoupMessage *msg);
 GUri          *soup_message_get_uri_for_auth (SoupMessage *msg);
 
+SoupOrigin    *soup_message_get_origin     (SoupMessage *msg);
+SoupOrigin    *soup_message_get_first_party_origin (SoupMessage *msg);
+
 /* I/O */
 void       soup_message_io_run         (SoupMessage *msg,
 					gboolean     blocking);
@@ -69,6 +69,7 @@ typedef struct {
 	SoupHTTPVersion    http_version, orig_http_version;
 
 	GUri              *uri;
+        SoupOrigin        *origin;
 
 	SoupAuth          *auth, *proxy_auth;
 	GWeakRef           connection;
@@ -76,6 +77,7 @@ typedef struct {
 	GHashTable        *disabled_features;
 
 	GUri              *first_party;
+        SoupOrigin        *first_party_origin;
 	GUri              *site_for_cookies;
 
 	GTlsCertificate      *tls_peer_certificate;
@@ -195,7 +197,9 @@ soup_message_finalize (GObject *object)
         g_weak_ref_clear (&priv->connection);
 
 	g_clear_pointer (&priv->uri, g_uri_unref);
+        g_clear_pointer (&priv->origin, soup_origin_unref);
 	g_clear_pointer (&priv->first_party, g_uri_unref);
+        g_clear_pointer (&priv->first_party_origin, soup_origin_unref);
 	g_clear_pointer (&priv->site_for_cookies, g_uri_unref);
         g_clear_pointer (&priv->metrics, soup_message_metrics_free);
         g_clear_pointer (&priv->tls_ciphersuite_name, g_free);
@@ -2151,9 +2155,24 @@ soup_message_set_uri (SoupMessage *msg, GUri *uri)
         }
 
 	priv->uri = normalized_uri;
+        g_clear_pointer (&priv->origin, soup_origin_unref);
 	g_object_notify_by_pspec (G_OBJECT (msg), properties[PROP_URI]);
 }
 
+/* Gets the origin of @msg's URI. It's computed the first time it's
+ * needed after the URI changes.
+ */
+SoupOrigin *
+soup_message_get_origin (SoupMessage *msg)
+{
+	SoupMessagePrivate *priv = soup_message_get_instance_private (msg);
+
+        if (!priv->origin)
+                priv->origin = soup_origin_new_for_uri (priv->uri);
+
+        return priv->origin;
+}
+
 /**
  * soup_message_get_uri: (attributes org.gtk.Method.get_property=method)
  * @msg: a #SoupMessage
@@ -2358,9 +2377,25 @@ soup_message_set_first_party (SoupMessage *msg,
 	}
 
 	priv->first_party = g_steal_pointer (&first_party_normalized);
+        g_clear_pointer (&priv->first_party_origin, soup_origin_unref);
 	g_object_notify_by_pspec (G_OBJECT (msg), properties[PROP_FIRST_PARTY]);
 }
 
+/* Gets the origin of @msg's first party, or %NULL if it has none or
+ * it has no host. Like soup_message_get_origin(), it's computed the
+ * first time it's needed after the first party changes.
+ */
+SoupOrigin *
+soup_message_get_first_party_origin (SoupMessage *msg)
+{
+	SoupMessagePrivate *priv = soup_message_get_instance_private (msg);
+
+        if (!priv->first_party_origin && priv->first_party && g_uri_get_host (priv->first_party))
+                priv->first_party_origin = soup_origin_new_for_uri (priv->first_party);
+
+        return priv->first_party_origin;
+}
+
 /**
  * soup_message_get_site_for_cookies: (attributes org.gtk.Method.get_property=site-for-cookies)
  * @msg: a #SoupMessage
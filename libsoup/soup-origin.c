@@ -0,0 +1,190 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*- */
+/*
+ * soup-origin.c: interned network origins
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "soup-origin.h"
+#include "soup-misc.h"
+#include "soup-uri-utils-private.h"
+#include "soup.h"
+
+/* A SoupOrigin identifies the endpoint a request is sent to: whether
+ * it's secure, the host and the port. Other schemes are folded into
+ * http and https, so http://example.com and webcal://example.com are
+ * the same origin.
+ *
+ * Origins are interned, so there's a single SoupOrigin for each of
+ * them while it's in use, and they can be compared and hashed as
+ * pointers. The host is stored lowercased, and its base domain is
+ * looked up only once per origin.
+ */
+struct _SoupOrigin {
+        gint ref_count;
+        gboolean https;
+        int port;
+        guint hash;
+        char *host;
+        gsize base_domain; /* offset in host + 2, 1 if there's none */
+};
+
+static GMutex origins_mutex;
+static GHashTable *origins;
+
+static guint
+origin_hash (gconstpointer key)
+{
+        const SoupOrigin *origin = key;
+
+        return origin->hash;
+}
+
+static gboolean
+origin_equal (gconstpointer v1,
+              gconstpointer v2)
+{
+        const SoupOrigin *one = v1;
+        const SoupOrigin *two = v2;
+
+        return one->https == two->https &&
+                one->port == two->port &&
+                g_ascii_strcasecmp (one->host, two->host) == 0;
+}
+
+/* Takes a reference unless @origin is already being destroyed */
+static gboolean
+origin_try_ref (SoupOrigin *origin)
+{
+        int ref_count;
+
+        do {
+                ref_count = g_atomic_int_get (&origin->ref_count);
+                if (ref_count == 0)
+                        return FALSE;
+        } while (!g_atomic_int_compare_and_exchange (&origin->ref_count, ref_count, ref_count + 1));
+
+        return TRUE;
+}
+
+/**
+ * soup_origin_new_for_uri:
+ * @uri: a #GUri with a non-%NULL host
+ *
+ * Gets the origin of @uri.
+ *
+ * Returns: (transfer full): the #SoupOrigin for @uri
+ */
+SoupOrigin *
+soup_origin_new_for_uri (GUri *uri)
+{
+        SoupOrigin key, *origin;
+
+        g_return_val_if_fail (uri != NULL, NULL);
+        g_return_val_if_fail (g_uri_get_host (uri) != NULL, NULL);
+
+        key.https = soup_uri_is_https (uri);
+        key.port = g_uri_get_port (uri);
+        key.host = (char *)g_uri_get_host (uri);
+        key.hash = soup_str_case_hash (key.host) + key.port + key.https;
+
+        g_mutex_lock (&origins_mutex);
+
+        if (!origins)
+                origins = g_hash_table_new (origin_hash, origin_equal);
+
+        origin = g_hash_table_lookup (origins, &key);
+        if (origin && origin_try_ref (origin)) {
+                g_mutex_unlock (&origins_mutex);
+
+                return origin;
+        }
+
+        origin = g_new0 (SoupOrigin, 1);
+        origin->ref_count = 1;
+        origin->https = key.https;
+        origin->port = key.port;
+        origin->hash = key.hash;
+        origin->host = g_ascii_strdown (key.host, -1);
+        /* A dying origin is replaced, soup_origin_unref() frees it */
+        g_hash_table_replace (origins, origin, origin);
+
+        g_mutex_unlock (&origins_mutex);
+
+        return origin;
+}
+
+SoupOrigin *
+soup_origin_ref (SoupOrigin *origin)
+{
+        g_atomic_int_inc (&origin->ref_count);
+
+        return origin;
+}
+
+void
+soup_origin_unref (SoupOrigin *origin)
+{
+        if (!g_atomic_int_dec_and_test (&origin->ref_count))
+                return;
+
+        /* soup_origin_new_for_uri() doesn't take references to an
+         * origin once its count is zero, but it may have replaced it
+         * in the table already.
+         */
+        g_mutex_lock (&origins_mutex);
+        if (g_hash_table_lookup (origins, origin) == origin)
+                g_hash_table_remove (origins, origin);
+        g_mutex_unlock (&origins_mutex);
+
+        g_free (origin->host);
+        g_free (origin);
+}
+
+gboolean
+soup_origin_is_https (SoupOrigin *origin)
+{
+        return origin->https;
+}
+
+const char *
+soup_origin_get_scheme (SoupOrigin *origin)
+{
+        return origin->https ? "https" : "http";
+}
+
+const char *
+soup_origin_get_host (SoupOrigin *origin)
+{
+        return origin->host;
+}
+
+int
+soup_origin_get_port (SoupOrigin *origin)
+{
+        return origin->port;
+}
+
+/**
+ * soup_origin_get_base_domain:
+ * @origin: a #SoupOrigin
+ *
+ * Gets the base domain of @origin's host, as returned by
+ * soup_tld_get_base_domain().
+ *
+ * Returns: (nullable): the base domain, or %NULL if the host has none
+ */
+const char *
+soup_origin_get_base_domain (SoupOrigin *origin)
+{
+        if (g_once_init_enter (&origin->base_domain)) {
+                const char *base_domain = soup_tld_get_base_domain (origin->host, NULL);
+
+                g_once_init_leave (&origin->base_domain,
+                                   base_domain ? (gsize)(base_domain - origin->host) + 2 : 1);
+        }
+
+        return origin->base_domain > 1 ? origin->host + origin->base_domain - 2 : NULL;
+}
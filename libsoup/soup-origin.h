@@ -0,0 +1,23 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*- */
+
+#pragma once
+
+#include "soup-types.h"
+
+G_BEGIN_DECLS
+
+typedef struct _SoupOrigin SoupOrigin;
+
+SoupOrigin *soup_origin_new_for_uri     (GUri       *uri);
+SoupOrigin *soup_origin_ref             (SoupOrigin *origin);
+void        soup_origin_unref           (SoupOrigin *origin);
+
+gboolean    soup_origin_is_https        (SoupOrigin *origin);
+const char *soup_origin_get_scheme      (SoupOrigin *origin);
+const char *soup_origin_get_host        (SoupOrigin *origin);
+int         soup_origin_get_port        (SoupOrigin *origin);
+const char *soup_origin_get_base_domain (SoupOrigin *origin);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (SoupOrigin, soup_origin_unref)
+
+G_END_DECLS
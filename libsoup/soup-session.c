@@ -2898,6 +2898,42 @@ cancel_cache_response (SoupMessageQueueItem *item)
 	soup_session_kick_queue (item->session);
 }
 
+static void
+cache_response_ready_cb (SoupCache            *cache,
+			 GAsyncResult         *result,
+			 SoupMessageQueueItem *item)
+{
+	GInputStream *stream;
+
+	stream = soup_cache_send_response_finish (cache, result, NULL);
+	if (item->state == SOUP_MESSAGE_FINISHED) {
+		/* The original request was cancelled so it has been
+		 * already handled by the cancellation code path.
+		 */
+	} else if (g_cancellable_is_cancelled (item->cancellable)) {
+		/* Cancel original msg after g_cancellable_cancel(). */
+		cancel_cache_response (item);
+	} else if (stream) {
+		async_return_from_cache (item, stream);
+	} else {
+		/* Cached file was deleted? Get the resource again */
+		item->state = SOUP_MESSAGE_STARTING;
+		soup_session_kick_queue (item->session);
+	}
+
+	g_clear_object (&stream);
+	soup_message_queue_item_unref (item);
+}
+
+static gboolean
+is_stale_if_error_status (guint status)
+{
+	return status == SOUP_STATUS_INTERNAL_SERVER_ERROR ||
+		status == SOUP_STATUS_BAD_GATEWAY ||
+		status == SOUP_STATUS_SERVICE_UNAVAILABLE ||
+		status == SOUP_STATUS_GATEWAY_TIMEOUT;
+}
+
 static void
 conditional_get_ready_cb (SoupSession               *session,
 			  GAsyncResult              *result,
@@ -2908,58 +2944,58 @@ conditional_get_ready_cb (SoupSession               *session,
 
 	stream = soup_session_send_finish (session, result, &error);
 	if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+		g_error_free (error);
 		soup_cache_cancel_conditional_request (data->cache, data->conditional_msg);
 		cancel_cache_response (data->item);
 		async_cache_conditional_data_free (data);
 		return;
 	}
-	g_object_unref (stream);
+	g_clear_object (&stream);
 
 	soup_cache_update_from_conditional_request (data->cache, data->conditional_msg);
 
-	if (soup_message_get_status (data->conditional_msg) == SOUP_STATUS_NOT_MODIFIED) {
-		stream = soup_cache_send_response (data->cache, data->item->msg);
-		if (stream) {
-			async_return_from_cache (data->item, stream);
-			g_object_unref (stream);
-			async_cache_conditional_data_free (data);
-			return;
-		}
+	/* The stale response can be used if the server could not be
+	 * reached or failed, when it allows it with stale-if-error.
+	 */
+	if (soup_message_get_status (data->conditional_msg) == SOUP_STATUS_NOT_MODIFIED ||
+	    ((error || is_stale_if_error_status (soup_message_get_status (data->conditional_msg))) &&
+	     soup_cache_allows_stale_if_error (data->cache, data->item->msg))) {
+		g_clear_error (&error);
+		soup_cache_send_response_async (data->cache, data->item->msg,
+						data->item->io_priority,
+						data->item->cancellable,
+						(GAsyncReadyCallback)cache_response_ready_cb,
+						soup_message_queue_item_ref (data->item));
+		async_cache_conditional_data_free (data);
+		return;
 	}
 
 	/* The resource was modified or the server returned a 200
 	 * OK. Either way we reload it. FIXME.
 	 */
+	g_clear_error (&error);
 	data->item->state = SOUP_MESSAGE_STARTING;
 	soup_session_kick_queue (session);
 	async_cache_conditional_data_free (data);
 }
 
-static gboolean
-idle_return_from_cache_cb (gpointer data)
+static void
+background_revalidation_ready_cb (SoupSession  *session,
+				  GAsyncResult *result,
+				  SoupCache    *cache)
 {
-	GTask *task = data;
-	SoupMessageQueueItem *item = g_task_get_task_data (task);
-	GInputStream *istream;
-
-	if (item->state == SOUP_MESSAGE_FINISHED) {
-		/* The original request was cancelled so it has been
-		 * already handled by the cancellation code path.
-		 */
-		return FALSE;
-	} else if (g_cancellable_is_cancelled (item->cancellable)) {
-		/* Cancel original msg after g_cancellable_cancel(). */
-		cancel_cache_response (item);
-		return FALSE;
-	}
+	SoupMessage *conditional_msg;
+	GInputStream *stream;
 
-	istream = g_object_get_data (G_OBJECT (task), "SoupSession:istream");
-	async_return_from_cache (item, istream);
+	conditional_msg = g_object_ref (soup_session_get_async_result_message (session, result));
+	stream = soup_session_send_finish (session, result, NULL);
+	g_clear_object (&stream);
 
-	return FALSE;
+	soup_cache_update_from_conditional_request (cache, conditional_msg);
+	g_object_unref (conditional_msg);
+	g_object_unref (cache);
 }
 
-
 static gboolean
 async_respond_from_cache (SoupSession          *session,
 			  SoupMessageQueueItem *item)
@@ -2973,22 +3009,11 @@ async_respond_from_cache (SoupSession          *session,
 
 	response = soup_cache_has_response (cache, item->msg);
 	if (response == SOUP_CACHE_RESPONSE_FRESH) {
-		GInputStream *stream;
-		GSource *source;
-
-		stream = soup_cache_send_response (cache, item->msg);
-		if (!stream) {
-			/* Cached file was deleted? */
-			return FALSE;
-		}
-
-		g_object_set_data_full (G_OBJECT (item->task), "SoupSession:istream",
-					stream, g_object_unref);
-
-		source = g_timeout_source_new (0);
-		g_task_attach_source (item->task, source,
-				      (GSourceFunc) idle_return_from_cache_cb);
-		g_source_unref (source);
+		soup_cache_send_response_async (cache, item->msg,
+						item->io_priority,
+						item->cancellable,
+						(GAsyncReadyCallback)cache_response_ready_cb,
+						soup_message_queue_item_ref (item));
 		return TRUE;
 	} else if (response == SOUP_CACHE_RESPONSE_NEEDS_VALIDATION) {
 		SoupMessage *conditional_msg;
@@ -3011,6 +3036,28 @@ async_respond_from_cache (SoupSession          *session,
 					 data);
 
 		return TRUE;
+	} else if (response == SOUP_CACHE_RESPONSE_STALE_WHILE_REVALIDATE) {
+		SoupMessage *conditional_msg;
+
+		conditional_msg = soup_cache_generate_conditional_request (cache, item->msg);
+		if (!conditional_msg)
+			return FALSE;
+
+		/* Nobody waits for the revalidation, the stale
+		 * response is sent right away.
+		 */
+		soup_session_send_async (session, conditional_msg,
+					 G_PRIORITY_LOW, NULL,
+					 (GAsyncReadyCallback)background_revalidation_ready_cb,
+					 g_object_ref (cache));
+		g_object_unref (conditional_msg);
+
+		soup_cache_send_response_async (cache, item->msg,
+						item->io_priority,
+						item->cancellable,
+						(GAsyncReadyCallback)cache_response_ready_cb,
+						soup_message_queue_item_ref (item));
+		return TRUE;
 	} else
 		return FALSE;
 }
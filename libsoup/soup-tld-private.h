@@ -0,0 +1,12 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*- */
+
+#pragma once
+
+#include "soup-tld.h"
+
+G_BEGIN_DECLS
+
+void soup_tld_get_cache_stats (guint64 *hits,
+                               guint64 *misses);
+
+G_END_DECLS
@@ -15,11 +15,121 @@
 #include <libpsl.h>
 
 #include "soup-tld.h"
+#include "soup-tld-private.h"
 #include "soup.h"
 
 static const char *soup_tld_get_base_domain_internal (const char *hostname,
 						      GError    **error);
 
+/* Looking up a host in the public suffix list is expensive, and the
+ * same few hosts are looked up again and again for every cookie. The
+ * results are kept in a small LRU cache, shared by all threads.
+ */
+#define TLD_CACHE_MAX_ENTRIES 1024
+
+typedef struct {
+	char *hostname;
+	int result;
+} SoupTLDCacheEntry;
+
+typedef struct {
+	GHashTable *entries; /* hostname -> link in lru */
+	GQueue lru;
+} SoupTLDCache;
+
+static GMutex tld_cache_mutex;
+static SoupTLDCache base_domain_cache = { NULL, G_QUEUE_INIT };
+static SoupTLDCache public_suffix_cache = { NULL, G_QUEUE_INIT };
+static guint64 tld_cache_hits;
+static guint64 tld_cache_misses;
+
+static gboolean
+tld_cache_lookup (SoupTLDCache *cache,
+		  const char   *hostname,
+		  int          *result)
+{
+	GList *link = NULL;
+
+        g_mutex_lock (&tld_cache_mutex);
+	if (cache->entries)
+		link = g_hash_table_lookup (cache->entries, hostname);
+	if (link) {
+		g_queue_unlink (&cache->lru, link);
+		g_queue_push_head_link (&cache->lru, link);
+		*result = ((SoupTLDCacheEntry *)link->data)->result;
+		tld_cache_hits++;
+	} else
+		tld_cache_misses++;
+        g_mutex_unlock (&tld_cache_mutex);
+
+	return link != NULL;
+}
+
+static void
+tld_cache_insert (SoupTLDCache *cache,
+		  const char   *hostname,
+		  int           result)
+{
+	SoupTLDCacheEntry *entry;
+
+        g_mutex_lock (&tld_cache_mutex);
+	if (!cache->entries)
+		cache->entries = g_hash_table_new (g_str_hash, g_str_equal);
+
+	/* Another thread may have added it in the meantime */
+	if (g_hash_table_contains (cache->entries, hostname)) {
+                g_mutex_unlock (&tld_cache_mutex);
+		return;
+	}
+
+	if (cache->lru.length >= TLD_CACHE_MAX_ENTRIES) {
+		entry = g_queue_pop_tail (&cache->lru);
+		g_hash_table_remove (cache->entries, entry->hostname);
+		g_free (entry->hostname);
+		g_free (entry);
+	}
+
+	entry = g_new (SoupTLDCacheEntry, 1);
+	entry->hostname = g_strdup (hostname);
+	entry->result = result;
+	g_queue_push_head (&cache->lru, entry);
+	g_hash_table_insert (cache->entries, entry->hostname, cache->lru.head);
+        g_mutex_unlock (&tld_cache_mutex);
+}
+
+/* Gets the number of lookups answered from the cache (@hits) and the
+ * number that needed the public suffix list (@misses).
+ */
+void
+soup_tld_get_cache_stats (guint64 *hits,
+			  guint64 *misses)
+{
+        g_mutex_lock (&tld_cache_mutex);
+	if (hits)
+		*hits = tld_cache_hits;
+	if (misses)
+		*misses = tld_cache_misses;
+        g_mutex_unlock (&tld_cache_mutex);
+}
+
+static const char *
+tld_error_message (SoupTLDError code)
+{
+	switch (code) {
+	case SOUP_TLD_ERROR_IS_IP_ADDRESS:
+		return _("Hostname is an IP address");
+	case SOUP_TLD_ERROR_NOT_ENOUGH_DOMAINS:
+		return _("Not enough domains");
+	case SOUP_TLD_ERROR_NO_BASE_DOMAIN:
+		return _("Hostname has no base domain");
+	case SOUP_TLD_ERROR_NO_PSL_DATA:
+		return _("No public-suffix list available.");
+	case SOUP_TLD_ERROR_INVALID_HOSTNAME:
+	default:
+		return _("Invalid hostname");
+	}
+}
+
 /**
  * soup_tld_get_base_domain:
  * @hostname: a hostname
@@ -80,6 +190,7 @@ gboolean
 soup_tld_domain_is_public_suffix (const char *domain)
 {
 	const psl_ctx_t* psl = soup_psl_context ();
+	int is_public;
 
 	g_return_val_if_fail (domain, FALSE);
 
@@ -88,7 +199,13 @@ soup_tld_domain_is_public_suffix (const char *domain)
 		return FALSE;
 	}
 
-	return psl_is_public_suffix2 (psl, domain, PSL_TYPE_ANY | PSL_TYPE_NO_STAR_RULE);
+	if (tld_cache_lookup (&public_suffix_cache, domain, &is_public))
+		return is_public;
+
+	is_public = psl_is_public_suffix2 (psl, domain, PSL_TYPE_ANY | PSL_TYPE_NO_STAR_RULE);
+	tld_cache_insert (&public_suffix_cache, domain, is_public);
+
+	return is_public;
 }
 
 /**
@@ -116,65 +233,71 @@ soup_tld_domain_is_public_suffix (const char *domain)
 
 G_DEFINE_QUARK (soup-tld-error-quark, soup_tld_error)
 
-static const char *
-soup_tld_get_base_domain_internal (const char *hostname, GError **error)
+/* Returns the offset of the base domain in @hostname, or a negated
+ * #SoupTLDError minus one.
+ */
+static int
+lookup_base_domain (const psl_ctx_t *psl,
+		    const char      *hostname)
 {
-	char *utf8_hostname = NULL;
-	const psl_ctx_t* psl = soup_psl_context ();
 	const char *registrable_domain, *unregistrable_domain;
 
-	if (!psl) {
-		g_set_error_literal (error, SOUP_TLD_ERROR,
-				     SOUP_TLD_ERROR_NO_PSL_DATA,
-				     _("No public-suffix list available."));
-		return NULL;
-	}
-
 	/* Valid hostnames neither start with a dot nor have more than one
 	 * dot together.
 	 */
-	if (*hostname == '.') {
-		g_set_error_literal (error, SOUP_TLD_ERROR,
-				     SOUP_TLD_ERROR_INVALID_HOSTNAME,
-				     _("Invalid hostname"));
-		return NULL;
-	}
+	if (*hostname == '.')
+		return -SOUP_TLD_ERROR_INVALID_HOSTNAME - 1;
 
-	if (g_hostname_is_ip_address (hostname)) {
-		g_set_error_literal (error, SOUP_TLD_ERROR,
-				     SOUP_TLD_ERROR_IS_IP_ADDRESS,
-				     _("Hostname is an IP address"));
-		return NULL;
-	}
+	if (g_hostname_is_ip_address (hostname))
+		return -SOUP_TLD_ERROR_IS_IP_ADDRESS - 1;
 
 	if (g_hostname_is_ascii_encoded (hostname)) {
-		utf8_hostname = g_hostname_to_unicode (hostname);
-		if (!utf8_hostname) {
-			g_set_error_literal (error, SOUP_TLD_ERROR,
-					     SOUP_TLD_ERROR_INVALID_HOSTNAME,
-					     _("Invalid hostname"));
-			return NULL;
-		}
+		char *utf8_hostname = g_hostname_to_unicode (hostname);
+
+		if (!utf8_hostname)
+			return -SOUP_TLD_ERROR_INVALID_HOSTNAME - 1;
 		g_free (utf8_hostname);
 	}
 
 	/* Fetch the domain portion of the hostname and check whether
 	 * it's a public domain. */
 	unregistrable_domain = psl_unregistrable_domain (psl, hostname);
-	if (!psl_is_public_suffix2 (psl, unregistrable_domain, PSL_TYPE_ANY | PSL_TYPE_NO_STAR_RULE)) {
+	if (!psl_is_public_suffix2 (psl, unregistrable_domain, PSL_TYPE_ANY | PSL_TYPE_NO_STAR_RULE))
+		return -SOUP_TLD_ERROR_NO_BASE_DOMAIN - 1;
+
+	registrable_domain = psl_registrable_domain (psl, hostname);
+	if (!registrable_domain)
+		return -SOUP_TLD_ERROR_NOT_ENOUGH_DOMAINS - 1;
+
+	return registrable_domain - hostname;
+}
+
+static const char *
+soup_tld_get_base_domain_internal (const char *hostname, GError **error)
+{
+	const psl_ctx_t* psl = soup_psl_context ();
+	int result;
+
+	if (!psl) {
 		g_set_error_literal (error, SOUP_TLD_ERROR,
-				     SOUP_TLD_ERROR_NO_BASE_DOMAIN,
-				     _("Hostname has no base domain"));
+				     SOUP_TLD_ERROR_NO_PSL_DATA,
+				     tld_error_message (SOUP_TLD_ERROR_NO_PSL_DATA));
 		return NULL;
 	}
 
-	registrable_domain = psl_registrable_domain (psl, hostname);
-	if (!registrable_domain) {
-		g_set_error_literal (error, SOUP_TLD_ERROR,
-				     SOUP_TLD_ERROR_NOT_ENOUGH_DOMAINS,
-				     _("Not enough domains"));
+	if (!tld_cache_lookup (&base_domain_cache, hostname, &result)) {
+		result = lookup_base_domain (psl, hostname);
+		tld_cache_insert (&base_domain_cache, hostname, result);
+	}
+
+	if (result < 0) {
+		g_set_error_literal (error, SOUP_TLD_ERROR, -result - 1,
+				     tld_error_message (-result - 1));
 		return NULL;
 	}
 
-	return registrable_domain;
+	/* The cached result is an offset, so that it points into
+	 * this @hostname rather than the one that was cached.
+	 */
+	return hostname + result;
 }
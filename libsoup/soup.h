@@ -33,6 +33,7 @@
 #include "server/soup-auth-domain.h"
 #include "server/soup-auth-domain-basic.h"
 #include "server/soup-auth-domain-digest.h"
+#include "server/soup-content-encoder.h"
 #include "server/soup-server.h"
 #include "server/soup-server-message.h"
 #include "soup-session.h"
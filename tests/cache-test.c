@@ -4,6 +4,7 @@
  */
 
 #include "test-utils.h"
+#include "cache/soup-cache-client-input-stream.h"
 #include <glib/gstdio.h>
 
 static void
@@ -13,7 +14,7 @@ server_callback (SoupServer        *server,
 		 GHashTable        *query,
 		 gpointer           data)
 {
-	const char *last_modified, *etag;
+	const char *last_modified, *etag, *vary;
 	const char *header;
 	const char *method;
 	SoupMessageHeaders *request_headers;
@@ -29,6 +30,13 @@ server_callback (SoupServer        *server,
 
 	request_headers = soup_server_message_get_request_headers (msg);
 	response_headers = soup_server_message_get_response_headers (msg);
+	header = soup_message_headers_get_one (request_headers,
+					       "Test-Set-Status");
+	if (header) {
+		soup_server_message_set_status (msg, atoi (header), NULL);
+		return;
+	}
+
 	header = soup_message_headers_get_one (request_headers,
 					       "Test-Set-Expires");
 	if (header) {
@@ -92,9 +100,18 @@ server_callback (SoupServer        *server,
 					     header);
 	}
 
+	vary = soup_message_headers_get_one (request_headers,
+					     "Test-Set-Vary");
+	if (vary) {
+		soup_message_headers_append (response_headers,
+					     "Vary",
+					     vary);
+	}
+
 	if (status == SOUP_STATUS_OK) {
 		GChecksum *sum;
-		const char *body;
+		GString *body;
+		guint repeat = 1;
 
 		sum = g_checksum_new (G_CHECKSUM_SHA256);
 		g_checksum_update (sum, (guchar *)path, strlen (path));
@@ -102,10 +119,22 @@ server_callback (SoupServer        *server,
 			g_checksum_update (sum, (guchar *)last_modified, strlen (last_modified));
 		if (etag)
 			g_checksum_update (sum, (guchar *)etag, strlen (etag));
-		body = g_checksum_get_string (sum);
+		if (vary && strcmp (vary, "*") != 0) {
+			header = soup_message_headers_get_one (request_headers, vary);
+			if (header)
+				g_checksum_update (sum, (guchar *)header, strlen (header));
+		}
+		header = soup_message_headers_get_one (request_headers,
+						       "Test-Set-Repeat");
+		if (header)
+			repeat = atoi (header);
+		body = g_string_new (NULL);
+		while (repeat--)
+			g_string_append (body, g_checksum_get_string (sum));
 		soup_server_message_set_response (msg, "text/plain",
 						  SOUP_MEMORY_COPY,
-						  body, strlen (body) + 1);
+						  body->str, body->len + 1);
+		g_string_free (body, TRUE);
 		g_checksum_free (sum);
 	}
 	soup_server_message_set_status (msg, status, NULL);
@@ -114,8 +143,12 @@ server_callback (SoupServer        *server,
 static gboolean
 is_network_stream (GInputStream *stream)
 {
-	while (G_IS_FILTER_INPUT_STREAM (stream))
+	while (G_IS_FILTER_INPUT_STREAM (stream)) {
+		/* Responses from the memory tier have no file */
+		if (SOUP_IS_CACHE_CLIENT_INPUT_STREAM (stream))
+			return FALSE;
 		stream = G_FILTER_INPUT_STREAM (stream)->base_stream;
+	}
 
 	return !G_IS_FILE_INPUT_STREAM (stream);
 }
@@ -155,6 +188,7 @@ do_request (SoupSession        *session,
 	const char *header, *value;
 	char buf[256];
 	gsize nread;
+	GString *body;
 	GError *error = NULL;
 
 	last_request_validated = last_request_hit_network = FALSE;
@@ -194,8 +228,13 @@ do_request (SoupSession        *session,
 
 	last_request_hit_network = is_network_stream (stream);
 
-	g_input_stream_read_all (stream, buf, sizeof (buf), &nread,
-				 NULL, &error);
+	body = g_string_new (NULL);
+	while (g_input_stream_read_all (stream, buf, sizeof (buf), &nread,
+					NULL, &error) && nread) {
+		g_string_append_len (body, buf, nread);
+		if (nread < sizeof (buf))
+			break;
+	}
 	if (error) {
 		debug_printf (1, "    could not read response: %s\n",
 			      error->message);
@@ -212,7 +251,7 @@ do_request (SoupSession        *session,
 	/* Cache writes are G_PRIORITY_LOW, so they won't have happened yet... */
 	soup_cache_flush ((SoupCache *)soup_session_get_feature (session, SOUP_TYPE_CACHE));
 
-	return nread ? g_memdup2 (buf, nread) : g_strdup ("");
+	return g_string_free (body, FALSE);
 }
 
 static void
@@ -532,6 +571,88 @@ do_cancel_test (gconstpointer data)
 	g_free (body2);
 }
 
+typedef struct {
+	GInputStream *stream;
+	guint *n_pending;
+} CacheHitData;
+
+static void
+cache_hit_sent (SoupSession  *session,
+		GAsyncResult *result,
+		CacheHitData *data)
+{
+	GError *error = NULL;
+
+	data->stream = soup_session_send_finish (session, result, &error);
+	g_assert_no_error (error);
+	(*data->n_pending)--;
+}
+
+#define N_CACHE_HITS 8
+
+static void
+do_async_hits_test (gconstpointer data)
+{
+	GUri *base_uri = (GUri *)data;
+	SoupSession *session;
+	SoupCache *cache;
+	char *cache_dir;
+	char *body;
+	CacheHitData hits[N_CACHE_HITS];
+	guint n_pending = N_CACHE_HITS;
+	GUri *uri;
+	guint i;
+
+	cache_dir = g_dir_make_tmp ("cache-test-XXXXXX", NULL);
+	debug_printf (2, "  Caching to %s\n", cache_dir);
+	cache = soup_cache_new (cache_dir, SOUP_CACHE_SINGLE_USER);
+	session = soup_test_session_new (NULL);
+        soup_session_add_feature (session, SOUP_SESSION_FEATURE (cache));
+
+	body = do_request (session, base_uri, "GET", "/1", NULL,
+			   "Test-Set-Expires", "Fri, 01 Jan 2100 00:00:00 GMT",
+			   NULL);
+
+	/* Cache hits don't complete before returning to the main loop,
+	 * and can be in flight at the same time.
+	 */
+	uri = g_uri_parse_relative (base_uri, "/1", SOUP_HTTP_URI_FLAGS, NULL);
+	for (i = 0; i < N_CACHE_HITS; i++) {
+		SoupMessage *msg = soup_message_new_from_uri ("GET", uri);
+
+		hits[i].stream = NULL;
+		hits[i].n_pending = &n_pending;
+		soup_session_send_async (session, msg, G_PRIORITY_DEFAULT, NULL,
+					 (GAsyncReadyCallback)cache_hit_sent, &hits[i]);
+		g_object_unref (msg);
+	}
+	g_uri_unref (uri);
+	g_assert_cmpuint (n_pending, ==, N_CACHE_HITS);
+
+	while (n_pending)
+		g_main_context_iteration (NULL, TRUE);
+
+	for (i = 0; i < N_CACHE_HITS; i++) {
+		char buf[256];
+		gsize nread;
+		GError *error = NULL;
+
+		g_assert_nonnull (hits[i].stream);
+		g_assert_false (is_network_stream (hits[i].stream));
+		g_input_stream_read_all (hits[i].stream, buf, sizeof (buf), &nread, NULL, &error);
+		g_assert_no_error (error);
+		g_assert_cmpmem (buf, nread, body, strlen (body) + 1);
+		g_input_stream_close (hits[i].stream, NULL, NULL);
+		g_object_unref (hits[i].stream);
+	}
+
+	soup_test_session_abort_unref (session);
+	soup_cache_clear (cache);
+	g_object_unref (cache);
+	g_free (cache_dir);
+	g_free (body);
+}
+
 static gboolean
 unref_stream (gpointer stream)
 {
@@ -739,6 +860,776 @@ do_leaks_test (gconstpointer data)
 	g_free (cache_dir);
 }
 
+static void
+do_journal_test (gconstpointer data)
+{
+	GUri *base_uri = (GUri *)data;
+	SoupSession *session;
+	SoupCache *cache;
+	char *cache_dir;
+	char *body, *path;
+	guint i;
+
+	cache_dir = g_dir_make_tmp ("cache-test-XXXXXX", NULL);
+	debug_printf (2, "  Caching to %s\n", cache_dir);
+	cache = soup_cache_new (cache_dir, SOUP_CACHE_SINGLE_USER);
+	soup_cache_load (cache);
+	session = soup_test_session_new (NULL);
+        soup_session_add_feature (session, SOUP_SESSION_FEATURE (cache));
+
+	for (i = 1; i <= 3; i++) {
+		path = g_strdup_printf ("/%u", i);
+		body = do_request (session, base_uri, "GET", path, NULL,
+				   "Test-Set-Expires", "Fri, 01 Jan 2100 00:00:00 GMT",
+				   NULL);
+		g_free (body);
+		g_free (path);
+	}
+
+	/* Invalidates /2 */
+	body = do_request (session, base_uri, "POST", "/2", NULL, NULL);
+	g_free (body);
+	g_assert_cmpuint (count_cached_resources_in_dir (cache_dir), ==, 2);
+
+	/* Destroy the cache without dumping it, the changes are
+	 * in the journal.
+	 */
+	soup_test_session_abort_unref (session);
+	g_object_unref (cache);
+
+	debug_printf (2, "  Loading the cache\n");
+	cache = soup_cache_new (cache_dir, SOUP_CACHE_SINGLE_USER);
+	soup_cache_load (cache);
+	session = soup_test_session_new (NULL);
+        soup_session_add_feature (session, SOUP_SESSION_FEATURE (cache));
+	g_assert_cmpuint (count_cached_resources_in_dir (cache_dir), ==, 2);
+
+	body = do_request (session, base_uri, "GET", "/1", NULL, NULL);
+	soup_test_assert (!last_request_hit_network,
+			  "Request for /1 not filled from cache");
+	g_free (body);
+	body = do_request (session, base_uri, "GET", "/3", NULL, NULL);
+	soup_test_assert (!last_request_hit_network,
+			  "Request for /3 not filled from cache");
+	g_free (body);
+	body = do_request (session, base_uri, "GET", "/2", NULL, NULL);
+	soup_test_assert (last_request_hit_network,
+			  "Request for /2 filled from cache");
+	g_free (body);
+
+	soup_test_session_abort_unref (session);
+	soup_cache_clear (cache);
+	g_object_unref (cache);
+	g_free (cache_dir);
+}
+
+static void
+do_packed_test (gconstpointer data)
+{
+	GUri *base_uri = (GUri *)data;
+	SoupSession *session;
+	SoupCache *cache;
+	char *cache_dir;
+	char *bodies[5], *body, *path;
+	guint i;
+
+	cache_dir = g_dir_make_tmp ("cache-test-XXXXXX", NULL);
+	debug_printf (2, "  Caching to %s\n", cache_dir);
+	cache = soup_cache_new (cache_dir, SOUP_CACHE_SINGLE_USER);
+	soup_cache_load (cache);
+	soup_cache_set_packed_storage (cache, TRUE);
+	g_assert_true (soup_cache_get_packed_storage (cache));
+	session = soup_test_session_new (NULL);
+        soup_session_add_feature (session, SOUP_SESSION_FEATURE (cache));
+
+	debug_printf (2, "  Initial requests\n");
+	for (i = 0; i < G_N_ELEMENTS (bodies); i++) {
+		path = g_strdup_printf ("/%u", i + 1);
+		bodies[i] = do_request (session, base_uri, "GET", path, NULL,
+					"Test-Set-Expires", "Fri, 01 Jan 2100 00:00:00 GMT",
+					NULL);
+		g_free (path);
+	}
+
+	/* All of them are in the same segment */
+	g_assert_cmpuint (count_cached_resources_in_dir (cache_dir), ==, 1);
+
+	for (i = 0; i < G_N_ELEMENTS (bodies); i++) {
+		path = g_strdup_printf ("/%u", i + 1);
+		body = do_request (session, base_uri, "GET", path, NULL, NULL);
+		soup_test_assert (!last_request_hit_network,
+				  "Request for %s not filled from cache", path);
+		g_assert_cmpstr (body, ==, bodies[i]);
+		g_free (body);
+		g_free (path);
+	}
+
+	/* Invalidates all but /5, the segment is kept for it */
+	for (i = 0; i < G_N_ELEMENTS (bodies) - 1; i++) {
+		path = g_strdup_printf ("/%u", i + 1);
+		body = do_request (session, base_uri, "POST", path, NULL, NULL);
+		g_free (body);
+		g_free (path);
+	}
+	soup_cache_dump (cache);
+	g_assert_cmpuint (count_cached_resources_in_dir (cache_dir), ==, 1);
+
+	soup_test_session_abort_unref (session);
+	g_object_unref (cache);
+
+	debug_printf (2, "  Loading the cache\n");
+	cache = soup_cache_new (cache_dir, SOUP_CACHE_SINGLE_USER);
+	soup_cache_load (cache);
+	session = soup_test_session_new (NULL);
+        soup_session_add_feature (session, SOUP_SESSION_FEATURE (cache));
+	g_assert_cmpuint (count_cached_resources_in_dir (cache_dir), ==, 1);
+
+	body = do_request (session, base_uri, "GET", "/5", NULL, NULL);
+	soup_test_assert (!last_request_hit_network,
+			  "Request for /5 not filled from cache");
+	g_assert_cmpstr (body, ==, bodies[4]);
+	g_free (body);
+	body = do_request (session, base_uri, "GET", "/1", NULL, NULL);
+	soup_test_assert (last_request_hit_network,
+			  "Request for /1 filled from cache");
+	g_free (body);
+
+	soup_test_session_abort_unref (session);
+	soup_cache_clear (cache);
+	g_object_unref (cache);
+	for (i = 0; i < G_N_ELEMENTS (bodies); i++)
+		g_free (bodies[i]);
+	g_free (cache_dir);
+}
+
+static guint64
+get_cache_size (SoupCache *cache)
+{
+	GVariant *stats;
+	guint64 size = 0;
+
+	stats = soup_cache_get_stats (cache);
+	g_variant_lookup (stats, "size", "t", &size);
+	g_variant_unref (stats);
+
+	return size;
+}
+
+static void
+do_compression_test (gconstpointer data)
+{
+	GUri *base_uri = (GUri *)data;
+	SoupSession *session;
+	SoupCache *cache;
+	char *cache_dir;
+	char *body1, *body2, *body;
+
+	cache_dir = g_dir_make_tmp ("cache-test-XXXXXX", NULL);
+	debug_printf (2, "  Caching to %s\n", cache_dir);
+	cache = soup_cache_new (cache_dir, SOUP_CACHE_SINGLE_USER);
+	soup_cache_load (cache);
+	soup_cache_set_compression (cache, TRUE);
+	g_assert_true (soup_cache_get_compression (cache));
+	session = soup_test_session_new (NULL);
+        soup_session_add_feature (session, SOUP_SESSION_FEATURE (cache));
+
+	/* 6400 bytes of text each, /2 is packed in a segment */
+	body1 = do_request (session, base_uri, "GET", "/1", NULL,
+			    "Test-Set-Expires", "Fri, 01 Jan 2100 00:00:00 GMT",
+			    "Test-Set-Repeat", "100",
+			    NULL);
+	soup_cache_set_packed_storage (cache, TRUE);
+	body2 = do_request (session, base_uri, "GET", "/2", NULL,
+			    "Test-Set-Expires", "Fri, 01 Jan 2100 00:00:00 GMT",
+			    "Test-Set-Repeat", "100",
+			    NULL);
+	g_assert_cmpuint (strlen (body1), ==, 6400);
+	g_assert_cmpuint (strlen (body2), ==, 6400);
+	g_assert_cmpuint (get_cache_size (cache), <, 1000);
+
+	body = do_request (session, base_uri, "GET", "/1", NULL, NULL);
+	soup_test_assert (!last_request_hit_network,
+			  "Request for /1 not filled from cache");
+	g_assert_cmpstr (body, ==, body1);
+	g_free (body);
+
+	body = do_request (session, base_uri, "GET", "/2", NULL, NULL);
+	soup_test_assert (!last_request_hit_network,
+			  "Request for /2 not filled from cache");
+	g_assert_cmpstr (body, ==, body2);
+	g_free (body);
+
+	/* Too small to be compressed */
+	body = do_request (session, base_uri, "GET", "/3", NULL,
+			   "Test-Set-Expires", "Fri, 01 Jan 2100 00:00:00 GMT",
+			   NULL);
+	g_free (body);
+	g_assert_cmpuint (get_cache_size (cache), >, 65);
+	g_assert_cmpuint (get_cache_size (cache), <, 1065);
+
+	soup_cache_dump (cache);
+	soup_test_session_abort_unref (session);
+	g_object_unref (cache);
+
+	debug_printf (2, "  Loading the cache\n");
+	cache = soup_cache_new (cache_dir, SOUP_CACHE_SINGLE_USER);
+	soup_cache_load (cache);
+	session = soup_test_session_new (NULL);
+        soup_session_add_feature (session, SOUP_SESSION_FEATURE (cache));
+	g_assert_cmpuint (get_cache_size (cache), <, 1065);
+
+	body = do_request (session, base_uri, "GET", "/1", NULL, NULL);
+	soup_test_assert (!last_request_hit_network,
+			  "Request for /1 not filled from cache");
+	g_assert_cmpstr (body, ==, body1);
+	g_free (body);
+
+	body = do_request (session, base_uri, "GET", "/2", NULL, NULL);
+	soup_test_assert (!last_request_hit_network,
+			  "Request for /2 not filled from cache");
+	g_assert_cmpstr (body, ==, body2);
+	g_free (body);
+
+	soup_test_session_abort_unref (session);
+	soup_cache_clear (cache);
+	g_object_unref (cache);
+	g_free (body1);
+	g_free (body2);
+	g_free (cache_dir);
+}
+
+static void
+do_range_request (SoupSession *session,
+		  GUri        *base_uri,
+		  const char  *path,
+		  const char  *range,
+		  const char  *if_range,
+		  const char  *expected_body,
+		  gsize        expected_length,
+		  const char  *expected_content_range)
+{
+	SoupMessageHeaders *headers;
+	char *body;
+
+	debug_printf (2, "    Range: %s\n", range);
+	headers = soup_message_headers_new (SOUP_MESSAGE_HEADERS_RESPONSE);
+	body = do_request (session, base_uri, "GET", path, headers,
+			   "Range", range,
+			   if_range ? "If-Range" : NULL, if_range,
+			   NULL);
+	soup_test_assert (!last_request_hit_network,
+			  "Request for %s not filled from cache", range);
+	g_assert_cmpmem (body, strlen (body), expected_body, expected_length);
+	g_assert_cmpstr (soup_message_headers_get_one (headers, "Content-Range"), ==, expected_content_range);
+	soup_message_headers_unref (headers);
+	g_free (body);
+}
+
+static void
+do_range_cache_test (gconstpointer data)
+{
+	GUri *base_uri = (GUri *)data;
+	SoupSession *session;
+	SoupCache *cache;
+	char *cache_dir;
+	char *body1, *body2, *body;
+
+	cache_dir = g_dir_make_tmp ("cache-test-XXXXXX", NULL);
+	debug_printf (2, "  Caching to %s\n", cache_dir);
+	cache = soup_cache_new (cache_dir, SOUP_CACHE_SINGLE_USER);
+	session = soup_test_session_new (NULL);
+        soup_session_add_feature (session, SOUP_SESSION_FEATURE (cache));
+
+	/* 640 bytes, and 6400 stored compressed */
+	body1 = do_request (session, base_uri, "GET", "/1", NULL,
+			    "Test-Set-Expires", "Fri, 01 Jan 2100 00:00:00 GMT",
+			    "Test-Set-ETag", "\"1\"",
+			    "Test-Set-Repeat", "10",
+			    NULL);
+	soup_cache_set_compression (cache, TRUE);
+	body2 = do_request (session, base_uri, "GET", "/2", NULL,
+			    "Test-Set-Expires", "Fri, 01 Jan 2100 00:00:00 GMT",
+			    "Test-Set-Repeat", "100",
+			    NULL);
+
+	debug_printf (1, "  Single ranges\n");
+	do_range_request (session, base_uri, "/1", "bytes=10-19", NULL,
+			  body1 + 10, 10, "bytes 10-19/641");
+	do_range_request (session, base_uri, "/1", "bytes=600-639", NULL,
+			  body1 + 600, 40, "bytes 600-639/641");
+	do_range_request (session, base_uri, "/2", "bytes=5000-5099", NULL,
+			  body2 + 5000, 100, "bytes 5000-5099/6401");
+
+	debug_printf (1, "  Unsatisfiable range\n");
+	do_range_request (session, base_uri, "/1", "bytes=1000-", NULL,
+			  "", 0, "bytes */641");
+
+	debug_printf (1, "  If-Range\n");
+	do_range_request (session, base_uri, "/1", "bytes=10-19", "\"1\"",
+			  body1 + 10, 10, "bytes 10-19/641");
+	do_range_request (session, base_uri, "/1", "bytes=10-19", "\"2\"",
+			  body1, strlen (body1), NULL);
+
+	debug_printf (1, "  Several ranges\n");
+	body = do_request (session, base_uri, "GET", "/1", NULL,
+			   "Range", "bytes=0-9,20-29",
+			   NULL);
+	soup_test_assert (last_request_hit_network,
+			  "Request for several ranges filled from cache");
+	g_free (body);
+
+	/* The partial response didn't replace the complete one */
+	body = do_request (session, base_uri, "GET", "/1", NULL, NULL);
+	soup_test_assert (!last_request_hit_network,
+			  "Request for /1 not filled from cache");
+	g_assert_cmpstr (body, ==, body1);
+	g_free (body);
+
+	soup_test_session_abort_unref (session);
+	soup_cache_clear (cache);
+	g_object_unref (cache);
+	g_free (body1);
+	g_free (body2);
+	g_free (cache_dir);
+}
+
+static void
+do_memory_tier_test (gconstpointer data)
+{
+	GUri *base_uri = (GUri *)data;
+	SoupSession *session;
+	SoupCache *cache;
+	char *cache_dir;
+	char *body1, *body;
+	guint64 memory_hits, disk_hits;
+	const char *name;
+	GDir *dir;
+	guint i;
+
+	cache_dir = g_dir_make_tmp ("cache-test-XXXXXX", NULL);
+	debug_printf (2, "  Caching to %s\n", cache_dir);
+	cache = soup_cache_new (cache_dir, SOUP_CACHE_SINGLE_USER);
+	soup_cache_set_memory_tier_size (cache, 1024 * 1024);
+	g_assert_cmpuint (soup_cache_get_memory_tier_size (cache), ==, 1024 * 1024);
+	session = soup_test_session_new (NULL);
+        soup_session_add_feature (session, SOUP_SESSION_FEATURE (cache));
+
+	body1 = do_request (session, base_uri, "GET", "/1", NULL,
+			    "Test-Set-Expires", "Fri, 01 Jan 2100 00:00:00 GMT",
+			    NULL);
+
+	/* The last of these reads it into memory */
+	for (i = 0; i < 2; i++) {
+		body = do_request (session, base_uri, "GET", "/1", NULL, NULL);
+		soup_test_assert (!last_request_hit_network,
+				  "Request for /1 not filled from cache");
+		g_assert_cmpstr (body, ==, body1);
+		g_free (body);
+	}
+
+	/* So it doesn't need its file anymore */
+	dir = g_dir_open (cache_dir, 0, NULL);
+	while ((name = g_dir_read_name (dir))) {
+		char *path;
+
+		if (g_str_has_prefix (name, "soup."))
+			continue;
+
+		path = g_build_filename (cache_dir, name, NULL);
+		g_unlink (path);
+		g_free (path);
+	}
+	g_dir_close (dir);
+
+	body = do_request (session, base_uri, "GET", "/1", NULL, NULL);
+	soup_test_assert (!last_request_hit_network,
+			  "Request for /1 not filled from the memory tier");
+	g_assert_cmpstr (body, ==, body1);
+	g_free (body);
+
+	soup_cache_get_tier_hits (cache, &memory_hits, &disk_hits);
+	g_assert_cmpuint (memory_hits, ==, 1);
+	g_assert_cmpuint (disk_hits, ==, 2);
+
+	/* Dropped from memory, so the file is needed again */
+	soup_cache_set_memory_tier_size (cache, 0);
+	body = do_request (session, base_uri, "GET", "/1", NULL, NULL);
+	soup_test_assert (last_request_hit_network,
+			  "Request for /1 filled from cache without its file");
+	g_free (body);
+
+	soup_test_session_abort_unref (session);
+	soup_cache_clear (cache);
+	g_object_unref (cache);
+	g_free (body1);
+	g_free (cache_dir);
+}
+
+static void
+revalidation_unqueued (SoupSession *session,
+		       SoupMessage *msg,
+		       gboolean    *revalidated)
+{
+	if (soup_message_headers_get_one (soup_message_get_request_headers (msg), "If-None-Match"))
+		*revalidated = TRUE;
+}
+
+static void
+do_stale_test (gconstpointer data)
+{
+	GUri *base_uri = (GUri *)data;
+	SoupSession *session;
+	SoupCache *cache;
+	char *cache_dir;
+	char *body1, *body2, *body3, *body4, *cmp;
+	GVariant *stats;
+	guint64 stale_hits = 0;
+	gboolean revalidated = FALSE;
+
+	cache_dir = g_dir_make_tmp ("cache-test-XXXXXX", NULL);
+	debug_printf (2, "  Caching to %s\n", cache_dir);
+	cache = soup_cache_new (cache_dir, SOUP_CACHE_SINGLE_USER);
+	session = soup_test_session_new (NULL);
+        soup_session_add_feature (session, SOUP_SESSION_FEATURE (cache));
+
+	g_signal_connect (session, "request-queued",
+			  G_CALLBACK (request_queued), NULL);
+	g_signal_connect (session, "request-unqueued",
+			  G_CALLBACK (revalidation_unqueued), &revalidated);
+
+	debug_printf (2, "  Initial requests\n");
+	body1 = do_request (session, base_uri, "GET", "/1", NULL,
+			    "Test-Set-ETag", "\"abcdefg\"",
+			    "Test-Set-Cache-Control", "max-age=0, stale-while-revalidate=3600",
+			    NULL);
+	body2 = do_request (session, base_uri, "GET", "/2", NULL,
+			    "Test-Set-ETag", "\"abcdefg\"",
+			    "Test-Set-Cache-Control", "max-age=0, stale-if-error=3600",
+			    NULL);
+	body3 = do_request (session, base_uri, "GET", "/3", NULL,
+			    "Test-Set-ETag", "\"abcdefg\"",
+			    "Test-Set-Cache-Control", "max-age=0",
+			    NULL);
+	body4 = do_request (session, base_uri, "GET", "/4", NULL,
+			    "Test-Set-Cache-Control", "max-age=0, stale-while-revalidate=3600",
+			    NULL);
+
+	/* Served stale right away, and revalidated afterwards */
+	debug_printf (1, "  Stale resource w/ stale-while-revalidate\n");
+	cmp = do_request (session, base_uri, "GET", "/1", NULL,
+			  "Test-Set-ETag", "\"abcdefg\"",
+			  "Test-Set-Cache-Control", "max-age=0, stale-while-revalidate=3600",
+			  NULL);
+	soup_test_assert (!last_request_hit_network,
+			  "Request for /1 not filled from cache");
+	g_assert_cmpstr (body1, ==, cmp);
+	g_free (cmp);
+
+	while (!revalidated)
+		g_main_context_iteration (NULL, TRUE);
+
+	/* The server failing doesn't prevent using the stale response */
+	debug_printf (1, "  Failed validation w/ stale-if-error\n");
+	cmp = do_request (session, base_uri, "GET", "/2", NULL,
+			  "Test-Set-Status", "503",
+			  NULL);
+	soup_test_assert (last_request_validated,
+			  "Request for /2 not validated");
+	soup_test_assert (!last_request_hit_network,
+			  "Request for /2 not filled from cache");
+	g_assert_cmpstr (body2, ==, cmp);
+	g_free (cmp);
+
+	/* But it does without stale-if-error */
+	debug_printf (1, "  Failed validation w/o stale-if-error\n");
+	cmp = do_request (session, base_uri, "GET", "/3", NULL,
+			  "Test-Set-Status", "503",
+			  NULL);
+	soup_test_assert (last_request_hit_network,
+			  "Request for /3 filled from cache");
+	g_assert_cmpstr (body3, !=, cmp);
+	g_free (cmp);
+
+	/* Without validators it can't be revalidated in the background */
+	debug_printf (1, "  Stale resource w/ stale-while-revalidate w/o validators\n");
+	cmp = do_request (session, base_uri, "GET", "/4", NULL,
+			  "Test-Set-Cache-Control", "max-age=0, stale-while-revalidate=3600",
+			  NULL);
+	soup_test_assert (last_request_hit_network,
+			  "Request for /4 filled from cache");
+	g_assert_cmpstr (body4, ==, cmp);
+	g_free (cmp);
+
+	/* Only /1 and /2 were served stale */
+	stats = soup_cache_get_stats (cache);
+	g_variant_lookup (stats, "stale-hits", "t", &stale_hits);
+	g_variant_unref (stats);
+	g_assert_cmpuint (stale_hits, ==, 2);
+
+	soup_test_session_abort_unref (session);
+	soup_cache_clear (cache);
+	g_object_unref (cache);
+	g_free (cache_dir);
+	g_free (body1);
+	g_free (body2);
+	g_free (body3);
+	g_free (body4);
+}
+
+static void
+do_eviction_test (gconstpointer data)
+{
+	GUri *base_uri = (GUri *)data;
+	SoupSession *session;
+	SoupCache *cache;
+	char *cache_dir;
+	char *body, *path;
+	guint i;
+
+	cache_dir = g_dir_make_tmp ("cache-test-XXXXXX", NULL);
+	debug_printf (2, "  Caching to %s\n", cache_dir);
+	cache = soup_cache_new (cache_dir, SOUP_CACHE_SINGLE_USER);
+	/* Room for 10 of the 65 bytes responses */
+	soup_cache_set_max_size (cache, 650);
+	session = soup_test_session_new (NULL);
+        soup_session_add_feature (session, SOUP_SESSION_FEATURE (cache));
+
+	debug_printf (2, "  Filling the cache\n");
+	for (i = 1; i <= 10; i++) {
+		path = g_strdup_printf ("/%u", i);
+		body = do_request (session, base_uri, "GET", path, NULL,
+				   "Test-Set-Expires", "Fri, 01 Jan 2100 00:00:00 GMT",
+				   NULL);
+		g_free (body);
+		g_free (path);
+	}
+	g_assert_cmpuint (count_cached_resources_in_dir (cache_dir), ==, 10);
+
+	/* Hits on /1 make it the last one to be evicted */
+	body = do_request (session, base_uri, "GET", "/1", NULL, NULL);
+	soup_test_assert (!last_request_hit_network,
+			  "Request for /1 not filled from cache");
+	g_free (body);
+
+	debug_printf (2, "  Evicting\n");
+	for (i = 11; i <= 15; i++) {
+		path = g_strdup_printf ("/%u", i);
+		body = do_request (session, base_uri, "GET", path, NULL,
+				   "Test-Set-Expires", "Fri, 01 Jan 2100 00:00:00 GMT",
+				   NULL);
+		g_free (body);
+		g_free (path);
+		g_assert_cmpuint (count_cached_resources_in_dir (cache_dir), ==, 10);
+	}
+
+	body = do_request (session, base_uri, "GET", "/1", NULL, NULL);
+	soup_test_assert (!last_request_hit_network,
+			  "Request for /1 not filled from cache");
+	g_free (body);
+
+	/* The index keeps the eviction order */
+	debug_printf (2, "  Reloading the cache\n");
+	soup_cache_dump (cache);
+	soup_test_session_abort_unref (session);
+	g_object_unref (cache);
+
+	cache = soup_cache_new (cache_dir, SOUP_CACHE_SINGLE_USER);
+	soup_cache_set_max_size (cache, 650);
+	soup_cache_load (cache);
+	session = soup_test_session_new (NULL);
+        soup_session_add_feature (session, SOUP_SESSION_FEATURE (cache));
+
+	body = do_request (session, base_uri, "GET", "/16", NULL,
+			   "Test-Set-Expires", "Fri, 01 Jan 2100 00:00:00 GMT",
+			   NULL);
+	g_free (body);
+	g_assert_cmpuint (count_cached_resources_in_dir (cache_dir), ==, 10);
+
+	body = do_request (session, base_uri, "GET", "/1", NULL, NULL);
+	soup_test_assert (!last_request_hit_network,
+			  "Request for /1 not filled from cache");
+	g_free (body);
+
+	soup_test_session_abort_unref (session);
+	soup_cache_clear (cache);
+	g_rmdir (cache_dir);
+	g_object_unref (cache);
+	g_free (cache_dir);
+}
+
+static void
+evicted (SoupCache  *cache,
+	 const char *uri,
+	 guint      *n_evicted)
+{
+	debug_printf (2, "    Evicted %s\n", uri);
+	(*n_evicted)++;
+}
+
+static guint64
+lookup_stat (GVariant   *stats,
+	     const char *key)
+{
+	guint64 value = 0;
+
+	g_assert_true (g_variant_lookup (stats, key, "t", &value));
+	return value;
+}
+
+static void
+do_stats_test (gconstpointer data)
+{
+	GUri *base_uri = (GUri *)data;
+	SoupSession *session;
+	SoupCache *cache;
+	GVariant *stats, *origin_stats;
+	char *cache_dir;
+	char *body, *path, *origin;
+	guint n_evicted = 0;
+	guint i;
+
+	cache_dir = g_dir_make_tmp ("cache-test-XXXXXX", NULL);
+	debug_printf (2, "  Caching to %s\n", cache_dir);
+	cache = soup_cache_new (cache_dir, SOUP_CACHE_SINGLE_USER);
+	/* Room for 10 of the 65 bytes responses */
+	soup_cache_set_max_size (cache, 650);
+	g_signal_connect (cache, "evicted", G_CALLBACK (evicted), &n_evicted);
+	session = soup_test_session_new (NULL);
+        soup_session_add_feature (session, SOUP_SESSION_FEATURE (cache));
+
+	for (i = 1; i <= 12; i++) {
+		path = g_strdup_printf ("/%u", i);
+		body = do_request (session, base_uri, "GET", path, NULL,
+				   "Test-Set-Expires", "Fri, 01 Jan 2100 00:00:00 GMT",
+				   NULL);
+		g_free (body);
+		g_free (path);
+	}
+
+	body = do_request (session, base_uri, "GET", "/12", NULL, NULL);
+	soup_test_assert (!last_request_hit_network,
+			  "Request for /12 not filled from cache");
+	g_free (body);
+
+	stats = soup_cache_get_stats (cache);
+	g_assert_cmpuint (lookup_stat (stats, "hits"), ==, 1);
+	g_assert_cmpuint (lookup_stat (stats, "disk-hits"), ==, 1);
+	g_assert_cmpuint (lookup_stat (stats, "misses"), ==, 12);
+	g_assert_cmpuint (lookup_stat (stats, "evictions"), ==, 2);
+	g_assert_cmpuint (lookup_stat (stats, "bytes-from-cache"), ==, 65);
+	g_assert_cmpuint (lookup_stat (stats, "bytes-from-network"), ==, 12 * 65);
+	g_assert_cmpuint (lookup_stat (stats, "entries"), ==, 10);
+	g_assert_cmpuint (lookup_stat (stats, "size"), ==, 650);
+	g_variant_unref (stats);
+	g_assert_cmpuint (n_evicted, ==, 2);
+
+	/* The 10 entries and the hit on /12 */
+	origin_stats = soup_cache_get_origin_stats (cache);
+	g_assert_cmpuint (g_variant_n_children (origin_stats), ==, 1);
+	origin = g_uri_join (G_URI_FLAGS_NONE, g_uri_get_scheme (base_uri), NULL,
+			     g_uri_get_host (base_uri), g_uri_get_port (base_uri), "", NULL, NULL);
+	stats = g_variant_lookup_value (origin_stats, origin, G_VARIANT_TYPE ("a{st}"));
+	g_assert_nonnull (stats);
+	g_assert_cmpuint (lookup_stat (stats, "entries"), ==, 10);
+	g_assert_cmpuint (lookup_stat (stats, "hits"), ==, 11);
+	g_variant_unref (stats);
+	g_variant_unref (origin_stats);
+	g_free (origin);
+
+	soup_test_session_abort_unref (session);
+	soup_cache_clear (cache);
+	g_object_unref (cache);
+	g_free (cache_dir);
+}
+
+static void
+do_vary_test (gconstpointer data)
+{
+	GUri *base_uri = (GUri *)data;
+	SoupSession *session;
+	SoupCache *cache;
+	char *cache_dir;
+	char *body_en, *body_fr, *body;
+
+	cache_dir = g_dir_make_tmp ("cache-test-XXXXXX", NULL);
+	debug_printf (2, "  Caching to %s\n", cache_dir);
+	cache = soup_cache_new (cache_dir, SOUP_CACHE_SINGLE_USER);
+	session = soup_test_session_new (NULL);
+        soup_session_add_feature (session, SOUP_SESSION_FEATURE (cache));
+
+	/* Each variant gets its own entry */
+	body_en = do_request (session, base_uri, "GET", "/1", NULL,
+			      "Test-Set-Expires", "Fri, 01 Jan 2100 00:00:00 GMT",
+			      "Test-Set-Vary", "Accept-Language",
+			      "Accept-Language", "en",
+			      NULL);
+	body_fr = do_request (session, base_uri, "GET", "/1", NULL,
+			      "Test-Set-Expires", "Fri, 01 Jan 2100 00:00:00 GMT",
+			      "Test-Set-Vary", "Accept-Language",
+			      "Accept-Language", "fr",
+			      NULL);
+	soup_test_assert (last_request_hit_network,
+			  "Request for a new variant filled from cache");
+	g_assert_cmpstr (body_en, !=, body_fr);
+	g_assert_cmpuint (count_cached_resources_in_dir (cache_dir), ==, 2);
+
+	body = do_request (session, base_uri, "GET", "/1", NULL,
+			   "Accept-Language", "en",
+			   NULL);
+	soup_test_assert (!last_request_hit_network,
+			  "Request for /1 (en) not filled from cache");
+	g_assert_cmpstr (body, ==, body_en);
+	g_free (body);
+
+	body = do_request (session, base_uri, "GET", "/1", NULL,
+			   "Accept-Language", "fr",
+			   NULL);
+	soup_test_assert (!last_request_hit_network,
+			  "Request for /1 (fr) not filled from cache");
+	g_assert_cmpstr (body, ==, body_fr);
+	g_free (body);
+
+	/* Variants are kept in the index */
+	debug_printf (2, "  Reloading the cache\n");
+	soup_cache_dump (cache);
+	soup_test_session_abort_unref (session);
+	g_object_unref (cache);
+
+	cache = soup_cache_new (cache_dir, SOUP_CACHE_SINGLE_USER);
+	soup_cache_load (cache);
+	session = soup_test_session_new (NULL);
+        soup_session_add_feature (session, SOUP_SESSION_FEATURE (cache));
+	g_assert_cmpuint (count_cached_resources_in_dir (cache_dir), ==, 2);
+
+	body = do_request (session, base_uri, "GET", "/1", NULL,
+			   "Accept-Language", "fr",
+			   NULL);
+	soup_test_assert (!last_request_hit_network,
+			  "Request for /1 (fr) not filled from cache");
+	g_assert_cmpstr (body, ==, body_fr);
+	g_free (body);
+
+	/* Vary: * is never reused */
+	body = do_request (session, base_uri, "GET", "/2", NULL,
+			   "Test-Set-Expires", "Fri, 01 Jan 2100 00:00:00 GMT",
+			   "Test-Set-Vary", "*",
+			   NULL);
+	g_free (body);
+	body = do_request (session, base_uri, "GET", "/2", NULL, NULL);
+	soup_test_assert (last_request_hit_network,
+			  "Request for /2 filled from cache");
+	g_free (body);
+	g_assert_cmpuint (count_cached_resources_in_dir (cache_dir), ==, 2);
+
+	soup_test_session_abort_unref (session);
+	soup_cache_clear (cache);
+	g_rmdir (cache_dir);
+	g_object_unref (cache);
+	g_free (cache_dir);
+	g_free (body_en);
+	g_free (body_fr);
+}
+
 static void
 do_metrics_test (gconstpointer data)
 {
@@ -1110,9 +2001,19 @@ main (int argc, char **argv)
 
 	g_test_add_data_func ("/cache/basics", base_uri, do_basics_test);
 	g_test_add_data_func ("/cache/cancellation", base_uri, do_cancel_test);
+	g_test_add_data_func ("/cache/async-hits", base_uri, do_async_hits_test);
 	g_test_add_data_func ("/cache/refcounting", base_uri, do_refcounting_test);
 	g_test_add_data_func ("/cache/headers", base_uri, do_headers_test);
 	g_test_add_data_func ("/cache/leaks", base_uri, do_leaks_test);
+	g_test_add_data_func ("/cache/journal", base_uri, do_journal_test);
+	g_test_add_data_func ("/cache/packed", base_uri, do_packed_test);
+	g_test_add_data_func ("/cache/compression", base_uri, do_compression_test);
+	g_test_add_data_func ("/cache/range", base_uri, do_range_cache_test);
+	g_test_add_data_func ("/cache/memory-tier", base_uri, do_memory_tier_test);
+	g_test_add_data_func ("/cache/stale", base_uri, do_stale_test);
+	g_test_add_data_func ("/cache/eviction", base_uri, do_eviction_test);
+	g_test_add_data_func ("/cache/vary", base_uri, do_vary_test);
+	g_test_add_data_func ("/cache/stats", base_uri, do_stats_test);
         g_test_add_data_func ("/cache/metrics", base_uri, do_metrics_test);
         g_test_add_data_func ("/cache/threads", base_uri, do_threads_test);
 
@@ -5,6 +5,8 @@
 
 #include "test-utils.h"
 
+#include <glib/gstdio.h>
+
 static SoupServer *server;
 static GUri *first_party_uri, *third_party_uri;
 
@@ -425,6 +427,76 @@ do_cookies_parsing_test (void)
 	soup_test_session_abort_unref (session);
 }	
 
+static void
+do_cookies_parsing_attributes_test (void)
+{
+	SoupCookie *cookie;
+	GUri *origin, *ip_origin;
+	GString *long_domain;
+	char *header;
+
+	origin = g_uri_parse ("http://www.example.com/foo/bar", SOUP_HTTP_URI_FLAGS, NULL);
+	ip_origin = g_uri_parse ("http://127.0.0.1/", SOUP_HTTP_URI_FLAGS, NULL);
+
+	cookie = soup_cookie_parse ("a = b ; Domain=example.com; Path=/x; Max-Age=10; Secure; SameSite=Strict", origin);
+	g_assert_nonnull (cookie);
+	g_assert_cmpstr (soup_cookie_get_name (cookie), ==, "a");
+	g_assert_cmpstr (soup_cookie_get_value (cookie), ==, "b");
+	g_assert_cmpstr (soup_cookie_get_domain (cookie), ==, ".example.com");
+	g_assert_cmpstr (soup_cookie_get_path (cookie), ==, "/x");
+	g_assert_nonnull (soup_cookie_get_expires (cookie));
+	g_assert_true (soup_cookie_get_secure (cookie));
+	g_assert_false (soup_cookie_get_http_only (cookie));
+	g_assert_cmpint (soup_cookie_get_same_site_policy (cookie), ==, SOUP_SAME_SITE_POLICY_STRICT);
+	soup_cookie_free (cookie);
+
+	/* Invalid values don't override earlier attributes */
+	cookie = soup_cookie_parse ("c=d; Expires=Wed, 09 Jun 2021 10:18:14 GMT; Max-Age=soon; SameSite=None; SameSite=Bogus", origin);
+	g_assert_nonnull (cookie);
+	g_assert_cmpint (g_date_time_get_year (soup_cookie_get_expires (cookie)), ==, 2021);
+	g_assert_cmpint (soup_cookie_get_same_site_policy (cookie), ==, SOUP_SAME_SITE_POLICY_NONE);
+	soup_cookie_free (cookie);
+
+	/* The last of Expires and Max-Age wins */
+	cookie = soup_cookie_parse ("e=f; Max-Age=10; Expires=garbage", origin);
+	g_assert_nonnull (cookie);
+	g_assert_null (soup_cookie_get_expires (cookie));
+	soup_cookie_free (cookie);
+
+	/* No name, and the path defaults to the origin's directory */
+	cookie = soup_cookie_parse ("value; Path=relative", origin);
+	g_assert_nonnull (cookie);
+	g_assert_cmpstr (soup_cookie_get_name (cookie), ==, "");
+	g_assert_cmpstr (soup_cookie_get_value (cookie), ==, "value");
+	g_assert_cmpstr (soup_cookie_get_domain (cookie), ==, "www.example.com");
+	g_assert_cmpstr (soup_cookie_get_path (cookie), ==, "/foo");
+	soup_cookie_free (cookie);
+
+	g_assert_null (soup_cookie_parse ("g=h; Domain=com", origin));
+	g_assert_null (soup_cookie_parse ("i=j; Domain=example.org", origin));
+
+	cookie = soup_cookie_parse ("k=l; Domain=127.0.0.1", ip_origin);
+	g_assert_nonnull (cookie);
+	g_assert_cmpstr (soup_cookie_get_domain (cookie), ==, "127.0.0.1");
+	soup_cookie_free (cookie);
+
+	long_domain = g_string_new (NULL);
+	while (long_domain->len < 300)
+		g_string_append (long_domain, "sub.");
+	g_string_append (long_domain, "example.com");
+	header = g_strdup_printf ("m=n; Domain=%s", long_domain->str);
+	cookie = soup_cookie_parse (header, NULL);
+	g_assert_nonnull (cookie);
+	g_assert_cmpint (soup_cookie_get_domain (cookie)[0], ==, '.');
+	g_assert_cmpstr (soup_cookie_get_domain (cookie) + 1, ==, long_domain->str);
+	soup_cookie_free (cookie);
+	g_free (header);
+	g_string_free (long_domain, TRUE);
+
+	g_uri_unref (origin);
+	g_uri_unref (ip_origin);
+}
+
 static void
 do_cookies_parsing_nopath_nullorigin (void)
 {
@@ -634,6 +706,211 @@ do_cookies_threads_test (void)
         soup_test_session_abort_unref (session);
 }
 
+static void
+do_get_cookies_order_test (void)
+{
+	SoupCookieJar *jar;
+	GUri *uri, *parent_uri, *other_uri;
+	GSList *cookies, *l;
+	char *header;
+
+	jar = soup_cookie_jar_new ();
+	uri = g_uri_parse ("http://www.example.com/a/b/c", SOUP_HTTP_URI_FLAGS, NULL);
+	parent_uri = g_uri_parse ("http://www.example.com/a", SOUP_HTTP_URI_FLAGS, NULL);
+	other_uri = g_uri_parse ("http://www.example.com/x", SOUP_HTTP_URI_FLAGS, NULL);
+
+	soup_cookie_jar_set_cookie (jar, uri, "a=1; Path=/");
+	soup_cookie_jar_set_cookie (jar, uri, "b=2; Path=/a/b");
+	soup_cookie_jar_set_cookie (jar, uri, "c=3; Domain=example.com; Path=/a");
+	soup_cookie_jar_set_cookie (jar, uri, "d=4; Path=/a");
+
+	/* Longest path first, then oldest first, across domains */
+	header = soup_cookie_jar_get_cookies (jar, uri, TRUE);
+	g_assert_cmpstr (header, ==, "b=2; c=3; d=4; a=1");
+	g_free (header);
+
+	/* Served again from the header cache */
+	header = soup_cookie_jar_get_cookies (jar, uri, TRUE);
+	g_assert_cmpstr (header, ==, "b=2; c=3; d=4; a=1");
+	g_free (header);
+
+	cookies = soup_cookie_jar_get_cookie_list (jar, uri, TRUE);
+	g_assert_cmpuint (g_slist_length (cookies), ==, 4);
+	g_assert_cmpstr (soup_cookie_get_name (cookies->data), ==, "b");
+	g_assert_cmpstr (soup_cookie_get_name (cookies->next->data), ==, "c");
+	g_slist_free_full (cookies, (GDestroyNotify)soup_cookie_free);
+
+	/* A replaced cookie counts as the newest one */
+	soup_cookie_jar_set_cookie (jar, uri, "c=5; Domain=example.com; Path=/a");
+	header = soup_cookie_jar_get_cookies (jar, uri, TRUE);
+	g_assert_cmpstr (header, ==, "b=2; d=4; c=5; a=1");
+	g_free (header);
+
+	cookies = soup_cookie_jar_get_cookie_list (jar, uri, TRUE);
+	l = g_slist_find_custom (cookies, "b", (GCompareFunc)find_cookie);
+	g_assert_nonnull (l);
+	soup_cookie_jar_delete_cookie (jar, l->data);
+	g_slist_free_full (cookies, (GDestroyNotify)soup_cookie_free);
+
+	header = soup_cookie_jar_get_cookies (jar, uri, TRUE);
+	g_assert_cmpstr (header, ==, "d=4; c=5; a=1");
+	g_free (header);
+
+	header = soup_cookie_jar_get_cookies (jar, parent_uri, TRUE);
+	g_assert_cmpstr (header, ==, "d=4; c=5; a=1");
+	g_free (header);
+
+	header = soup_cookie_jar_get_cookies (jar, other_uri, TRUE);
+	g_assert_cmpstr (header, ==, "a=1");
+	g_free (header);
+
+	g_uri_unref (uri);
+	g_uri_unref (parent_uri);
+	g_uri_unref (other_uri);
+	g_object_unref (jar);
+}
+
+static void
+cookie_expired_cb (SoupCookieJar *jar,
+                   SoupCookie    *old_cookie,
+                   SoupCookie    *new_cookie,
+                   GSList       **expired)
+{
+        if (!new_cookie)
+                *expired = g_slist_prepend (*expired, g_strdup (soup_cookie_get_name (old_cookie)));
+}
+
+static gboolean
+expiration_timeout_cb (gboolean *timed_out)
+{
+        *timed_out = TRUE;
+        return G_SOURCE_REMOVE;
+}
+
+static void
+do_cookies_expiration_test (void)
+{
+        SoupCookieJar *jar;
+        GSList *expired = NULL, *cookies;
+        gboolean timed_out = FALSE;
+        guint timeout_id;
+
+        jar = soup_cookie_jar_new ();
+        g_signal_connect (jar, "changed", G_CALLBACK (cookie_expired_cb), &expired);
+
+        soup_cookie_jar_add_cookie (jar, soup_cookie_new ("short", "1", "example.com", "/", 1));
+        soup_cookie_jar_add_cookie (jar, soup_cookie_new ("long", "2", "example.com", "/", 3600));
+        soup_cookie_jar_add_cookie (jar, soup_cookie_new ("session", "3", "example.com", "/", -1));
+
+        /* The expired cookie is swept without any lookup */
+        timeout_id = g_timeout_add_seconds (5, (GSourceFunc)expiration_timeout_cb, &timed_out);
+        while (!expired && !timed_out)
+                g_main_context_iteration (NULL, TRUE);
+        g_assert_false (timed_out);
+        g_source_remove (timeout_id);
+
+        g_assert_cmpuint (g_slist_length (expired), ==, 1);
+        g_assert_cmpstr (expired->data, ==, "short");
+
+        cookies = soup_cookie_jar_all_cookies (jar);
+        g_assert_cmpuint (g_slist_length (cookies), ==, 2);
+        g_assert_null (g_slist_find_custom (cookies, "short", (GCompareFunc)find_cookie));
+        g_slist_free_full (cookies, (GDestroyNotify)soup_cookie_free);
+
+        g_slist_free_full (expired, g_free);
+        g_object_unref (jar);
+}
+
+static void
+do_cookies_text_jar_test (void)
+{
+        SoupCookieJar *jar;
+        GSList *cookies;
+        char *dir, *filename;
+        GUri *uri;
+
+        dir = g_dir_make_tmp ("cookies-test-XXXXXX", NULL);
+        g_assert_nonnull (dir);
+        filename = g_build_filename (dir, "cookies.txt", NULL);
+        uri = g_uri_parse ("http://www.example.com/", SOUP_HTTP_URI_FLAGS, NULL);
+
+        jar = soup_cookie_jar_text_new (filename, FALSE);
+        soup_cookie_jar_set_cookie (jar, uri, "one=1; Max-Age=3600");
+        soup_cookie_jar_set_cookie (jar, uri, "two=2; Max-Age=3600");
+        soup_cookie_jar_set_cookie (jar, uri, "session=3");
+
+        /* Changes are only written later, all at once */
+        g_assert_false (g_file_test (filename, G_FILE_TEST_EXISTS));
+        soup_cookie_jar_text_flush (SOUP_COOKIE_JAR_TEXT (jar));
+        g_assert_true (g_file_test (filename, G_FILE_TEST_EXISTS));
+
+        /* Pending changes are written when the jar goes away */
+        soup_cookie_jar_set_cookie (jar, uri, "one=1; Expires=Thu, 01 Jan 1970 00:00:00 GMT");
+        g_object_unref (jar);
+
+        jar = soup_cookie_jar_text_new (filename, TRUE);
+        cookies = soup_cookie_jar_all_cookies (jar);
+        g_assert_cmpuint (g_slist_length (cookies), ==, 1);
+        g_assert_cmpstr (soup_cookie_get_name (cookies->data), ==, "two");
+        g_slist_free_full (cookies, (GDestroyNotify)soup_cookie_free);
+        g_object_unref (jar);
+
+        g_unlink (filename);
+        g_rmdir (dir);
+        g_uri_unref (uri);
+        g_free (filename);
+        g_free (dir);
+}
+
+static void
+do_cookies_db_jar_test (void)
+{
+        SoupCookieJar *jar;
+        GSList *cookies;
+        char *dir, *filename;
+        GUri *uri;
+        guint i;
+
+        dir = g_dir_make_tmp ("cookies-test-XXXXXX", NULL);
+        g_assert_nonnull (dir);
+        filename = g_build_filename (dir, "cookies.sqlite", NULL);
+        uri = g_uri_parse ("http://www.example.com/", SOUP_HTTP_URI_FLAGS, NULL);
+
+        jar = soup_cookie_jar_db_new (filename, FALSE);
+        for (i = 0; i < 100; i++) {
+                char *cookie = g_strdup_printf ("counter=%u; Max-Age=3600", i);
+
+                soup_cookie_jar_set_cookie (jar, uri, cookie);
+                g_free (cookie);
+        }
+        soup_cookie_jar_set_cookie (jar, uri, "other=1; Max-Age=3600");
+        soup_cookie_jar_set_cookie (jar, uri, "session=1");
+        soup_cookie_jar_set_cookie (jar, uri, "other=1; Expires=Thu, 01 Jan 1970 00:00:00 GMT");
+
+        /* Pending changes are committed when the jar goes away */
+        g_object_unref (jar);
+
+        jar = soup_cookie_jar_db_new (filename, TRUE);
+        cookies = soup_cookie_jar_all_cookies (jar);
+        g_assert_cmpuint (g_slist_length (cookies), ==, 1);
+        g_assert_cmpstr (soup_cookie_get_name (cookies->data), ==, "counter");
+        g_assert_cmpstr (soup_cookie_get_value (cookies->data), ==, "99");
+        g_slist_free_full (cookies, (GDestroyNotify)soup_cookie_free);
+        g_object_unref (jar);
+
+        for (i = 0; i < 3; i++) {
+                const char *suffixes[] = { "", "-wal", "-shm" };
+                char *path = g_strconcat (filename, suffixes[i], NULL);
+
+                g_unlink (path);
+                g_free (path);
+        }
+        g_rmdir (dir);
+        g_uri_unref (uri);
+        g_free (filename);
+        g_free (dir);
+}
+
 int
 main (int argc, char **argv)
 {
@@ -654,14 +931,19 @@ main (int argc, char **argv)
 	g_test_add_func ("/cookies/accept-policy", do_cookies_accept_policy_test);
 	g_test_add_func ("/cookies/accept-policy-subdomains", do_cookies_subdomain_policy_test);
 	g_test_add_func ("/cookies/parsing", do_cookies_parsing_test);
+	g_test_add_func ("/cookies/parsing/attributes", do_cookies_parsing_attributes_test);
 	g_test_add_func ("/cookies/parsing/no-path-null-origin", do_cookies_parsing_nopath_nullorigin);
 	g_test_add_func ("/cookies/parsing/equal-nullpath", do_cookies_equal_nullpath);
 	g_test_add_func ("/cookies/parsing/control-characters", do_cookies_parsing_control_characters);
 	g_test_add_func ("/cookies/get-cookies/empty-host", do_get_cookies_empty_host_test);
+	g_test_add_func ("/cookies/get-cookies/order", do_get_cookies_order_test);
 	g_test_add_func ("/cookies/remove-feature", do_remove_feature_test);
 	g_test_add_func ("/cookies/secure-cookies", do_cookies_strict_secure_test);
 	g_test_add_func ("/cookies/prefix", do_cookies_prefix_test);
         g_test_add_func ("/cookies/threads", do_cookies_threads_test);
+        g_test_add_func ("/cookies/expiration", do_cookies_expiration_test);
+        g_test_add_func ("/cookies/text-jar", do_cookies_text_jar_test);
+        g_test_add_func ("/cookies/db-jar", do_cookies_db_jar_test);
 
 	ret = g_test_run ();
 
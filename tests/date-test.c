@@ -4,6 +4,7 @@
  */
 
 #include "test-utils.h"
+#include "soup-date-utils-private.h"
 
 static void check_ok (gconstpointer data);
 
@@ -268,6 +269,70 @@ check_conversion (gconstpointer data)
 	g_date_time_unref (date);
 }
 
+static void
+do_unix_time_test (void)
+{
+	static const char *const weekdays[] = {
+		"Mon", "Tue", "Wed", "Thu", "Fri", "Sat", "Sun"
+	};
+	char buffer[SOUP_HTTP_DATE_BUFFER_SIZE];
+	gint64 time;
+	int i;
+
+	/* IMF-fixdate, parsed without GDateTime */
+	g_assert_true (soup_date_parse_http_time ("Sat, 06 Nov 2004 08:09:07 GMT", &time));
+	g_assert_cmpint (time, ==, 1099728547);
+
+	/* The other formats go through the date cache, so the second
+	 * lookup must give the same answer as the first.
+	 */
+	for (i = 0; i < 2; i++) {
+		time = 0;
+		g_assert_true (soup_date_parse_http_time ("Saturday, 06-Nov-04 08:09:07 GMT", &time));
+		g_assert_cmpint (time, ==, 1099728547);
+	}
+
+	g_assert_true (soup_date_parse_http_time ("Sat, 6 Nov 2004 08:09:07 -0430", &time));
+	g_assert_cmpint (time, ==, 1099728547 + 4 * 3600 + 30 * 60);
+
+	g_assert_false (soup_date_parse_http_time ("Sat, 31 Feb 2004 08:09:07 GMT", &time));
+	g_assert_null (soup_date_time_new_from_http_string ("Sat, 31 Feb 2004 08:09:07 GMT"));
+	g_assert_false (soup_date_parse_http_time ("Sat, 06 Nov 2004 24:09:07 GMT", &time));
+	g_assert_false (soup_date_parse_http_time ("", &time));
+
+	soup_date_format_http_time (0, SOUP_DATE_HTTP, buffer);
+	g_assert_cmpstr (buffer, ==, "Thu, 01 Jan 1970 00:00:00 GMT");
+	soup_date_format_http_time (1099728547, SOUP_DATE_COOKIE, buffer);
+	g_assert_cmpstr (buffer, ==, "Sat, 06-Nov-2004 08:09:07 GMT");
+	soup_date_format_http_time (951782400, SOUP_DATE_HTTP, buffer);
+	g_assert_cmpstr (buffer, ==, "Tue, 29 Feb 2000 00:00:00 GMT");
+	soup_date_format_http_time (-1, SOUP_DATE_HTTP, buffer);
+	g_assert_cmpstr (buffer, ==, "Wed, 31 Dec 1969 23:59:59 GMT");
+
+	/* Formatting and parsing round-trip across the whole range */
+	for (time = G_GINT64_CONSTANT (-62135596800); time < G_GINT64_CONSTANT (253402300799); time += 86400 * 97 + 3671) {
+		gint64 parsed;
+		GDateTime *date;
+		char weekday[4];
+		int day, year, hour, minute, second;
+
+		soup_date_format_http_time (time, SOUP_DATE_HTTP, buffer);
+		g_assert_true (soup_date_parse_http_time (buffer, &parsed));
+		g_assert_cmpint (parsed, ==, time);
+
+		g_assert_cmpint (sscanf (buffer, "%3s, %d %*3s %d %d:%d:%d GMT",
+					 weekday, &day, &year, &hour, &minute, &second), ==, 6);
+		date = g_date_time_new_from_unix_utc (time);
+		g_assert_cmpstr (weekday, ==, weekdays[g_date_time_get_day_of_week (date) - 1]);
+		g_assert_cmpint (day, ==, g_date_time_get_day_of_month (date));
+		g_assert_cmpint (year, ==, g_date_time_get_year (date));
+		g_assert_cmpint (hour, ==, g_date_time_get_hour (date));
+		g_assert_cmpint (minute, ==, g_date_time_get_minute (date));
+		g_assert_cmpint (second, ==, g_date_time_get_second (date));
+		g_date_time_unref (date);
+	}
+}
+
 int
 main (int argc, char **argv)
 {
@@ -300,6 +365,8 @@ main (int argc, char **argv)
 		g_free (path);
 	}
 
+	g_test_add_func ("/date/unix-time", do_unix_time_test);
+
 	ret = g_test_run ();
 
 	test_cleanup ();
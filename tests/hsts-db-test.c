@@ -186,6 +186,67 @@ do_hsts_db_large_max_age_test (void)
 	g_remove (DB_FILE);
 }
 
+static void
+set_policy_with_expiry (SoupHSTSEnforcer *enforcer,
+                        const char       *domain,
+                        gint64            expiry)
+{
+        GDateTime *expires = g_date_time_new_from_unix_utc (expiry);
+        SoupHSTSPolicy *policy = soup_hsts_policy_new_full (domain, 1000, expires, FALSE);
+
+        soup_hsts_enforcer_set_policy (enforcer, policy);
+        soup_hsts_policy_free (policy);
+        g_date_time_unref (expires);
+}
+
+static gint64
+stored_expiry (const char *domain)
+{
+        SoupHSTSEnforcer *enforcer = soup_hsts_enforcer_db_new (DB_FILE);
+        GList *policies, *l;
+        gint64 expiry = 0;
+
+        policies = soup_hsts_enforcer_get_policies (enforcer, FALSE);
+        for (l = policies; l; l = l->next) {
+                if (!strcmp (soup_hsts_policy_get_domain (l->data), domain))
+                        expiry = g_date_time_to_unix (soup_hsts_policy_get_expires (l->data));
+        }
+        g_list_free_full (policies, (GDestroyNotify)soup_hsts_policy_free);
+        g_object_unref (enforcer);
+
+        return expiry;
+}
+
+static void
+do_hsts_db_batching_test (void)
+{
+        SoupHSTSEnforcer *enforcer;
+        gint64 now = g_get_real_time () / G_USEC_PER_SEC;
+        int i;
+
+        enforcer = soup_hsts_enforcer_db_new (DB_FILE);
+        for (i = 0; i < 100; i++)
+                set_policy_with_expiry (enforcer, "example.com", now + 1000 + i);
+        set_policy_with_expiry (enforcer, "example.org", now + 1000);
+        g_object_unref (enforcer);
+
+        /* Only the last change for each host is written */
+        g_assert_cmpint (stored_expiry ("example.com"), ==, now + 1099);
+        g_assert_cmpint (stored_expiry ("example.org"), ==, now + 1000);
+
+        /* Small expiration refreshes are skipped */
+        enforcer = soup_hsts_enforcer_db_new (DB_FILE);
+        soup_hsts_enforcer_db_set_expiry_threshold (SOUP_HSTS_ENFORCER_DB (enforcer), 3600);
+        set_policy_with_expiry (enforcer, "example.com", now + 2000);
+        set_policy_with_expiry (enforcer, "example.org", now + 10000);
+        g_object_unref (enforcer);
+
+        g_assert_cmpint (stored_expiry ("example.com"), ==, now + 1099);
+        g_assert_cmpint (stored_expiry ("example.org"), ==, now + 10000);
+
+        g_remove (DB_FILE);
+}
+
 int
 main (int argc, char **argv)
 {
@@ -208,6 +269,7 @@ main (int argc, char **argv)
 	g_test_add_func ("/hsts-db/basic", do_hsts_db_persistency_test);
 	g_test_add_func ("/hsts-db/subdomains", do_hsts_db_subdomains_test);
 	g_test_add_func ("/hsts-db/large-max-age", do_hsts_db_large_max_age_test);
+	g_test_add_func ("/hsts-db/batching", do_hsts_db_batching_test);
 
 	ret = g_test_run ();
 
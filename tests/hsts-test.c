@@ -575,6 +575,48 @@ do_hsts_get_policies_test (void)
 	g_object_unref(enforcer);
 }
 
+static void
+do_hsts_preload_test (void)
+{
+	SoupHSTSEnforcer *enforcer = soup_hsts_enforcer_new ();
+	SoupSession *session;
+	GBytes *json;
+	GError *error = NULL;
+	static const char preload_list[] =
+		"// Comments are allowed, as in Chromium's list\n"
+		"{\n"
+		"  \"pinsets\": [ { \"name\": \"test\", \"static_spki_hashes\": [ \"TestSPKI\" ] } ],\n"
+		"  \"entries\": [\n"
+		"    /* Entries without a mode are ignored */\n"
+		"    { \"name\": \"pinned.localhost\", \"include_subdomains\": true, \"pins\": \"test\" },\n"
+		"    { \"name\": \"localhost\", \"policy\": \"custom\", \"mode\": \"force-https\" },\n"
+		"    { \"name\": \"gnome.org\", \"include_subdomains\": true, \"mode\": \"force-https\" },\n"
+		"    { \"name\": \"xn--1caqm.com\", \"mode\": \"force-https\" }\n"
+		"  ]\n"
+		"}\n";
+
+	json = g_bytes_new_static ("{ \"entries\": [ { \"name\": ", 25);
+	g_assert_false (soup_hsts_enforcer_load_preload_list (enforcer, json, &error));
+	g_assert_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA);
+	g_clear_error (&error);
+	g_bytes_unref (json);
+
+	json = g_bytes_new_static (preload_list, sizeof (preload_list) - 1);
+	g_assert_true (soup_hsts_enforcer_load_preload_list (enforcer, json, &error));
+	g_assert_no_error (error);
+	g_bytes_unref (json);
+
+	/* Preloaded hosts are not reported as policies */
+	g_assert_null (soup_hsts_enforcer_get_domains (enforcer, TRUE));
+
+	session = hsts_session_new (enforcer);
+	session_get_uri (session, "http://localhost", SOUP_STATUS_OK, TRUE);
+	session_get_uri (session, "http://subdomain.localhost", SOUP_STATUS_MOVED_PERMANENTLY, FALSE);
+	soup_test_session_abort_unref (session);
+
+	g_object_unref (enforcer);
+}
+
 int
 main (int argc, char **argv)
 {
@@ -622,6 +664,7 @@ main (int argc, char **argv)
 	g_test_add_func ("/hsts/idna-addresses", do_hsts_idna_addresses_test);
 	g_test_add_func ("/hsts/get-domains", do_hsts_get_domains_test);
 	g_test_add_func ("/hsts/get-policies", do_hsts_get_policies_test);
+	g_test_add_func ("/hsts/preload", do_hsts_preload_test);
 
 	ret = g_test_run ();
 
@@ -461,6 +461,46 @@ do_post_large_async_test (Test *test, gconstpointer data)
         g_uri_unref (uri);
 }
 
+static void
+do_post_stream_async_test (Test *test, gconstpointer data)
+{
+        GUri *uri;
+        SoupMessage *msg;
+        GBytes *response = NULL;
+        GMainContext *async_context = g_main_context_ref_thread_default ();
+        guint large_size = 1024 * 1024;
+        char *large_data;
+        unsigned int i;
+
+        /* Larger than the initial flow control window, so that window
+         * updates are only sent as the handler reads the stream.
+         */
+        large_data = g_malloc (large_size);
+        for (i = 0; i < large_size; i++)
+                large_data[i] = i & 0xFF;
+        GBytes *bytes = g_bytes_new_take (large_data, large_size);
+
+        uri = g_uri_parse_relative (base_uri, "/echo_stream", SOUP_HTTP_URI_FLAGS, NULL);
+        msg = soup_message_new_from_uri (SOUP_METHOD_POST, uri);
+        soup_message_set_request_body_from_bytes (msg, "application/octet-stream", bytes);
+
+        soup_session_send_async (test->session, msg, G_PRIORITY_DEFAULT, NULL, on_send_complete, &response);
+
+        while (!response)
+                g_main_context_iteration (async_context, TRUE);
+
+        g_assert_true (g_bytes_equal (bytes, response));
+
+        while (g_main_context_pending (async_context))
+                g_main_context_iteration (async_context, FALSE);
+
+        g_bytes_unref (response);
+        g_bytes_unref (bytes);
+        g_main_context_unref (async_context);
+        g_object_unref (msg);
+        g_uri_unref (uri);
+}
+
 static void
 do_post_blocked_async_test (Test *test, gconstpointer data)
 {
@@ -1191,6 +1231,67 @@ unpause_message (SoupServerMessage *msg)
         return FALSE;
 }
 
+typedef struct {
+        GInputStream *stream;
+        GByteArray *body;
+        guint8 buffer[16384];
+} EchoStreamData;
+
+static void
+echo_stream_data_free (EchoStreamData *data)
+{
+        if (data->body)
+                g_byte_array_unref (data->body);
+        g_free (data);
+}
+
+static void
+echo_stream_read_cb (GObject      *source,
+                     GAsyncResult *result,
+                     gpointer      user_data)
+{
+        SoupServerMessage *msg = user_data;
+        EchoStreamData *data = g_object_get_data (G_OBJECT (msg), "echo-stream-data");
+        GError *error = NULL;
+        gssize nread;
+
+        nread = g_input_stream_read_finish (G_INPUT_STREAM (source), result, &error);
+        g_assert_no_error (error);
+
+        if (nread > 0) {
+                g_byte_array_append (data->body, data->buffer, nread);
+                g_input_stream_read_async (data->stream, data->buffer, sizeof (data->buffer),
+                                           G_PRIORITY_DEFAULT, NULL,
+                                           echo_stream_read_cb, msg);
+                return;
+        }
+
+        g_assert_cmpint (soup_server_message_get_request_body (msg)->length, ==, 0);
+
+        soup_server_message_set_status (msg, SOUP_STATUS_OK, NULL);
+        soup_message_body_append_bytes (soup_server_message_get_response_body (msg),
+                                        g_byte_array_free_to_bytes (g_steal_pointer (&data->body)));
+        soup_server_message_unpause (msg);
+        g_object_unref (msg);
+}
+
+static void
+early_server_handler (SoupServer        *server,
+                      SoupServerMessage *msg,
+                      const char        *path,
+                      GHashTable        *query,
+                      gpointer           user_data)
+{
+        EchoStreamData *data;
+
+        data = g_new0 (EchoStreamData, 1);
+        data->body = g_byte_array_new ();
+        data->stream = soup_server_message_get_request_body_stream (msg);
+        g_assert_nonnull (data->stream);
+        g_object_set_data_full (G_OBJECT (msg), "echo-stream-data", data,
+                                (GDestroyNotify)echo_stream_data_free);
+}
+
 static void
 server_handler (SoupServer        *server,
                 SoupServerMessage *msg,
@@ -1252,6 +1353,13 @@ server_handler (SoupServer        *server,
                                                   SOUP_MEMORY_COPY,
                                                   request_body->data,
                                                   request_body->length);
+        } else if (strcmp (path, "/echo_stream") == 0) {
+                EchoStreamData *data = g_object_get_data (G_OBJECT (msg), "echo-stream-data");
+
+                soup_server_message_pause (msg);
+                g_input_stream_read_async (data->stream, data->buffer, sizeof (data->buffer),
+                                           G_PRIORITY_DEFAULT, NULL,
+                                           echo_stream_read_cb, g_object_ref (msg));
         } else if (strcmp (path, "/misdirected_request") == 0) {
                 static SoupServerConnection *conn = NULL;
 
@@ -1339,6 +1447,8 @@ main (int argc, char **argv)
         g_object_unref (auth);
 
         soup_server_add_handler (server, NULL, server_handler, NULL, NULL);
+        soup_server_add_handler (server, "/echo_stream", server_handler, NULL, NULL);
+        soup_server_add_early_handler (server, "/echo_stream", early_server_handler, NULL, NULL);
         base_uri = soup_test_server_get_uri (server, "https", "127.0.0.1");
 
         g_test_add ("/http2/basic/async", Test, NULL,
@@ -1381,6 +1491,10 @@ main (int argc, char **argv)
                     setup_session,
                     do_post_large_async_test,
                     teardown_session);
+        g_test_add ("/http2/post/stream/async", Test, NULL,
+                    setup_session,
+                    do_post_stream_async_test,
+                    teardown_session);
         g_test_add ("/http2/post/blocked/async", Test, NULL,
                     setup_session,
                     do_post_blocked_async_test,
@@ -5,6 +5,7 @@
 GBytes *full_response;
 int total_length;
 char *test_response;
+int server_requests;
 
 static void
 check_part (SoupMessageHeaders *headers,
@@ -354,6 +355,12 @@ server_handler (SoupServer        *server,
 		GHashTable        *query,
 		gpointer           user_data)
 {
+	server_requests++;
+	if (!strcmp (path, "/cached")) {
+		soup_message_headers_append (soup_server_message_get_response_headers (msg),
+					     "Cache-Control", "max-age=3600");
+	}
+
 	soup_server_message_set_status (msg, SOUP_STATUS_OK, NULL);
 	soup_message_body_append_bytes (soup_server_message_get_response_body (msg),
 					full_response);
@@ -381,6 +388,51 @@ do_libsoup_range_test (void)
 	soup_test_session_abort_unref (session);
 }
 
+static void
+do_cache_range_test (void)
+{
+	SoupSession *session;
+	SoupServer *server;
+	SoupCache *cache;
+	SoupMessage *msg;
+	GBytes *body;
+	GUri *base_uri, *uri;
+	char *uri_str, *cache_dir;
+
+	cache_dir = g_dir_make_tmp ("range-test-XXXXXX", NULL);
+	cache = soup_cache_new (cache_dir, SOUP_CACHE_SINGLE_USER);
+	session = soup_test_session_new (NULL);
+	soup_session_add_feature (session, SOUP_SESSION_FEATURE (cache));
+
+	server = soup_test_server_new (SOUP_TEST_SERVER_DEFAULT);
+	soup_server_add_handler (server, NULL, server_handler, NULL, NULL);
+	base_uri = soup_test_server_get_uri (server, "http", NULL);
+	uri = g_uri_parse_relative (base_uri, "/cached", SOUP_HTTP_URI_FLAGS, NULL);
+	uri_str = g_uri_to_string (uri);
+
+	msg = soup_message_new ("GET", uri_str);
+	body = soup_test_session_async_send (session, msg, NULL, NULL);
+	soup_test_assert_message_status (msg, SOUP_STATUS_OK);
+	g_bytes_unref (body);
+	g_object_unref (msg);
+	soup_cache_flush (cache);
+
+	/* Only the requests for several ranges reach the server */
+	server_requests = 0;
+	do_range_test (session, uri_str, TRUE, TRUE);
+	g_assert_cmpint (server_requests, ==, 4);
+
+	g_uri_unref (uri);
+	g_uri_unref (base_uri);
+	g_free (uri_str);
+	soup_test_server_quit_unref (server);
+
+	soup_test_session_abort_unref (session);
+	soup_cache_clear (cache);
+	g_object_unref (cache);
+	g_free (cache_dir);
+}
+
 int
 main (int argc, char **argv)
 {
@@ -394,6 +446,7 @@ main (int argc, char **argv)
 
 	g_test_add_func ("/ranges/apache", do_apache_range_test);
 	g_test_add_func ("/ranges/libsoup", do_libsoup_range_test);
+	g_test_add_func ("/ranges/cache", do_cache_range_test);
 
 	ret = g_test_run ();
 
@@ -1060,6 +1060,785 @@ do_early_multi_test (ServerData *sd, gconstpointer test_data)
 	soup_test_session_abort_unref (session);
 }
 
+typedef struct {
+	GInputStream *stream;
+	GChecksum *checksum;
+	gsize length;
+	guchar buffer[8192];
+} BodyStreamData;
+
+static void
+body_stream_data_free (BodyStreamData *bsd)
+{
+	g_checksum_free (bsd->checksum);
+	g_free (bsd);
+}
+
+static void
+body_stream_read_cb (GObject      *source,
+		     GAsyncResult *result,
+		     gpointer      user_data)
+{
+	SoupServerMessage *msg = user_data;
+	BodyStreamData *bsd = g_object_get_data (G_OBJECT (msg), "body-stream-data");
+	GError *error = NULL;
+	gssize nread;
+	char *response;
+
+	nread = g_input_stream_read_finish (G_INPUT_STREAM (source), result, &error);
+	g_assert_no_error (error);
+
+	if (nread > 0) {
+		g_checksum_update (bsd->checksum, bsd->buffer, nread);
+		bsd->length += nread;
+		g_input_stream_read_async (bsd->stream, bsd->buffer, sizeof (bsd->buffer),
+					   G_PRIORITY_DEFAULT, NULL,
+					   body_stream_read_cb, msg);
+		return;
+	}
+
+	/* The body was never accumulated */
+	g_assert_cmpint (soup_server_message_get_request_body (msg)->length, ==, 0);
+
+	response = g_strdup_printf ("%s %" G_GSIZE_FORMAT,
+				    g_checksum_get_string (bsd->checksum),
+				    bsd->length);
+	soup_server_message_set_status (msg, SOUP_STATUS_OK, NULL);
+	soup_server_message_set_response (msg, "text/plain", SOUP_MEMORY_TAKE,
+					  response, strlen (response));
+	soup_server_message_unpause (msg);
+	g_object_unref (msg);
+}
+
+static void
+early_body_stream_callback (SoupServer        *server,
+			    SoupServerMessage *msg,
+			    const char        *path,
+			    GHashTable        *query,
+			    gpointer           data)
+{
+	BodyStreamData *bsd;
+
+	bsd = g_new0 (BodyStreamData, 1);
+	bsd->checksum = g_checksum_new (G_CHECKSUM_MD5);
+	bsd->stream = soup_server_message_get_request_body_stream (msg);
+	g_assert_nonnull (bsd->stream);
+	g_assert_true (G_IS_POLLABLE_INPUT_STREAM (bsd->stream));
+	g_object_set_data_full (G_OBJECT (msg), "body-stream-data", bsd,
+				(GDestroyNotify)body_stream_data_free);
+}
+
+static void
+body_stream_callback (SoupServer        *server,
+		      SoupServerMessage *msg,
+		      const char        *path,
+		      GHashTable        *query,
+		      gpointer           data)
+{
+	BodyStreamData *bsd = g_object_get_data (G_OBJECT (msg), "body-stream-data");
+
+	g_assert_nonnull (bsd);
+
+	soup_server_message_pause (msg);
+	g_input_stream_read_async (bsd->stream, bsd->buffer, sizeof (bsd->buffer),
+				   G_PRIORITY_DEFAULT, NULL,
+				   body_stream_read_cb, g_object_ref (msg));
+}
+
+static void
+do_request_body_stream_test (ServerData *sd, gconstpointer test_data)
+{
+	SoupSession *session;
+	SoupMessage *msg;
+	GBytes *request_body, *body;
+	guchar *data;
+	gsize length = 4 * 1024 * 1024;
+	char *md5, *expected;
+	gsize i;
+	int n;
+
+	server_add_early_handler (sd, NULL, early_body_stream_callback, NULL, NULL);
+	server_add_handler (sd, NULL, body_stream_callback, NULL, NULL);
+
+	data = g_malloc (length);
+	for (i = 0; i < length; i++)
+		data[i] = i % 251;
+	request_body = g_bytes_new_take (data, length);
+	md5 = g_compute_checksum_for_bytes (G_CHECKSUM_MD5, request_body);
+	expected = g_strdup_printf ("%s %" G_GSIZE_FORMAT, md5, length);
+
+	session = soup_test_session_new (NULL);
+
+	/* Twice, to check the connection is reusable once the body was read */
+	for (n = 0; n < 2; n++) {
+		msg = soup_message_new_from_uri ("POST", sd->base_uri);
+		soup_message_set_request_body_from_bytes (msg, "application/octet-stream", request_body);
+		body = soup_session_send_and_read (session, msg, NULL, NULL);
+
+		soup_test_assert_message_status (msg, SOUP_STATUS_OK);
+		g_assert_cmpmem (expected, strlen (expected), g_bytes_get_data (body, NULL), g_bytes_get_size (body));
+
+		g_bytes_unref (body);
+		g_object_unref (msg);
+	}
+
+	g_free (expected);
+	g_free (md5);
+	g_bytes_unref (request_body);
+	soup_test_session_abort_unref (session);
+}
+
+static void
+response_file_callback (SoupServer        *server,
+			SoupServerMessage *msg,
+			const char        *path,
+			GHashTable        *query,
+			gpointer           user_data)
+{
+	GFile *file = user_data;
+	GError *error = NULL;
+
+	soup_server_message_set_response_file (msg, "application/octet-stream", file, &error);
+	g_assert_no_error (error);
+}
+
+static void
+do_response_file_test (ServerData *sd, gconstpointer test_data)
+{
+	SoupSession *session;
+	SoupMessage *msg;
+	GFile *file;
+	GFileIOStream *iostream;
+	GBytes *body;
+	guchar *data;
+	gsize length = 256 * 1024;
+	char *etag, *last_modified;
+	gsize i;
+	GError *error = NULL;
+
+	data = g_malloc (length);
+	for (i = 0; i < length; i++)
+		data[i] = i % 251;
+
+	file = g_file_new_tmp ("soup-server-test-XXXXXX", &iostream, &error);
+	g_assert_no_error (error);
+	g_object_unref (iostream);
+	g_file_replace_contents (file, (const char *)data, length, NULL, FALSE,
+				 G_FILE_CREATE_NONE, NULL, NULL, &error);
+	g_assert_no_error (error);
+
+	server_add_handler (sd, NULL, response_file_callback, file, NULL);
+	session = soup_test_session_new (NULL);
+
+	/* Full response */
+	msg = soup_message_new_from_uri ("GET", sd->base_uri);
+	body = soup_session_send_and_read (session, msg, NULL, NULL);
+	soup_test_assert_message_status (msg, SOUP_STATUS_OK);
+	g_assert_cmpmem (data, length, g_bytes_get_data (body, NULL), g_bytes_get_size (body));
+	etag = g_strdup (soup_message_headers_get_one (soup_message_get_response_headers (msg), "ETag"));
+	g_assert_nonnull (etag);
+	last_modified = g_strdup (soup_message_headers_get_one (soup_message_get_response_headers (msg), "Last-Modified"));
+	g_assert_nonnull (last_modified);
+	g_bytes_unref (body);
+	g_object_unref (msg);
+
+	/* Conditional requests */
+	msg = soup_message_new_from_uri ("GET", sd->base_uri);
+	soup_message_headers_append (soup_message_get_request_headers (msg), "If-None-Match", etag);
+	body = soup_session_send_and_read (session, msg, NULL, NULL);
+	soup_test_assert_message_status (msg, SOUP_STATUS_NOT_MODIFIED);
+	g_assert_cmpuint (g_bytes_get_size (body), ==, 0);
+	g_bytes_unref (body);
+	g_object_unref (msg);
+
+	msg = soup_message_new_from_uri ("GET", sd->base_uri);
+	soup_message_headers_append (soup_message_get_request_headers (msg), "If-None-Match", "\"foo\"");
+	body = soup_session_send_and_read (session, msg, NULL, NULL);
+	soup_test_assert_message_status (msg, SOUP_STATUS_OK);
+	g_assert_cmpuint (g_bytes_get_size (body), ==, length);
+	g_bytes_unref (body);
+	g_object_unref (msg);
+
+	msg = soup_message_new_from_uri ("GET", sd->base_uri);
+	soup_message_headers_append (soup_message_get_request_headers (msg), "If-Modified-Since", last_modified);
+	body = soup_session_send_and_read (session, msg, NULL, NULL);
+	soup_test_assert_message_status (msg, SOUP_STATUS_NOT_MODIFIED);
+	g_bytes_unref (body);
+	g_object_unref (msg);
+
+	/* Range request */
+	msg = soup_message_new_from_uri ("GET", sd->base_uri);
+	soup_message_headers_set_range (soup_message_get_request_headers (msg), 1000, 65999);
+	body = soup_session_send_and_read (session, msg, NULL, NULL);
+	soup_test_assert_message_status (msg, SOUP_STATUS_PARTIAL_CONTENT);
+	g_assert_cmpmem (data + 1000, 65000, g_bytes_get_data (body, NULL), g_bytes_get_size (body));
+	g_bytes_unref (body);
+	g_object_unref (msg);
+
+	soup_test_session_abort_unref (session);
+
+	g_file_delete (file, NULL, NULL);
+	g_object_unref (file);
+	g_free (etag);
+	g_free (last_modified);
+	g_free (data);
+}
+
+static GBytes *
+get_compressible_body (void)
+{
+	GString *body = g_string_new (NULL);
+	int i;
+
+	for (i = 0; i < 1000; i++)
+		g_string_append_printf (body, "line %d of a compressible body\n", i);
+
+	return g_string_free_to_bytes (body);
+}
+
+static void
+response_text_file_callback (SoupServer        *server,
+			     SoupServerMessage *msg,
+			     const char        *path,
+			     GHashTable        *query,
+			     gpointer           user_data)
+{
+	GFile *file = user_data;
+	GError *error = NULL;
+
+	soup_server_message_set_response_file (msg, "text/plain", file, &error);
+	g_assert_no_error (error);
+}
+
+static void
+do_response_file_encoded_test (ServerData *sd, gconstpointer test_data)
+{
+	SoupContentEncoder *encoder;
+	SoupSession *session;
+	SoupMessage *msg;
+	GFile *file;
+	GFileIOStream *iostream;
+	GBytes *expected, *body;
+	char *etag;
+	GError *error = NULL;
+
+	expected = get_compressible_body ();
+	file = g_file_new_tmp ("soup-server-test-XXXXXX", &iostream, &error);
+	g_assert_no_error (error);
+	g_object_unref (iostream);
+	g_file_replace_contents (file, g_bytes_get_data (expected, NULL), g_bytes_get_size (expected),
+				 NULL, FALSE, G_FILE_CREATE_NONE, NULL, NULL, &error);
+	g_assert_no_error (error);
+
+	server_add_handler (sd, NULL, response_text_file_callback, file, NULL);
+
+	encoder = soup_content_encoder_new ();
+	soup_server_set_content_encoder (sd->server, encoder);
+	g_object_unref (encoder);
+
+	session = soup_test_session_new (NULL);
+
+	msg = soup_message_new_from_uri ("GET", sd->base_uri);
+	body = soup_session_send_and_read (session, msg, NULL, NULL);
+	soup_test_assert_message_status (msg, SOUP_STATUS_OK);
+	g_assert_cmpstr (soup_message_headers_get_one (soup_message_get_response_headers (msg), "Content-Encoding"), ==, "gzip");
+	g_assert_true (g_bytes_equal (body, expected));
+	etag = g_strdup (soup_message_headers_get_one (soup_message_get_response_headers (msg), "ETag"));
+	g_assert_true (g_str_has_prefix (etag, "W/"));
+	g_bytes_unref (body);
+	g_object_unref (msg);
+
+	/* The 304 response has the ETag of the compressed one */
+	msg = soup_message_new_from_uri ("GET", sd->base_uri);
+	soup_message_headers_append (soup_message_get_request_headers (msg), "If-None-Match", etag);
+	body = soup_session_send_and_read (session, msg, NULL, NULL);
+	soup_test_assert_message_status (msg, SOUP_STATUS_NOT_MODIFIED);
+	g_assert_cmpstr (soup_message_headers_get_one (soup_message_get_response_headers (msg), "ETag"), ==, etag);
+	g_assert_true (soup_message_headers_header_contains (soup_message_get_response_headers (msg), "Vary", "Accept-Encoding"));
+	g_bytes_unref (body);
+	g_object_unref (msg);
+
+	soup_test_session_abort_unref (session);
+
+	g_file_delete (file, NULL, NULL);
+	g_object_unref (file);
+	g_bytes_unref (expected);
+	g_free (etag);
+}
+
+static void
+content_encoder_callback (SoupServer        *server,
+			  SoupServerMessage *msg,
+			  const char        *path,
+			  GHashTable        *query,
+			  gpointer           user_data)
+{
+	GBytes *body = user_data;
+	SoupMessageBody *response_body;
+
+	soup_server_message_set_status (msg, SOUP_STATUS_OK, NULL);
+	response_body = soup_server_message_get_response_body (msg);
+
+	if (!strcmp (path, "/small")) {
+		soup_server_message_set_response (msg, "text/plain",
+						  SOUP_MEMORY_STATIC, "small", 5);
+	} else if (!strcmp (path, "/binary")) {
+		soup_server_message_set_response (msg, "image/png", SOUP_MEMORY_STATIC, NULL, 0);
+		soup_message_body_append_bytes (response_body, body);
+	} else if (!strcmp (path, "/chunked")) {
+		gsize size = g_bytes_get_size (body);
+		GBytes *part;
+
+		soup_message_headers_set_encoding (soup_server_message_get_response_headers (msg),
+						   SOUP_ENCODING_CHUNKED);
+		soup_message_headers_set_content_type (soup_server_message_get_response_headers (msg),
+						       "text/plain", NULL);
+		part = g_bytes_new_from_bytes (body, 0, size / 2);
+		soup_message_body_append_bytes (response_body, part);
+		g_bytes_unref (part);
+		part = g_bytes_new_from_bytes (body, size / 2, size - size / 2);
+		soup_message_body_append_bytes (response_body, part);
+		g_bytes_unref (part);
+		soup_message_body_complete (response_body);
+	} else {
+		soup_server_message_set_response (msg, "text/plain", SOUP_MEMORY_STATIC, NULL, 0);
+		soup_message_body_append_bytes (response_body, body);
+	}
+}
+
+static void
+do_content_encoder_test (ServerData *sd, gconstpointer test_data)
+{
+	static const struct {
+		const char *path;
+		const char *content_encoding;
+	} tests[] = {
+		{ "/text", "gzip" },
+		{ "/chunked", "gzip" },
+		{ "/small", NULL },
+		{ "/binary", NULL }
+	};
+	SoupContentEncoder *encoder;
+	SoupSession *session;
+	GBytes *expected;
+	guint i;
+
+	expected = get_compressible_body ();
+	server_add_handler (sd, NULL, content_encoder_callback, expected, NULL);
+
+	encoder = soup_content_encoder_new ();
+	soup_content_encoder_set_use_thread_pool (encoder, GPOINTER_TO_INT (test_data));
+	soup_server_set_content_encoder (sd->server, encoder);
+	g_object_unref (encoder);
+
+	session = soup_test_session_new (NULL);
+
+	for (i = 0; i < G_N_ELEMENTS (tests); i++) {
+		SoupMessage *msg;
+		GUri *uri;
+		GBytes *body;
+		SoupMessageHeaders *headers;
+
+		uri = g_uri_parse_relative (sd->base_uri, tests[i].path, SOUP_HTTP_URI_FLAGS, NULL);
+		msg = soup_message_new_from_uri ("GET", uri);
+		body = soup_session_send_and_read (session, msg, NULL, NULL);
+
+		soup_test_assert_message_status (msg, SOUP_STATUS_OK);
+		headers = soup_message_get_response_headers (msg);
+		g_assert_cmpstr (soup_message_headers_get_one (headers, "Content-Encoding"), ==, tests[i].content_encoding);
+		if (tests[i].content_encoding)
+			g_assert_true (soup_message_headers_header_contains (headers, "Vary", "Accept-Encoding"));
+
+		if (!strcmp (tests[i].path, "/small"))
+			g_assert_cmpmem (g_bytes_get_data (body, NULL), g_bytes_get_size (body), "small", 5);
+		else
+			g_assert_true (g_bytes_equal (body, expected));
+
+		g_bytes_unref (body);
+		g_object_unref (msg);
+		g_uri_unref (uri);
+	}
+
+	soup_test_session_abort_unref (session);
+	g_bytes_unref (expected);
+}
+
+static void
+headers_template_callback (SoupServer        *server,
+			   SoupServerMessage *msg,
+			   const char        *path,
+			   GHashTable        *query,
+			   gpointer           user_data)
+{
+	SoupMessageHeaders *template = user_data;
+
+	if (!strcmp (path, "/custom"))
+		soup_server_message_set_status (msg, SOUP_STATUS_OK, "Fine");
+	else
+		soup_server_message_set_status (msg, SOUP_STATUS_OK, NULL);
+	soup_server_message_set_response (msg, "text/plain",
+					  SOUP_MEMORY_STATIC, "index", 5);
+	soup_server_message_set_response_headers_template (msg, template);
+}
+
+static void
+do_response_headers_template_test (ServerData *sd, gconstpointer test_data)
+{
+	static const char *paths[] = { "/", "/custom", "/" };
+	SoupMessageHeaders *template;
+	SoupSession *session;
+	guint i;
+
+	template = soup_message_headers_new (SOUP_MESSAGE_HEADERS_RESPONSE);
+	soup_message_headers_append (template, "X-Template", "yes");
+	soup_message_headers_append (template, "Cache-Control", "no-store");
+	server_add_handler (sd, NULL, headers_template_callback,
+			    template, (GDestroyNotify)soup_message_headers_unref);
+
+	session = soup_test_session_new (NULL);
+
+	for (i = 0; i < G_N_ELEMENTS (paths); i++) {
+		SoupMessage *msg;
+		GUri *uri;
+		GBytes *body;
+		SoupMessageHeaders *headers;
+
+		uri = g_uri_parse_relative (sd->base_uri, paths[i], SOUP_HTTP_URI_FLAGS, NULL);
+		msg = soup_message_new_from_uri ("GET", uri);
+		body = soup_session_send_and_read (session, msg, NULL, NULL);
+
+		soup_test_assert_message_status (msg, SOUP_STATUS_OK);
+		g_assert_cmpstr (soup_message_get_reason_phrase (msg), ==,
+				 !strcmp (paths[i], "/custom") ? "Fine" : "OK");
+		headers = soup_message_get_response_headers (msg);
+		g_assert_cmpstr (soup_message_headers_get_one (headers, "X-Template"), ==, "yes");
+		g_assert_cmpstr (soup_message_headers_get_one (headers, "Cache-Control"), ==, "no-store");
+		g_assert_cmpstr (soup_message_headers_get_content_type (headers, NULL), ==, "text/plain");
+		g_assert_nonnull (soup_message_headers_get_one (headers, "Date"));
+		g_assert_cmpmem (g_bytes_get_data (body, NULL), g_bytes_get_size (body), "index", 5);
+
+		g_bytes_unref (body);
+		g_object_unref (msg);
+		g_uri_unref (uri);
+	}
+
+	soup_test_session_abort_unref (session);
+}
+
+typedef struct {
+	SoupServerMessage *slow_msg;
+	int handled_while_slow;
+} PipelineData;
+
+static gboolean
+pipeline_unpause_slow (gpointer user_data)
+{
+	PipelineData *pd = user_data;
+
+	soup_server_message_set_response (pd->slow_msg, "text/plain",
+					  SOUP_MEMORY_STATIC, "response-slow", 13);
+	soup_server_message_unpause (g_steal_pointer (&pd->slow_msg));
+	return FALSE;
+}
+
+static void
+pipeline_callback (SoupServer        *server,
+		   SoupServerMessage *msg,
+		   const char        *path,
+		   GHashTable        *query,
+		   gpointer           user_data)
+{
+	PipelineData *pd = user_data;
+	char *body;
+
+	soup_server_message_set_status (msg, SOUP_STATUS_OK, NULL);
+
+	if (!strcmp (path, "/slow")) {
+		GSource *source;
+
+		pd->slow_msg = msg;
+		soup_server_message_pause (msg);
+		source = soup_add_timeout (g_main_context_get_thread_default (),
+					   200, pipeline_unpause_slow, pd);
+		g_source_unref (source);
+		return;
+	}
+
+	/* The slow response is still pending, so this request
+	 * was read while it was being handled.
+	 */
+	if (pd->slow_msg)
+		g_atomic_int_inc (&pd->handled_while_slow);
+
+	body = g_strdup_printf ("response-%s", path + 1);
+	soup_server_message_set_response (msg, "text/plain",
+					  SOUP_MEMORY_TAKE, body, strlen (body));
+}
+
+static void
+do_pipelining_test (ServerData *sd, gconstpointer test_data)
+{
+	PipelineData pd = { NULL, 0 };
+	GSocketClient *client;
+	GSocketConnection *conn;
+	GString *requests;
+	GByteArray *responses;
+	guchar buf[1024];
+	gssize nread;
+	const char *data, *slow, *fast1, *fast2;
+	GError *error = NULL;
+
+	server_add_handler (sd, NULL, pipeline_callback, &pd, NULL);
+
+	client = g_socket_client_new ();
+	conn = g_socket_client_connect_to_host (client, g_uri_get_host (sd->base_uri),
+						g_uri_get_port (sd->base_uri),
+						NULL, &error);
+	g_assert_no_error (error);
+
+	/* Send all the requests at once; the last one closes the connection */
+	requests = g_string_new (NULL);
+	g_string_append (requests, "GET /slow HTTP/1.1\r\nHost: localhost\r\n\r\n");
+	g_string_append (requests, "GET /fast1 HTTP/1.1\r\nHost: localhost\r\n\r\n");
+	g_string_append (requests, "GET /fast2 HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n");
+	g_output_stream_write_all (g_io_stream_get_output_stream (G_IO_STREAM (conn)),
+				   requests->str, requests->len, NULL, NULL, &error);
+	g_assert_no_error (error);
+	g_string_free (requests, TRUE);
+
+	responses = g_byte_array_new ();
+	while ((nread = g_input_stream_read (g_io_stream_get_input_stream (G_IO_STREAM (conn)),
+					     buf, sizeof (buf), NULL, &error)) > 0)
+		g_byte_array_append (responses, buf, nread);
+	g_assert_no_error (error);
+	g_byte_array_append (responses, (guchar *)"", 1);
+
+	/* The handlers of the pipelined requests ran while the first
+	 * one was paused, but the responses are still in order.
+	 */
+	g_assert_cmpint (g_atomic_int_get (&pd.handled_while_slow), ==, 2);
+
+	data = (const char *)responses->data;
+	slow = strstr (data, "response-slow");
+	fast1 = strstr (data, "response-fast1");
+	fast2 = strstr (data, "response-fast2");
+	g_assert_nonnull (slow);
+	g_assert_nonnull (fast1);
+	g_assert_nonnull (fast2);
+	g_assert_true (slow < fast1);
+	g_assert_true (fast1 < fast2);
+
+	g_byte_array_free (responses, TRUE);
+	g_io_stream_close (G_IO_STREAM (conn), NULL, NULL);
+	g_object_unref (conn);
+	g_object_unref (client);
+}
+
+typedef struct {
+	SoupServerMessage *slow_msg;
+	int handled;
+	int aborted;
+	int finished;
+} PipelineAbortData;
+
+static gboolean
+pipeline_abort_close (gpointer user_data)
+{
+	PipelineAbortData *pd = user_data;
+	GIOStream *stream;
+
+	stream = soup_server_message_steal_connection (g_steal_pointer (&pd->slow_msg));
+	g_io_stream_close (stream, NULL, NULL);
+	g_object_unref (stream);
+	return FALSE;
+}
+
+static void
+pipeline_abort_callback (SoupServer        *server,
+			 SoupServerMessage *msg,
+			 const char        *path,
+			 GHashTable        *query,
+			 gpointer           user_data)
+{
+	PipelineAbortData *pd = user_data;
+	GSource *source;
+
+	if (strcmp (path, "/slow")) {
+		soup_server_message_set_status (msg, SOUP_STATUS_OK, NULL);
+		soup_server_message_set_response (msg, "text/plain",
+						  SOUP_MEMORY_STATIC, "fast", 4);
+		g_atomic_int_inc (&pd->handled);
+		return;
+	}
+
+	/* Close the connection while the requests pipelined after
+	 * this one are waiting for their responses to be written.
+	 */
+	pd->slow_msg = msg;
+	soup_server_message_pause (msg);
+	source = soup_add_timeout (g_main_context_get_thread_default (),
+				   200, pipeline_abort_close, pd);
+	g_source_unref (source);
+}
+
+static void
+pipeline_request_aborted (SoupServer        *server,
+			  SoupServerMessage *msg,
+			  gpointer           user_data)
+{
+	PipelineAbortData *pd = user_data;
+
+	g_atomic_int_inc (&pd->aborted);
+}
+
+static void
+pipeline_request_finished (SoupServer        *server,
+			   SoupServerMessage *msg,
+			   gpointer           user_data)
+{
+	PipelineAbortData *pd = user_data;
+
+	g_atomic_int_inc (&pd->finished);
+}
+
+static void
+do_pipelining_abort_test (ServerData *sd, gconstpointer test_data)
+{
+	PipelineAbortData pd = { NULL, 0, 0, 0 };
+	GSocketClient *client;
+	GSocketConnection *conn;
+	const char *requests;
+	guchar buf[1024];
+	gssize nread;
+	GError *error = NULL;
+
+	server_add_handler (sd, NULL, pipeline_abort_callback, &pd, NULL);
+	g_signal_connect (sd->server, "request-aborted",
+			  G_CALLBACK (pipeline_request_aborted), &pd);
+	g_signal_connect (sd->server, "request-finished",
+			  G_CALLBACK (pipeline_request_finished), &pd);
+
+	client = g_socket_client_new ();
+	conn = g_socket_client_connect_to_host (client, g_uri_get_host (sd->base_uri),
+						g_uri_get_port (sd->base_uri),
+						NULL, &error);
+	g_assert_no_error (error);
+
+	requests = "GET /slow HTTP/1.1\r\nHost: localhost\r\n\r\n"
+		"GET /fast1 HTTP/1.1\r\nHost: localhost\r\n\r\n"
+		"GET /fast2 HTTP/1.1\r\nHost: localhost\r\n\r\n";
+	g_output_stream_write_all (g_io_stream_get_output_stream (G_IO_STREAM (conn)),
+				   requests, strlen (requests), NULL, NULL, &error);
+	g_assert_no_error (error);
+
+	/* No response is sent before the server closes the connection */
+	nread = g_input_stream_read (g_io_stream_get_input_stream (G_IO_STREAM (conn)),
+				     buf, sizeof (buf), NULL, &error);
+	g_assert_no_error (error);
+	g_assert_cmpint (nread, ==, 0);
+
+	/* Both pipelined requests were handled, then aborted */
+	g_assert_cmpint (g_atomic_int_get (&pd.handled), ==, 2);
+	g_assert_cmpint (g_atomic_int_get (&pd.aborted), ==, 2);
+	g_assert_cmpint (g_atomic_int_get (&pd.finished), ==, 0);
+
+	g_signal_handlers_disconnect_by_data (sd->server, &pd);
+	g_io_stream_close (G_IO_STREAM (conn), NULL, NULL);
+	g_object_unref (conn);
+	g_object_unref (client);
+}
+
+static void
+content_encoder_etag_callback (SoupServer        *server,
+			       SoupServerMessage *msg,
+			       const char        *path,
+			       GHashTable        *query,
+			       gpointer           user_data)
+{
+	GBytes *body = user_data;
+	GUri *uri = soup_server_message_get_uri (msg);
+	SoupMessageBody *response_body;
+
+	/* Every resource has the same ETag, but a body that depends on
+	 * the host and the query.
+	 */
+	soup_server_message_set_status (msg, SOUP_STATUS_OK, NULL);
+	soup_server_message_set_response (msg, "text/plain", SOUP_MEMORY_COPY,
+					  g_uri_get_host (uri), strlen (g_uri_get_host (uri)));
+	response_body = soup_server_message_get_response_body (msg);
+	if (g_uri_get_query (uri))
+		soup_message_body_append (response_body, SOUP_MEMORY_COPY,
+					  g_uri_get_query (uri), strlen (g_uri_get_query (uri)));
+	soup_message_body_append_bytes (response_body, body);
+	soup_message_headers_replace (soup_server_message_get_response_headers (msg),
+				      "ETag", "\"shared\"");
+}
+
+static void
+do_content_encoder_cache_key_test (ServerData *sd, gconstpointer test_data)
+{
+	static const struct {
+		const char *host;
+		const char *query;
+	} tests[] = {
+		{ "one.example", NULL },
+		{ "two.example", NULL },
+		{ "one.example", "a" },
+		{ "one.example", "b" },
+		{ "two.example", "a" }
+	};
+	SoupContentEncoder *encoder;
+	SoupSession *session;
+	GBytes *common;
+	guint i, round;
+
+	common = get_compressible_body ();
+	server_add_handler (sd, NULL, content_encoder_etag_callback, common, NULL);
+
+	encoder = soup_content_encoder_new ();
+	soup_server_set_content_encoder (sd->server, encoder);
+	g_object_unref (encoder);
+
+	session = soup_test_session_new (NULL);
+
+	/* The second round is served from the cache of compressed bodies */
+	for (round = 0; round < 2; round++) {
+		for (i = 0; i < G_N_ELEMENTS (tests); i++) {
+			SoupMessage *msg;
+			GUri *uri, *base;
+			GBytes *body;
+			GString *expected;
+
+			base = g_uri_parse_relative (sd->base_uri, "/etag", SOUP_HTTP_URI_FLAGS, NULL);
+			uri = soup_uri_copy (base, SOUP_URI_QUERY, tests[i].query, SOUP_URI_NONE);
+			g_uri_unref (base);
+
+			msg = soup_message_new_from_uri ("GET", uri);
+			soup_message_headers_replace (soup_message_get_request_headers (msg),
+						      "Host", tests[i].host);
+			body = soup_session_send_and_read (session, msg, NULL, NULL);
+
+			soup_test_assert_message_status (msg, SOUP_STATUS_OK);
+			g_assert_cmpstr (soup_message_headers_get_one (soup_message_get_response_headers (msg), "Content-Encoding"), ==, "gzip");
+
+			expected = g_string_new (tests[i].host);
+			if (tests[i].query)
+				g_string_append (expected, tests[i].query);
+			g_string_append_len (expected, g_bytes_get_data (common, NULL), g_bytes_get_size (common));
+			g_assert_cmpmem (g_bytes_get_data (body, NULL), g_bytes_get_size (body),
+					 expected->str, expected->len);
+
+			g_string_free (expected, TRUE);
+			g_bytes_unref (body);
+			g_object_unref (msg);
+			g_uri_unref (uri);
+		}
+	}
+
+	soup_test_session_abort_unref (session);
+	g_bytes_unref (common);
+}
+
 typedef struct {
 	GIOStream *iostream;
 	GInputStream *istream;
@@ -1393,6 +2172,24 @@ main (int argc, char **argv)
 		    server_setup, do_early_respond_test, server_teardown);
 	g_test_add ("/server/early/multi", ServerData, NULL,
 		    server_setup_nohandler, do_early_multi_test, server_teardown);
+	g_test_add ("/server/early/body-stream", ServerData, NULL,
+		    server_setup_nohandler, do_request_body_stream_test, server_teardown);
+	g_test_add ("/server/response-file", ServerData, NULL,
+		    server_setup_nohandler, do_response_file_test, server_teardown);
+	g_test_add ("/server/response-file/content-encoder", ServerData, NULL,
+		    server_setup_nohandler, do_response_file_encoded_test, server_teardown);
+	g_test_add ("/server/content-encoder", ServerData, GINT_TO_POINTER (FALSE),
+		    server_setup_nohandler, do_content_encoder_test, server_teardown);
+	g_test_add ("/server/content-encoder/thread-pool", ServerData, GINT_TO_POINTER (TRUE),
+		    server_setup_nohandler, do_content_encoder_test, server_teardown);
+	g_test_add ("/server/content-encoder/cache-key", ServerData, NULL,
+		    server_setup_nohandler, do_content_encoder_cache_key_test, server_teardown);
+	g_test_add ("/server/response-headers-template", ServerData, NULL,
+		    server_setup_nohandler, do_response_headers_template_test, server_teardown);
+	g_test_add ("/server/pipelining", ServerData, NULL,
+		    server_setup_nohandler, do_pipelining_test, server_teardown);
+	g_test_add ("/server/pipelining/abort", ServerData, NULL,
+		    server_setup_nohandler, do_pipelining_abort_test, server_teardown);
 	g_test_add ("/server/steal/CONNECT", ServerData, NULL,
 		    server_setup, do_steal_connect_test, server_teardown);
 
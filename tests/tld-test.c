@@ -4,6 +4,7 @@
  */
 
 #include "test-utils.h"
+#include "soup-tld-private.h"
 
 /* From http://publicsuffix.org/list/test.txt */
 static struct {
@@ -177,6 +178,51 @@ do_non_inet_tests (void)
 	}
 }
 
+static void
+do_cache_tests (void)
+{
+	guint64 hits, misses, new_hits, new_misses;
+	int i, pass;
+
+	/* Results must be the same when they come from the cache, and
+	 * point into the hostname that was passed in.
+	 */
+	for (pass = 0; pass < 2; pass++) {
+		for (i = 0; i < G_N_ELEMENTS (tld_tests); i++) {
+			char *hostname = g_strdup (tld_tests[i].hostname);
+			GError *error = NULL;
+			const char *base_domain;
+
+			soup_tld_get_cache_stats (&hits, &misses);
+			base_domain = soup_tld_get_base_domain (hostname, &error);
+			soup_tld_get_cache_stats (&new_hits, &new_misses);
+			if (pass > 0)
+				g_assert_cmpuint (new_hits, ==, hits + 1);
+			g_assert_cmpuint (new_misses, >=, misses);
+
+			if (base_domain) {
+				g_assert_no_error (error);
+				g_assert_true (base_domain >= hostname &&
+					       base_domain < hostname + strlen (hostname));
+				g_assert_cmpstr (base_domain, ==, tld_tests[i].result);
+			} else {
+				g_assert_null (tld_tests[i].result);
+				g_assert_error (error, SOUP_TLD_ERROR, tld_tests[i].error);
+				g_clear_error (&error);
+			}
+
+			g_free (hostname);
+		}
+	}
+
+	soup_tld_get_cache_stats (&hits, &misses);
+	g_assert_false (soup_tld_domain_is_public_suffix ("co.uk.example.org"));
+	g_assert_false (soup_tld_domain_is_public_suffix ("co.uk.example.org"));
+	soup_tld_get_cache_stats (&new_hits, &new_misses);
+	g_assert_cmpuint (new_hits, ==, hits + 1);
+	g_assert_cmpuint (new_misses, ==, misses + 1);
+}
+
 int
 main (int argc, char **argv)
 {
@@ -186,6 +232,7 @@ main (int argc, char **argv)
 
 	g_test_add_func ("/tld/inet", do_inet_tests);
 	g_test_add_func ("/tld/non-inet", do_non_inet_tests);
+	g_test_add_func ("/tld/cache", do_cache_tests);
 
 	ret = g_test_run ();
 
@@ -2,6 +2,8 @@
 
 #include "test-utils.h"
 #include "soup-uri-utils-private.h"
+#include "soup-message-private.h"
+#include "soup-origin.h"
 
 static struct {
 	const char *one, *two;
@@ -193,6 +195,51 @@ do_path_and_query_tests (void)
         }
 }
 
+static void
+do_origin_tests (void)
+{
+        GUri *uri;
+        SoupOrigin *origin, *other;
+        SoupMessage *msg;
+
+        uri = g_uri_parse ("http://www.GNOME.org/a", SOUP_HTTP_URI_FLAGS, NULL);
+        origin = soup_origin_new_for_uri (uri);
+        g_uri_unref (uri);
+
+        g_assert_false (soup_origin_is_https (origin));
+        g_assert_cmpstr (soup_origin_get_scheme (origin), ==, "http");
+        g_assert_cmpstr (soup_origin_get_host (origin), ==, "www.gnome.org");
+        g_assert_cmpint (soup_origin_get_port (origin), ==, 80);
+        g_assert_cmpstr (soup_origin_get_base_domain (origin), ==, "gnome.org");
+
+        /* Origins are interned */
+        uri = g_uri_parse ("http://www.gnome.org:80/b?c", SOUP_HTTP_URI_FLAGS, NULL);
+        other = soup_origin_new_for_uri (uri);
+        g_assert_true (other == origin);
+        soup_origin_unref (other);
+        g_uri_unref (uri);
+
+        uri = g_uri_parse ("https://www.gnome.org/a", SOUP_HTTP_URI_FLAGS, NULL);
+        other = soup_origin_new_for_uri (uri);
+        g_assert_true (other != origin);
+        g_assert_true (soup_origin_is_https (other));
+        g_assert_cmpint (soup_origin_get_port (other), ==, 443);
+        soup_origin_unref (other);
+        g_uri_unref (uri);
+
+        /* Messages keep the origin of their current URI */
+        msg = soup_message_new ("GET", "http://www.gnome.org/index.html");
+        g_assert_true (soup_message_get_origin (msg) == origin);
+        uri = g_uri_parse ("http://localhost/", SOUP_HTTP_URI_FLAGS, NULL);
+        soup_message_set_uri (msg, uri);
+        g_uri_unref (uri);
+        g_assert_cmpstr (soup_origin_get_host (soup_message_get_origin (msg)), ==, "localhost");
+        g_assert_null (soup_origin_get_base_domain (soup_message_get_origin (msg)));
+        g_object_unref (msg);
+
+        soup_origin_unref (origin);
+}
+
 int
 main (int argc, char **argv)
 {
@@ -204,6 +251,7 @@ main (int argc, char **argv)
 	g_test_add_func ("/uri/copy", do_copy_tests);
         g_test_add_func ("/data", do_data_uri_tests);
         g_test_add_func ("/path_and_query", do_path_and_query_tests);
+        g_test_add_func ("/origin", do_origin_tests);
 
 	ret = g_test_run ();
 